@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2026 Marc Balmer HB9SSB
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/*
+ * Time the transcoding of a JSON document to CBOR, as the reactor does
+ * once per message for the CBOR clients.
+ *
+ * usage: cbor-bench file [iterations]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "buffer.h"
+#include "trxd.h"
+
+extern int cbor_transcode(struct buffer *, const char *, size_t);
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int
+main(int argc, char *argv[])
+{
+	static char doc[1 << 22];
+	struct buffer b;
+	FILE *fp;
+	size_t len;
+	double t;
+	long i, n;
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: cbor-bench file [iterations]\n");
+		exit(1);
+	}
+	fp = fopen(argv[1], "r");
+	if (fp == NULL) {
+		perror(argv[1]);
+		exit(1);
+	}
+	len = fread(doc, 1, sizeof(doc), fp);
+	fclose(fp);
+	while (len > 0 && doc[len - 1] == '\n')
+		len--;
+	n = argc > 2 ? atol(argv[2]) : 1000000;
+
+	if (buf_init(&b)) {
+		fprintf(stderr, "cbor-bench: malloc\n");
+		exit(1);
+	}
+	t = now();
+	for (i = 0; i < n; i++) {
+		b.size = 0;
+		buf_reserve(&b, MSG_HEADROOM);
+		b.size = MSG_HEADROOM;
+		if (cbor_transcode(&b, doc, len)) {
+			fprintf(stderr, "cbor-bench: %s is not JSON\n",
+			    argv[1]);
+			exit(1);
+		}
+	}
+	t = now() - t;
+
+	printf("%s: JSON %zu bytes, CBOR %zu bytes, %.0f ns per transcode\n",
+	    argv[1], len, b.size - MSG_HEADROOM, t / n * 1e9);
+	return 0;
+}
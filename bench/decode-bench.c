@@ -0,0 +1,122 @@
+/*
+ * Copyright (c) 2026 Marc Balmer HB9SSB
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/*
+ * JSON work per request: decoding it in the dispatcher to find its
+ * destination and again in the controller, or scanning the envelope
+ * with envelope_scan() and decoding it in the controller only.
+ *
+ * usage: decode-bench [request [iterations]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <lua.h>
+#include <lualib.h>
+#include <lauxlib.h>
+
+#include "trxd.h"
+
+extern int luaopen_json(lua_State *);
+extern void envelope_init(void);
+extern int envelope_scan(const char *, size_t, envelope_t *);
+extern void envelope_free(envelope_t *);
+
+static lua_State *
+json_state(void)
+{
+	lua_State *L;
+
+	L = luaL_newstate();
+	if (L == NULL) {
+		fprintf(stderr, "decode-bench: luaL_newstate\n");
+		exit(1);
+	}
+	luaL_openlibs(L);
+	luaopen_json(L);
+	lua_setglobal(L, "json");
+	return L;
+}
+
+static void
+decode(lua_State *L, const char *data, size_t len)
+{
+	lua_getglobal(L, "json");
+	lua_getfield(L, -1, "decode");
+	lua_pushlstring(L, data, len);
+	lua_call(L, 1, 1);
+	lua_settop(L, 0);
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int
+main(int argc, char *argv[])
+{
+	lua_State *dispatcher, *controller;
+	envelope_t env;
+	const char *request;
+	size_t len;
+	double t0, t1, t2;
+	long i, n;
+
+	request = argc > 1 ? argv[1] : "{\"request\":\"set-frequency\","
+	    "\"to\":\"ft991a\",\"frequency\":14074000,\"vfo\":\"vfo-1\"}";
+	n = argc > 2 ? atol(argv[2]) : 1000000;
+	len = strlen(request);
+
+	envelope_init();
+	dispatcher = json_state();
+	controller = json_state();
+
+	t0 = now();
+	for (i = 0; i < n; i++) {
+		decode(dispatcher, request, len);
+		decode(controller, request, len);
+	}
+	t1 = now();
+	for (i = 0; i < n; i++) {
+		if (envelope_scan(request, len, &env)) {
+			fprintf(stderr, "decode-bench: not a JSON object\n");
+			exit(1);
+		}
+		envelope_free(&env);
+		decode(controller, request, len);
+	}
+	t2 = now();
+
+	printf("decode in dispatcher + decode in controller:  %.2f us\n",
+	    (t1 - t0) / n * 1e6);
+	printf("envelope scan + decode in controller:         %.2f us\n",
+	    (t2 - t1) / n * 1e6);
+	return 0;
+}
@@ -0,0 +1,63 @@
+#!/usr/bin/env python3
+#
+# Let subscribers receive status updates as JSON or CBOR and report the
+# bytes per update and the CPU time trxd uses per delivered update
+#
+# usage: fanout.py json|cbor subscribers seconds
+
+import os
+import socket
+import sys
+import threading
+import time
+
+encoding, subscribers = sys.argv[1], int(sys.argv[2])
+seconds = float(sys.argv[3])
+pid = os.environ['TRXD_PID']
+
+done = False
+received = [[0, 0] for i in range(subscribers)]
+
+def cpu():
+	stat = open('/proc/%s/stat' % pid).read().split(')')[1].split()
+	return (int(stat[11]) + int(stat[12])) / os.sysconf('SC_CLK_TCK')
+
+def subscriber(counter):
+	s = socket.create_connection(('localhost', 14285))
+	if encoding == 'cbor':
+		s.sendall(b'{"request":"set-encoding","encoding":"cbor"}\n')
+	s.sendall(b'{"request":"start-status-updates"}\n')
+	s.settimeout(0.1)
+	tail = b''
+	while not done:
+		try:
+			data = s.recv(65536)
+		except socket.timeout:
+			continue
+		# Both encodings carry the request name as text
+		counter[0] += (tail + data).count(b'status-update')
+		counter[1] += len(data)
+		tail = data[-12:]
+
+threads = [threading.Thread(target=subscriber, args=(received[i],))
+    for i in range(subscribers)]
+for t in threads:
+	t.start()
+time.sleep(1)
+
+def totals():
+	return [sum(c[i] for c in received) for i in (0, 1)]
+
+t = cpu()
+updates, octets = totals()
+time.sleep(seconds)
+t = cpu() - t
+u, o = totals()
+updates, octets = u - updates, o - octets
+done = True
+for th in threads:
+	th.join()
+
+print('%s: %d updates delivered, %.0f bytes per update, '
+    '%.1f us CPU per delivered update' % (encoding, updates,
+    octets / updates, t / updates * 1e6))
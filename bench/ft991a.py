@@ -0,0 +1,100 @@
+#!/usr/bin/env python3
+#
+# Yaesu FT-991A CAT emulator on a pseudo terminal that is linked to
+# /tmp/trxd-bench-cat.  It answers the commands the cat-delimited driver
+# uses and sends FA frames while auto information (AI1;) is on.
+#
+# usage: ft991a.py [-r rate] [-d delay] [-t turnaround]
+#
+# -r  FA frames per second while auto information is on
+# -d  seconds before a read (FA, MD0, ID) is answered
+# -t  seconds before the commands in a write are handled
+#
+# On SIGUSR1 it prints how many writes it received and how many reads it
+# answered so far.
+
+import getopt
+import os
+import pty
+import select
+import signal
+import sys
+import time
+import tty
+
+DEVICE = '/tmp/trxd-bench-cat'
+
+rate = delay = turnaround = 0.0
+opts, args = getopt.getopt(sys.argv[1:], 'r:d:t:')
+for opt, arg in opts:
+	if opt == '-r':
+		rate = float(arg)
+	elif opt == '-d':
+		delay = float(arg)
+	elif opt == '-t':
+		turnaround = float(arg)
+
+master, slave = pty.openpty()
+tty.setraw(slave)
+os.chmod(os.ttyname(slave), 0o666)	# trxd may run as another user
+try:
+	os.unlink(DEVICE)
+except FileNotFoundError:
+	pass
+os.symlink(os.ttyname(slave), DEVICE)
+
+frequency = 14074000
+mode = b'2'
+ai = False
+data = b''
+deadline = time.time()
+writes = reads = 0
+
+def counters(signum, frame):
+	print('writes %d reads %d' % (writes, reads), flush=True)
+
+signal.signal(signal.SIGUSR1, counters)
+
+def command(cmd):
+	global frequency, mode, ai, reads
+
+	if cmd in (b'FA', b'FB', b'MD0', b'ID', b'TX'):
+		reads += 1
+	if cmd in (b'FA', b'MD0', b'ID') and delay:
+		time.sleep(delay)
+	if cmd == b'ID':
+		os.write(master, b'ID0670;')
+	elif cmd == b'FA':
+		os.write(master, b'FA%09d;' % frequency)
+	elif cmd == b'FB':
+		os.write(master, b'FB%09d;' % frequency)
+	elif cmd == b'MD0':
+		os.write(master, b'MD0' + mode + b';')
+	elif cmd == b'TX':
+		os.write(master, b'TX0;')
+	elif cmd.startswith(b'FA'):
+		frequency = int(cmd[2:])
+	elif cmd.startswith(b'MD0'):
+		mode = cmd[3:4]
+	elif cmd in (b'AI1', b'AI0'):
+		ai = cmd == b'AI1'
+	elif not cmd.startswith(b'TX'):
+		os.write(master, b'?;')
+
+while True:
+	timeout = None
+	if ai and rate:
+		timeout = max(0, deadline - time.time())
+	readable, _, _ = select.select([master], [], [], timeout)
+	if readable:
+		data += os.read(master, 1024)
+		writes += 1
+		if turnaround:
+			time.sleep(turnaround)
+		while b';' in data:
+			cmd, data = data.split(b';', 1)
+			command(cmd)
+	if ai and rate and time.time() >= deadline:
+		frequency += 10
+		os.write(master, b'FA%09d;' % frequency)
+		deadline = max(deadline + 1 / rate, time.time() - 1)
@@ -0,0 +1,31 @@
+#!/usr/bin/env python3
+#
+# Connect idle clients that ask for status updates, then report the
+# number of threads of trxd and the CPU time it uses while they are idle
+#
+# usage: idle.py clients seconds
+
+import os
+import socket
+import sys
+import time
+
+clients, seconds = int(sys.argv[1]), float(sys.argv[2])
+pid = os.environ['TRXD_PID']
+
+def cpu():
+	stat = open('/proc/%s/stat' % pid).read().split(')')[1].split()
+	return (int(stat[11]) + int(stat[12])) / os.sysconf('SC_CLK_TCK')
+
+socks = []
+for i in range(clients):
+	s = socket.create_connection(('localhost', 14285))
+	s.sendall(b'{"request":"start-status-updates"}\n')
+	socks.append(s)
+time.sleep(1)
+
+t = cpu()
+time.sleep(seconds)
+t = cpu() - t
+print('%d clients: %d threads, %.2f s CPU time in %.0f s' % (clients,
+    len(os.listdir('/proc/%s/task' % pid)), t, seconds))
@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2024 - 2025 Marc Balmer HB9SSB
+ * Copyright (c) 2026 Marc Balmer HB9SSB
  *
  * Permission is hereby granted, free of charge, to any person obtaining a copy
  * of this software and associated documentation files (the "Software"), to
@@ -20,50 +20,43 @@
  * IN THE SOFTWARE.
  */
 
-/* Notify listeners (connected clients or extensions) of events */
+/*
+ * Run a Lua benchmark script with the json module of trxd as global
+ * "json", e.g. json.lua.
+ *
+ * usage: json-bench script
+ */
 
-#include <err.h>
-#include <pthread.h>
-#include <sched.h>
 #include <stdio.h>
-#include <string.h>
 #include <stdlib.h>
-#include <unistd.h>
 
-#include "trxd.h"
-#include "trx-control.h"
+#include <lua.h>
+#include <lualib.h>
+#include <lauxlib.h>
 
-extern int verbose;
+extern int luaopen_json(lua_State *);
 
-void *
-notifier(void *arg)
+int
+main(int argc, char *argv[])
 {
-	dispatcher_tag_t *d = (dispatcher_tag_t *)arg;
-
-	if (pthread_detach(pthread_self()))
-		err(1, "notifier: pthread_detach");
-
-	pthread_cleanup_push(free, arg);
-
-	if (pthread_setname_np(pthread_self(), "notifier"))
-		err(1, "notifier: pthread_setname_np");
+	lua_State *L;
 
-	if (pthread_mutex_lock(&d->mutex))
-		err(1, "notifier: pthread_mutex_lock");
-
-	if (verbose)
-		printf("notifier: ready\n");
-
-	d->data = NULL;
-	if (pthread_cond_signal(&d->cond2))
-		err(1, "c: pthread_cond_signal");
-
-	for (;;) {
-		while (d->data == NULL) {
-			if (pthread_cond_wait(&d->cond, &d->mutex))
-				err(1, "notifier: pthread_cond_wait");
-		}
+	if (argc != 2) {
+		fprintf(stderr, "usage: json-bench script\n");
+		exit(1);
+	}
+	L = luaL_newstate();
+	if (L == NULL) {
+		fprintf(stderr, "json-bench: luaL_newstate\n");
+		exit(1);
+	}
+	luaL_openlibs(L);
+	luaopen_json(L);
+	lua_setglobal(L, "json");
+	if (luaL_dofile(L, argv[1])) {
+		fprintf(stderr, "json-bench: %s\n", lua_tostring(L, -1));
+		exit(1);
 	}
-	pthread_cleanup_pop(0);
-	return NULL;
+	lua_close(L);
+	return 0;
 }
@@ -0,0 +1,31 @@
+-- JSON decode throughput for payloads shaped like the responses of
+-- getSpots and getToplevel, and for a status update
+--
+-- usage: json-bench json.lua
+
+dofile('payload.lua')
+
+local function bench(name, s, iterations)
+	local t = os.clock()
+
+	for i = 1, iterations do
+		assert(json.decode(s))
+	end
+	t = (os.clock() - t) / iterations
+	if t < 0.001 then
+		print(string.format('%-22s %8d bytes %9.1f us', name, #s,
+		    t * 1e6))
+	else
+		print(string.format('%-22s %8d bytes %9.2f ms', name, #s,
+		    t * 1e3))
+	end
+end
+
+bench('spots 100', spots(100), 2000)
+bench('spots 1000', spots(1000), 20)
+bench('spots 10000', spots(10000), 2)
+bench('memory tree 20x50', tree(20, 50), 20)
+bench('memory tree 100x100', tree(100, 100), 2)
+bench('status update', '{"request":"status-update","from":"ft991",'
+    .. '"status":{"frequency":14074000,"mode":"usb","vfo":"vfo-a",'
+    .. '"ptt":false}}', 200000)
@@ -0,0 +1,33 @@
+#!/usr/bin/env python3
+#
+# Replay a tuning knob:  Send 300 set-frequency requests at 100 per
+# second without waiting for the answers, then read the frequency back.
+# Report how many sets reached the driver, i.e. were not superseded, and
+# how long after the last set the frequency was read.
+#
+# usage: knob.py
+
+import json
+import socket
+import time
+
+s = socket.create_connection(('localhost', 14285))
+f = s.makefile('rb')
+
+start = time.time()
+for i in range(300):
+	s.sendall(b'{"request":"set-frequency","frequency":%d}\n' %
+	    (14000000 + i * 10))
+	time.sleep(max(0, start + (i + 1) * 0.01 - time.time()))
+stopped = time.time()
+s.sendall(b'{"request":"get-frequency"}\n')
+
+status = {}
+while True:
+	response = json.loads(f.readline())
+	if response.get('response') == 'get-frequency':
+		break
+	status[response['status']] = status.get(response['status'], 0) + 1
+print('%d driver writes, %d superseded, frequency %d, settled after '
+    '%.2f s' % (status.get('Ok', 0), status.get('Superseded', 0),
+    response['frequency'], time.time() - stopped))
@@ -0,0 +1,64 @@
+#!/usr/bin/env python3
+#
+# Let clients hammer the radio with get-frequency while a probe client
+# measures the latency of its own requests, then report the median and
+# the 99th percentile of the probe latency and how many get-frequency
+# requests were answered per second
+#
+# usage: latency.py clients seconds [probe-request ...]
+#
+# The probe sends the probe requests in turn, "version" by default.
+
+import socket
+import sys
+import threading
+import time
+
+clients, seconds = int(sys.argv[1]), float(sys.argv[2])
+probes = [p.encode() + b'\n' for p in sys.argv[3:]] or \
+    [b'{"request":"version"}\n']
+
+done = False
+served = 0
+lock = threading.Lock()
+
+def connect():
+	s = socket.create_connection(('localhost', 14285))
+	s.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+	return s, s.makefile('rb')
+
+def hammer():
+	global served
+
+	s, f = connect()
+	while not done:
+		s.sendall(b'{"request":"get-frequency"}\n')
+		f.readline()
+		with lock:
+			served += 1
+
+threads = [threading.Thread(target=hammer) for i in range(clients)]
+for t in threads:
+	t.start()
+time.sleep(1)
+
+s, f = connect()
+latency = []
+with lock:
+	served = 0
+end = time.time() + seconds
+while time.time() < end:
+	t = time.perf_counter()
+	s.sendall(probes[len(latency) % len(probes)])
+	f.readline()
+	latency.append(time.perf_counter() - t)
+	time.sleep(0.01)
+n = served
+done = True
+for t in threads:
+	t.join()
+
+latency.sort()
+print('N=%-3d p50 %.2f ms, p99 %.2f ms, %.0f get-frequency/s' % (clients,
+    latency[len(latency) // 2] * 1000,
+    latency[len(latency) * 99 // 100] * 1000, n / seconds))
@@ -0,0 +1,37 @@
+-- Payloads shaped like the responses of getSpots and getToplevel, as
+-- JSON text, for json.lua and proxy-bench
+
+function spots(n)
+	local t = {}
+	for i = 1, n do
+		t[i] = string.format('{"spotter":"HB9%03d","frequency":%d.%d,'
+		    .. '"call":"DL%dABC","comment":"CQ CQ de DL%dABC \\"59\\" '
+		    .. 'tnx QSO","time":"1234Z","band":"20m","mode":"FT8",'
+		    .. '"dxcc":%d,"snr":-%d}', i % 1000, 14000 + i % 350,
+		    i % 10, i, i, 200 + i % 100, i % 20)
+	end
+	return '{"status":"Ok","response":"getSpots","spots":['
+	    .. table.concat(t, ',') .. ']}'
+end
+
+function tree(groups, per)
+	local g = {}
+	for i = 1, groups do
+		local m = {}
+		for j = 1, per do
+			m[j] = string.format('{"name":"Memory %d/%d",'
+			    .. '"frequency":%d,"mode":"usb","ctcss":%d.%d,'
+			    .. '"offset":-600000,"notes":"Repeater HB9%s '
+			    .. 'on the hill, access tone required",'
+			    .. '"tags":["local","fm","repeater"],'
+			    .. '"enabled":true}', i, j,
+			    144000000 + j * 12500, 67 + j % 30, j % 10,
+			    string.char(65 + j % 26))
+		end
+		g[i] = string.format('{"name":"Group %d","id":%d,'
+		    .. '"memories":[%s],"children":[]}', i, i,
+		    table.concat(m, ','))
+	end
+	return '{"status":"Ok","response":"getToplevel","groups":['
+	    .. table.concat(g, ',') .. ']}'
+end
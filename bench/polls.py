@@ -0,0 +1,35 @@
+#!/usr/bin/env python3
+#
+# Ask for status updates from a polled transceiver and report how many
+# polls the FT-991A emulator saw and how many writes they took
+#
+# usage: polls.py seconds
+#
+# A poll reads the frequency and the mode, so the emulator answers two
+# reads per poll.
+
+import os
+import signal
+import socket
+import sys
+import time
+
+seconds = float(sys.argv[1])
+pid = int(os.environ['FT991A_PID'])
+
+def counters():
+	os.kill(pid, signal.SIGUSR1)
+	time.sleep(0.5)
+	line = open('ft991a.log').read().splitlines()[-1].split()
+	return int(line[1]), int(line[3])
+
+s = socket.create_connection(('localhost', 14285))
+s.sendall(b'{"request":"start-status-updates"}\n')
+time.sleep(1)
+
+writes, reads = counters()
+time.sleep(seconds)
+w, r = counters()
+polls, writes = (r - reads) / 2, w - writes
+print('%.0f polls, %d writes (%.1f per poll)' % (polls, writes,
+    writes / polls))
@@ -0,0 +1,149 @@
+/*
+ * Copyright (c) 2026 Marc Balmer HB9SSB
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/*
+ * Time copying tables from one Lua state to another with proxy_copy().
+ * The tables are decoded from the payloads of payload.lua.  Built with
+ * -DPROXY_MAP against the proxy.c of before user-025, it times the
+ * recursive proxy_map() instead.
+ *
+ * usage: proxy-bench
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <lua.h>
+#include <lualib.h>
+#include <lauxlib.h>
+
+#include "buffer.h"
+
+extern int luaopen_json(lua_State *);
+#ifdef PROXY_MAP
+extern void proxy_map(lua_State *, lua_State *, int);
+#else
+extern int proxy_copy(lua_State *, int, lua_State *);
+extern int proxy_encode(lua_State *, int, struct buffer *,
+    const char **);
+#endif
+
+static lua_State *
+state(void)
+{
+	lua_State *L;
+
+	L = luaL_newstate();
+	if (L == NULL) {
+		fprintf(stderr, "proxy-bench: luaL_newstate\n");
+		exit(1);
+	}
+	luaL_openlibs(L);
+	luaopen_json(L);
+	lua_setglobal(L, "json");
+	return L;
+}
+
+/* Copy the table on top of L to the top of R */
+static void
+copy(lua_State *L, lua_State *R)
+{
+#ifdef PROXY_MAP
+	/* proxy_map() expects the key of the table below it */
+	lua_pushnil(L);
+	lua_pushvalue(L, -2);
+	proxy_map(L, R, lua_gettop(R));
+	lua_pop(L, 2);
+#else
+	if (proxy_copy(L, -1, R)) {
+		fprintf(stderr, "proxy-bench: proxy_copy failed\n");
+		exit(1);
+	}
+#endif
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+bench(const char *name, const char *payload, int n)
+{
+	lua_State *L, *R;
+	char code[128];
+	double t;
+	int i;
+
+	L = state();
+	R = state();
+	snprintf(code, sizeof code, "dofile('payload.lua') return %s",
+	    payload);
+	if (luaL_dostring(L, code)) {
+		fprintf(stderr, "proxy-bench: %s\n", lua_tostring(L, -1));
+		exit(1);
+	}
+
+	t = now();
+	for (i = 0; i < n; i++) {
+		copy(L, R);
+		lua_pop(R, 1);
+	}
+	t = (now() - t) / n;
+	if (t < 1e-3)
+		printf("%-22s %8.1f us", name, t * 1e6);
+	else
+		printf("%-22s %8.2f ms", name, t * 1e3);
+
+#ifndef PROXY_MAP
+	{
+		struct buffer b;
+		const char *error;
+
+		if (buf_init(&b) || proxy_encode(L, -1, &b, &error)) {
+			fprintf(stderr, "proxy-bench: proxy_encode failed\n");
+			exit(1);
+		}
+		printf("  buffer %zu bytes", b.size);
+		buf_free(&b);
+	}
+#endif
+	printf("\n");
+	lua_close(L);
+	lua_close(R);
+}
+
+int
+main(int argc, char *argv[])
+{
+	bench("config, 5 keys", "{ host = 'localhost', port = 5432, "
+	    "user = 'trx', password = 'secret', ssl = true }", 200000);
+	bench("spots 50", "json.decode(spots(50))", 2000);
+	bench("memory tree 20x50", "json.decode(tree(20, 50))", 200);
+	bench("memory tree 100x100", "json.decode(tree(100, 100))", 20);
+	return 0;
+}
@@ -0,0 +1,52 @@
+#!/bin/sh
+#
+# Run a benchmark against trxd
+#
+# usage: run.sh config [emulator-argument ...] -- command [argument ...]
+#
+# Starts the FT-991A emulator if the configuration uses its device, then
+# trxd, runs the command with TRXD_PID (and FT991A_PID) set and stops
+# both again.  The output of trxd and of the emulator goes to trxd.log
+# and ft991a.log.
+
+TRXD=${TRXD:-../sbin/trxd/trxd}
+DEVICE=/tmp/trxd-bench-cat
+
+config=$1
+shift
+emulator=
+while [ $# -gt 0 ] && [ "$1" != "--" ]; do
+	emulator="$emulator $1"
+	shift
+done
+shift
+
+stop() {
+	[ -n "$trxd" ] && kill $trxd 2>/dev/null
+	[ -n "$ft991a" ] && kill $ft991a 2>/dev/null
+	wait 2>/dev/null
+}
+trap stop EXIT INT TERM
+
+if grep -q $DEVICE $config; then
+	./ft991a.py $emulator > ft991a.log 2>&1 &
+	ft991a=$!
+	while [ ! -e $DEVICE ]; do
+		sleep 0.1
+	done
+fi
+
+$TRXD -d -c $config > trxd.log 2>&1 &
+trxd=$!
+n=0
+until python3 -c "import socket; socket.create_connection(('localhost', \
+    14285))" 2>/dev/null; do
+	n=$((n + 1))
+	if [ $n -gt 100 ]; then
+		echo "trxd did not start, see trxd.log" >&2
+		exit 1
+	fi
+	sleep 0.1
+done
+
+TRXD_PID=$trxd FT991A_PID=$ft991a "$@"
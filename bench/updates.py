@@ -0,0 +1,35 @@
+#!/usr/bin/env python3
+#
+# Receive status updates as one client and report how many arrived and
+# the CPU time trxd used meanwhile
+#
+# usage: updates.py seconds
+
+import os
+import socket
+import sys
+import time
+
+seconds = float(sys.argv[1])
+pid = os.environ['TRXD_PID']
+
+def cpu():
+	stat = open('/proc/%s/stat' % pid).read().split(')')[1].split()
+	return (int(stat[11]) + int(stat[12])) / os.sysconf('SC_CLK_TCK')
+
+s = socket.create_connection(('localhost', 14285))
+s.sendall(b'{"request":"start-status-updates"}\n')
+s.settimeout(0.1)
+time.sleep(1)
+
+updates = 0
+t = cpu()
+end = time.time() + seconds
+while time.time() < end:
+	try:
+		updates += s.recv(65536).count(b'status-update')
+	except socket.timeout:
+		pass
+t = cpu() - t
+print('%.0f updates/s, trxd uses %.0f%% of a core' % (updates / seconds,
+    t / seconds * 100))
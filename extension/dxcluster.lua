@@ -87,7 +87,7 @@ function dataReady()
 					from = config.source or 'dxcluster',
 					spot = spot
 				}
-				trxd.notify(json.encode(notification))
+				trxd.notify(notification)
 				purgeSpots()
 			end
 		end
@@ -38,14 +38,12 @@ buf_init(struct buffer *b)
         return 0;
 }
 
+/* Make room for len more bytes, the capacity doubles to keep appends cheap */
 static void
-buf_resize(struct buffer *b, size_t size)
+buf_resize(struct buffer *b, size_t len)
 {
-        size_t enlargement = BUFFER_SIZE;
-
-        while (enlargement < size)
-                enlargement += BUFFER_SIZE;
-        b->capacity += enlargement;
+        while (b->size + len >= b->capacity)
+                b->capacity *= 2;
         b->data = realloc(b->data, b->capacity);
 }
 
@@ -61,6 +59,24 @@ buf_addstring(struct buffer *b, const char *s)
         b->size += len;
 }
 
+void
+buf_addlstring(struct buffer *b, const char *s, size_t len)
+{
+        if (b->size + len >= b->capacity)
+                buf_resize(b, len);
+        memcpy(b->data + b->size, s, len);
+        b->size += len;
+}
+
+/* Room for len bytes at the end, the caller adds what it used to size */
+char *
+buf_reserve(struct buffer *b, size_t len)
+{
+        if (b->size + len >= b->capacity)
+                buf_resize(b, len);
+        return b->data + b->size;
+}
+
 void
 buf_addchar(struct buffer *b, char c)
 {
@@ -36,6 +36,8 @@ struct buffer {
 
 extern int buf_init(struct buffer *);
 extern void buf_addstring(struct buffer *, const char *);
+extern void buf_addlstring(struct buffer *, const char *, size_t);
+extern char *buf_reserve(struct buffer *, size_t);
 extern void buf_addchar(struct buffer *, char);
 extern void buf_printf(struct buffer *, const char *, ...);
 extern void buf_push(struct buffer *, lua_State *);
@@ -32,365 +32,388 @@
 #include <lauxlib.h>
 #include <lualib.h>
 
-#include <setjmp.h>
-#include <stdarg.h>
-#include <stdio.h>
-#include <string.h>
 #include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "buffer.h"
 
 #define JSON_NULL_METATABLE 	"JSON null object"
-#define JSON_GCMEM_METATABLE	"JSON garbage collected memory"
 
-static void decode_value(lua_State *, char **, int);
-static void decode_string(lua_State *, char **);
-static void encode(lua_State *, struct buffer *);
-
-static jmp_buf env;
+/* Nesting deeper than this is refused, the decoder recurses */
+#define JSON_MAX_DEPTH		256
 
 /*
- * Garbage collected memory
+ * The decoder state lives on the stack of the caller, errors are returned
+ * up the call chain, so the decoder can run in many threads at once.
  */
-static void *
-gcmalloc(lua_State *L, size_t size)
+struct decoder {
+	lua_State	*L;
+	const char	*start;
+	const char	*s;		/* The next character */
+	const char	*end;
+	int		 null;		/* How null is decoded */
+	int		 depth;
+	const char	*error;
+};
+
+static int decode_value(struct decoder *);
+
+static int
+decode_error(struct decoder *d, const char *error)
 {
-	void **p;
-	p = lua_newuserdata(L, size);
-	*p = NULL;
-	luaL_setmetatable(L, JSON_GCMEM_METATABLE);
-	return p;
+	d->error = error;
+	return -1;
 }
 
-/* Memory can be free'ed immediately or left to the garbage collector */
-static void
-gcfree(void *p)
+/* Skip to the first quote or backslash, or to end if there is none */
+static const char *
+scan_string(const char *s, const char *end)
 {
-	void **mem = (void **)p;
-	free(*mem);
-	*mem = NULL;
+#ifdef __SSE2__
+	const __m128i quote = _mm_set1_epi8('"');
+	const __m128i backslash = _mm_set1_epi8('\\');
+	__m128i v;
+	int mask;
+
+	for (; end - s >= 16; s += 16) {
+		v = _mm_loadu_si128((const __m128i *)s);
+		mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, quote),
+		    _mm_cmpeq_epi8(v, backslash)));
+		if (mask)
+			return s + __builtin_ctz(mask);
+	}
+#else
+	/* Eight bytes at a time, a byte of q or b is zero at a match */
+	const uint64_t ones = 0x0101010101010101ULL;
+	const uint64_t highs = 0x8080808080808080ULL;
+	uint64_t w, q, b;
+
+	for (; end - s >= 8; s += 8) {
+		memcpy(&w, s, sizeof(w));
+		q = w ^ (ones * '"');
+		b = w ^ (ones * '\\');
+		if ((((q - ones) & ~q) | ((b - ones) & ~b)) & highs)
+			break;
+	}
+#endif
+	while (s < end && *s != '"' && *s != '\\')
+		s++;
+	return s;
 }
 
-static int
-gcmem_clear(lua_State *L)
+static void
+skip_ws(struct decoder *d)
 {
-	void **p = luaL_checkudata(L, 1, JSON_GCMEM_METATABLE);
-
-	free(*p);
-	*p = NULL;
-	return 0;
+	while (d->s < d->end && isspace((unsigned char)*d->s))
+		d->s++;
 }
 
+/* Four hex digits, -1 if they are not */
 static int
-json_error(lua_State *L, const char *fmt, ...)
+hex4(const char *s, const char *end, unsigned int *code)
 {
-	va_list ap;
-	int len;
-	char **msg;
-
-	msg = gcmalloc(L, sizeof(char *));
-	va_start(ap, fmt);
-	len = vasprintf((char **)msg, fmt, ap);
-	va_end(ap);
-
-	lua_pushnil(L);
-	if (len != -1) {
-		lua_pushstring(L, *msg);
-		gcfree(msg);
-	} else
-		lua_pushstring(L, "internal error: vasprintf failed");
-	longjmp(env, 0);
+	int n;
+
+	if (end - s < 4)
+		return -1;
+	for (*code = 0, n = 0; n < 4; n++, s++) {
+		*code <<= 4;
+		if (*s >= '0' && *s <= '9')
+			*code |= *s - '0';
+		else if (*s >= 'a' && *s <= 'f')
+			*code |= *s - 'a' + 10;
+		else if (*s >= 'A' && *s <= 'F')
+			*code |= *s - 'A' + 10;
+		else
+			return -1;
+	}
+	return 0;
 }
 
-static unsigned int
-digit2int(lua_State *L, const unsigned char digit)
+/* Encode a code point as UTF-8, returns the length */
+static size_t
+code2utf8(unsigned int code, char buf[4])
 {
-	unsigned int val;
-
-	if (digit >= '0' && digit <= '9')
-		val = digit - '0';
-	else if (digit >= 'a' || digit <= 'f')
-		val = digit - 'a' + 10;
-	else if (digit >= 'A' || digit <= 'F')
-		val = digit - 'A' + 10;
-	else
-		json_error(L, "Invalid hex digit");
-	return val;
+	if (code < 0x80) {
+		buf[0] = code;
+		return 1;
+	} else if (code < 0x800) {
+		buf[0] = ((code >> 6) & 0x1f) | 0xc0;
+		buf[1] = (code & 0x3f) | 0x80;
+		return 2;
+	} else if (code < 0x10000) {
+		buf[0] = ((code >> 12) & 0x0f) | 0xe0;
+		buf[1] = ((code >> 6) & 0x3f) | 0x80;
+		buf[2] = (code & 0x3f) | 0x80;
+		return 3;
+	}
+	buf[0] = ((code >> 18) & 0x07) | 0xf0;
+	buf[1] = ((code >> 12) & 0x3f) | 0x80;
+	buf[2] = ((code >> 6) & 0x3f) | 0x80;
+	buf[3] = (code & 0x3f) | 0x80;
+	return 4;
 }
 
-static unsigned int
-fourhex2int(lua_State *L, const unsigned char *code)
+/*
+ * Strings without escapes are pushed straight from the input, others are
+ * unescaped into a Lua buffer.
+ */
+static int
+decode_string(struct decoder *d)
 {
-	unsigned int utf = 0;
+	luaL_Buffer b;
+	const char *p, *q;
+	unsigned int code, low;
+	char utf[4];
+
+	p = ++d->s;
+	d->s = scan_string(p, d->end);
+	if (d->s == d->end)
+		return decode_error(d, "string does not end with '\"'");
+	if (*d->s == '"') {
+		lua_pushlstring(d->L, p, d->s - p);
+		d->s++;
+		return 0;
+	}
 
-	utf += digit2int(L, code[0]) * 4096;
-	utf += digit2int(L, code[1]) * 256;
-	utf += digit2int(L, code[2]) * 16;
-	utf += digit2int(L, code[3]);
-	return utf;
+	luaL_buffinit(d->L, &b);
+	while (*d->s == '\\') {
+		luaL_addlstring(&b, p, d->s - p);
+		if (d->end - d->s < 2)
+			return decode_error(d, "string does not end with '\"'");
+		p = d->s + 2;
+		switch (d->s[1]) {
+		case '"':
+		case '\\':
+		case '/':
+			luaL_addchar(&b, d->s[1]);
+			break;
+		case 'b':
+			luaL_addchar(&b, '\b');
+			break;
+		case 'f':
+			luaL_addchar(&b, '\f');
+			break;
+		case 'n':
+			luaL_addchar(&b, '\n');
+			break;
+		case 'r':
+			luaL_addchar(&b, '\r');
+			break;
+		case 't':
+			luaL_addchar(&b, '\t');
+			break;
+		case 'u':
+			if (hex4(p, d->end, &code))
+				return decode_error(d,
+				    "invalid unicode escape");
+			p += 4;
+
+			/* A surrogate pair is one code point */
+			q = p;
+			if (code >= 0xd800 && code < 0xdc00 && d->end - q >= 6
+			    && q[0] == '\\' && q[1] == 'u'
+			    && !hex4(q + 2, d->end, &low)
+			    && low >= 0xdc00 && low < 0xe000) {
+				code = 0x10000 + ((code - 0xd800) << 10)
+				    + (low - 0xdc00);
+				p += 6;
+			}
+			luaL_addlstring(&b, utf, code2utf8(code, utf));
+			break;
+		default:
+			return decode_error(d, "invalid escape character");
+		}
+		d->s = scan_string(p, d->end);
+		if (d->s == d->end)
+			return decode_error(d, "string does not end with '\"'");
+	}
+	luaL_addlstring(&b, p, d->s - p);
+	luaL_pushresult(&b);
+	d->s++;
+	return 0;
 }
 
-static const char *
-code2utf8(lua_State *L, const unsigned char *code, char buf[4])
+static int
+decode_number(struct decoder *d)
 {
-	unsigned int utf = 0;
-
-	utf = fourhex2int(L, code);
-	if (utf < 128) {
-		buf[0] = utf & 0x7F;
-		buf[1] = buf[2] = buf[3] = 0;
-	} else if (utf < 2048) {
-		buf[0] = ((utf >> 6) & 0x1F) | 0xC0;
-		buf[1] = (utf & 0x3F) | 0x80;
-		buf[2] = buf[3] = 0;
-	} else if (utf < 65536) {
-		buf[0] = ((utf >> 12) & 0x0F) | 0xE0;
-		buf[1] = ((utf >> 6) & 0x3F) | 0x80;
-		buf[2] = (utf & 0x3F) | 0x80;
-		buf[3] = 0;
-	} else {
-		buf[0] = ((utf >> 18) & 0x07) | 0xF0;
-		buf[1] = ((utf >> 12) & 0x3F) | 0x80;
-		buf[2] = ((utf >> 6) & 0x3F) | 0x80;
-		buf[3] = (utf & 0x3F) | 0x80;
+	const char *p;
+	char *endp;
+	lua_Integer n;
+	int digits, neg;
+
+	/* Up to 18 digits fit any integer */
+	p = d->s;
+	neg = *p == '-';
+	if (*p == '-' || *p == '+')
+		p++;
+	for (n = 0, digits = 0; p < d->end && isdigit((unsigned char)*p)
+	    && digits < 18; p++, digits++)
+		n = n * 10 + (*p - '0');
+	if (digits && (p == d->end || (!isdigit((unsigned char)*p)
+	    && *p != '.' && *p != 'e' && *p != 'E'))) {
+		lua_pushinteger(d->L, neg ? -n : n);
+		d->s = p;
+		return 0;
 	}
-	return buf;
-}
 
-static void
-skip_ws(char **s)
-{
-	while (isspace(**s))
-		(*s)++;
+	/* Floats and long integers, the input is NUL terminated */
+	for (p = d->s; p < d->end && *p != '.' && *p != 'e' && *p != 'E'
+	    && (isdigit((unsigned char)*p) || *p == '-' || *p == '+'); p++)
+		;
+	errno = 0;
+	if (p == d->end || (*p != '.' && *p != 'e' && *p != 'E')) {
+		n = strtoll(d->s, &endp, 10);
+		if (errno == 0 && endp != d->s) {
+			lua_pushinteger(d->L, n);
+			d->s = endp;
+			return 0;
+		}
+	}
+	lua_pushnumber(d->L, strtod(d->s, &endp));
+	if (endp == d->s)
+		return decode_error(d, "invalid number");
+	d->s = endp;
+	return 0;
 }
 
-static void
-decode_array(lua_State *L, char **s, int null)
+static int
+decode_array(struct decoder *d)
 {
-	int i = 1;
-
-	luaL_checkstack(L, 2, "Out of stack space");
-	(*s)++;
-	lua_newtable(L);
-	for (i = 1; 1; i++) {
-		skip_ws(s);
-		lua_pushinteger(L, i);
-		decode_value(L, s, null);
-		lua_settable(L, -3);
-		skip_ws(s);
-		if (**s == ',') {
-			(*s)++;
-			skip_ws(s);
-		} else
+	lua_Integer i;
+
+	if (++d->depth > JSON_MAX_DEPTH)
+		return decode_error(d, "nesting too deep");
+	d->s++;
+	lua_newtable(d->L);
+	skip_ws(d);
+	if (d->s < d->end && *d->s == ']') {
+		d->s++;
+		d->depth--;
+		return 0;
+	}
+	for (i = 1; ; i++) {
+		if (decode_value(d))
+			return -1;
+		lua_rawseti(d->L, -2, i);
+		skip_ws(d);
+		if (d->s == d->end || *d->s != ',')
 			break;
+		d->s++;
 	}
-	skip_ws(s);
-	if (**s == ']')
-		(*s)++;
-	else
-		json_error(L, "array does not end with ']'");
+	if (d->s == d->end || *d->s != ']')
+		return decode_error(d, "array does not end with ']'");
+	d->s++;
+	d->depth--;
+	return 0;
 }
 
-static void
-decode_object(lua_State *L, char **s, int null)
+static int
+decode_object(struct decoder *d)
 {
-	luaL_checkstack(L, 1, "Out of stack space");
-
-	(*s)++;
-	lua_newtable(L);
-	skip_ws(s);
-
-	if (**s != '}') {
-		while (1) {
-			skip_ws(s);
-			decode_string(L, s);
-			skip_ws(s);
-			if (**s != ':')
-				json_error(L, "object lacks separator ':'");
-			(*s)++;
-			skip_ws(s);
-			decode_value(L, s, null);
-			lua_settable(L, -3);
-			skip_ws(s);
-			if (**s == ',') {
-				(*s)++;
-				skip_ws(s);
-			} else
-				break;
-		}
-		skip_ws(s);
+	if (++d->depth > JSON_MAX_DEPTH)
+		return decode_error(d, "nesting too deep");
+	d->s++;
+	lua_newtable(d->L);
+	skip_ws(d);
+	if (d->s < d->end && *d->s == '}') {
+		d->s++;
+		d->depth--;
+		return 0;
 	}
-	if (**s == '}')
-		(*s)++;
-	else
-		json_error(L, "object does not end with '}'");
+	for (;;) {
+		skip_ws(d);
+		if (d->s == d->end || *d->s != '"')
+			return decode_error(d, "object key is not a string");
+		if (decode_string(d))
+			return -1;
+		skip_ws(d);
+		if (d->s == d->end || *d->s != ':')
+			return decode_error(d, "object lacks separator ':'");
+		d->s++;
+		if (decode_value(d))
+			return -1;
+		lua_rawset(d->L, -3);
+		skip_ws(d);
+		if (d->s == d->end || *d->s != ',')
+			break;
+		d->s++;
+	}
+	if (d->s == d->end || *d->s != '}')
+		return decode_error(d, "object does not end with '}'");
+	d->s++;
+	d->depth--;
+	return 0;
 }
 
-static void
-decode_string(lua_State *L, char **s)
+/* Consume a literal like true, 0 if it is not at the current position */
+static int
+literal(struct decoder *d, const char *s, size_t len)
 {
-	size_t len;
-	char *newstr = NULL, *newc, *beginning, *end, *nextEscape = NULL;
-	char utfbuf[4] = "";
-
-	luaL_checkstack(L, 1, "Out of stack space");
-	(*s)++;
-	beginning = *s;
-	for (end = NULL; **s != '\0' && end == NULL; (*s)++) {
-		if (**s == '"' && (*((*s) - 1) != '\\'))
-			end = *s;
-	}
-	if (end == NULL)
-		return;
-	*s = beginning;
-	len = strlen(*s);
-	if ((newstr = malloc(len + 1)) == NULL)
-		json_error(L, "memory error");
-	memset(newstr, 0, len + 1);
-	newc = newstr;
-	while (*s != end) {
-		nextEscape = strchr(*s, '\\');
-		if (nextEscape > end)
-			nextEscape = NULL;
-		if (nextEscape == *s) {
-			switch (*((*s) + 1)) {
-			case '"':
-				*newc = '"';
-				newc++;
-				(*s) += 2;
-				break;
-			case '\\':
-				*newc = '\\';
-				newc++;
-				(*s) += 2;
-				break;
-			case '/':
-				*newc = '/';
-				newc++;
-				(*s) += 2;
-				break;
-			case 'b':
-				*newc = '\b';
-				newc++;
-				(*s) += 2;
-				break;
-			case 'f':
-				*newc = '\f';
-				newc++;
-				(*s) += 2;
-				break;
-			case 'n':
-				*newc = '\n';
-				newc++;
-				(*s) += 2;
-				break;
-			case 'r':
-				*newc = '\r';
-				newc++;
-				(*s) += 2;
-				break;
-			case 't':
-				*newc = '\t';
-				newc++;
-				(*s) += 2;
-				break;
-			case 'u':
-				code2utf8(L, (unsigned char *)(*s) + 2, utfbuf);
-				len = strlen(utfbuf);
-				strcpy(newc, utfbuf);
-				newc += len;
-				(*s) += 6;
-				break;
-			default:
-				json_error(L, "invalid escape character");
-				break;
-			}
-		} else if (nextEscape != NULL) {
-			len = nextEscape - *s;
-			strncpy(newc, *s, len);
-			newc += len;
-			(*s) += len;
-		} else {
-			len = end - *s;
-			strncpy(newc, *s, len);
-			newc += len;
-			(*s) += len;
-		}
-	}
-	*newc = 0;
-	lua_pushstring(L, newstr);
-	(*s)++;
-	free(newstr);
+	if ((size_t)(d->end - d->s) < len || memcmp(d->s, s, len))
+		return 0;
+	d->s += len;
+	return 1;
 }
 
-static void
-decode_value(lua_State *L, char **s, int null)
+static int
+decode_value(struct decoder *d)
 {
-	skip_ws(s);
-
-	luaL_checkstack(L, 1, "Out of stack space");
-	if (!strncmp(*s, "false", 5)) {
-		lua_pushboolean(L, 0);
-		*s += 5;
-	} else if (!strncmp(*s, "true", 4)) {
-		lua_pushboolean(L, 1);
-		*s += 4;
-	} else if (!strncmp(*s, "null", 4)) {
-		switch (null) {
+	skip_ws(d);
+	if (d->s == d->end)
+		return decode_error(d, "unexpected end of input");
+
+	luaL_checkstack(d->L, 3, "Out of stack space");
+	switch (*d->s) {
+	case '{':
+		return decode_object(d);
+	case '[':
+		return decode_array(d);
+	case '"':
+		return decode_string(d);
+	case '-':
+	case '+':
+	case '0': case '1': case '2': case '3': case '4':
+	case '5': case '6': case '7': case '8': case '9':
+		return decode_number(d);
+	}
+
+	if (literal(d, "true", 4))
+		lua_pushboolean(d->L, 1);
+	else if (literal(d, "false", 5))
+		lua_pushboolean(d->L, 0);
+	else if (literal(d, "null", 4)) {
+		switch (d->null) {
 		case 0:
-			lua_pushstring(L, "");
+			lua_pushstring(d->L, "");
 			break;
 		case 1:
-			lua_newtable(L);
-			luaL_setmetatable(L, JSON_NULL_METATABLE);
+			lua_newtable(d->L);
+			luaL_setmetatable(d->L, JSON_NULL_METATABLE);
 			break;
 		case 2:
-			lua_pushnil(L);
+			lua_pushnil(d->L);
 			break;
 		}
-		*s += 4;
-	} else if (isdigit(**s) || **s == '+' || **s == '-') {
-		char *p = *s;
-		int isfloat = 0;
-
-		/* advance pointer past the number */
-		while (isdigit(**s) || **s == '+' || **s == '-'
-		    || **s == 'e' || **s == 'E' || **s == '.') {
-		    	if (**s == 'e' || **s == 'E' || **s == '.')
-		    		isfloat = 1;
-			(*s)++;
-		}
-		if (isfloat)
-			lua_pushnumber(L, atof(p));
-		else
-			lua_pushinteger(L, atol(p));
-	} else {
-		switch (**s) {
-		case '[':
-			decode_array(L, s, null);
-			break;
-		case '{':
-			decode_object(L, s, null);
-			break;
-		case '"':
-			decode_string(L, s);
-			break;
-		case ']':	/* ignore end of empty array */
-			lua_pushnil(L);
-			break;
-		default:
-			json_error(L, "syntax error");
-			break;
-		}
-	}
+	} else
+		return decode_error(d, "syntax error");
+	return 0;
 }
 
 static int
 json_decode(lua_State *L)
 {
-	char *s;
-	int null;
+	struct decoder d;
+	size_t len;
+	int top;
 	const char *const options[] = {
 		"empty-string",
 		"json-null",
@@ -398,192 +421,488 @@ json_decode(lua_State *L)
 		NULL
 	};
 
-	s = (char *)luaL_checkstring(L, 1);
+	d.L = L;
+	d.start = d.s = luaL_checklstring(L, 1, &len);
+	d.end = d.s + len;
+	d.null = luaL_checkoption(L, 2, "json-null", options);
+	d.depth = 0;
 
-	null = luaL_checkoption(L, 2, "json-null", options);
-
-	if (!setjmp(env)) {
-		decode_value(L, &s, null);
-		return 1;
-	} else
+	top = lua_gettop(L);
+	if (decode_value(&d)) {
+		lua_settop(L, top);
+		lua_pushnil(L);
+		lua_pushfstring(L, "%s at offset %d", d.error,
+		    (int)(d.s - d.start));
 		return 2;
+	}
+	return 1;
 }
 
 /* encode JSON */
 
-/* encode_string assumes an UTF-8 string */
+/*
+ * The encoder appends to a buffer that belongs to the Lua state and is
+ * reused by every encode, so encoding does not allocate once the buffer
+ * is large enough.  A buffer that grew beyond JSON_BUFFER_KEEP bytes is
+ * shrunk again before it is reused.
+ */
+#define JSON_BUFFER		"JSON encode buffer"
+#define JSON_BUFFER_KEEP	(64 * 1024)
+
+static const char buffer_key;
+
+struct encoder {
+	lua_State	*L;
+	struct buffer	*b;
+	int		 depth;
+	char		 error[64];
+
+	/* Streaming, see json_encode_stream() */
+	size_t		 chunk;
+	int		(*write)(void *, const char *, size_t, int);
+	void		*arg;
+};
+
+static int
+encode_error(struct encoder *e, const char *error)
+{
+	snprintf(e->error, sizeof e->error, "%s", error);
+	return -1;
+}
+
+static int
+encode_buffer_gc(lua_State *L)
+{
+	struct buffer *b = lua_touserdata(L, 1);
+
+	buf_free(b);
+	b->data = NULL;
+	return 0;
+}
+
+static struct buffer *
+encode_buffer(lua_State *L)
+{
+	struct buffer *b;
+
+	lua_rawgetp(L, LUA_REGISTRYINDEX, &buffer_key);
+	b = lua_touserdata(L, -1);
+	lua_pop(L, 1);
+
+	if (b == NULL) {
+		b = lua_newuserdatauv(L, sizeof(struct buffer), 0);
+		if (buf_init(b))
+			luaL_error(L, "memory error");
+		if (luaL_newmetatable(L, JSON_BUFFER)) {
+			lua_pushcfunction(L, encode_buffer_gc);
+			lua_setfield(L, -2, "__gc");
+		}
+		lua_setmetatable(L, -2);
+		lua_rawsetp(L, LUA_REGISTRYINDEX, &buffer_key);
+	} else if (b->capacity > JSON_BUFFER_KEEP) {
+		buf_free(b);
+		if (buf_init(b))
+			luaL_error(L, "memory error");
+	}
+	b->size = 0;
+	return b;
+}
+
 static void
-encode_string(lua_State *L, struct buffer *b, unsigned char *s)
+encode_u(struct buffer *b, unsigned int code)
 {
-	char hexbuf[6];
+	static const char hex[] = "0123456789abcdef";
+	char *p;
+
+	p = buf_reserve(b, 6);
+	p[0] = '\\';
+	p[1] = 'u';
+	p[2] = hex[(code >> 12) & 0x0f];
+	p[3] = hex[(code >> 8) & 0x0f];
+	p[4] = hex[(code >> 4) & 0x0f];
+	p[5] = hex[code & 0x0f];
+	b->size += 6;
+}
+
+/* Printable ASCII that is copied as is */
+#define PLAIN(c)	((c) >= 0x20 && (c) < 0x80 && (c) != '"' && \
+			    (c) != '\\')
+
+/*
+ * encode_string assumes an UTF-8 string, characters outside the BMP are
+ * written as surrogate pairs, invalid or truncated sequences are skipped.
+ */
+static void
+encode_string(struct buffer *b, const char *str, size_t len)
+{
+	const unsigned char *s, *end, *run;
+	unsigned int code;
+	int n;
+
+	s = (const unsigned char *)str;
+	end = s + len;
 
 	buf_addchar(b, '"');
-	for (; *s; s++) {
+	while (s < end) {
+		for (run = s; s < end && PLAIN(*s); s++)
+			;
+		if (s > run)
+			buf_addlstring(b, (const char *)run, s - run);
+		if (s == end)
+			break;
+
 		switch (*s) {
 		case '\\':
-			buf_addstring(b, "\\\\");
+			buf_addlstring(b, "\\\\", 2);
 			break;
 		case '"':
-			buf_addstring(b, "\\\"");
+			buf_addlstring(b, "\\\"", 2);
 			break;
 		case '\b':
-			buf_addstring(b, "\\b");
+			buf_addlstring(b, "\\b", 2);
 			break;
 		case '\f':
-			buf_addstring(b, "\\f");
+			buf_addlstring(b, "\\f", 2);
 			break;
 		case '\n':
-			buf_addstring(b, "\\n");
+			buf_addlstring(b, "\\n", 2);
 			break;
 		case '\r':
-			buf_addstring(b, "\\r");
+			buf_addlstring(b, "\\r", 2);
 			break;
 		case '\t':
-			buf_addstring(b, "\\t");
+			buf_addlstring(b, "\\t", 2);
 			break;
 		default:
+			if (*s < 0x80) {
+				encode_u(b, *s);
+				break;
+			}
 		/* Convert UTF-8 to unicode
 		 * 00000000 - 0000007F: 0xxxxxxx
 		 * 00000080 - 000007FF: 110xxxxx 10xxxxxx
 		 * 00000800 - 0000FFFF: 1110xxxx 10xxxxxx 10xxxxxx
 		 * 00010000 - 001FFFFF: 11110xxx 10xxxxxx 10xxxxxx 10xxxxxx
 		 */
-			if ((*s & 0x80) == 0)
-				buf_addchar(b, *s);
-			else if (((*s >> 5) & 0x07) == 0x06) {
-				buf_addstring(b, "\\u");
-				snprintf(hexbuf, sizeof hexbuf, "%04x",
-				    ((*s & 0x1f) << 6) | (*(s + 1) & 0x3f));
-				buf_addstring(b, hexbuf);
-				s++;
-			} else if (((*s >> 4) & 0x0f) == 0x0e) {
-				buf_addstring(b, "\\u");
-				snprintf(hexbuf, sizeof hexbuf, "%04x",
-				    ((*s & 0x0f) << 12) |
-				    ((*(s + 1) & 0x3f) << 6) |
-				    (*(s + 2) & 0x3f));
-				buf_addstring(b, hexbuf);
-				s += 2;
-			} else if (((*s >> 3) & 0x1f) == 0x1e) {
-				buf_addstring(b, "\\u");
-				snprintf(hexbuf, sizeof hexbuf, "%04x",
-				    ((*s & 0x07) << 18) |
-				    ((*(s + 1) & 0x3f) << 12) |
-				    ((*(s + 2) & 0x3f) << 6) |
-				    (*(s + 3) & 0x3f));
-				buf_addstring(b, hexbuf);
-				s += 3;
+			if ((*s & 0xe0) == 0xc0) {
+				code = *s & 0x1f;
+				n = 1;
+			} else if ((*s & 0xf0) == 0xe0) {
+				code = *s & 0x0f;
+				n = 2;
+			} else if ((*s & 0xf8) == 0xf0) {
+				code = *s & 0x07;
+				n = 3;
+			} else
+				break;
+			if (end - s <= n)
+				break;
+			for (; n > 0; n--) {
+				if ((*(s + 1) & 0xc0) != 0x80)
+					break;
+				code = (code << 6) | (*++s & 0x3f);
 			}
+			if (n > 0)
+				break;
+			if (code >= 0x10000) {
+				code -= 0x10000;
+				encode_u(b, 0xd800 | (code >> 10));
+				encode_u(b, 0xdc00 | (code & 0x3ff));
+			} else
+				encode_u(b, code);
 			break;
 		}
+		s++;
 	}
 	buf_addchar(b, '"');
 }
 
 static void
-encode(lua_State *L, struct buffer *b)
+encode_integer(struct buffer *b, lua_Integer i)
 {
-	int e, t, n, m;
+	char digits[24], *p;
+	lua_Unsigned u;
+
+	u = i < 0 ? 0 - (lua_Unsigned)i : (lua_Unsigned)i;
+	p = digits + sizeof digits;
+	do {
+		*--p = '0' + u % 10;
+		u /= 10;
+	} while (u);
+	if (i < 0)
+		*--p = '-';
+	buf_addlstring(b, p, digits + sizeof digits - p);
+}
+
+/*
+ * Most floats in trx data have few decimals, like 14074.5 or 88.5.  If n
+ * is the closest float to such a decimal with at most 15 digits, that is
+ * also what tostring() returns and it is written without snprintf().
+ */
+static int
+encode_decimal(struct buffer *b, lua_Number n)
+{
+	static const lua_Number scale[] = { 1, 10, 100, 1e3, 1e4, 1e5, 1e6 };
+	lua_Number a, s;
+	char digits[24], *p;
+	uint64_t m;
+	int i, k;
+
+	a = n < 0 ? -n : n;
+	if (a < 1e-4 || a >= 1e15)
+		return -1;
+	for (k = 0; k < 7; k++) {
+		s = a * scale[k];
+		if (s >= 1e15)
+			return -1;
+		m = (uint64_t)(s + 0.5);
+		if ((lua_Number)m / scale[k] == a)
+			break;
+	}
+	if (k == 7)
+		return -1;
+
+	p = digits + sizeof digits;
+	if (k == 0) {
+		*--p = '0';
+		*--p = '.';
+	}
+	for (i = 0; i < k; i++) {
+		*--p = '0' + m % 10;
+		m /= 10;
+	}
+	if (k > 0)
+		*--p = '.';
+	do {
+		*--p = '0' + m % 10;
+		m /= 10;
+	} while (m);
+	if (n < 0)
+		*--p = '-';
+	buf_addlstring(b, p, digits + sizeof digits - p);
+	return 0;
+}
+
+/*
+ * Floats are written like tostring() does, JSON has no representation for
+ * nan and inf, they become null.
+ */
+static void
+encode_float(struct buffer *b, lua_Number n)
+{
+	char *p;
+	int len;
+
+	if (n != n || n - n != 0) {
+		buf_addlstring(b, "null", 4);
+		return;
+	}
+	if (encode_decimal(b, n) == 0)
+		return;
+	p = buf_reserve(b, LUA_N2SBUFFSZ);
+	len = snprintf(p, LUA_N2SBUFFSZ, LUA_NUMBER_FMT,
+	    (LUAI_UACNUMBER)n);
+	if (lua_str2number(p, NULL) != n)
+		len = snprintf(p, LUA_N2SBUFFSZ, LUA_NUMBER_FMT_N,
+		    (LUAI_UACNUMBER)n);
+	if (p[strspn(p, "-0123456789")] == '\0') {
+		p[len++] = '.';
+		p[len++] = '0';
+	}
+	b->size += len;
+}
+
+static int encode(struct encoder *);
+
+/* Pass what has been encoded so far on when a chunk is full */
+static int
+encode_flush(struct encoder *e)
+{
+	if (e->write == NULL || e->b->size < e->chunk)
+		return 0;
+	if (e->write(e->arg, e->b->data, e->b->size, 0))
+		return encode_error(e, "stream aborted");
+	e->b->size = 0;
+	return 0;
+}
+
+static int
+encode_table(struct encoder *e)
+{
+	lua_State *L = e->L;
+	lua_Integer i, n;
+	const char *key;
+	size_t len;
+	int t, null, first;
+
+	/* check if this is the null value */
+	if (lua_getmetatable(L, -1)) {
+		luaL_getmetatable(L, JSON_NULL_METATABLE);
+		null = lua_rawequal(L, -2, -1);
+		lua_pop(L, 2);
+		if (null) {
+			buf_addlstring(e->b, "null", 4);
+			return 0;
+		}
+	}
+
+	/* A table that contains itself ends up here as well */
+	if (++e->depth > JSON_MAX_DEPTH)
+		return encode_error(e, "nesting too deep");
+	if (!lua_checkstack(L, 3))
+		return encode_error(e, "out of stack space");
+	t = lua_gettop(L);
+
+	/* if there are t[1] .. t[n], output them as array */
+	n = lua_rawlen(L, t);
+	if (n > 0) {
+		buf_addchar(e->b, '[');
+		for (i = 1; i <= n; i++) {
+			if (i > 1)
+				buf_addchar(e->b, ',');
+			lua_rawgeti(L, t, i);
+			if (encode(e) || encode_flush(e))
+				return -1;
+		}
+		buf_addchar(e->b, ']');
+		e->depth--;
+		return 0;
+	}
+
+	/* output string indices as object, an empty table as array */
+	first = 1;
+	lua_pushnil(L);
+	while (lua_next(L, t) != 0) {
+		if (lua_type(L, -2) != LUA_TSTRING) {
+			lua_pop(L, 1);
+			continue;
+		}
+		buf_addchar(e->b, first ? '{' : ',');
+		first = 0;
+		key = lua_tolstring(L, -2, &len);
+		encode_string(e->b, key, len);
+		buf_addchar(e->b, ':');
+		if (encode(e) || encode_flush(e))
+			return -1;
+	}
+	if (first)
+		buf_addlstring(e->b, "[]", 2);
+	else
+		buf_addchar(e->b, '}');
+	e->depth--;
+	return 0;
+}
+
+/* Encode and pop the value on the top of the stack */
+static int
+encode(struct encoder *e)
+{
+	lua_State *L = e->L;
+	const char *s;
+	size_t len;
 
 	switch (lua_type(L, -1)) {
 	case LUA_TBOOLEAN:
-		buf_addstring(b, lua_toboolean(L, -1) ? "true" : "false");
-		lua_pop(L, 1);
+		if (lua_toboolean(L, -1))
+			buf_addlstring(e->b, "true", 4);
+		else
+			buf_addlstring(e->b, "false", 5);
 		break;
 	case LUA_TNUMBER:
-		buf_addstring(b, lua_tostring(L, -1));
-		lua_pop(L, 1);
+		if (lua_isinteger(L, -1))
+			encode_integer(e->b, lua_tointeger(L, -1));
+		else
+			encode_float(e->b, lua_tonumber(L, -1));
 		break;
 	case LUA_TSTRING:
-		encode_string(L, b, (unsigned char *)lua_tostring(L, -1));
-		lua_pop(L, 1);
+		s = lua_tolstring(L, -1, &len);
+		encode_string(e->b, s, len);
 		break;
 	case LUA_TTABLE:
-		/* check if this is the null value */
-		luaL_checkstack(L, 2, "out of stack space");
-		if (lua_getmetatable(L, -1)) {
-			luaL_getmetatable(L, JSON_NULL_METATABLE);
-			if (lua_compare(L, -2, -1, LUA_OPEQ)) {
-				lua_pop(L, 2);
-				buf_addstring(b, "null");
-				lua_pop(L, 1);
-				break;
-			}
-			lua_pop(L, 2);
-		}
-		/* if there are t[1] .. t[n], output them as array */
-		n = 0;
-		e = 1;
-		t = lua_gettop(L);
-		for (m = 1; ; m++) {
-			lua_geti(L, t, m);
-			if (lua_isnil(L, -1)) {
-				lua_pop(L, 1);
-				break;
-			}
-			buf_addchar(b, n ? ',' : '[');
-			encode(L, b);
-			n++;
-		}
-		if (n) {
-			buf_addchar(b, ']');
-			lua_pop(L, 1);
-			e = 0;
-			break;
-		}
-
-		/* output non-numerical indices as object */
-		t = lua_gettop(L);
-		lua_pushnil(L);
-		n = 0;
-		while (lua_next(L, t) != 0) {
-			int key /*, value */;
-
-			key = lua_absindex(L, -2);
-			/* value = lua_absindex(L, -1); */
-
-			if (lua_type(L, -2) == LUA_TNUMBER) {
-				lua_pop(L, 1);
-				continue;
-			}
-			buf_addstring(b, n ? ",\"" : "{\"");
-			buf_addstring(b, lua_tostring(L, -2));
-			buf_addstring(b, "\":");
-			encode(L, b);
-			lua_pushvalue(L, key);
-			/* lua_remove(L, value); */
-			/* lua_remove(L, key); */
-			n++;
-		}
-		if (n) {
-			buf_addchar(b, '}');
-			e = 0;
-		}
-
-		if (e)
-			buf_addstring(b, "[]");
-		lua_pop(L, 1);
+		if (encode_table(e))
+			return -1;
 		break;
 	case LUA_TNIL:
-		buf_addstring(b, "null");
-		lua_pop(L, 1);
+		buf_addlstring(e->b, "null", 4);
 		break;
 	default:
-		json_error(L, "Lua type %s is incompatible with JSON",
+		snprintf(e->error, sizeof e->error,
+		    "Lua type %s is incompatible with JSON",
 		    luaL_typename(L, -1));
-		lua_pop(L, 1);
+		return -1;
 	}
+	lua_pop(L, 1);
+	return 0;
+}
+
+/* The caller sets up streaming, if any */
+static int
+encode_value(lua_State *L, int idx, struct encoder *e)
+{
+	int top;
+
+	top = lua_gettop(L);
+	e->L = L;
+	e->b = encode_buffer(L);
+	e->depth = 0;
+	lua_pushvalue(L, idx);
+	if (encode(e)) {
+		lua_settop(L, top);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Encode the value at idx for C code that sends the result on without
+ * creating a Lua string.  The returned data belongs to the Lua state and
+ * is valid until the next encode in the same state.  Returns NULL if the
+ * value can not be encoded.
+ */
+const char *
+json_encode_value(lua_State *L, int idx, size_t *len)
+{
+	struct encoder e;
+
+	e.write = NULL;
+	if (encode_value(L, lua_absindex(L, idx), &e))
+		return NULL;
+	*len = e.b->size;
+	return e.b->data;
+}
+
+/*
+ * Encode the value at idx and pass the result to write() in chunks of
+ * about chunk bytes while it is being encoded, so large values are never
+ * held in memory as a whole.  The last call to write() has final set.
+ * write() returns non-zero to abort the encoding.  Returns -1 if the
+ * value can not be encoded or the encoding was aborted, write() may have
+ * been called with the first part of the value already.
+ */
+int
+json_encode_stream(lua_State *L, int idx, size_t chunk,
+    int (*write)(void *, const char *, size_t, int), void *arg)
+{
+	struct encoder e;
+
+	e.chunk = chunk;
+	e.write = write;
+	e.arg = arg;
+	if (encode_value(L, lua_absindex(L, idx), &e))
+		return -1;
+	return write(arg, e.b->data, e.b->size, 1) ? -1 : 0;
 }
 
 static int
 json_encode(lua_State *L)
 {
-	struct buffer b;
+	struct encoder e;
 
-	buf_init(&b);
-	encode(L, &b);
-	buf_push(&b, L);
-	buf_free(&b);
+	luaL_checkany(L, 1);
+	e.write = NULL;
+	if (encode_value(L, 1, &e))
+		return luaL_error(L, "%s", e.error);
+	lua_pushlstring(L, e.b->data, e.b->size);
 	return 1;
 }
 
@@ -634,7 +953,7 @@ luaopen_json(lua_State* L)
 	lua_pushliteral(L, "JSON encoder/decoder for Lua");
 	lua_settable(L, -3);
 	lua_pushliteral(L, "_VERSION");
-	lua_pushliteral(L, "json 1.3.0");
+	lua_pushliteral(L, "json 1.4.0");
 	lua_settable(L, -3);
 
 	lua_newtable(L);
@@ -649,13 +968,6 @@ luaopen_json(lua_State* L)
 	}
 	lua_setmetatable(L, -2);
 
-	if (luaL_newmetatable(L, JSON_GCMEM_METATABLE)) {
-		lua_pushliteral(L, "__gc");
-		lua_pushcfunction(L, gcmem_clear);
-		lua_settable(L, -3);
-	}
-	lua_pop(L, 1);
-
 	lua_setfield(L, -2, "null");
 	return 1;
 }
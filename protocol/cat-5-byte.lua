@@ -103,8 +103,7 @@ local function getFrequency(driver, request, response)
 		end
 	end
 
-	trx.write('\x00\x00\x00\x00\x03')
-	local f = trx.read(5)
+	local f = trx.transact('\x00\x00\x00\x00\x03', 5)
 	if f ~= nil then
 		local frequency = trx.bcdToString(string.sub(f, 1, 4))
 		local modeCode = string.byte(string.sub(f, 5))
@@ -164,8 +163,12 @@ local function getMode(driver, request, response)
 		end
 	end
 
-	trx.write('\x00\x00\x00\x00\x03')
-	local f = trx.read(5)
+	local f = trx.transact('\x00\x00\x00\x00\x03', 5)
+	if f == nil then
+		response.status = 'Failure'
+		response.reason = 'No reply from trx'
+		return
+	end
 	local m = string.byte(f, 5)
 
 	response.mode = internalCodeToMode[m]
@@ -185,8 +188,12 @@ local function powerOff(driver, request, response)
 end
 
 local function getPtt(driver, request, response)
-	trx.write('\x00\x00\x00\x00\xf7')
-	local status = trx.read(1)
+	local status = trx.transact('\x00\x00\x00\x00\xf7', 1)
+	if status == nil then
+		response.status = 'Failure'
+		response.reason = 'No reply from trx'
+		return
+	end
 
 	response.raw = string.format('%02x', string.byte(status))
 	if string.byte(status) & 0x80 == 0x80 then
@@ -47,8 +47,7 @@ local internalCodeToVfo = {}
 local lastVfo = 'vfo-1'
 
 local function initialize(driver)
-	trx.write('ID;')
-	local reply = trx.read(7)
+	local reply = trx.transact('ID;', ';')
 
 	if reply ~= nil then
 		if trx.verbose() > 0 then
@@ -201,17 +200,23 @@ end
 local function getFrequency(driver, request, response)
 	local vfo = request.vfo or lastVfo
 
+	local reply
+
 	if vfo == 'vfo-1' then
-		trx.write('FA;')
+		reply = trx.transact('FA;', ';')
 	elseif vfo == 'vfo-2' then
-		trx.write('FB;')
+		reply = trx.transact('FB;', ';')
 	else
 		response.status = 'Failure'
 		response.reason = 'Unknown VFO'
 		return
 	end
 
-	local reply = trx.read(12)
+	if reply == nil then
+		response.status = 'Failure'
+		response.reason = 'No reply from trx'
+		return
+	end
 	response.vfo = vfo
 	response.frequency = tonumber(string.sub(reply, 3, 11))
 end
@@ -239,8 +244,12 @@ local function getMode(driver, request, response)
 		return
 	end
 
-	trx.write(string.format('MD%s;', vfoCode))
-	local reply = trx.read(5)
+	local reply = trx.transact(string.format('MD%s;', vfoCode), ';')
+	if reply == nil then
+		response.status = 'Failure'
+		response.reason = 'No reply from trx'
+		return
+	end
 	local mode = string.sub(reply, 4, 4)
 
 	response.mode = internalCodeToMode[mode] or 'unknown'
@@ -249,6 +258,32 @@ local function getMode(driver, request, response)
 	lastVfo = vfo
 end
 
+-- Query frequency and mode in one round trip
+local function getStatus(driver, request, response)
+	local vfo = lastVfo
+	local vfoCode = vfoToInternalCode[vfo]
+	local frequency, mode
+
+	if vfo == 'vfo-1' then
+		frequency = trx.transact(string.format('FA;MD%s;', vfoCode), ';')
+	else
+		frequency = trx.transact(string.format('FB;MD%s;', vfoCode), ';')
+	end
+	if frequency ~= nil then
+		mode = trx.transact(nil, ';')
+	end
+
+	if mode == nil then
+		response.status = 'Failure'
+		response.reason = 'No reply from trx'
+		return
+	end
+
+	response.vfo = vfo
+	response.frequency = tonumber(string.sub(frequency, 3, 11))
+	response.mode = internalCodeToMode[string.sub(mode, 4, 4)] or 'unknown'
+end
+
 local function powerOn(driver, request, response)
 	trx.write('PS1;')
 end
@@ -258,8 +293,12 @@ local function powerOff(driver, request, response)
 end
 
 local function getPtt(driver, request, response)
-	trx.write('TX;')
-	local reply = trx.read(4)
+	local reply = trx.transact('TX;', ';')
+	if reply == nil then
+		response.status = 'Failure'
+		response.reason = 'No reply from trx'
+		return
+	end
 
 	local code = string.sub(reply, 3, 3)
 
@@ -305,6 +344,7 @@ return {
 	getFrequency = getFrequency,
 	getMode = getMode,
 	setMode = setMode,
+	getStatus = getStatus,
 	getPtt = getPtt,
 	setPtt = setPtt,
 	powerOn = powerOn,
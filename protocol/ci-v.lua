@@ -39,7 +39,7 @@ local internalCodeToMode = {}
 local controllerAddress = 0xe0
 local transceiverAddress = 0xa4
 
-local function sendMessage(cn, sc, data)
+local function frame(cn, sc, data)
 	local message = string.format('\xfe\xfe%c%c%s', transceiverAddress,
 	    controllerAddress, cn)
 
@@ -51,15 +51,22 @@ local function sendMessage(cn, sc, data)
 		message = message .. data
 	end
 
-	message = message .. '\xfd'
+	return message .. '\xfd'
+end
 
-	trx.write(message)
+local function sendMessage(cn, sc, data)
+	trx.write(frame(cn, sc, data))
+end
+
+-- Send a message and return the reply frame
+local function transact(cn, sc, data)
+	return trx.transact(frame(cn, sc, data), '\xfd')
 end
 
 local function recvReply()
-	local reply = trx.read(6)
+	local reply = trx.transact(nil, '\xfd')
 
-	if string.byte(reply, 5) == 0xfb then
+	if reply ~= nil and string.byte(reply, 5) == 0xfb then
 		return true
 	else
 		return false
@@ -106,14 +113,22 @@ local function setFrequency(driver, request, response)
 end
 
 local function getFrequency(driver, request, response)
-	sendMessage('\x03')
-	local reply = trx.read(11)
+	local reply = transact('\x03')
+	if reply == nil then
+		response.status = 'Failure'
+		response.reason = 'No reply from trx'
+		return
+	end
 
 	response.frequency =
 	    tonumber(trx.bcdToString(string.reverse(string.sub(reply, 6, -2))))
 
-	sendMessage('\x04')
-	reply = trx.read(8)
+	reply = transact('\x04')
+	if reply == nil then
+		response.status = 'Failure'
+		response.reason = 'No reply from trx'
+		return
+	end
 
 	local mode = string.byte(reply, 6)
 	response.mode = internalCodeToMode[mode] or '??'
@@ -142,14 +157,40 @@ local function setMode(driver, request, response)
 end
 
 local function getMode(driver, request, response)
-	sendMessage('\x04')
-	local reply = trx.read(8)
+	local reply = transact('\x04')
+	if reply == nil then
+		response.status = 'Failure'
+		response.reason = 'No reply from trx'
+		return
+	end
 
 	local mode = string.byte(reply, 6)
 
 	response.mode = internalCodeToMode[mode] or '??'
 end
 
+-- Send 0x03 and 0x04 back to back, then read both replies
+local function getStatus(driver, request, response)
+	local frequency, mode
+
+	frequency = trx.transact(frame('\x03') .. frame('\x04'), '\xfd')
+	if frequency ~= nil then
+		mode = trx.transact(nil, '\xfd')
+	end
+
+	if mode == nil then
+		response.status = 'Failure'
+		response.reason = 'No reply from trx'
+		return
+	end
+
+	response.frequency = tonumber(trx.bcdToString(string.reverse(
+	    string.sub(frequency, 6, -2))))
+
+	mode = string.byte(mode, 6)
+	response.mode = internalCodeToMode[mode] or '??'
+end
+
 local function powerOn(driver, request, response)
 	sendMessage('\x18\x01')
 end
@@ -182,6 +223,7 @@ return {
 	getFrequency = getFrequency,
 	getMode = getMode,
 	setMode = setMode,
+	getStatus = getStatus,
 	getPtt = nil,
 	setPtt = nil,
 	powerOn = powerOn,
@@ -72,14 +72,12 @@ local internalStepSize = {
 
 -- Handling auto information
 local function startStatusUpdates(driver)
-	trx.write('AI 1\r')
-	local reply = trx.read(5)
+	trx.transact('AI 1\r', '\r')
 	return string.byte('\r')
 end
 
 local function stopStatusUpdates(driver)
-	trx.write('AI 0\r')
-	local reply = trx.read(5)
+	trx.transact('AI 0\r', '\r')
 	return string.byte('\r')
 end
 
@@ -228,14 +226,22 @@ local function getFrequency(driver, request, response)
 		return
 	end
 
-	trx.write(string.format('FQ %s\r', vfoCode))
-	local reply = trx.read(16)
+	local reply = trx.transact(string.format('FQ %s\r', vfoCode), '\r')
+	if reply == nil then
+		response.status = 'Failure'
+		response.reason = 'No reply from trx'
+		return
+	end
 	local freq = string.sub(reply, 6, -1)
 	response.frequency = tonumber(freq)
 
-	trx.write(string.format('MD %s\r', vfoCode))
-    reply = trx.read(7)
-    local mode = string.sub(reply, 6, -2)
+	reply = trx.transact(string.format('MD %s\r', vfoCode), '\r')
+	if reply == nil then
+		response.status = 'Failure'
+		response.reason = 'No reply from trx'
+		return
+	end
+	local mode = string.sub(reply, 6, -2)
 
 	response.mode = internalCodeToMode[mode] or 'unknown'
 
@@ -280,9 +286,13 @@ local function getMode(driver, request, response)
 		return
 	end
 
-	trx.write(string.format('MD %s\r', vfoCode))
-	reply = trx.read(7)
-    local mode = string.sub(reply, 6, -2)
+	local reply = trx.transact(string.format('MD %s\r', vfoCode), '\r')
+	if reply == nil then
+		response.status = 'Failure'
+		response.reason = 'No reply from trx'
+		return
+	end
+	local mode = string.sub(reply, 6, -2)
 
 	response.mode = internalCodeToMode[mode] or 'unknown'
 
@@ -29,6 +29,11 @@ local function sendMessage(data)
 	trx.write(message)
 end
 
+-- Send a message and return the reply
+local function transact(data)
+	return trx.transact(data .. ';', ';')
+end
+
 -- Exported functions
 local function initialize(driver)
 	print (driver.name .. ': initialize')
@@ -56,13 +61,21 @@ local function setFrequency(driver, request, response)
 end
 
 local function getFrequency(driver, request, response)
-	sendMessage('FA')
-	local reply = trx.read(14)
+	local reply = transact('FA')
+	if reply == nil then
+		response.status = 'Failure'
+		response.reason = 'No reply from trx'
+		return
+	end
 	local freq = string.sub(reply, 3, 13)
 
-	sendMessage('MD')
-        reply = trx.read(4)
-        local mode = string.sub(reply, 3,3 )
+	reply = transact('MD')
+	if reply == nil then
+		response.status = 'Failure'
+		response.reason = 'No reply from trx'
+		return
+	end
+	local mode = string.sub(reply, 3, 3)
 
 	response.frequency = tonumber(freq)
 	response.mode = internalMode[tonumber(mode)] or '??'
@@ -84,13 +97,36 @@ local function setMode(driver, request, response, band, mode)
 end
 
 local function getMode(driver, request, response)
-	sendMessage('MD')
-	local reply = trx.read(4)
-        local mode = string.sub(reply,3,3)
+	local reply = transact('MD')
+	if reply == nil then
+		response.status = 'Failure'
+		response.reason = 'No reply from trx'
+		return
+	end
+	local mode = string.sub(reply, 3, 3)
 
 	response.mode = internalMode[tonumber(mode)]
 end
 
+-- Query frequency and mode in one round trip
+local function getStatus(driver, request, response)
+	local frequency, mode
+
+	frequency = trx.transact('FA;MD;', ';')
+	if frequency ~= nil then
+		mode = trx.transact(nil, ';')
+	end
+
+	if mode == nil then
+		response.status = 'Failure'
+		response.reason = 'No reply from trx'
+		return
+	end
+
+	response.frequency = tonumber(string.sub(frequency, 3, 13))
+	response.mode = internalMode[tonumber(string.sub(mode, 3, 3))] or '??'
+end
+
 return {
 	name = 'Kenwood TS-480 CAT protocol',
 	capabilities = {	-- driver specific
@@ -110,5 +146,6 @@ return {
 	setFrequency = setFrequency,
 	getFrequency = getFrequency,
 	getMode = getMode,
-	setMode = setMode
+	setMode = setMode,
+	getStatus = getStatus
 }
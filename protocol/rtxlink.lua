@@ -20,35 +20,35 @@
 
 -- OpenRTX RTXLink protocol (http://openrtx.org/#/rtxlink)
 
-local function slipWrite(s)
-	trx.write(string.format('\xc0%s\xc0',
-	    s:gsub('\xc0', '\xdb\xdc'):gsub('\xdb', '\xdb\xdd')))
+local function slipEncode(s)
+	return string.format('\xc0%s\xc0',
+	    s:gsub('\xc0', '\xdb\xdc'):gsub('\xdb', '\xdb\xdd'))
 end
 
-local function slipRead(nbytes)
-	local rawData = trx.read(nbytes)
-	local decodedData = ''
+-- Length of the first complete SLIP frame in data, or nil
+local function slipFrame(data)
+	local start = data:find('\xc0', 1, true)
 
-	repeat
-		local data, n = rawData:gsub('\xdb\xdc', '\xc0')
-		local data, m = data:gsub('\xdb\xdd', '\xdb')
-		decodedData = decodedData .. data
-		local missingBytes = n + m
+	if start ~= nil then
+		local stop = data:find('\xc0', start + 1, true)
+		return stop
+	end
+end
 
-		if missingBytes > 0 then
-			rawData = trx.read(missingBytes)
-		end
-	until missingBytes == 0
+-- Send a message and return the decoded reply, or nil on timeout
+local function slipTransact(s)
+	local frame = trx.transact(slipEncode(s), slipFrame, 1000)
 
-	return decodedData
+	if frame ~= nil then
+		return (frame:gsub('\xdb\xdc', '\xc0'):gsub('\xdb\xdd', '\xdb'))
+	end
 end
 
 local function initialize(driver)
 	print('initialize', driver.name)
 	local payload = '\x01GIN'
-	slipWrite(payload .. trx.crc16(payload))
-	if trx.waitForData(1000) then
-		local resp = slipRead(19)
+	local resp = slipTransact(payload .. trx.crc16(payload))
+	if resp ~= nil then
 		print('OpenRTX device ID', resp:sub(4, -4))
 	else
 		print('Could not retrieve OpenRTX device ID')
@@ -75,19 +75,13 @@ local function setFrequency(driver, request, response)
 	local payload = string.format('\x01SRF%s',
 	     string.char(byte1, byte2, byte3, byte4))
 
-	slipWrite(payload .. trx.crc16(payload))
-
-	if trx.waitForData(1000) then
-		local ack = slipRead(8)
-	end
+	slipTransact(payload .. trx.crc16(payload))
 end
 
 local function getFrequency(driver, request, response)
 	local payload = '\x01GRF'
-	slipWrite(payload .. trx.crc16(payload))
-	if trx.waitForData(1000) then
-		local resp = slipRead(10)
-
+	local resp = slipTransact(payload .. trx.crc16(payload))
+	if resp ~= nil then
 		local frequency = resp:byte(7) * 16777216 +
 		    resp:byte(6) * 65536 +
 		    resp:byte(5) * 256 + resp:byte(4)
@@ -120,10 +114,7 @@ local function setMode(driver, request, response)
 	end
 
 	local payload = string.format('\x01SOM%c', newmode)
-	slipWrite(payload .. trx.crc16(payload))
-	if trx.waitForData(1000) then
-		local resp = slipRead(6)
-	else
+	if slipTransact(payload .. trx.crc16(payload)) == nil then
 		response.status = 'Failure'
 		response.reason = 'No response from trx'
 	end
@@ -132,10 +123,9 @@ end
 
 local function getMode(driver, request, response)
 	local payload = '\x01GOM'
-	slipWrite(payload .. trx.crc16(payload))
-	if trx.waitForData(1000) then
+	local resp = slipTransact(payload .. trx.crc16(payload))
+	if resp ~= nil then
 		local name = 'unknown mode'
-		local resp = slipRead(6)
 
 		local operatingMode = 'none'
 		local opmode = tonumber(string.byte(resp, 4))
@@ -162,10 +152,7 @@ local function setPtt(driver, request, response)
 	end
 
 	local payload = string.format('\x01SPT%c', opstatus)
-	slipWrite(payload .. trx.crc16(payload))
-	if trx.waitForData(1000) then
-		local resp = slipRead(6)
-	else
+	if slipTransact(payload .. trx.crc16(payload)) == nil then
 		response.status = 'Failure'
 		response.reason = 'No answer from trx'
 	end
@@ -173,10 +160,8 @@ end
 
 local function getPtt(driver, request, response)
 	local payload = '\x01GPT'
-	slipWrite(payload .. trx.crc16(payload))
-	if trx.waitForData(1000) then
-		local resp = slipRead(6)
-
+	local resp = slipTransact(payload .. trx.crc16(payload))
+	if resp ~= nil then
 		response.ptt = tonumber(string.byte(resp, 4)) == 0x02
 		    and 'on' or 'off'
 	else
@@ -189,11 +174,7 @@ local function setCallsign(driver, request, response)
 	response.callsign = request.callsign
 
 	local payload = string.format('\x01SMC%-10s', request.callsign)
-	slipWrite(payload .. trx.crc16(payload))
-
-	if trx.waitForData(1000) then
-		local resp = slipRead(6)
-	else
+	if slipTransact(payload .. trx.crc16(payload)) == nil then
 		response.status = 'Failure'
 		response.reason = 'No answer from trx'
 	end
@@ -205,10 +186,8 @@ local function getCallsign(driver, request, response)
 	response.callsign = request.callsign
 
 	local payload = '\x01GMC'
-	slipWrite(payload .. trx.crc16(payload))
-
-	if trx.waitForData(1000) then
-		local resp = slipRead(16)
+	local resp = slipTransact(payload .. trx.crc16(payload))
+	if resp ~= nil then
 		response.callsign = resp:sub(4, -4)
 	else
 		response.status = 'Failure'
@@ -222,11 +201,7 @@ end
 local function setDestination(driver, request, response)
 	response.callsign = request.callsign
 	local payload = string.format('\x01SMD%-10s', request.callsign)
-	slipWrite(payload .. trx.crc16(payload))
-
-	if trx.waitForData(1000) then
-		local resp = slipRead(6)
-	else
+	if slipTransact(payload .. trx.crc16(payload)) == nil then
 		response.status = 'Failure'
 		response.reason = 'No answer from trx'
 	end
@@ -234,10 +209,8 @@ end
 
 local function getDestination(driver, request, response)
 	local payload = '\x01GMD'
-	slipWrite(payload .. trx.crc16(payload))
-
-	if trx.waitForData(1000) then
-		local resp = slipRead(16)
+	local resp = slipTransact(payload .. trx.crc16(payload))
+	if resp ~= nil then
 		response.callsign = resp:sub(4, -4)
 	else
 		response.status = 'Failure'
@@ -66,7 +66,7 @@ end
 
 local function getMode(driver, request, response, band)
 	print (driver.name .. ': get mode')
-	reponse.mode = mode
+	response.mode = mode
 end
 
 return {
@@ -0,0 +1,553 @@
+/*
+ * Copyright (c) 2023 - 2026 Marc Balmer HB9SSB
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+
+/* Read from the CAT device into a ring buffer, without polling */
+
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trxd.h"
+
+extern void command_submit(command_queue_t *, command_t *);
+extern int reconnect(reconnect_t *, const char *, int, int);
+extern void reconnect_stop(reconnect_t *);
+
+extern int verbose;
+
+/* Append to the ring, dropping the oldest input on overrun */
+static void
+ring_put(trx_controller_tag_t *t, const unsigned char *data, size_t len)
+{
+	size_t tail, n;
+
+	if (len > CAT_INPUT_SIZE) {
+		data += len - CAT_INPUT_SIZE;
+		len = CAT_INPUT_SIZE;
+	}
+	if (t->input_len + len > CAT_INPUT_SIZE) {
+		n = t->input_len + len - CAT_INPUT_SIZE;
+		t->input_head = (t->input_head + n) % CAT_INPUT_SIZE;
+		t->input_len -= n;
+		t->input_overruns++;
+		if (verbose)
+			printf("trx-input: %s: overrun, %zu bytes lost\n",
+			    t->name, n);
+	}
+
+	tail = (t->input_head + t->input_len) % CAT_INPUT_SIZE;
+	n = CAT_INPUT_SIZE - tail;
+	if (n > len)
+		n = len;
+	memcpy(&t->input[tail], data, n);
+	memcpy(t->input, data + n, len - n);
+	t->input_len += len;
+}
+
+/* Remove input from the ring */
+static void
+ring_get(trx_controller_tag_t *t, void *buf, size_t len)
+{
+	size_t n;
+
+	n = CAT_INPUT_SIZE - t->input_head;
+	if (n > len)
+		n = len;
+	memcpy(buf, &t->input[t->input_head], n);
+	memcpy((char *)buf + n, t->input, len - n);
+	t->input_head = (t->input_head + len) % CAT_INPUT_SIZE;
+	t->input_len -= len;
+}
+
+/* Length of the first complete frame in the ring, or 0 */
+static size_t
+ring_frame(trx_controller_tag_t *t)
+{
+	size_t n;
+
+	for (n = 0; n < t->input_len; n++)
+		if (t->input[(t->input_head + n) % CAT_INPUT_SIZE] ==
+		    t->handler_eol)
+			return n + 1;
+	return 0;
+}
+
+/* Set ts to timeout milliseconds from now, on the clock of input_cond */
+void
+cat_input_deadline(struct timespec *ts, int timeout)
+{
+	clock_gettime(CLOCK_MONOTONIC, ts);
+	ts->tv_sec += timeout / 1000;
+	ts->tv_nsec += (long)(timeout % 1000) * 1000000L;
+	if (ts->tv_nsec >= 1000000000L) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000L;
+	}
+}
+
+/* Initialize the ring, its condition variable uses the monotonic clock */
+void
+cat_input_init(trx_controller_tag_t *t)
+{
+	pthread_condattr_t attr;
+
+	if (pthread_mutex_init(&t->input_mutex, NULL)
+	    || pthread_condattr_init(&attr)
+	    || pthread_condattr_setclock(&attr, CLOCK_MONOTONIC)
+	    || pthread_cond_init(&t->input_cond, &attr)) {
+		syslog(LOG_ERR, "trx-input: can't initialize the input ring");
+		exit(1);
+	}
+	pthread_condattr_destroy(&attr);
+	t->input_head = t->input_len = 0;
+	t->input_stop = 0;
+
+	if (pipe(t->input_wakeup)
+	    || fcntl(t->input_wakeup[0], F_SETFL, O_NONBLOCK)) {
+		syslog(LOG_ERR, "trx-input: pipe");
+		exit(1);
+	}
+}
+
+/* Make the trx-input thread poll the CAT device again after a reopen */
+void
+cat_input_wakeup(trx_controller_tag_t *t)
+{
+	if (write(t->input_wakeup[1], "", 1) != 1)
+		syslog(LOG_ERR, "trx-input: %s: wakeup failed", t->name);
+}
+
+/*
+ * Wait until input is available or the deadline ts has passed, then remove
+ * at most len bytes.  If eol is not -1, stop after the first eol byte.
+ * Returns the number of bytes removed, 0 on timeout.
+ */
+size_t
+cat_input_take(trx_controller_tag_t *t, void *buf, size_t len, int eol,
+    const struct timespec *ts)
+{
+	size_t n;
+	int rv = 0;
+
+	if (pthread_mutex_lock(&t->input_mutex)) {
+		syslog(LOG_ERR, "trx-input: pthread_mutex_lock");
+		exit(1);
+	}
+	while (t->input_len == 0 && rv != ETIMEDOUT) {
+		rv = pthread_cond_timedwait(&t->input_cond, &t->input_mutex,
+		    ts);
+		if (rv != 0 && rv != ETIMEDOUT) {
+			syslog(LOG_ERR, "trx-input: pthread_cond_timedwait");
+			exit(1);
+		}
+	}
+
+	if (len > t->input_len)
+		len = t->input_len;
+	if (eol != -1)
+		for (n = 0; n < len; n++)
+			if (t->input[(t->input_head + n) % CAT_INPUT_SIZE] ==
+			    eol) {
+				len = n + 1;
+				break;
+			}
+	ring_get(t, buf, len);
+
+	if (pthread_mutex_unlock(&t->input_mutex)) {
+		syslog(LOG_ERR, "trx-input: pthread_mutex_unlock");
+		exit(1);
+	}
+	return len;
+}
+
+/* Return input that was taken but not used to the front of the ring */
+void
+cat_input_unread(trx_controller_tag_t *t, const void *buf, size_t len)
+{
+	size_t n;
+
+	if (pthread_mutex_lock(&t->input_mutex)) {
+		syslog(LOG_ERR, "trx-input: pthread_mutex_lock");
+		exit(1);
+	}
+	if (len > CAT_INPUT_SIZE - t->input_len) {
+		len = CAT_INPUT_SIZE - t->input_len;
+		t->input_overruns++;
+	}
+	t->input_head = (t->input_head + CAT_INPUT_SIZE - len) %
+	    CAT_INPUT_SIZE;
+	n = CAT_INPUT_SIZE - t->input_head;
+	if (n > len)
+		n = len;
+	memcpy(&t->input[t->input_head], buf, n);
+	memcpy(t->input, (const char *)buf + n, len - n);
+	t->input_len += len;
+
+	if (pthread_cond_broadcast(&t->input_cond)) {
+		syslog(LOG_ERR, "trx-input: pthread_cond_broadcast");
+		exit(1);
+	}
+	if (pthread_mutex_unlock(&t->input_mutex)) {
+		syslog(LOG_ERR, "trx-input: pthread_mutex_unlock");
+		exit(1);
+	}
+}
+
+/*
+ * Read up to len bytes, waiting at most timeout milliseconds for all of
+ * them to arrive.  Returns the number of bytes read.
+ */
+size_t
+cat_input_read(trx_controller_tag_t *t, void *buf, size_t len, int timeout)
+{
+	struct timespec ts;
+	int rv = 0;
+
+	cat_input_deadline(&ts, timeout);
+
+	if (pthread_mutex_lock(&t->input_mutex)) {
+		syslog(LOG_ERR, "trx-input: pthread_mutex_lock");
+		exit(1);
+	}
+	while (t->input_len < len && rv != ETIMEDOUT)
+		rv = pthread_cond_timedwait(&t->input_cond, &t->input_mutex,
+		    &ts);
+
+	if (len > t->input_len)
+		len = t->input_len;
+	ring_get(t, buf, len);
+
+	if (pthread_mutex_unlock(&t->input_mutex)) {
+		syslog(LOG_ERR, "trx-input: pthread_mutex_unlock");
+		exit(1);
+	}
+	return len;
+}
+
+/*
+ * Wait at most timeout milliseconds for input, a negative timeout waits
+ * forever.  Returns 1 if input is available.
+ */
+int
+cat_input_wait(trx_controller_tag_t *t, int timeout)
+{
+	struct timespec ts;
+	int rv = 0, available;
+
+	cat_input_deadline(&ts, timeout);
+
+	if (pthread_mutex_lock(&t->input_mutex)) {
+		syslog(LOG_ERR, "trx-input: pthread_mutex_lock");
+		exit(1);
+	}
+	while (t->input_len == 0 && rv != ETIMEDOUT) {
+		if (timeout < 0)
+			rv = pthread_cond_wait(&t->input_cond, &t->input_mutex);
+		else
+			rv = pthread_cond_timedwait(&t->input_cond,
+			    &t->input_mutex, &ts);
+	}
+	available = t->input_len > 0;
+
+	if (pthread_mutex_unlock(&t->input_mutex)) {
+		syslog(LOG_ERR, "trx-input: pthread_mutex_unlock");
+		exit(1);
+	}
+	return available;
+}
+
+/* Discard all pending input before a command is sent */
+void
+cat_input_flush(trx_controller_tag_t *t)
+{
+	if (pthread_mutex_lock(&t->input_mutex)) {
+		syslog(LOG_ERR, "trx-input: pthread_mutex_lock");
+		exit(1);
+	}
+	tcflush(t->cat_device, TCIFLUSH);
+	t->input_head = t->input_len = 0;
+
+	if (pthread_mutex_unlock(&t->input_mutex)) {
+		syslog(LOG_ERR, "trx-input: pthread_mutex_unlock");
+		exit(1);
+	}
+}
+
+/*
+ * Sleep until status updates are enabled and a complete frame arrived.
+ * Returns 0 if the controller has been retired instead.
+ */
+int
+cat_input_wait_frame(trx_controller_tag_t *t)
+{
+	int running;
+
+	if (pthread_mutex_lock(&t->input_mutex)) {
+		syslog(LOG_ERR, "trx-input: pthread_mutex_lock");
+		exit(1);
+	}
+	while (!t->input_stop
+	    && (!t->handler_running || ring_frame(t) == 0)) {
+		if (pthread_cond_wait(&t->input_cond, &t->input_mutex)) {
+			syslog(LOG_ERR, "trx-input: pthread_cond_wait");
+			exit(1);
+		}
+	}
+	running = !t->input_stop;
+	if (pthread_mutex_unlock(&t->input_mutex)) {
+		syslog(LOG_ERR, "trx-input: pthread_mutex_unlock");
+		exit(1);
+	}
+	return running;
+}
+
+/*
+ * Remove the first complete frame from the ring.  Returns a NUL terminated
+ * copy allocated with malloc(), or NULL if there is no complete frame.
+ */
+char *
+cat_input_frame(trx_controller_tag_t *t, size_t *len)
+{
+	char *frame = NULL;
+	size_t n;
+
+	if (pthread_mutex_lock(&t->input_mutex)) {
+		syslog(LOG_ERR, "trx-input: pthread_mutex_lock");
+		exit(1);
+	}
+	if (t->handler_running && (n = ring_frame(t)) > 0) {
+		frame = malloc(n + 1);
+		if (frame == NULL) {
+			syslog(LOG_ERR, "trx-input: malloc");
+			exit(1);
+		}
+		ring_get(t, frame, n);
+		frame[n] = '\0';
+		*len = n;
+	}
+	if (pthread_mutex_unlock(&t->input_mutex)) {
+		syslog(LOG_ERR, "trx-input: pthread_mutex_unlock");
+		exit(1);
+	}
+	return frame;
+}
+
+/* Free the input ring of a controller whose threads have exited */
+void
+cat_input_free(trx_controller_tag_t *t)
+{
+	pthread_mutex_destroy(&t->input_mutex);
+	pthread_cond_destroy(&t->input_cond);
+	close(t->input_wakeup[0]);
+	close(t->input_wakeup[1]);
+}
+
+/*
+ * The controller has been retired by a reload.  The trx-handler thread
+ * exits, the trx-input thread closes the CAT device and exits.
+ */
+void
+cat_input_stop(trx_controller_tag_t *t)
+{
+	if (pthread_mutex_lock(&t->input_mutex)) {
+		syslog(LOG_ERR, "trx-input: pthread_mutex_lock");
+		exit(1);
+	}
+	t->input_stop = 1;
+	if (pthread_cond_broadcast(&t->input_cond)) {
+		syslog(LOG_ERR, "trx-input: pthread_cond_broadcast");
+		exit(1);
+	}
+	if (pthread_mutex_unlock(&t->input_mutex)) {
+		syslog(LOG_ERR, "trx-input: pthread_mutex_unlock");
+		exit(1);
+	}
+	reconnect_stop(&t->reconnect);
+	cat_input_wakeup(t);
+}
+
+/* Enable or disable the delivery of frames to the dataHandler */
+void
+cat_input_frames(trx_controller_tag_t *t, int enable)
+{
+	if (pthread_mutex_lock(&t->input_mutex)) {
+		syslog(LOG_ERR, "trx-input: pthread_mutex_lock");
+		exit(1);
+	}
+	t->handler_running = enable;
+	if (pthread_cond_broadcast(&t->input_cond)) {
+		syslog(LOG_ERR, "trx-input: pthread_cond_broadcast");
+		exit(1);
+	}
+	if (pthread_mutex_unlock(&t->input_mutex)) {
+		syslog(LOG_ERR, "trx-input: pthread_mutex_unlock");
+		exit(1);
+	}
+}
+
+static void
+reconnected(command_t *c, const char *response, size_t len)
+{
+	trx_controller_tag_t *t = c->arg;
+
+	__atomic_store_n(&t->queue.offline, 0, __ATOMIC_RELAXED);
+	if (verbose)
+		printf("trx-input: %s is back online\n", t->name);
+	free(c);
+}
+
+/* A character device that is not a terminal, e.g. /dev/null, has no input */
+static int
+no_input(int fd)
+{
+	struct stat sb;
+
+	return !isatty(fd) && fstat(fd, &sb) == 0 && S_ISCHR(sb.st_mode);
+}
+
+/*
+ * The device went away.  Requests fail while it is reopened, under the
+ * same descriptor as before, then the controller initializes the driver
+ * again.
+ */
+static void
+offline(trx_controller_tag_t *t, const char *reason)
+{
+	command_t *c;
+	int fd;
+
+	syslog(LOG_ERR, "trx-input: %s: %s", t->name, reason);
+	__atomic_store_n(&t->queue.offline, 1, __ATOMIC_RELAXED);
+
+	fd = reconnect(&t->reconnect, t->device, t->speed, t->channel);
+	if (fd == -1)
+		return;
+	if (dup2(fd, t->cat_device) == -1) {
+		syslog(LOG_ERR, "trx-input: dup2: %s", strerror(errno));
+		exit(1);
+	}
+	close(fd);
+	cat_input_flush(t);
+
+	c = calloc(1, sizeof(command_t));
+	if (c == NULL) {
+		syslog(LOG_ERR, "trx-input: malloc");
+		exit(1);
+	}
+	c->handler = "reconnectHandler";
+	c->prio = PRIO_REALTIME;
+	c->done = reconnected;
+	c->arg = t;
+	command_submit(&t->queue, c);
+}
+
+/*
+ * The trx-input thread sleeps until the CAT device becomes readable and
+ * then reads all available input at once.  Reading is done with the ring
+ * locked, so that cat_input_flush() never misses input that was read
+ * before the device was flushed.
+ */
+void *
+trx_input(void *arg)
+{
+	trx_controller_tag_t *t = (trx_controller_tag_t *)arg;
+	struct pollfd pfd[2];
+	unsigned char buf[CAT_INPUT_SIZE];
+	ssize_t n;
+	int error;
+
+	if (pthread_detach(pthread_self())) {
+		syslog(LOG_ERR, "trx-input: pthread_detach");
+		exit(1);
+	}
+
+	if (pthread_setname_np(pthread_self(), "trx-input")) {
+		syslog(LOG_ERR, "trx-input: pthread_setname_np");
+		exit(1);
+	}
+
+	pfd[0].fd = t->cat_device;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = t->input_wakeup[0];
+	pfd[1].events = POLLIN;
+
+	for (;;) {
+		if (poll(pfd, 2, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			syslog(LOG_ERR, "trx-input: poll");
+			exit(1);
+		}
+
+		/* The device has been reopened, or the controller retired */
+		if (pfd[1].revents & POLLIN) {
+			while (read(t->input_wakeup[0], buf, sizeof(buf)) > 0)
+				;
+			if (__atomic_load_n(&t->input_stop, __ATOMIC_RELAXED))
+				break;
+			pfd[0].fd = t->cat_device;
+			continue;
+		}
+
+		if (pthread_mutex_lock(&t->input_mutex)) {
+			syslog(LOG_ERR, "trx-input: pthread_mutex_lock");
+			exit(1);
+		}
+
+		n = read(t->cat_device, buf, sizeof(buf));
+		error = errno;
+		if (n > 0) {
+			ring_put(t, buf, n);
+			if (pthread_cond_broadcast(&t->input_cond)) {
+				syslog(LOG_ERR,
+				    "trx-input: pthread_cond_broadcast");
+				exit(1);
+			}
+		}
+
+		if (pthread_mutex_unlock(&t->input_mutex)) {
+			syslog(LOG_ERR, "trx-input: pthread_mutex_unlock");
+			exit(1);
+		}
+
+		/* Nothing will ever be read from it, stop polling it */
+		if (n == 0 && no_input(t->cat_device))
+			pfd[0].fd = -1;
+		else if (n == 0 || (n == -1 && error != EAGAIN &&
+		    error != EINTR))
+			offline(t, n == 0 ? "device closed" : strerror(error));
+	}
+	close(t->cat_device);
+	__atomic_sub_fetch(&t->threads, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
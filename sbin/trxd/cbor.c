@@ -0,0 +1,407 @@
+/*
+ * Copyright (c) 2026 Marc Balmer HB9SSB
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/* Transcode JSON messages to CBOR (RFC 8949) for clients that want it */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <lua.h>
+
+#include "buffer.h"
+
+#define CBOR_MAX_DEPTH	256
+
+#define CBOR_UINT	0x00
+#define CBOR_NINT	0x20
+#define CBOR_TEXT	0x60
+#define CBOR_ARRAY	0x80
+#define CBOR_MAP	0xa0
+#define CBOR_FALSE	0xf4
+#define CBOR_TRUE	0xf5
+#define CBOR_NULL	0xf6
+#define CBOR_FLOAT32	0xfa
+#define CBOR_FLOAT64	0xfb
+
+#define IS_WS(c)	((c) == ' ' || (c) == '\t' || (c) == '\n' \
+	|| (c) == '\r')
+
+static const char *value(struct buffer *, const char *, const char *, int);
+
+static const char *
+skip_ws(const char *p, const char *end)
+{
+	while (p < end && IS_WS(*p))
+		p++;
+	return p;
+}
+
+/* Length of the head of a data item with argument n */
+static size_t
+head_len(uint64_t n)
+{
+	if (n < 24)
+		return 1;
+	if (n <= 0xff)
+		return 2;
+	if (n <= 0xffff)
+		return 3;
+	if (n <= 0xffffffff)
+		return 5;
+	return 9;
+}
+
+/* Write a head of hlen bytes, as returned by head_len() */
+static void
+put_head(char *p, int major, uint64_t n, size_t hlen)
+{
+	size_t i;
+
+	switch (hlen) {
+	case 1:
+		p[0] = major | n;
+		return;
+	case 2:
+		p[0] = major | 24;
+		break;
+	case 3:
+		p[0] = major | 25;
+		break;
+	case 5:
+		p[0] = major | 26;
+		break;
+	default:
+		p[0] = major | 27;
+	}
+	for (i = hlen - 1; i > 0; i--, n >>= 8)
+		p[i] = n & 0xff;
+}
+
+static void
+add_head(struct buffer *b, int major, uint64_t n)
+{
+	size_t hlen = head_len(n);
+
+	put_head(buf_reserve(b, hlen), major, n, hlen);
+	b->size += hlen;
+}
+
+/*
+ * Make room for a head of hlen bytes at pos, where a head of one byte has
+ * been reserved, once the length of the data item is known.
+ */
+static void
+insert_head(struct buffer *b, size_t pos, int major, uint64_t n)
+{
+	size_t hlen = head_len(n);
+
+	if (hlen > 1) {
+		buf_reserve(b, hlen - 1);
+		memmove(b->data + pos + hlen, b->data + pos + 1,
+		    b->size - pos - 1);
+		b->size += hlen - 1;
+	}
+	put_head(b->data + pos, major, n, hlen);
+}
+
+static int
+hex4(const char *p, unsigned int *code)
+{
+	int i;
+
+	*code = 0;
+	for (i = 0; i < 4; i++) {
+		*code <<= 4;
+		if (p[i] >= '0' && p[i] <= '9')
+			*code |= p[i] - '0';
+		else if (p[i] >= 'a' && p[i] <= 'f')
+			*code |= p[i] - 'a' + 10;
+		else if (p[i] >= 'A' && p[i] <= 'F')
+			*code |= p[i] - 'A' + 10;
+		else
+			return -1;
+	}
+	return 0;
+}
+
+static char *
+put_utf8(char *q, unsigned int code)
+{
+	if (code < 0x80)
+		*q++ = code;
+	else if (code < 0x800) {
+		*q++ = 0xc0 | (code >> 6);
+		*q++ = 0x80 | (code & 0x3f);
+	} else if (code < 0x10000) {
+		*q++ = 0xe0 | (code >> 12);
+		*q++ = 0x80 | ((code >> 6) & 0x3f);
+		*q++ = 0x80 | (code & 0x3f);
+	} else {
+		*q++ = 0xf0 | (code >> 18);
+		*q++ = 0x80 | ((code >> 12) & 0x3f);
+		*q++ = 0x80 | ((code >> 6) & 0x3f);
+		*q++ = 0x80 | (code & 0x3f);
+	}
+	return q;
+}
+
+/*
+ * A JSON string becomes a text string.  Unescaping never makes a string
+ * longer, so it is unescaped in place after a head for the raw length.
+ */
+static const char *
+string(struct buffer *b, const char *p, const char *end)
+{
+	const char *s;
+	char *start, *q;
+	unsigned int code, low;
+	size_t pos, hlen, len;
+
+	for (s = ++p; p < end && *p != '"'; p++)
+		if (*p == '\\' && ++p == end)
+			return NULL;
+	if (p == end)
+		return NULL;
+
+	pos = b->size;
+	hlen = head_len(p - s);
+	start = buf_reserve(b, hlen + (p - s)) + hlen;
+
+	for (q = start; s < p; s++) {
+		if (*s != '\\') {
+			*q++ = *s;
+			continue;
+		}
+		switch (*++s) {
+		case 'b':
+			*q++ = '\b';
+			break;
+		case 'f':
+			*q++ = '\f';
+			break;
+		case 'n':
+			*q++ = '\n';
+			break;
+		case 'r':
+			*q++ = '\r';
+			break;
+		case 't':
+			*q++ = '\t';
+			break;
+		case 'u':
+			if (p - s < 5 || hex4(s + 1, &code))
+				return NULL;
+			s += 4;
+			if (code >= 0xd800 && code < 0xdc00 && p - s >= 7
+			    && s[1] == '\\' && s[2] == 'u'
+			    && !hex4(s + 3, &low) && low >= 0xdc00
+			    && low < 0xe000) {
+				code = 0x10000 + ((code - 0xd800) << 10)
+				    + (low - 0xdc00);
+				s += 6;
+			}
+			q = put_utf8(q, code);
+			break;
+		default:
+			*q++ = *s;
+		}
+	}
+	len = q - start;
+
+	/* The unescaped string may need a shorter head */
+	if (head_len(len) < hlen) {
+		memmove(start - hlen + head_len(len), start, len);
+		hlen = head_len(len);
+	}
+	put_head(b->data + pos, CBOR_TEXT, len, hlen);
+	b->size = pos + hlen + len;
+	return p + 1;
+}
+
+/* Integers that fit are integers, all others floats */
+static const char *
+number(struct buffer *b, const char *p, const char *end)
+{
+	const char *s;
+	char *q, num[64];
+	uint64_t n = 0;
+	double d;
+	float f;
+	int neg, integer = 1, digits = 0;
+
+	s = p;
+	neg = *p == '-';
+	if (neg)
+		p++;
+	for (; p < end && *p >= '0' && *p <= '9'; p++, digits++)
+		n = n * 10 + *p - '0';
+	for (; p < end && (*p == '.' || *p == 'e' || *p == 'E'
+	    || *p == '+' || *p == '-' || (*p >= '0' && *p <= '9')); p++)
+		integer = 0;
+	if (p - s == neg || (size_t)(p - s) >= sizeof(num))
+		return NULL;
+
+	if (integer && digits < 19) {
+		if (neg && n > 0)
+			add_head(b, CBOR_NINT, n - 1);
+		else
+			add_head(b, CBOR_UINT, n);
+		return p;
+	}
+
+	memcpy(num, s, p - s);
+	num[p - s] = '\0';
+	d = strtod(num, NULL);
+
+	/* The shortest float that holds the value */
+	f = d;
+	if (f == d) {
+		uint32_t u;
+
+		memcpy(&u, &f, sizeof(u));
+		q = buf_reserve(b, 5);
+		put_head(q, 0, u, 5);
+		q[0] = CBOR_FLOAT32;
+		b->size += 5;
+	} else {
+		uint64_t u;
+
+		memcpy(&u, &d, sizeof(u));
+		q = buf_reserve(b, 9);
+		put_head(q, 0, u, 9);
+		q[0] = CBOR_FLOAT64;
+		b->size += 9;
+	}
+	return p;
+}
+
+static const char *
+literal(struct buffer *b, const char *p, const char *end, const char *name,
+    int simple)
+{
+	size_t len = strlen(name);
+
+	if ((size_t)(end - p) < len || memcmp(p, name, len))
+		return NULL;
+	buf_addchar(b, simple);
+	return p + len;
+}
+
+/* Arrays and objects, the count is known when the items are written */
+static const char *
+container(struct buffer *b, const char *p, const char *end, int depth)
+{
+	size_t pos;
+	uint64_t n = 0;
+	int major, close;
+
+	if (depth > CBOR_MAX_DEPTH)
+		return NULL;
+
+	major = *p == '[' ? CBOR_ARRAY : CBOR_MAP;
+	close = *p == '[' ? ']' : '}';
+	pos = b->size;
+	buf_addchar(b, 0);
+
+	p = skip_ws(p + 1, end);
+	if (p < end && *p == close)
+		p++;
+	else for (;;) {
+		if (major == CBOR_MAP) {
+			if (p == end || *p != '"')
+				return NULL;
+			p = string(b, p, end);
+			if (p == NULL)
+				return NULL;
+			p = skip_ws(p, end);
+			if (p == end || *p++ != ':')
+				return NULL;
+		}
+		p = value(b, p, end, depth + 1);
+		if (p == NULL)
+			return NULL;
+		n++;
+		p = skip_ws(p, end);
+		if (p == end)
+			return NULL;
+		if (*p == close) {
+			p++;
+			break;
+		}
+		if (*p++ != ',')
+			return NULL;
+		p = skip_ws(p, end);
+	}
+	insert_head(b, pos, major, n);
+	return p;
+}
+
+static const char *
+value(struct buffer *b, const char *p, const char *end, int depth)
+{
+	p = skip_ws(p, end);
+	if (p == end)
+		return NULL;
+
+	switch (*p) {
+	case '{':
+	case '[':
+		return container(b, p, end, depth);
+	case '"':
+		return string(b, p, end);
+	case 't':
+		return literal(b, p, end, "true", CBOR_TRUE);
+	case 'f':
+		return literal(b, p, end, "false", CBOR_FALSE);
+	case 'n':
+		return literal(b, p, end, "null", CBOR_NULL);
+	default:
+		return number(b, p, end);
+	}
+}
+
+/*
+ * Transcode a JSON text to a CBOR data item, appended to b.  Returns -1 if
+ * the text is not valid JSON, b is left as it was then.
+ */
+int
+cbor_transcode(struct buffer *b, const char *json, size_t len)
+{
+	const char *p, *end = json + len;
+	size_t size = b->size;
+
+	p = value(b, json, end, 0);
+	if (p == NULL || skip_ws(p, end) != end) {
+		b->size = size;
+		return -1;
+	}
+	return 0;
+}
+
+/* Append data as a text string, for messages that are not JSON */
+void
+cbor_text(struct buffer *b, const char *data, size_t len)
+{
+	add_head(b, CBOR_TEXT, len);
+	buf_addlstring(b, data, len);
+}
@@ -0,0 +1,423 @@
+/*
+ * Copyright (c) 2023 - 2026 Marc Balmer HB9SSB
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/* Queue commands to controller threads */
+
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <syslog.h>
+#include <time.h>
+
+#include <lua.h>
+
+#include "trxd.h"
+
+extern int envelope_supersedes(const envelope_t *, const envelope_t *);
+extern int envelope_identical(const envelope_t *, const envelope_t *);
+
+/* A thread waiting for a command to be executed, see command_call() */
+struct waiter {
+	pthread_mutex_t		 mutex;
+	pthread_cond_t		 cond;
+	int			 done;
+};
+
+void
+command_queue_init(command_queue_t *q)
+{
+	int prio;
+
+	q->head = NULL;
+	for (prio = 0; prio < PRIO_MAX; prio++) {
+		q->next[prio] = NULL;
+		q->tail[prio] = &q->next[prio];
+	}
+	if (sem_init(&q->pending, 0, 0)) {
+		syslog(LOG_ERR, "command: sem_init");
+		exit(1);
+	}
+	q->queued = 0;
+	q->busy = 0;
+	q->degraded = 0;
+	q->offline = 0;
+	q->timeout = REQUEST_TIMEOUT;
+	q->watchdog = WATCHDOG_TIMEOUT;
+}
+
+/* Free a queue that no thread uses anymore */
+void
+command_queue_free(command_queue_t *q)
+{
+	sem_destroy(&q->pending);
+}
+
+/* Monotonic time in milliseconds for deadlines, never 0 */
+unsigned long
+command_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000L + 1;
+}
+
+/* Queue a command, this never blocks */
+void
+command_submit(command_queue_t *q, command_t *c)
+{
+	__atomic_add_fetch(&q->queued, 1, __ATOMIC_RELAXED);
+
+	c->next = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&q->head, &c->next, c, 1,
+	    __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+
+	if (sem_post(&q->pending)) {
+		syslog(LOG_ERR, "command: sem_post");
+		exit(1);
+	}
+}
+
+/* The last command queued in a class, the class must not be empty */
+#define LAST(q, prio)	((command_t *)((char *)(q)->tail[prio] \
+			    - offsetof(command_t, next)))
+
+/* Pass the result to a command, it is no longer queued */
+static void
+finish(command_queue_t *q, command_t *c, const char *response, size_t len)
+{
+	__atomic_sub_fetch(&q->queued, 1, __ATOMIC_RELAXED);
+	c->done(c, response, len);
+}
+
+/*
+ * Answer a command instead of executing it.  The commands that were to
+ * share its result are queued again in their order, ahead of the others,
+ * so each is answered on its own, e.g. when its own deadline has passed.
+ */
+static void
+answer(command_queue_t *q, command_t *c, const char *fmt)
+{
+	command_t *f, *next;
+	char *response;
+	int len;
+
+	/* Followers are stacked, the latest first */
+	for (f = c->followers; f != NULL; f = next) {
+		next = f->next;
+		f->next = q->next[f->prio];
+		if (f->next == NULL)
+			q->tail[f->prio] = &f->next;
+		q->next[f->prio] = f;
+		if (sem_post(&q->pending)) {
+			syslog(LOG_ERR, "command: sem_post");
+			exit(1);
+		}
+	}
+	c->followers = NULL;
+
+	len = asprintf(&response, fmt,
+	    c->request->env.request != NULL ? c->request->env.request :
+	    "batch");
+	if (len == -1) {
+		syslog(LOG_ERR, "command: asprintf");
+		exit(1);
+	}
+	finish(q, c, response, len);
+	free(response);
+}
+
+static int
+expired(command_t *c)
+{
+	return c->request != NULL && c->request->deadline != 0
+	    && command_clock() >= c->request->deadline;
+}
+
+/* Returns 1 if the last queued command is superseded by c */
+static int
+superseded(command_queue_t *q, command_t *c)
+{
+	command_t *last;
+
+	if (q->next[c->prio] == NULL || c->request == NULL)
+		return 0;
+	last = LAST(q, c->prio);
+	return last->request != NULL
+	    && envelope_supersedes(&last->request->env, &c->request->env);
+}
+
+static int
+identical(command_t *a, command_t *b)
+{
+	return a->request != NULL && b->request != NULL
+	    && envelope_identical(&a->request->env, &b->request->env);
+}
+
+static int
+is_write(command_t *c)
+{
+	return c->request != NULL && !c->request->env.readonly;
+}
+
+/*
+ * Make c share the result of l.  It is no longer queued on its own, so
+ * its count is taken from the semaphore, which may only be posted soon.
+ */
+static void
+follow(command_queue_t *q, command_t *l, command_t *c)
+{
+	c->next = l->followers;
+	l->followers = c;
+	while (sem_wait(&q->pending)) {
+		if (errno != EINTR) {
+			syslog(LOG_ERR, "command: sem_wait");
+			exit(1);
+		}
+	}
+}
+
+/*
+ * The last queued command c can share the result of, i.e. an identical
+ * read that is not followed by a write.  Returns NULL if there is none.
+ */
+static command_t *
+leader(command_queue_t *q, command_t *c)
+{
+	command_t *l, *found = NULL;
+
+	for (l = q->next[c->prio]; l != NULL; l = l->next) {
+		if (identical(l, c))
+			found = l;
+		else if (is_write(l))
+			found = NULL;
+	}
+	return found;
+}
+
+/* Sort the commands on the stack into their class, keeping their order */
+static void
+drain(command_queue_t *q)
+{
+	command_t *c, *l, *stack, *fifo;
+
+	/* They are stacked in reverse order */
+	stack = __atomic_exchange_n(&q->head, NULL, __ATOMIC_ACQUIRE);
+	for (fifo = NULL; stack != NULL; fifo = c) {
+		c = stack;
+		stack = c->next;
+		c->next = fifo;
+	}
+
+	while (fifo != NULL) {
+		c = fifo;
+		fifo = c->next;
+		c->next = NULL;
+		if (c->request != NULL && c->request->env.readonly
+		    && (l = leader(q, c)) != NULL) {
+			follow(q, l, c);
+			continue;
+		}
+		if (superseded(q, c))
+			LAST(q, c->prio)->superseded = 1;
+		*q->tail[c->prio] = c;
+		q->tail[c->prio] = &c->next;
+	}
+}
+
+/*
+ * Wait for the next command, only called by the controller thread.  The
+ * stack is emptied on every call, so a command of a higher class never
+ * waits for more than the command currently being executed.  A command
+ * that sets the same setting as the command queued right after it is
+ * superseded, only the latest value is sent to the device.  A read that
+ * is identical to a queued read is not queued, it gets the same result.
+ * A request whose deadline passed while it was queued is dropped, as are
+ * requests while the device is offline.
+ */
+command_t *
+command_next(command_queue_t *q)
+{
+	command_t *c;
+	int prio;
+
+again:
+	while (sem_wait(&q->pending)) {
+		if (errno != EINTR) {
+			syslog(LOG_ERR, "command: sem_wait");
+			exit(1);
+		}
+	}
+
+	drain(q);
+
+	/* Each count is that of a queued command */
+	for (prio = 0; prio < PRIO_MAX && q->next[prio] == NULL; prio++)
+		;
+	if (prio == PRIO_MAX) {
+		syslog(LOG_ERR, "command: queue is empty");
+		exit(1);
+	}
+
+	c = q->next[prio];
+	q->next[prio] = c->next;
+	if (q->next[prio] == NULL)
+		q->tail[prio] = &q->next[prio];
+
+	if (c->superseded) {
+		answer(q, c, SUPERSEDED);
+		goto again;
+	}
+	if (expired(c)) {
+		answer(q, c, EXPIRED);
+		goto again;
+	}
+	if (c->request != NULL
+	    && __atomic_load_n(&q->offline, __ATOMIC_RELAXED)) {
+		answer(q, c, OFFLINE);
+		goto again;
+	}
+	__atomic_store_n(&q->busy, command_clock(), __ATOMIC_RELAXED);
+	return c;
+}
+
+/*
+ * Answer a command and all commands sharing its result with the Offline
+ * status, the controller does not execute commands anymore.
+ */
+void
+command_offline(command_queue_t *q, command_t *c)
+{
+	command_t *f, *next;
+
+	for (f = c->followers; f != NULL; f = next) {
+		next = f->next;
+		command_offline(q, f);
+	}
+	c->followers = NULL;
+	if (c->request != NULL)
+		answer(q, c, OFFLINE);
+	else
+		finish(q, c, NULL, 0);
+}
+
+/* Pass the result of a command to it and to all commands sharing it */
+static void
+fan_out(command_queue_t *q, command_t *c, const char *response, size_t len)
+{
+	command_t *f, *next;
+
+	for (f = c->followers; f != NULL; f = next) {
+		next = f->next;
+		fan_out(q, f, response, len);
+	}
+	finish(q, c, response, len);
+}
+
+/*
+ * A command has been executed.  Identical reads that have been queued
+ * while it was executing share its result, unless a write is queued
+ * before them.  A degraded queue recovers when a command completes in
+ * time.
+ */
+void
+command_done(command_queue_t *q, command_t *c, const char *response,
+    size_t len)
+{
+	command_t **p, *f;
+	unsigned long busy;
+
+	busy = __atomic_exchange_n(&q->busy, 0, __ATOMIC_RELAXED);
+	if (busy != 0 && command_clock() - busy < q->watchdog)
+		__atomic_store_n(&q->degraded, 0, __ATOMIC_RELAXED);
+
+	if (c->request != NULL && c->request->env.readonly) {
+		drain(q);
+		for (p = &q->next[c->prio]; (f = *p) != NULL
+		    && !is_write(f); ) {
+			if (identical(f, c)) {
+				*p = f->next;
+				if (q->tail[c->prio] == &f->next)
+					q->tail[c->prio] = p;
+				follow(q, c, f);
+			} else
+				p = &f->next;
+		}
+	}
+	fan_out(q, c, response, len);
+}
+
+static void
+wakeup(command_t *c, const char *response, size_t len)
+{
+	struct waiter *w = c->arg;
+
+	pthread_mutex_lock(&w->mutex);
+	w->done = 1;
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->mutex);
+}
+
+/* Queue a command and wait until it has been executed */
+void
+command_call(command_queue_t *q, command_t *c)
+{
+	struct waiter w;
+
+	if (pthread_mutex_init(&w.mutex, NULL)
+	    || pthread_cond_init(&w.cond, NULL)) {
+		syslog(LOG_ERR, "command: pthread_mutex_init");
+		exit(1);
+	}
+	w.done = 0;
+	c->done = wakeup;
+	c->arg = &w;
+
+	command_submit(q, c);
+
+	pthread_mutex_lock(&w.mutex);
+	while (!w.done)
+		pthread_cond_wait(&w.cond, &w.mutex);
+	pthread_mutex_unlock(&w.mutex);
+
+	pthread_mutex_destroy(&w.mutex);
+	pthread_cond_destroy(&w.cond);
+}
+
+/* Push a request decoded, or nil if it is not valid JSON */
+void
+request_push(lua_State *L, request_t *r)
+{
+	lua_getglobal(L, "json");
+	lua_getfield(L, -1, "decode");
+	lua_remove(L, -2);
+	lua_pushlstring(L, r->data, r->len);
+	if (lua_pcall(L, 1, 1, 0) != LUA_OK) {
+		syslog(LOG_ERR, "command: %s", lua_tostring(L, -1));
+		lua_pop(L, 1);
+		lua_pushnil(L);
+	}
+}
@@ -0,0 +1,233 @@
+/*
+ * Copyright (c) 2023 - 2026 Marc Balmer HB9SSB
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+
+/* Open CAT and NMEA devices and reopen them when they come back */
+
+#include <sys/socket.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/rfcomm.h>
+
+#include "trxd.h"
+
+extern void cat_input_deadline(struct timespec *, int);
+
+extern destination_t *destination;
+extern pthread_mutex_t destination_mutex;
+extern int verbose;
+
+/*
+ * Open a serial device or connect to a Bluetooth RFCOMM device.  Returns
+ * a non-blocking descriptor, or -1 if the device can't be opened.
+ */
+int
+device_open(const char *device, int speed, int channel)
+{
+	struct termios tty;
+	int fd;
+
+	if (*device == '/') {	/* Assume device under /dev */
+		fd = open(device, O_RDWR);
+		if (fd == -1) {
+			syslog(LOG_ERR, "device: can't open %s: %s", device,
+			    strerror(errno));
+			return -1;
+		}
+
+		if (isatty(fd)) {
+			if (tcgetattr(fd, &tty) < 0) {
+				syslog(LOG_ERR, "device: %s: tcgetattr",
+				    device);
+				goto fail;
+			}
+			cfmakeraw(&tty);
+			tty.c_cflag |= CLOCAL;
+			cfsetspeed(&tty, speed);
+
+			if (tcsetattr(fd, TCSADRAIN, &tty) < 0) {
+				syslog(LOG_ERR, "device: %s: tcsetattr",
+				    device);
+				goto fail;
+			}
+		}
+	} else if (strlen(device) == 17) {	/* Assume Bluetooth RFCOMM */
+		struct sockaddr_rc addr = { 0 };
+
+		fd = socket(AF_BLUETOOTH, SOCK_STREAM, BTPROTO_RFCOMM);
+		if (fd == -1) {
+			syslog(LOG_ERR, "device: %s: can't get bluetooth "
+			    "socket: %s", device, strerror(errno));
+			return -1;
+		}
+
+		addr.rc_family = AF_BLUETOOTH;
+		addr.rc_channel = (uint8_t) channel;
+		str2ba(device, &addr.rc_bdaddr);
+
+		if (verbose)
+			syslog(LOG_INFO, "device: attempting to connect to %s",
+			    device);
+
+		if (connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+			syslog(LOG_ERR, "device: can't connect to %s: %s",
+			    device, strerror(errno));
+			goto fail;
+		}
+
+		if (verbose)
+			syslog(LOG_INFO, "device: connected to %s", device);
+	} else {
+		syslog(LOG_ERR, "device: unknown device %s", device);
+		return -1;
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	return fd;
+
+fail:
+	close(fd);
+	return -1;
+}
+
+void
+reconnect_init(reconnect_t *r)
+{
+	pthread_condattr_t attr;
+
+	if (pthread_mutex_init(&r->mutex, NULL)
+	    || pthread_condattr_init(&attr)
+	    || pthread_condattr_setclock(&attr, CLOCK_MONOTONIC)
+	    || pthread_cond_init(&r->cond, &attr)) {
+		syslog(LOG_ERR, "device: can't initialize reconnection");
+		exit(1);
+	}
+	pthread_condattr_destroy(&attr);
+	r->attached = r->stop = 0;
+	r->interval = RECONNECT_MIN;
+}
+
+/*
+ * Reopen a device that went away, this blocks until it could be opened or
+ * reconnect_stop() is called, then -1 is returned.  The interval between
+ * the attempts doubles up to RECONNECT_MAX, an attempt is made right away
+ * when the device is attached again.
+ */
+int
+reconnect(reconnect_t *r, const char *device, int speed, int channel)
+{
+	struct timespec ts;
+	int fd, rv, stop;
+
+	for (;;) {
+		if (pthread_mutex_lock(&r->mutex)) {
+			syslog(LOG_ERR, "device: pthread_mutex_lock");
+			exit(1);
+		}
+		cat_input_deadline(&ts, r->interval);
+		rv = 0;
+		while (!r->attached && !r->stop && rv != ETIMEDOUT)
+			rv = pthread_cond_timedwait(&r->cond, &r->mutex, &ts);
+		if (r->attached)
+			r->interval = RECONNECT_MIN;
+		r->attached = 0;
+		stop = r->stop;
+		if (pthread_mutex_unlock(&r->mutex)) {
+			syslog(LOG_ERR, "device: pthread_mutex_unlock");
+			exit(1);
+		}
+		if (stop)
+			return -1;
+
+		if (verbose)
+			printf("device: reconnecting to %s\n", device);
+		fd = device_open(device, speed, channel);
+		if (fd != -1) {
+			syslog(LOG_INFO, "device: %s is back", device);
+			r->interval = RECONNECT_MIN;
+			return fd;
+		}
+		r->interval *= 2;
+		if (r->interval > RECONNECT_MAX)
+			r->interval = RECONNECT_MAX;
+	}
+}
+
+static void
+wakeup(reconnect_t *r, int *flag)
+{
+	if (pthread_mutex_lock(&r->mutex)) {
+		syslog(LOG_ERR, "device: pthread_mutex_lock");
+		exit(1);
+	}
+	*flag = 1;
+	if (pthread_cond_signal(&r->cond)) {
+		syslog(LOG_ERR, "device: pthread_cond_signal");
+		exit(1);
+	}
+	if (pthread_mutex_unlock(&r->mutex)) {
+		syslog(LOG_ERR, "device: pthread_mutex_unlock");
+		exit(1);
+	}
+}
+
+/* The user of the device goes away, a pending reconnect() returns -1 */
+void
+reconnect_stop(reconnect_t *r)
+{
+	wakeup(r, &r->stop);
+}
+
+/* The device monitor saw a device appear under name, retry its users */
+void
+device_attached(const char *name)
+{
+	destination_t *d;
+
+	if (pthread_mutex_lock(&destination_mutex)) {
+		syslog(LOG_ERR, "device: pthread_mutex_lock");
+		exit(1);
+	}
+	for (d = destination; d != NULL; d = d->next) {
+		if (d->type == DEST_TRX && !strcmp(d->tag.trx->device, name))
+			wakeup(&d->tag.trx->reconnect,
+			    &d->tag.trx->reconnect.attached);
+		else if (d->type == DEST_INTERNAL && !strcmp(d->name, "nmea")
+		    && !strcmp(d->tag.nmea->device, name))
+			wakeup(&d->tag.nmea->reconnect,
+			    &d->tag.nmea->reconnect.attached);
+	}
+	if (pthread_mutex_unlock(&destination_mutex)) {
+		syslog(LOG_ERR, "device: pthread_mutex_unlock");
+		exit(1);
+	}
+}
@@ -20,9 +20,8 @@
  * IN THE SOFTWARE.
  */
 
-/* Dispatch incoming data from (web)socket-handlers */
 
-/* XXX evaluate if this needs to be a thread on its own */
+/* Dispatch incoming requests using a pool of dispatcher threads */
 
 #include <pthread.h>
 #include <sched.h>
@@ -42,211 +41,144 @@
 #include "trx-control.h"
 
 extern int luaopen_json(lua_State *);
+extern int json_encode_stream(lua_State *, int, size_t,
+    int (*)(void *, const char *, size_t, int), void *);
 extern int luaopen_trxd(lua_State *);
-extern void proxy_map(lua_State *, lua_State *, int);
-extern void *trx_poller(void *);
-extern void *trx_handler(void *);
+extern void envelope_init(void);
+extern int envelope_scan(const char *, size_t, envelope_t *);
+extern int envelope_supersedes(const envelope_t *, const envelope_t *);
+extern void envelope_free(envelope_t *);
+extern void poll_start(poll_timer_t *);
+extern void poll_stop(poll_timer_t *);
+extern void poll_activity(poll_timer_t *);
+extern void cat_input_frames(trx_controller_tag_t *, int);
+extern void command_submit(command_queue_t *, command_t *);
+extern unsigned long command_clock(void);
+extern void request_push(lua_State *, request_t *);
 extern void *extension(void *);
-
-extern char *private_extensions;
+extern void sender_ref(sender_tag_t *);
+extern void sender_unref(sender_tag_t *);
+extern void sender_send(sender_tag_t *, const char *, size_t);
+extern int sender_stream(sender_tag_t *, const char *, size_t, int);
+extern int sender_stream_abort(sender_tag_t *);
+extern void sender_set_encoding(sender_tag_t *, enum Encoding, const char *,
+    size_t);
+extern void sender_queue_status(sender_tag_t *);
+extern void reactor_resume(sender_tag_t *);
+extern void destination_unref(destination_t *);
+
+extern __thread const char *response_id;
+extern __thread size_t response_idlen;
+
+extern private_extension_t *private_extensions;
 extern destination_t *destination;
 extern pthread_mutex_t destination_mutex;
 
 extern int verbose;
 
 extern __thread int cat_device;
+extern __thread trx_controller_tag_t	*trx_controller_tag;
 
-static void
-call_trx_controller(dispatcher_tag_t *d, trx_controller_tag_t *t)
-{
-	if (pthread_mutex_lock(&t->mutex)) {
-		syslog(LOG_ERR, "dispatcher: pthread_mutex_lock");
-		exit(1);
-	}
-
-	if (pthread_mutex_lock(&d->sender->mutex)) {
-		syslog(LOG_ERR, "dispatcher: pthread_mutex_lock");
-		exit(1);
-	}
-
-	t->handler = "requestHandler";
-	t->response = NULL;
-	t->data = d->data;
-	t->len = d->len;
-
-	if (pthread_mutex_lock(&t->mutex2)) {
-		syslog(LOG_ERR, "dispatcher: pthread_mutex_lock");
-		exit(1);
-	}
-
-	/* We signal cond, and mutex gets owned by trx-controller */
-	if (pthread_cond_signal(&t->cond1)) {
-		syslog(LOG_ERR, "dispatcher: pthread_cond_signal");
-		exit(1);
-	}
-
-	if (pthread_mutex_unlock(&t->mutex2)) {
-		syslog(LOG_ERR, "dispatcher: pthread_mutex_unlock");
-		exit(1);
-	}
+/* Clients with pending requests, linked through ready_next */
+static pthread_mutex_t dispatcher_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dispatcher_cond = PTHREAD_COND_INITIALIZER;
+static sender_tag_t *ready_list;
+static sender_tag_t **ready_tail = &ready_list;
 
-	while (t->response == NULL) {
-		if (pthread_cond_wait(&t->cond2, &t->mutex2)) {
-			syslog(LOG_ERR, "dispatcher: pthread_cond_wait");
-			exit(1);
-		}
-	}
-
-	if (strlen(t->response) > 0) {
-		d->sender->data = t->response;
-		if (pthread_cond_signal(&d->sender->cond)) {
-			syslog(LOG_ERR, "dispatcher: pthread_cond_signal");
-			exit(1);
-		}
-		pthread_mutex_unlock(&d->sender->mutex);
-	} else {
-		pthread_mutex_unlock(&d->sender->mutex);
-	}
-
-	if (pthread_mutex_unlock(&t->mutex2)) {
-		syslog(LOG_ERR, "dispatcher: pthread_mutex_unlock");
-		exit(1);
-	}
+static void request_done(request_t *);
 
-	if (pthread_mutex_unlock(&t->mutex)) {
-		syslog(LOG_ERR, "dispatcher: pthread_mutex_unlock");
-		exit(1);
-	}
+static void
+reply(sender_tag_t *s, const char *data)
+{
+	sender_send(s, data, strlen(data));
 }
 
+/* Answer a request without handling it */
 static void
-call_sdr_controller(dispatcher_tag_t *d, sdr_controller_tag_t *t)
+refuse(request_t *r, const char *fmt)
 {
-	if (pthread_mutex_lock(&t->mutex)) {
-		syslog(LOG_ERR, "dispatcher: pthread_mutex_lock");
-		exit(1);
-	}
-
-	if (pthread_mutex_lock(&d->sender->mutex)) {
-		syslog(LOG_ERR, "dispatcher: pthread_mutex_lock");
-		exit(1);
-	}
-
-	t->handler = "requestHandler";
-	t->response = NULL;
-	t->data = d->data;
-	t->len = d->len;
-
-	if (pthread_mutex_lock(&t->mutex2)) {
-		syslog(LOG_ERR, "dispatcher: pthread_mutex_lock");
-		exit(1);
-	}
-
-	/* We signal cond, and mutex gets owned by trx-controller */
-	if (pthread_cond_signal(&t->cond1)) {
-		syslog(LOG_ERR, "dispatcher: pthread_cond_signal");
-		exit(1);
-	}
+	char *response;
+	int len;
 
-	if (pthread_mutex_unlock(&t->mutex2)) {
-		syslog(LOG_ERR, "dispatcher: pthread_mutex_unlock");
-		exit(1);
-	}
-
-	while (t->response == NULL) {
-		if (pthread_cond_wait(&t->cond2, &t->mutex2)) {
-			syslog(LOG_ERR, "dispatcher: pthread_cond_wait");
-			exit(1);
-		}
-	}
-
-	if (strlen(t->response) > 0) {
-		d->sender->data = t->response;
-		if (pthread_cond_signal(&d->sender->cond)) {
-			syslog(LOG_ERR, "dispatcher: pthread_cond_signal");
-			exit(1);
-		}
-		pthread_mutex_unlock(&d->sender->mutex);
-	} else {
-		pthread_mutex_unlock(&d->sender->mutex);
-	}
-
-	if (pthread_mutex_unlock(&t->mutex2)) {
-		syslog(LOG_ERR, "dispatcher: pthread_mutex_unlock");
-		exit(1);
-	}
-
-	if (pthread_mutex_unlock(&t->mutex)) {
-		syslog(LOG_ERR, "dispatcher: pthread_mutex_unlock");
+	len = asprintf(&response, fmt,
+	    r->env.request != NULL ? r->env.request : "batch");
+	if (len == -1) {
+		syslog(LOG_ERR, "dispatcher: asprintf");
 		exit(1);
 	}
+	sender_send(r->sender, response, len);
+	free(response);
 }
 
+/* Called by a controller thread when it has handled a request */
 static void
-call_gpio_controller(dispatcher_tag_t *d, gpio_controller_tag_t *t)
+controller_done(command_t *c, const char *response, size_t len)
 {
-	if (pthread_mutex_lock(&t->mutex)) {
-		syslog(LOG_ERR, "dispatcher: pthread_mutex_lock");
-		exit(1);
-	}
+	request_t *r = c->arg;
 
-	if (pthread_mutex_lock(&d->sender->mutex)) {
-		syslog(LOG_ERR, "dispatcher: pthread_mutex_lock");
-		exit(1);
-	}
-
-	t->handler = "requestHandler";
-	t->response = NULL;
-	t->data = d->data;
-	t->len = d->len;
-
-	if (pthread_mutex_lock(&t->mutex2)) {
-		syslog(LOG_ERR, "dispatcher: pthread_mutex_lock");
-		exit(1);
+	if (len > 0) {
+		response_id = r->env.id;
+		response_idlen = r->env.idlen;
+		sender_send(r->sender, response, len);
+		response_id = NULL;
 	}
+	free(c);
+	request_done(r);
+}
 
-	/* We signal cond, and mutex gets owned by trx-controller */
-	if (pthread_cond_signal(&t->cond1)) {
-		syslog(LOG_ERR, "dispatcher: pthread_cond_signal");
-		exit(1);
-	}
+/* Requests that must not wait for other commands to the same controller */
+static const char *realtime_requests[] = {
+	"set-ptt",
+	NULL
+};
 
-	if (pthread_mutex_unlock(&t->mutex2)) {
-		syslog(LOG_ERR, "dispatcher: pthread_mutex_unlock");
+/*
+ * Queue a request to a controller.  The dispatcher does not wait for the
+ * response, the controller decodes the request in its own Lua state and
+ * sends the response when it is done.  A degraded controller is probed
+ * with one command at a time, other requests fail right away, as do all
+ * requests to an offline controller.
+ */
+static void
+call_controller(command_queue_t *q, const char *handler, request_t *r)
+{
+	const char **p;
+	command_t *c;
+
+	if (__atomic_load_n(&q->offline, __ATOMIC_RELAXED)) {
+		refuse(r, OFFLINE);
+		request_done(r);
+		return;
+	}
+	if (__atomic_load_n(&q->degraded, __ATOMIC_RELAXED)
+	    && __atomic_load_n(&q->queued, __ATOMIC_RELAXED) > 0) {
+		refuse(r, DEGRADED);
+		request_done(r);
+		return;
+	}
+	if (r->deadline == 0 && q->timeout > 0)
+		r->deadline = command_clock() + q->timeout;
+
+	c = calloc(1, sizeof(command_t));
+	if (c == NULL) {
+		syslog(LOG_ERR, "dispatcher: malloc");
 		exit(1);
 	}
-
-	while (t->response == NULL) {
-		if (pthread_cond_wait(&t->cond2, &t->mutex2)) {
-			syslog(LOG_ERR, "dispatcher: pthread_cond_wait");
-			exit(1);
-		}
-	}
-
-	if (strlen(t->response) > 0) {
-		d->sender->data = t->response;
-		if (pthread_cond_signal(&d->sender->cond)) {
-			syslog(LOG_ERR, "dispatcher: pthread_cond_signal");
-			exit(1);
+	c->handler = handler;
+	c->prio = PRIO_INTERACTIVE;
+	for (p = realtime_requests; r->env.request != NULL && *p != NULL; p++)
+		if (!strcmp(r->env.request, *p)) {
+			c->prio = PRIO_REALTIME;
+			break;
 		}
-		pthread_mutex_unlock(&d->sender->mutex);
-	} else {
-		pthread_mutex_unlock(&d->sender->mutex);
-	}
-
-	if (pthread_mutex_unlock(&t->mutex2)) {
-		syslog(LOG_ERR, "dispatcher: pthread_mutex_unlock");
-		exit(1);
-	}
-
-	if (pthread_mutex_unlock(&t->mutex)) {
-		syslog(LOG_ERR, "dispatcher: pthread_mutex_unlock");
-		exit(1);
-	}
+	c->request = r;
+	c->done = controller_done;
+	c->arg = r;
+	command_submit(q, c);
 }
 
 static void
-call_nmea(dispatcher_tag_t *d, nmea_tag_t *t)
+call_nmea(sender_tag_t *s, nmea_tag_t *t)
 {
 	struct buffer buf;
 
@@ -280,246 +212,168 @@ call_nmea(dispatcher_tag_t *d, nmea_tag_t *t)
 	}
 
 	buf_addstring(&buf, "}}");
-
-	if (pthread_mutex_lock(&d->sender->mutex)) {
-		syslog(LOG_ERR, "dispatcher: pthread_mutex_lock");
-		exit(1);
-	}
-
-	d->sender->data = buf.data;
-
-	if (pthread_cond_signal(&d->sender->cond)) {
-		syslog(LOG_ERR, "dispatcher: pthread_cond_signal");
-		exit(1);
-	}
-
-	while (d->sender->data != NULL) {
-		if (pthread_cond_wait(&d->sender->cond2, &d->sender->mutex)) {
-			syslog(LOG_ERR, "dispatcher: pthread_cond_wait");
-			exit(1);
-		}
-	}
-	pthread_mutex_unlock(&d->sender->mutex);
+	sender_send(s, buf.data, buf.size);
 	buf_free(&buf);
 }
 
 static void
-destination_not_found(dispatcher_tag_t *d)
+destination_not_found(sender_tag_t *s)
 {
-	if (pthread_mutex_lock(&d->sender->mutex)) {
-		syslog(LOG_ERR, "dispatcher: pthread_mutex_lock");
-		exit(1);
-	}
-
-	d->sender->data = "{\"status\":\"Error\",\"reason\":"
-	    "\"Destination not found\"}";
-
-	if (pthread_cond_signal(&d->sender->cond)) {
-		syslog(LOG_ERR, "dispatcher: pthread_cond_signal");
-		exit(1);
-	}
-
-	while (d->sender->data != NULL) {
-		if (pthread_cond_wait(&d->sender->cond2, &d->sender->mutex)) {
-			syslog(LOG_ERR, "dispatcher: pthread_cond_wait");
-			exit(1);
-		}
-	}
-	pthread_mutex_unlock(&d->sender->mutex);
+	reply(s, "{\"status\":\"Error\",\"reason\":"
+	    "\"Destination not found\"}");
 }
 
 static void
-destination_set(dispatcher_tag_t *d)
+destination_set(sender_tag_t *s)
 {
-	if (pthread_mutex_lock(&d->sender->mutex)) {
-		syslog(LOG_ERR, "dispatcher: pthread_mutex_lock");
-		exit(1);
-	}
-
-	d->sender->data = "{\"status\":\"Ok\",\"message\":"
-	    "\"Destination set\"}";
-
-	if (pthread_cond_signal(&d->sender->cond)) {
-		syslog(LOG_ERR, "dispatcher: pthread_cond_signal");
-		exit(1);
-	}
-
-	while (d->sender->data != NULL) {
-		if (pthread_cond_wait(&d->sender->cond2, &d->sender->mutex)) {
-			syslog(LOG_ERR, "dispatcher: pthread_cond_wait");
-			exit(1);
-		}
-	}
-	pthread_mutex_unlock(&d->sender->mutex);
+	reply(s, "{\"status\":\"Ok\",\"message\":"
+	    "\"Destination set\"}");
 }
 
 static void
-destination_not_supported(dispatcher_tag_t *d)
+destination_not_supported(sender_tag_t *s)
 {
-	if (pthread_mutex_lock(&d->sender->mutex)) {
-		syslog(LOG_ERR, "dispatcher: pthread_mutex_lock");
-		exit(1);
-	}
-
-	d->sender->data = "{\"status\":\"Error\",\"reason\":"
-	    "\"Destination type not supported\"}";
-
-	if (pthread_cond_signal(&d->sender->cond)) {
-		syslog(LOG_ERR, "dispatcher: pthread_cond_signal");
-		exit(1);
-	}
-
-	while (d->sender->data != NULL) {
-		if (pthread_cond_wait(&d->sender->cond2, &d->sender->mutex)) {
-			syslog(LOG_ERR, "dispatcher: pthread_cond_wait");
-			exit(1);
-		}
-	}
-	pthread_mutex_unlock(&d->sender->mutex);
+	reply(s, "{\"status\":\"Error\",\"reason\":"
+	    "\"Destination type not supported\"}");
 }
 
 static void
-request_not_supported(dispatcher_tag_t *d)
+request_not_supported(sender_tag_t *s)
 {
-	/* The sender mutex is already locked */
-	d->sender->data = "{\"status\":\"Error\",\"reason\":"
-	    "\"Request not supported by extension\"}";
-
-	if (pthread_cond_signal(&d->sender->cond)) {
-		syslog(LOG_ERR, "dispatcher: pthread_cond_signal");
-		exit(1);
-	}
+	reply(s, "{\"status\":\"Error\",\"reason\":"
+	    "\"Request not supported by extension\"}");
+}
 
-	while (d->sender->data != NULL) {
-		if (pthread_cond_wait(&d->sender->cond2, &d->sender->mutex)) {
-			syslog(LOG_ERR, "dispatcher: pthread_cond_wait");
-			exit(1);
-		}
-	}
-	pthread_mutex_unlock(&d->sender->mutex);
+static void
+not_encodable(sender_tag_t *s)
+{
+	reply(s, "{\"status\":\"Error\",\"reason\":"
+	    "\"Response is not encodable as JSON\"}");
 }
 
 static void
-request_ok(dispatcher_tag_t *d)
+superseded(sender_tag_t *s, const char *req)
 {
-	/* The sender mutex is already locked */
-	d->sender->data = "{\"status\":\"Ok\",\"response\":"
-	    "\"Request handled\"}";
+	char response[128];
+	int len;
 
-	if (pthread_cond_signal(&d->sender->cond)) {
-		syslog(LOG_ERR, "dispatcher: pthread_cond_signal");
-		exit(1);
-	}
+	len = snprintf(response, sizeof(response), SUPERSEDED, req);
+	if (len < sizeof(response))
+		sender_send(s, response, len);
+}
 
-	while (d->sender->data != NULL) {
-		if (pthread_cond_wait(&d->sender->cond2, &d->sender->mutex)) {
-			syslog(LOG_ERR, "dispatcher: pthread_cond_wait");
-			exit(1);
-		}
-	}
-	pthread_mutex_unlock(&d->sender->mutex);
+static void
+request_ok(sender_tag_t *s)
+{
+	reply(s, "{\"status\":\"Ok\",\"response\":"
+	    "\"Request handled\"}");
 }
 
 static void
-version(dispatcher_tag_t *d)
+version(sender_tag_t *s)
 {
-	/* The sender mutex is already locked */
-	d->sender->data = "{\"status\":\"Ok\",\"response\":"
+	reply(s, "{\"status\":\"Ok\",\"response\":"
 	    "\"version\",\"version\":{\"version\":\"" TRXD_VERSION "\","
-	    "\"release\":\"" TRXD_RELEASE "\"}}";
-
-	if (pthread_cond_signal(&d->sender->cond)) {
-		syslog(LOG_ERR, "dispatcher: pthread_cond_signal");
-		exit(1);
-	}
-
-	while (d->sender->data != NULL) {
-		if (pthread_cond_wait(&d->sender->cond2, &d->sender->mutex)) {
-			syslog(LOG_ERR, "dispatcher: pthread_cond_wait");
-			exit(1);
-		}
-	}
-	pthread_mutex_unlock(&d->sender->mutex);
+	    "\"release\":\"" TRXD_RELEASE "\"}}");
 }
 
 static void
-status_updates_not_supported(dispatcher_tag_t *d)
+set_encoding(sender_tag_t *s, const char *name)
 {
-	if (pthread_mutex_lock(&d->sender->mutex)) {
-		syslog(LOG_ERR, "dispatcher: pthread_mutex_lock");
-		exit(1);
-	}
-
-	d->sender->data = "{\"status\":\"Error\",\"reason\":"
-	    "\"Automatic status updated not supported by destination\"}";
-
-	if (pthread_cond_signal(&d->sender->cond)) {
-		syslog(LOG_ERR, "dispatcher: pthread_cond_signal");
-		exit(1);
-	}
+	static const char json[] = "{\"status\":\"Ok\",\"response\":"
+	    "\"set-encoding\",\"encoding\":\"json\"}";
+	static const char cbor[] = "{\"status\":\"Ok\",\"response\":"
+	    "\"set-encoding\",\"encoding\":\"cbor\"}";
+
+	if (name != NULL && !strcmp(name, "json"))
+		sender_set_encoding(s, ENCODING_JSON, json, sizeof(json) - 1);
+	else if (name != NULL && !strcmp(name, "cbor"))
+		sender_set_encoding(s, ENCODING_CBOR, cbor, sizeof(cbor) - 1);
+	else
+		reply(s, "{\"status\":\"Error\",\"response\":"
+		    "\"set-encoding\",\"reason\":\"Unknown encoding\"}");
+}
 
-	while (d->sender->data != NULL) {
-		if (pthread_cond_wait(&d->sender->cond2, &d->sender->mutex)) {
-			syslog(LOG_ERR, "dispatcher: pthread_cond_wait");
-			exit(1);
-		}
-	}
-	pthread_mutex_unlock(&d->sender->mutex);
+static void
+status_updates_not_supported(sender_tag_t *s)
+{
+	reply(s, "{\"status\":\"Error\",\"reason\":"
+	    "\"Automatic status updated not supported by destination\"}");
 }
 
 static void
-listen_not_supported(dispatcher_tag_t *d)
+batch_not_supported(sender_tag_t *s)
 {
-	if (pthread_mutex_lock(&d->sender->mutex)) {
-		syslog(LOG_ERR, "dispatcher: pthread_mutex_lock");
-		exit(1);
-	}
+	reply(s, "{\"status\":\"Error\",\"reason\":"
+	    "\"Batch not supported by destination\"}");
+}
 
-	d->sender->data = "{\"status\":\"Error\",\"reason\":"
-	    "\"Listen not supported by destination\"}";
+static void
+listen_not_supported(sender_tag_t *s)
+{
+	reply(s, "{\"status\":\"Error\",\"reason\":"
+	    "\"Listen not supported by destination\"}");
+}
 
-	if (pthread_cond_signal(&d->sender->cond)) {
-		syslog(LOG_ERR, "dispatcher: pthread_cond_signal");
-		exit(1);
-	}
+/* Called by the trx-controller, CAT input is now framed */
+static void
+status_updates_started(command_t *c, const char *response, size_t len)
+{
+	trx_controller_tag_t *t = c->arg;
 
-	while (d->sender->data != NULL) {
-		if (pthread_cond_wait(&d->sender->cond2, &d->sender->mutex)) {
-			syslog(LOG_ERR, "dispatcher: pthread_cond_wait");
-			exit(1);
-		}
-	}
-	pthread_mutex_unlock(&d->sender->mutex);
+	t->handler_eol = c->result;
+	if (verbose > 1)
+		printf("EOL character: %02x\n", t->handler_eol);
+	cat_input_frames(t, 1);
+	free(c);
 }
 
 static void
-start_updater_if_not_running(dispatcher_tag_t *d, trx_controller_tag_t *t)
+status_updates_stopped(command_t *c, const char *response, size_t len)
 {
-	if (t->poller_required) {
-		if (t->poller_running == 0) {
-			t->poller_running = 1;
-			pthread_create(&t->trx_poller, NULL, trx_poller, t);
-		}
-	} else {
-		if (t->handler_running == 0) {
-			t->handler_running = 1;
-			cat_device = t->cat_device;
+	cat_input_frames(c->arg, 0);
+	free(c);
+}
 
-			lua_getglobal(t->L, "_protocol");
-			lua_getfield(t->L, -1, "startStatusUpdates");
-			lua_pcall(t->L, 0, 1, 0);
+/* Start or stop status updates, the trx must be locked */
+static void
+status_updates(trx_controller_tag_t *t, int start)
+{
+	command_t *c;
 
-			t->handler_eol = lua_tointeger(t->L, -1);
+	if (t->poller_required) {
+		if (start)
+			poll_start(&t->poll);
+		else {
 			if (verbose > 1)
-				printf("EOL character: %02x\n", t->handler_eol);
-
-			pthread_create(&t->trx_handler, NULL, trx_handler, t);
+				printf("dispatcher: stopping the poller\n");
+			poll_stop(&t->poll);
 		}
+		return;
 	}
+
+	/* The trx-controller talks to the trx, we don't wait for it */
+	c = calloc(1, sizeof(command_t));
+	if (c == NULL) {
+		syslog(LOG_ERR, "dispatcher: malloc");
+		exit(1);
+	}
+	if (start) {
+		c->handler = "startStatusUpdates";
+		c->done = status_updates_started;
+	} else {
+		if (verbose > 1)
+			printf("dispatcher: stopping the handler\n");
+		c->handler = "stopStatusUpdates";
+		c->done = status_updates_stopped;
+	}
+	c->prio = PRIO_INTERACTIVE;
+	c->arg = t;
+	command_submit(&t->queue, c);
 }
 
 static void
-add_sender(dispatcher_tag_t *d, destination_t *dst)
+add_sender(sender_tag_t *s, destination_t *dst)
 {
 	sender_list_t *p, *l;
 
@@ -528,7 +382,7 @@ add_sender(dispatcher_tag_t *d, destination_t *dst)
 
 	if (dst->tag.trx->senders != NULL) {
 		for (l = dst->tag.trx->senders; l; p = l, l = l->next)
-			if (l->sender == d->sender)
+			if (l->sender == s)
 				break;
 		if (l == NULL) {
 			p->next = malloc(sizeof(sender_list_t));
@@ -537,9 +391,8 @@ add_sender(dispatcher_tag_t *d, destination_t *dst)
 				exit(1);
 			}
 			p = p->next;
-			p->sender = d->sender;
+			p->sender = s;
 			p->next = NULL;
-			start_updater_if_not_running(d, dst->tag.trx);
 		}
 	} else {
 		dst->tag.trx->senders = malloc(sizeof(sender_list_t));
@@ -547,70 +400,51 @@ add_sender(dispatcher_tag_t *d, destination_t *dst)
 			syslog(LOG_ERR, "malloc");
 			exit(1);
 		}
-		dst->tag.trx->senders->sender = d->sender;
+		dst->tag.trx->senders->sender = s;
 		dst->tag.trx->senders->next = NULL;
-		start_updater_if_not_running(d, dst->tag.trx);
+
+		/* The first sender starts the status updates */
+		status_updates(dst->tag.trx, 1);
 	}
 	pthread_mutex_unlock(&dst->tag.trx->mutex);
 	pthread_mutex_unlock(&destination_mutex);
 }
 
+/* Stop sending status updates to a client, destination_mutex is held */
 static void
-remove_sender(dispatcher_tag_t *d, destination_t *dst)
+unsubscribe(sender_tag_t *s, trx_controller_tag_t *t)
 {
 	sender_list_t *p, *l;
-	trx_controller_tag_t *t;
-	int n;
 
-	pthread_mutex_lock(&destination_mutex);
-	pthread_mutex_lock(&dst->tag.trx->mutex);
+	pthread_mutex_lock(&t->mutex);
 
-	for (l = dst->tag.trx->senders, p = NULL; l; p = l, l = l->next) {
-		if (l->sender == d->sender) {
-			if (p == NULL) {
-				dst->tag.trx->senders = NULL;
-				free(l);
-				break;
-			} else {
+	for (l = t->senders, p = NULL; l; p = l, l = l->next) {
+		if (l->sender == s) {
+			if (p == NULL)
+				t->senders = l->next;
+			else
 				p->next = l->next;
-				free(l);
-				break;
-			}
-		}
-	}
-	l = dst->tag.trx->senders;
-	for (n = 0; l != NULL; ++n) {
-		if (l->next == NULL) {
-			++n;
-			break;
-		} else
-			l = l->next;
-	}
+			free(l);
 
-	if (n == 0) {
-		t = dst->tag.trx;
-
-		if (t->poller_running) {
-			t->poller_running = 0;
-			if (verbose > 1)
-				printf("dispatcher: stopping the poller\n");
-			pthread_cancel(t->trx_poller);
-		} else if (t->handler_running) {
-			t->handler_running = 0;
-			if (verbose > 1)
-				printf("dispatcher: stopping the handler\n");
-
-			lua_getglobal(t->L, "_protocol");
-			lua_getfield(t->L, -1, "stopStatusUpdates");
-			lua_pcall(t->L, 0, 1, 0);
+			/* The last sender stops them */
+			if (t->senders == NULL)
+				status_updates(t, 0);
+			break;
 		}
 	}
-	pthread_mutex_unlock(&dst->tag.trx->mutex);
+	pthread_mutex_unlock(&t->mutex);
+}
+
+static void
+remove_sender(sender_tag_t *s, destination_t *dst)
+{
+	pthread_mutex_lock(&destination_mutex);
+	unsubscribe(s, dst->tag.trx);
 	pthread_mutex_unlock(&destination_mutex);
 }
 
 static void
-add_listener(dispatcher_tag_t *d, destination_t *dst)
+add_listener(sender_tag_t *s, destination_t *dst)
 {
 	sender_list_t *p, *l;
 
@@ -620,7 +454,7 @@ add_listener(dispatcher_tag_t *d, destination_t *dst)
 
 	if (dst->tag.extension->listeners != NULL) {
 		for (l = dst->tag.extension->listeners; l; p = l, l = l->next)
-			if (l->sender == d->sender)
+			if (l->sender == s)
 				break;
 		if (l == NULL) {
 			p->next = malloc(sizeof(sender_list_t));
@@ -629,7 +463,7 @@ add_listener(dispatcher_tag_t *d, destination_t *dst)
 				exit(1);
 		}
 		p = p->next;
-			p->sender = d->sender;
+			p->sender = s;
 			p->next = NULL;
 		}
 	} else {
@@ -638,7 +472,7 @@ add_listener(dispatcher_tag_t *d, destination_t *dst)
 			syslog(LOG_ERR, "malloc");
 			exit(1);
 		}
-		dst->tag.extension->listeners->sender = d->sender;
+		dst->tag.extension->listeners->sender = s;
 		dst->tag.extension->listeners->next = NULL;
 	}
 	pthread_mutex_unlock(&dst->tag.extension->mutex);
@@ -646,146 +480,178 @@ add_listener(dispatcher_tag_t *d, destination_t *dst)
 	pthread_mutex_unlock(&destination_mutex);
 }
 
+/* Remove a listener from an extension, destination_mutex is held */
 static void
-remove_listener(dispatcher_tag_t *d, destination_t *dst)
+unlisten(sender_tag_t *s, extension_tag_t *e)
 {
 	sender_list_t *p, *l;
 
-	pthread_mutex_lock(&destination_mutex);
-	pthread_mutex_lock(&dst->tag.extension->mutex);
-	pthread_mutex_lock(&dst->tag.extension->mutex2);
+	pthread_mutex_lock(&e->mutex);
+	pthread_mutex_lock(&e->mutex2);
 
-	for (l = dst->tag.extension->listeners, p = NULL; l;
-	    p = l, l = l->next) {
-		if (l->sender == d->sender) {
-			if (p == NULL) {
-				dst->tag.extension->listeners = NULL;
-				free(l);
-				break;
-			} else {
+	for (l = e->listeners, p = NULL; l; p = l, l = l->next) {
+		if (l->sender == s) {
+			if (p == NULL)
+				e->listeners = l->next;
+			else
 				p->next = l->next;
-				free(l);
-				break;
-			}
+			free(l);
+			break;
 		}
 	}
-	pthread_mutex_unlock(&dst->tag.extension->mutex);
-	pthread_mutex_unlock(&dst->tag.extension->mutex2);
+	pthread_mutex_unlock(&e->mutex);
+	pthread_mutex_unlock(&e->mutex2);
+}
+
+static void
+remove_listener(sender_tag_t *s, destination_t *dst)
+{
+	pthread_mutex_lock(&destination_mutex);
+	unlisten(s, dst->tag.extension);
 	pthread_mutex_unlock(&destination_mutex);
 }
 
+/*
+ * A reload replaced a destination by a new one, or removed it if new is
+ * NULL.  The clients receiving status updates from it or listening to it
+ * are moved to the new one.  destination_mutex is held.
+ */
+void
+dispatcher_adopt(destination_t *old, destination_t *new)
+{
+	sender_list_t *list, *l;
+
+	switch (old->type) {
+	case DEST_TRX:
+		pthread_mutex_lock(&old->tag.trx->mutex);
+		list = old->tag.trx->senders;
+		old->tag.trx->senders = NULL;
+		pthread_mutex_unlock(&old->tag.trx->mutex);
+
+		if (new != NULL && list != NULL) {
+			pthread_mutex_lock(&new->tag.trx->mutex);
+			new->tag.trx->senders = list;
+			status_updates(new->tag.trx, 1);
+			pthread_mutex_unlock(&new->tag.trx->mutex);
+			list = NULL;
+		}
+		break;
+	case DEST_EXTENSION:
+		pthread_mutex_lock(&old->tag.extension->mutex);
+		pthread_mutex_lock(&old->tag.extension->mutex2);
+		list = old->tag.extension->listeners;
+		old->tag.extension->listeners = NULL;
+		pthread_mutex_unlock(&old->tag.extension->mutex2);
+		pthread_mutex_unlock(&old->tag.extension->mutex);
+
+		if (new != NULL) {
+			new->tag.extension->listeners = list;
+			list = NULL;
+		}
+		break;
+	default:
+		list = NULL;
+	}
+
+	while ((l = list) != NULL) {
+		list = l->next;
+		free(l);
+	}
+}
+
+static int
+stream_write(void *s, const char *data, size_t len, int final)
+{
+	return sender_stream(s, data, len, final);
+}
+
 static void
-call_extension(lua_State *L, dispatcher_tag_t* d, extension_tag_t *e,
-    const char *req)
+call_extension(sender_tag_t *s, extension_tag_t *e, const char *req,
+    request_t *r)
 {
 	pthread_mutex_lock(&e->mutex);
 
-	if (pthread_mutex_lock(&d->sender->mutex)) {
+	if (pthread_mutex_lock(&e->mutex2)) {
 		syslog(LOG_ERR, "dispatcher: pthread_mutex_lock");
 		exit(1);
 	}
 
-	if (pthread_mutex_lock(&e->mutex2)) {
-		syslog(LOG_ERR, "dispatcher: pthread_mutex_lock");
-		exit(1);
+	/* A reload retired the extension after we looked it up */
+	if (e->terminate) {
+		pthread_mutex_unlock(&e->mutex2);
+		pthread_mutex_unlock(&e->mutex);
+		destination_not_found(s);
+		return;
 	}
 
 	e->done = 0;
 	lua_getglobal(e->L, req);
 
-	if (lua_type(e->L, -1) != LUA_TFUNCTION)
-		request_not_supported(d);
-	else {
-		proxy_map(L, e->L, lua_gettop(e->L));
+	if (lua_type(e->L, -1) != LUA_TFUNCTION) {
+		lua_pop(e->L, 1);
+		request_not_supported(s);
+	} else {
+		request_push(e->L, r);
 		e->call = 1;
 
+		/* Waiting releases mutex2, the extension signals under it */
 		pthread_cond_signal(&e->cond1);
-		if (pthread_mutex_unlock(&e->mutex2)) {
-			syslog(LOG_ERR, "dispatcher: pthread_mutex_unlock");
-			exit(1);
-		}
-
 		while (!e->done)
 			pthread_cond_wait(&e->cond2, &e->mutex2);
 
 		e->done = 0;
 
-		lua_getglobal(L, "json");
-		if (lua_type(L, -1) != LUA_TTABLE) {
-			syslog(LOG_ERR, "dispatcher: table expected");
-			exit(1);
-		}
-		lua_getfield(L, -1, "encode");
-		if (lua_type(L, -1) != LUA_TFUNCTION) {
-			syslog(LOG_ERR, "dispatcher: function expected");
-			exit(1);
-		}
-		proxy_map(e->L, L, lua_gettop(L));
-		switch (lua_pcall(L, 1, 1, 0)) {
-		case LUA_OK:
-			break;
-		case LUA_ERRRUN:
-		case LUA_ERRMEM:
-		case LUA_ERRERR:
-			syslog(LOG_ERR, "dispatcher: %s", lua_tostring(L, -1));
-			exit(1);
-			break;
-		}
-		if (lua_type(L, -1) != LUA_TSTRING) {
-			syslog(LOG_ERR,
-			    "dispatcher: table does not encode to JSON ");
-			exit(1);
-		}
-
-		d->sender->data = (char *)lua_tostring(L, -1);
-
-		if (pthread_cond_signal(&d->sender->cond)) {
-			syslog(LOG_ERR, "dispatcher: pthread_cond_signal");
-			exit(1);
-		}
-
-		while (d->sender->data != NULL) {
-			if (pthread_cond_wait(&d->sender->cond2,
-			    &d->sender->mutex)) {
-				syslog(LOG_ERR, "dispatcher: "
-				    "pthread_cond_wait");
-				exit(1);
-			}
-		}
+		/*
+		 * The extension waits until the result has been encoded,
+		 * large results are streamed to the client meanwhile.  A
+		 * CBOR client gets the result in one piece, it is transcoded
+		 * as a whole.
+		 */
+		if (json_encode_stream(e->L, -1,
+		    __atomic_load_n(&s->next_encoding, __ATOMIC_RELAXED)
+		    == ENCODING_CBOR ? SIZE_MAX : STREAM_CHUNK, stream_write,
+		    s) && !sender_stream_abort(s))
+			not_encodable(s);
+		lua_pop(e->L, 1);
 	}
-	pthread_mutex_unlock(&d->sender->mutex);
 	pthread_mutex_unlock(&e->mutex2);
 	pthread_mutex_unlock(&e->mutex);
 }
 
-static void
-dispatch(lua_State *L, dispatcher_tag_t *d, destination_t *to, const char *req)
+/* Returns 1 if the request is handled asynchronously */
+static int
+dispatch(lua_State *L, sender_tag_t *s, destination_t *to, const char *req,
+    request_t *r)
 {
 	switch (to->type) {
 	case DEST_TRX:
-		call_trx_controller(d, to->tag.trx);
-		break;
+		/* Show the effect of a change soon, r is gone once queued */
+		if (to->tag.trx->poller_required && !strncmp(req, "set-", 4))
+			poll_activity(&to->tag.trx->poll);
+		call_controller(&to->tag.trx->queue, "requestHandler", r);
+		return 1;
 	case DEST_SDR:
-		call_sdr_controller(d, to->tag.sdr);
-		break;
+		call_controller(&to->tag.sdr->queue, "requestHandler", r);
+		return 1;
 	case DEST_GPIO:
-		call_gpio_controller(d, to->tag.gpio);
-		break;
+		call_controller(&to->tag.gpio->queue, "requestHandler", r);
+		return 1;
 	case DEST_INTERNAL:
 		if (!strcmp(to->name, "nmea")) {
 			if (!strcmp(req, "get-fix"))
-				call_nmea(d, to->tag.nmea);
+				call_nmea(s, to->tag.nmea);
 			else
-				request_not_supported(d);
+				request_not_supported(s);
 		} else
-			destination_not_supported(d);
+			destination_not_supported(s);
 		break;
 	case DEST_EXTENSION:
-		call_extension(L, d, to->tag.extension, req);
+		call_extension(s, to->tag.extension, req, r);
 		break;
 	default:
-		destination_not_supported(d);
+		destination_not_supported(s);
 	}
+	return 0;
 }
 
 static const char *
@@ -819,17 +685,12 @@ type2name(int type)
 }
 
 void
-list_destination(dispatcher_tag_t *d, const char *type)
+list_destination(sender_tag_t *s, const char *type)
 {
 	struct buffer buf;
 	destination_t *dest;
 	int first;
 
-	if (pthread_mutex_lock(&d->sender->mutex)) {
-		syslog(LOG_ERR, "dispatcher: pthread_mutex_lock");
-		exit(1);
-	}
-
 	buf_init(&buf);
 	buf_addstring(&buf,
 	    "{\"status\":\"Ok\",\"response\":\"list-destination\",");
@@ -871,393 +732,610 @@ list_destination(dispatcher_tag_t *d, const char *type)
 	pthread_mutex_unlock(&destination_mutex);
 
 	buf_addstring(&buf, "]}");
+	sender_send(s, buf.data, buf.size);
+	buf_free(&buf);
+}
 
-	d->sender->data = buf.data;
+/* Instantiate a private extension for a client */
+static extension_tag_t *
+private_extension_new(private_extension_t *p)
+{
+	extension_tag_t *t;
 
-	if (pthread_cond_signal(&d->sender->cond)) {
-		syslog(LOG_ERR, "dispatcher: pthread_cond_signal");
+	t = calloc(1, sizeof(extension_tag_t));
+	if (t == NULL) {
+		syslog(LOG_ERR, "dispatcher: malloc");
+		exit(1);
+	}
+	t->is_callable = 1;
+	t->L = luaL_newstate();
+	if (t->L == NULL) {
+		syslog(LOG_ERR, "dispatcher: luaL_newstate");
+		exit(1);
+	}
+	luaL_openlibs(t->L);
+	luaopen_trxd(t->L);
+	lua_setglobal(t->L, "trxd");
+	luaopen_json(t->L);
+	lua_setglobal(t->L, "json");
+
+	lua_getglobal(t->L, "package");
+	lua_getfield(t->L, -1, "cpath");
+	lua_pushfstring(t->L, "%s;%s%s%s", lua_tostring(t->L, -1),
+	    _PATH_LUA_CPATH, p->cpath ? ";" : "", p->cpath ? p->cpath : "");
+	lua_setfield(t->L, -3, "cpath");
+	lua_getfield(t->L, -2, "path");
+	lua_pushfstring(t->L, "%s;%s%s%s", lua_tostring(t->L, -1),
+	    _PATH_LUA_PATH, p->path ? ";" : "", p->path ? p->path : "");
+	lua_setfield(t->L, -4, "path");
+	lua_pop(t->L, 3);
+
+	if (luaL_loadfile(t->L, p->script)) {
+		syslog(LOG_ERR, "dispatcher: %s", lua_tostring(t->L, -1));
+		lua_close(t->L);
+		free(t);
+		return NULL;
+	}
+
+	if (p->configuration) {
+		lua_getglobal(t->L, "json");
+		lua_getfield(t->L, -1, "decode");
+		lua_pushstring(t->L, p->configuration);
+		lua_call(t->L, 1, 1);
+		lua_remove(t->L, -2);
+		t->has_config = 1;
+	}
+
+	if (pthread_mutex_init(&t->mutex, NULL)
+	    || pthread_mutex_init(&t->mutex2, NULL)
+	    || pthread_cond_init(&t->cond1, NULL)
+	    || pthread_cond_init(&t->cond2, NULL)) {
+		syslog(LOG_ERR, "dispatcher: pthread_mutex_init");
 		exit(1);
 	}
 
-	while (d->sender->data != NULL) {
-		if (pthread_cond_wait(&d->sender->cond2, &d->sender->mutex)) {
-			syslog(LOG_ERR, "dispatcher: pthread_cond_wait");
-			exit(1);
+	if (pthread_mutex_lock(&t->mutex2)) {
+		syslog(LOG_ERR, "dispatcher: pthread_mutex_lock");
+		exit(1);
+	}
+
+	if (pthread_create(&t->extension, NULL, extension, t)) {
+		syslog(LOG_ERR, "dispatcher: pthread_create");
+		exit(1);
+	}
+
+	/* Wait until the script has been run */
+	while (!t->done)
+		pthread_cond_wait(&t->cond2, &t->mutex2);
+	t->done = 0;
+
+	if (pthread_mutex_unlock(&t->mutex2)) {
+		syslog(LOG_ERR, "dispatcher: pthread_mutex_unlock");
+		exit(1);
+	}
+	return t;
+}
+
+/*
+ * Find a private extension of a client by name.  It is instantiated when
+ * the client uses it for the first time.
+ */
+static destination_t *
+private_destination(sender_tag_t *s, const char *name)
+{
+	private_extension_t *p;
+	destination_t *dst;
+
+	for (p = private_extensions; p != NULL; p = p->next)
+		if (!strcmp(p->name, name))
+			break;
+	if (p == NULL)
+		return NULL;
+
+	/* Concurrent requests of the client must not instantiate it twice */
+	if (pthread_mutex_lock(&s->private_mutex)) {
+		syslog(LOG_ERR, "dispatcher: pthread_mutex_lock");
+		exit(1);
+	}
+
+	for (dst = s->private; dst != NULL; dst = dst->next)
+		if (!strcmp(dst->name, name))
+			goto done;
+
+	dst = calloc(1, sizeof(destination_t));
+	if (dst == NULL) {
+		syslog(LOG_ERR, "dispatcher: malloc");
+		exit(1);
+	}
+	dst->name = p->name;
+	dst->type = DEST_EXTENSION;
+	dst->refs = 1;
+	dst->tag.extension = private_extension_new(p);
+	if (dst->tag.extension == NULL) {
+		free(dst);
+		dst = NULL;
+		goto done;
+	}
+	if (verbose)
+		printf("dispatcher: private extension %s instantiated\n",
+		    p->name);
+
+	dst->next = s->private;
+	s->private = dst;
+done:
+	if (pthread_mutex_unlock(&s->private_mutex)) {
+		syslog(LOG_ERR, "dispatcher: pthread_mutex_unlock");
+		exit(1);
+	}
+	return dst;
+}
+
+/* Stop the private extensions of a client that went away */
+static void
+private_destinations_free(sender_tag_t *s)
+{
+	destination_t *dst;
+	extension_tag_t *t;
+	sender_list_t *l;
+
+	while ((dst = s->private) != NULL) {
+		s->private = dst->next;
+		t = dst->tag.extension;
+
+		pthread_mutex_lock(&t->mutex2);
+		while ((l = t->listeners) != NULL) {
+			t->listeners = l->next;
+			free(l);
 		}
+		t->terminate = 1;
+		pthread_cond_signal(&t->cond1);
+		pthread_mutex_unlock(&t->mutex2);
+		free(dst);
 	}
-	pthread_mutex_unlock(&d->sender->mutex);
-	buf_free(&buf);
 }
 
+/* Make dst the current destination of a client, destination_mutex is held */
 static void
-cleanup(void *arg)
+set_destination(sender_tag_t *s, destination_t *dst)
+{
+	if (dst != NULL)
+		dst->refs++;
+	if (s->to != NULL)
+		destination_unref(s->to);
+	s->to = dst;
+}
+
+/* Remove a client that went away from all destinations */
+static void
+detach(sender_tag_t *s)
 {
-	dispatcher_tag_t *d = (dispatcher_tag_t *)arg;
 	destination_t *dst;
 
+	/* A reload must not move the client while we look for it */
+	pthread_mutex_lock(&destination_mutex);
+	set_destination(s, NULL);
 	for (dst = destination; dst != NULL; dst = dst->next) {
 		switch (dst->type) {
 		case DEST_TRX:
-			remove_sender(d, dst);
+			unsubscribe(s, dst->tag.trx);
 			break;
 		case DEST_EXTENSION:
-			remove_listener(d, dst);
+			unlisten(s, dst->tag.extension);
 			break;
 		default:
 			break;
 		}
 	}
-	free(arg);
+	pthread_mutex_unlock(&destination_mutex);
+	private_destinations_free(s);
 }
 
+/*
+ * Called before the first request of a client is handled,
+ * destination_mutex is held.
+ */
 static void
-cleanup_lua(void *arg)
+attach(sender_tag_t *s)
 {
-	lua_State *L = (lua_State *)arg;
+	destination_t *to;
+
+	s->attached = 1;
+
+	/* Check if we have a default transceiver */
+	for (to = destination; to != NULL; to = to->next)
+		if (to->type == DEST_TRX && to->tag.trx->is_default)
+			break;
+
+	if (to == NULL)
+		for (to = destination; to != NULL; to = to->next)
+			if (to->type == DEST_TRX)
+				break;
+
+	if (to == NULL)
+		 to = destination;
 
-	lua_close(L);
+	set_destination(s, to);
 }
 
-static void
-initialize_private_extensions(lua_State *L)
+/* Handle a request for a destination, returns 1 if it is asynchronous */
+static int
+handle_destination(lua_State *L, sender_tag_t *s, destination_t *dst,
+    request_t *r)
 {
-	int top;
-
-	/* The tabe with the extensions is a the Lua stack top */
-	top = lua_gettop(L);
-	lua_pushnil(L);
-	while (lua_next(L, top)) {
-		extension_tag_t *t;
-		const char *p;
-		char script[PATH_MAX];
-
-		t = malloc(sizeof(extension_tag_t));
-		if (t == NULL) {
-			syslog(LOG_ERR, "memory allocation failure");
-			exit(1);
-		}
-		t->has_config = 0;
-		t->listeners = NULL;
-		t->L = luaL_newstate();
-		if (t->L == NULL) {
-			syslog(LOG_ERR, "cannot create Lua state");
-			exit(1);
-		}
-		luaL_openlibs(t->L);
-		luaopen_trxd(t->L);
-		lua_setglobal(t->L, "trxd");
-		luaopen_json(t->L);
-		lua_setglobal(t->L, "json");
-
-		t->call = t->done = 0;
-
-		lua_getglobal(t->L, "package");
-		lua_getfield(t->L, -1, "cpath");
-		lua_pushstring(t->L, ";");
-		lua_pushstring(t->L, _PATH_LUA_CPATH);
-		lua_concat(t->L, 3);
-		lua_setfield(t->L, -2, "cpath");
-		lua_pop(t->L, 1);
-
-		lua_getglobal(t->L, "package");
-		lua_getfield(t->L, -1, "path");
-		lua_pushstring(t->L, ";");
-		lua_pushstring(t->L, _PATH_LUA_PATH);
-		lua_concat(t->L, 3);
-		lua_setfield(t->L, -2, "path");
-		lua_pop(t->L, 1);
-
-		lua_getfield(L, -1, "path");
-		if (lua_isstring(L, -1)) {
-			p = lua_tostring(L, -1);
-			lua_getglobal(t->L, "package");
-			lua_getfield(t->L, -1, "path");
-			lua_pushstring(t->L, ";");
-			lua_pushstring(t->L, p);
-			lua_concat(t->L, 3);
-			lua_setfield(t->L, -2, "path");
-			lua_pop(t->L, 1);
-		}
-		lua_pop(L, 1);
-
-		lua_getfield(L, -1, "cpath");
-		if (lua_isstring(L, -1)) {
-			p = lua_tostring(L, -1);
-			lua_getglobal(t->L, "package");
-			lua_getfield(t->L, -1, "cpath");
-			lua_pushstring(t->L, ";");
-			lua_pushstring(t->L, p);
-			lua_concat(t->L, 3);
-			lua_setfield(t->L, -2, "cpath");
-			lua_pop(t->L, 1);
-		}
-		lua_pop(L, 1);
+	envelope_t *env = &r->env;
 
-		lua_getfield(L, -1, "script");
-		if (!lua_isstring(L, -1)) {
-			syslog(LOG_ERR,
-			    "missing extension script name");
-			exit(1);
+	switch (env->req) {
+	case REQ_START_STATUS_UPDATES:
+		if (dst->type == DEST_TRX) {
+			add_sender(s, dst);
+			request_ok(s);
+		} else
+			status_updates_not_supported(s);
+		break;
+	case REQ_STOP_STATUS_UPDATES:
+		if (dst->type == DEST_TRX) {
+			remove_sender(s, dst);
+			request_ok(s);
+		} else
+			status_updates_not_supported(s);
+		break;
+	case REQ_LISTEN:
+		if (dst->type == DEST_EXTENSION) {
+			add_listener(s, dst);
+			request_ok(s);
+		} else
+			listen_not_supported(s);
+		break;
+	case REQ_UNLISTEN:
+		if (dst->type == DEST_EXTENSION) {
+			remove_listener(s, dst);
+			request_ok(s);
+		} else
+			listen_not_supported(s);
+		break;
+	case REQ_LIST_DESTINATION:
+		list_destination(s, env->type);
+		break;
+	case REQ_VERSION:
+		version(s);
+		break;
+	case REQ_QUEUE_STATUS:
+		sender_queue_status(s);
+		break;
+	case REQ_SET_ENCODING:
+		set_encoding(s, env->encoding);
+		break;
+	case REQ_BATCH:
+		if (dst->type == DEST_TRX) {
+			call_controller(&dst->tag.trx->queue, "batchHandler",
+			    r);
+			return 1;
 		}
-		p = lua_tostring(L, -1);
+		batch_not_supported(s);
+		break;
+	case REQ_OTHER:
+		return dispatch(L, s, dst, env->request, r);
+	case REQ_NONE:
+	default:
+		destination_set(s);
+	}
+	return 0;
+}
 
-		if (strchr(p, '/')) {
-			syslog(LOG_ERR,
-			    "script name must not contain slashes");
-			exit(1);
-		}
-		snprintf(script, sizeof(script), "%s/%s.lua",
-		    _PATH_EXTENSION, p);
+/* Returns 1 if the request is handled asynchronously */
+static int
+handle_request(lua_State *L, sender_tag_t *s, request_t *r)
+{
+	envelope_t *env = &r->env;
+	destination_t *dst;
+	const char *name;
+	int rv;
 
-		lua_pop(L, 1);
+	/*
+	 * Only the routing fields have been extracted, the request is decoded
+	 * by the Lua state that handles it.
+	 */
+	if (r->error) {
+		syslog(LOG_ERR, "dispatcher: "
+		    "JSON is not an object. Skipping request.");
+		return 0;
+	}
 
-		if (luaL_loadfile(t->L, script)) {
-			syslog(LOG_ERR, "%s", lua_tostring(t->L, -1));
-			exit(1);
-		}
+	/* A later request of the client sets the same setting */
+	if (r->superseded) {
+		superseded(s, env->request);
+		return 0;
+	}
 
-		lua_getfield(L, -1, "configuration");
-		if (lua_istable(L, -1)) {
-			proxy_map(L, t->L, lua_gettop(t->L));
-			t->has_config = 1;
+	/*
+	 * A reload must not change the list while we look up the
+	 * destination, concurrent requests of a client may change it.
+	 */
+	pthread_mutex_lock(&destination_mutex);
+	if (!s->attached)
+		attach(s);
+	if (env->to != NULL) {
+		for (dst = destination; dst != NULL; dst = dst->next)
+			if (!strcmp(dst->name, env->to))
+				break;
+		if (dst == NULL) {
+			/* Starting an extension must not block the reload */
+			pthread_mutex_unlock(&destination_mutex);
+			dst = private_destination(s, env->to);
+			pthread_mutex_lock(&destination_mutex);
 		}
-		lua_pop(L, 1);
+		if (dst != NULL)
+			set_destination(s, dst);
+	} else
+		dst = s->to;
+
+	/* A reload replaced the destination, or removed it */
+	if (dst != NULL && dst->retired) {
+		name = dst->name;
+		for (dst = destination; dst != NULL; dst = dst->next)
+			if (!strcmp(dst->name, name))
+				break;
+		set_destination(s, dst);
+	}
 
-		lua_getfield(L, -1, "callable");
-		if (lua_isboolean(L, -1))
-			t->is_callable = lua_toboolean(L, -1);
-		else
-			t->is_callable = 1;
-		lua_pop(L, 1);
+	/* The reload frees the tag of a retired destination once unused */
+	if (dst != NULL)
+		__atomic_add_fetch(&dst->users, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&destination_mutex);
 
-#if 0
-		if (add_destination(name, DEST_EXTENSION, t)) {
-			syslog(LOG_ERR, "names must be unique");
-			exit(1);
-		}
-#endif
-		if (pthread_mutex_init(&t->mutex, NULL))
-			goto terminate;
+	if (dst == NULL) {
+		destination_not_found(s);
+		return 0;
+	}
 
-		if (pthread_mutex_init(&t->mutex2, NULL))
-			goto terminate;
+	rv = handle_destination(L, s, dst, r);
+	__atomic_sub_fetch(&dst->users, 1, __ATOMIC_RELEASE);
+	return rv;
+}
 
-		if (pthread_cond_init(&t->cond1, NULL))
-			goto terminate;
+/*
+ * Put a client on the ready list if its next request can be handled now.
+ * A request with an id can be handled while other requests with an id are
+ * in flight, a request without an id waits until it is the only one.  The
+ * dispatcher mutex must be held.
+ */
+static void
+make_ready(sender_tag_t *s)
+{
+	if (s->ready || s->requests == NULL || s->ordered)
+		return;
+	if (s->requests->env.id == NULL && s->inflight > 0)
+		return;
 
-		if (pthread_cond_init(&t->cond2, NULL))
-			goto terminate;
+	s->ready = 1;
+	s->ready_next = NULL;
+	*ready_tail = s;
+	ready_tail = &s->ready_next;
 
-		/* Create the extension thread */
-		pthread_create(&t->extension, NULL, extension, t);
-		lua_pop(L, 1);
+	if (pthread_cond_signal(&dispatcher_cond)) {
+		syslog(LOG_ERR, "dispatcher: pthread_cond_signal");
+		exit(1);
 	}
-terminate:
-	lua_pop(L, 1);
 }
 
-static void *
-freeexternalstring(void *ud, void *ptr, size_t osize, size_t nsize)
+/* A request has been handled, the client may have more */
+static void
+request_done(request_t *r)
 {
-	free(ptr);
-	return NULL;
-}
+	sender_tag_t *s = r->sender;
+	int ordered, counted, resume = 0;
 
-void *
-dispatcher(void *arg)
-{
-	dispatcher_tag_t *d = (dispatcher_tag_t *)arg;
-	destination_t *to, *dst;
-	lua_State *L;
-	int request;
-	const char *dest, *req;
+	ordered = r->env.id == NULL;
+	counted = r->data != NULL;
+	envelope_free(&r->env);
+	free(r->data);
+	free(r);
 
-	if (pthread_detach(pthread_self())) {
-		syslog(LOG_ERR, "dispatcher: pthread_detach");
+	if (pthread_mutex_lock(&dispatcher_mutex)) {
+		syslog(LOG_ERR, "dispatcher: pthread_mutex_lock");
 		exit(1);
 	}
 
-	pthread_cleanup_push(cleanup, arg);
+	s->inflight--;
+	if (ordered)
+		s->ordered = 0;
+	if (counted && --s->queued <= MAX_QUEUED / 2 && s->paused) {
+		s->paused = 0;
+		resume = 1;
+	}
+	make_ready(s);
 
-	if (pthread_setname_np(pthread_self(), "dispatcher")) {
-		syslog(LOG_ERR, "dispatcher: pthread_setname_np");
+	if (pthread_mutex_unlock(&dispatcher_mutex)) {
+		syslog(LOG_ERR, "dispatcher: pthread_mutex_unlock");
 		exit(1);
 	}
+	if (resume)
+		reactor_resume(s);
+	sender_unref(s);
+}
 
-	/* Check if we have a default transceiver */
-	for (to = destination; to != NULL; to = to->next)
-		if (to->type == DEST_TRX && to->tag.trx->is_default)
-			break;
-
-	if (to == NULL)
-		for (to = destination; to != NULL; to = to->next)
-			if (to->type == DEST_TRX)
-				break;
+/* Both requests go to the same destination, the current one if not set */
+static int
+same_destination(const envelope_t *a, const envelope_t *b)
+{
+	if (a->to == NULL || b->to == NULL)
+		return a->to == b->to;
+	return !strcmp(a->to, b->to);
+}
 
-	if (to == NULL)
-		 to = destination;
+/*
+ * Queue a request, data must be allocated with malloc().  Returns 1 if the
+ * client has MAX_QUEUED requests queued now, its input is to be paused
+ * until reactor_resume() is called.
+ */
+int
+dispatcher_submit(sender_tag_t *s, char *data, size_t len)
+{
+	request_t *r;
+	int paused;
 
-	/* Setup Lua */
-	L = luaL_newstate();
-	if (L == NULL) {
-		syslog(LOG_ERR, "trx-controller: luaL_newstate");
+	r = malloc(sizeof(request_t));
+	if (r == NULL) {
+		syslog(LOG_ERR, "dispatcher: malloc");
 		exit(1);
 	}
-
-	pthread_cleanup_push(cleanup_lua, L);
-
-	luaopen_json(L);
-	lua_setglobal(L, "json");
-
-	/* Initialize private extensions */
-	if (private_extensions) {
-		printf("initialize private extensions from:\n%s\n",
-		    private_extensions);
-		lua_getglobal(L, "json");
-		lua_getfield(L, -1, "decode");
-		lua_pushstring(L, private_extensions);
-		if (lua_istable(L, -1)) {
-			switch (lua_pcall(L, 1, 1, 0)) {
-			case LUA_OK:
-				/* Initialize the extensions */
-				initialize_private_extensions(L);
-				lua_pop(L, 1);
-				break;
-			case LUA_ERRRUN:
-			case LUA_ERRMEM:
-			case LUA_ERRERR:
-				syslog(LOG_ERR, "%s", lua_tostring(L, -1));
-				exit(1);
-				break;
-			}
-		}
-		lua_pop(L, 2);
+	r->next = NULL;
+	r->sender = s;
+	r->data = data;
+	r->len = len;
+	r->error = 0;
+	r->superseded = 0;
+	r->deadline = 0;
+	r->env.id = NULL;
+	r->env.buf = r->env.fixed;
+	r->env.coalesce = r->env.readonly = 0;
+	r->env.timeout = 0;
+
+	/* The id decides how the request is scheduled */
+	if (data != NULL && envelope_scan(data, len, &r->env)) {
+		r->error = 1;
+		r->env.id = NULL;
+	} else if (r->env.timeout > 0)
+		r->deadline = command_clock() + r->env.timeout;
+
+	/* Each queued request holds a reference to its sender */
+	sender_ref(s);
+
+	if (pthread_mutex_lock(&dispatcher_mutex)) {
+		syslog(LOG_ERR, "dispatcher: pthread_mutex_lock");
+		exit(1);
 	}
 
-	if (pthread_mutex_lock(&d->mutex)) {
-		syslog(LOG_ERR, "dispatcher: pthread_mutex_lock");
+	/* A knob sends faster than the trx can follow */
+	if (s->requests != NULL && r->data != NULL && !r->error
+	    && same_destination(&s->requests_last->env, &r->env)
+	    && envelope_supersedes(&s->requests_last->env, &r->env))
+		s->requests_last->superseded = 1;
+
+	*s->requests_tail = r;
+	s->requests_tail = &r->next;
+	s->requests_last = r;
+	if (data != NULL && ++s->queued >= MAX_QUEUED)
+		s->paused = 1;
+	paused = s->paused;
+	make_ready(s);
+
+	if (pthread_mutex_unlock(&dispatcher_mutex)) {
+		syslog(LOG_ERR, "dispatcher: pthread_mutex_unlock");
 		exit(1);
 	}
+	return paused;
+}
 
-	if (verbose)
-		printf("dispatcher: ready\n");
+/* The client went away, detach it after its pending requests */
+void
+dispatcher_detach(sender_tag_t *s)
+{
+	dispatcher_submit(s, NULL, 0);
+}
 
-	d->data = NULL;
-	if (pthread_cond_signal(&d->cond2)) {
-		syslog(LOG_ERR, "dispatcher: pthread_cond_signal");
+static void *
+dispatcher(void *arg)
+{
+	dispatcher_tag_t *d = (dispatcher_tag_t *)arg;
+	sender_tag_t *s;
+	request_t *r;
+	int async;
+
+	if (pthread_detach(pthread_self())) {
+		syslog(LOG_ERR, "dispatcher: pthread_detach");
+		exit(1);
+	}
+
+	if (pthread_setname_np(pthread_self(), "dispatcher")) {
+		syslog(LOG_ERR, "dispatcher: pthread_setname_np");
 		exit(1);
 	}
 
 	for (;;) {
-		while (d->data == NULL) {
-			if (pthread_cond_wait(&d->cond, &d->mutex)) {
-				syslog(LOG_ERR, "dispatcher: pthread_cond_wait");
+		if (pthread_mutex_lock(&dispatcher_mutex)) {
+			syslog(LOG_ERR, "dispatcher: pthread_mutex_lock");
+			exit(1);
+		}
+
+		while (ready_list == NULL) {
+			if (pthread_cond_wait(&dispatcher_cond,
+			    &dispatcher_mutex)) {
+				syslog(LOG_ERR,
+				    "dispatcher: pthread_cond_wait");
 				exit(1);
 			}
 		}
 
-		lua_getglobal(L, "json");
-		if (lua_type(L, -1) != LUA_TTABLE) {
-			syslog(LOG_ERR, "dispatcher: table expected");
+		s = ready_list;
+		ready_list = s->ready_next;
+		if (ready_list == NULL)
+			ready_tail = &ready_list;
+		s->ready = 0;
+
+		r = s->requests;
+		s->requests = r->next;
+		if (s->requests == NULL)
+			s->requests_tail = &s->requests;
+		s->inflight++;
+		if (r->env.id == NULL)
+			s->ordered = 1;
+
+		/* Let another dispatcher handle the next request */
+		make_ready(s);
+
+		if (pthread_mutex_unlock(&dispatcher_mutex)) {
+			syslog(LOG_ERR, "dispatcher: pthread_mutex_unlock");
 			exit(1);
 		}
-		lua_getfield(L, -1, "decode");
-		if (lua_type(L, -1) != LUA_TFUNCTION) {
-			syslog(LOG_ERR, "dispatcher: function expected");
+
+		response_id = r->env.id;
+		response_idlen = r->env.idlen;
+		async = 0;
+		if (r->data == NULL)
+			detach(s);
+		else if (r->deadline != 0 && command_clock() >= r->deadline)
+			refuse(r, EXPIRED);
+		else if (!s->closing)
+			async = handle_request(d->L, s, r);
+		lua_settop(d->L, 0);
+		response_id = NULL;
+
+		if (!async)
+			request_done(r);
+	}
+	return NULL;
+}
+
+void
+dispatcher_init(int n)
+{
+	dispatcher_tag_t *d;
+	int i;
+
+	envelope_init();
+
+	for (i = 0; i < n; i++) {
+		d = malloc(sizeof(dispatcher_tag_t));
+		if (d == NULL) {
+			syslog(LOG_ERR, "dispatcher: malloc");
 			exit(1);
 		}
-		lua_pushexternalstring(L, d->data, d->len,
-		    freeexternalstring, NULL);
-		switch (lua_pcall(L, 1, 1, 0)) {
-		case LUA_OK:
-			break;
-		case LUA_ERRRUN:
-		case LUA_ERRMEM:
-		case LUA_ERRERR:
-			syslog(LOG_ERR, "dispatcher: %s", lua_tostring(L, -1));
+
+		/* Setup Lua */
+		d->L = luaL_newstate();
+		if (d->L == NULL) {
+			syslog(LOG_ERR, "dispatcher: luaL_newstate");
 			exit(1);
-			break;
-		}
-		if (lua_type(L, -1) != LUA_TTABLE) {
-			syslog(LOG_ERR, "dispatcher: "
-			    "JSON does not decode to table. Skipping request.");
-			goto skip_request;
 		}
-		/* decoded JSON data is now on top of the stack */
-		request = lua_gettop(L);
-		dest = NULL;
-		dst = NULL;
-		lua_getfield(L, request, "to");
-		if (lua_type(L, -1) == LUA_TSTRING) {
-			dest = lua_tostring(L, -1);
-
-			for (dst = destination; dst != NULL; dst = dst->next) {
-				if (!strcmp(dst->name, dest)) {
-					to = dst;
-					break;
-				}
-			}
-		} else
-			dst = to;
-
-		lua_getfield(L, request, "request");
-		req = lua_tostring(L, -1);
-		lua_pop(L, 2);
+		luaopen_json(d->L);
+		lua_setglobal(d->L, "json");
 
-		if (dst == NULL)
-			destination_not_found(d);
-		else {
-			if (req && !strcmp(req, "start-status-updates")) {
-				if (dst->type == DEST_TRX) {
-					add_sender(d, dst);
-					request_ok(d);
-				} else
-					status_updates_not_supported(d);
-			} else if (req && !strcmp(req, "stop-status-updates")) {
-				if (dst->type == DEST_TRX) {
-					remove_sender(d, dst);
-					request_ok(d);
-				} else
-					status_updates_not_supported(d);
-			} else if (req && !strcmp(req, "listen")) {
-				if (dst->type == DEST_EXTENSION) {
-					add_listener(d, dst);
-					request_ok(d);
-				} else
-					listen_not_supported(d);
-			} else if (req && !strcmp(req, "unlisten")) {
-				if (dst->type == DEST_EXTENSION) {
-					remove_listener(d, dst);
-					request_ok(d);
-				} else
-					listen_not_supported(d);
-			} else if (req && !strcmp(req, "list-destination")) {
-				const char *type = NULL;
-				lua_getfield(L, request, "type");
-				type = lua_tostring(L, -1);
-				lua_pop(L, 2);
-				list_destination(d, type);
-			} else if (req && !strcmp(req, "version"))
-				version(d);
-			else if (req) {
-				dispatch(L, d, dst, req);
-				/* XXX check stack depth */
-				/* lua_pop(L, 4); */
-			} else
-				destination_set(d);
-		}
-skip_request:
-		/*
-		 * If we were not using Luas externalstrings, d->data must be
-		 * freed here before setting it to NULL.
-		 */
-		d->data = NULL;
-		if (pthread_cond_signal(&d->cond2)) {
-			syslog(LOG_ERR, "dispatcher: pthread_cond_signal");
+		if (pthread_create(&d->dispatcher, NULL, dispatcher, d)) {
+			syslog(LOG_ERR, "dispatcher: pthread_create");
 			exit(1);
 		}
 	}
-	pthread_cleanup_pop(0);
-	pthread_cleanup_pop(0);
-	return NULL;
+	if (verbose)
+		printf("dispatcher: %d dispatcher threads ready\n", n);
 }
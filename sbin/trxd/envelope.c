@@ -0,0 +1,348 @@
+/*
+ * Copyright (c) 2023 - 2026 Marc Balmer HB9SSB
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+
+/* Extract the routing fields of a request without decoding it */
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "trxd.h"
+
+#define REQUEST_TABLE_SIZE	16
+
+/* Must be perfect for the names below, checked by envelope_init() */
+#define REQUEST_HASH(s, len)	(((len) + 5 * ((const unsigned char *)(s))[0] \
+	+ ((const unsigned char *)(s))[(len) - 1]) & (REQUEST_TABLE_SIZE - 1))
+
+#define IS_WS(c)	((c) == ' ' || (c) == '\t' || (c) == '\n' \
+	|| (c) == '\r')
+
+static const char *request_names[REQ_MAX] = {
+	[REQ_START_STATUS_UPDATES] =	"start-status-updates",
+	[REQ_STOP_STATUS_UPDATES] =	"stop-status-updates",
+	[REQ_LISTEN] =			"listen",
+	[REQ_UNLISTEN] =		"unlisten",
+	[REQ_LIST_DESTINATION] =	"list-destination",
+	[REQ_VERSION] =			"version",
+	[REQ_QUEUE_STATUS] =		"queue-status",
+	[REQ_BATCH] =			"batch",
+	[REQ_SET_ENCODING] =		"set-encoding"
+};
+
+static enum Request request_table[REQUEST_TABLE_SIZE];
+
+/* Settings where a queued request is superseded by a later one */
+static const char *coalesce_requests[] = {
+	"set-frequency",
+	"set-mode",
+	NULL
+};
+
+void
+envelope_init(void)
+{
+	const char *name;
+	int req, h;
+
+	for (req = REQ_OTHER + 1; req < REQ_MAX; req++) {
+		name = request_names[req];
+		h = REQUEST_HASH(name, strlen(name));
+		if (request_table[h] != REQ_NONE) {
+			syslog(LOG_ERR, "envelope: request hash collision "
+			    "between %s and %s", name,
+			    request_names[request_table[h]]);
+			exit(1);
+		}
+		request_table[h] = req;
+	}
+}
+
+static enum Request
+request_lookup(const char *name, size_t len)
+{
+	enum Request req;
+
+	if (len == 0)
+		return REQ_OTHER;
+	req = request_table[REQUEST_HASH(name, len)];
+	if (req != REQ_NONE && !strcmp(request_names[req], name))
+		return req;
+	return REQ_OTHER;
+}
+
+static const char *
+skip_ws(const char *p, const char *end)
+{
+	while (p < end && IS_WS(*p))
+		p++;
+	return p;
+}
+
+/* Skip a string, p points to the opening quote */
+static const char *
+skip_string(const char *p, const char *end)
+{
+	for (p++; p < end; p++) {
+		if (*p == '\\')
+			p++;
+		else if (*p == '"')
+			return p + 1;
+	}
+	return NULL;
+}
+
+/* Skip any value, including nested objects and arrays */
+static const char *
+skip_value(const char *p, const char *end)
+{
+	int depth = 0;
+
+	while (p < end) {
+		switch (*p) {
+		case '"':
+			p = skip_string(p, end);
+			if (p == NULL)
+				return NULL;
+			break;
+		case '{':
+		case '[':
+			depth++;
+			p++;
+			break;
+		case '}':
+		case ']':
+			if (depth == 0)
+				return p;
+			depth--;
+			p++;
+			break;
+		case ',':
+			if (depth == 0)
+				return p;
+			p++;
+			break;
+		default:
+			p++;
+		}
+	}
+	return depth == 0 ? p : NULL;
+}
+
+static int
+is_key(const char *key, size_t len, const char *name)
+{
+	return len == strlen(name) && !memcmp(key, name, len);
+}
+
+/*
+ * Scan the top level of a JSON object for the "to", "request", "type",
+ * "vfo", and "encoding" string members.  Their values are copied to the
+ * envelope, members that are not present or not strings are set to NULL.
+ * The value of an "id" member is copied as JSON text, whatever its type.
+ * A "timeout" member is the deadline of the request in milliseconds.
+ * Requests handled by the dispatcher are identified by env->req.  A JSON
+ * array is a batch of requests for the current destination.  The values
+ * are copied to env->fixed, if they don't fit the scan is repeated with a
+ * buffer the size of the data, see envelope_free().  Returns 0 on success,
+ * -1 if the data is not a JSON object or array.
+ */
+int
+envelope_scan(const char *data, size_t len, envelope_t *env)
+{
+	const char *p, *end, *key, *val, **field;
+	size_t keylen, vallen, used;
+
+	env->buf = env->fixed;
+	env->bufsize = sizeof(env->fixed);
+again:
+	used = 0;
+	env->req = REQ_NONE;
+	env->to = env->request = env->type = env->vfo = env->encoding = NULL;
+	env->id = NULL;
+	env->idlen = 0;
+	env->coalesce = env->readonly = 0;
+	env->timeout = 0;
+
+	end = data + len;
+	p = skip_ws(data, end);
+	if (p != end && *p == '[') {
+		env->req = REQ_BATCH;
+		return 0;
+	}
+	if (p == end || *p++ != '{')
+		return -1;
+
+	for (;;) {
+		p = skip_ws(p, end);
+		if (p == end)
+			return -1;
+		if (*p == '}')
+			break;
+		if (*p != '"')
+			return -1;
+
+		key = p + 1;
+		p = skip_string(p, end);
+		if (p == NULL)
+			return -1;
+		keylen = p - key - 1;
+
+		p = skip_ws(p, end);
+		if (p == end || *p++ != ':')
+			return -1;
+		p = skip_ws(p, end);
+		if (p == end)
+			return -1;
+
+		if (is_key(key, keylen, "to"))
+			field = &env->to;
+		else if (is_key(key, keylen, "request"))
+			field = &env->request;
+		else if (is_key(key, keylen, "type"))
+			field = &env->type;
+		else if (is_key(key, keylen, "vfo"))
+			field = &env->vfo;
+		else if (is_key(key, keylen, "encoding"))
+			field = &env->encoding;
+		else
+			field = NULL;
+
+		/* The id is echoed in the responses as is */
+		if (is_key(key, keylen, "id")) {
+			val = p;
+			p = skip_value(p, end);
+			if (p == NULL)
+				return -1;
+			for (vallen = p - val; vallen > 0 &&
+			    IS_WS(val[vallen - 1]); vallen--)
+				;
+			if (vallen == 0)
+				return -1;
+			if (used + vallen > env->bufsize)
+				goto grow;
+			memcpy(&env->buf[used], val, vallen);
+			env->id = &env->buf[used];
+			env->idlen = vallen;
+			used += vallen;
+		} else if (*p == '"') {
+			val = p + 1;
+			p = skip_string(p, end);
+			if (p == NULL)
+				return -1;
+			if (field != NULL) {
+				vallen = p - val - 1;
+				if (used + vallen + 1 > env->bufsize)
+					goto grow;
+				memcpy(&env->buf[used], val, vallen);
+				env->buf[used + vallen] = '\0';
+				*field = &env->buf[used];
+				used += vallen + 1;
+			}
+		} else if (is_key(key, keylen, "timeout")) {
+			env->timeout = 0;
+			for (val = p; p < end && *p >= '0' && *p <= '9'; p++)
+				if (p - val < 9)
+					env->timeout = env->timeout * 10
+					    + *p - '0';
+			p = skip_value(p, end);
+			if (p == NULL)
+				return -1;
+		} else {
+			p = skip_value(p, end);
+			if (p == NULL)
+				return -1;
+			if (field != NULL)
+				*field = NULL;
+		}
+
+		p = skip_ws(p, end);
+		if (p == end)
+			return -1;
+		if (*p == ',')
+			p++;
+		else if (*p != '}')
+			return -1;
+	}
+
+	if (env->request != NULL) {
+		env->req = request_lookup(env->request, strlen(env->request));
+		env->readonly = !strncmp(env->request, "get-", 4);
+		for (field = coalesce_requests; *field != NULL; field++)
+			if (!strcmp(env->request, *field)) {
+				env->coalesce = 1;
+				break;
+			}
+	}
+	return 0;
+
+	/*
+	 * A value is copied with its quotes dropped and a NUL added, so the
+	 * values of any object fit in a buffer of its length.
+	 */
+grow:
+	if (env->buf != env->fixed)
+		return -1;
+	env->buf = malloc(len);
+	if (env->buf == NULL) {
+		syslog(LOG_ERR, "envelope: malloc");
+		exit(1);
+	}
+	env->bufsize = len;
+	goto again;
+}
+
+/* Free the buffer of the values if it was allocated by envelope_scan() */
+void
+envelope_free(envelope_t *env)
+{
+	if (env->buf != env->fixed)
+		free(env->buf);
+}
+
+static int
+same(const char *a, const char *b)
+{
+	return a == b || (a != NULL && b != NULL && !strcmp(a, b));
+}
+
+/*
+ * Returns 1 if a queued request is superseded by the request queued right
+ * after it, i.e. both set the same setting of the same VFO.
+ */
+int
+envelope_supersedes(const envelope_t *queued, const envelope_t *env)
+{
+	return queued->coalesce && env->coalesce
+	    && !strcmp(queued->request, env->request)
+	    && same(queued->vfo, env->vfo);
+}
+
+/* Returns 1 if two requests are the same read */
+int
+envelope_identical(const envelope_t *a, const envelope_t *b)
+{
+	return a->readonly && b->readonly && !strcmp(a->request, b->request)
+	    && same(a->vfo, b->vfo);
+}
@@ -54,6 +54,7 @@ void *
 extension(void *arg)
 {
 	extension_tag_t *t = (extension_tag_t *)arg;
+	int retired;
 
 	if (pthread_detach(pthread_self())) {
 		syslog(LOG_ERR, "extension: pthread_detach");
@@ -78,16 +79,24 @@ extension(void *arg)
 		else
 			lua_call(t->L, 0, 1);
 
+		/* Tell a waiting dispatcher that the extension is ready */
+		t->done = 1;
+		if (pthread_cond_signal(&t->cond2)) {
+			syslog(LOG_ERR, "extension: pthread_cond_signal");
+			exit(1);
+		}
+
 		for (;;) {
-			t->call = 0;
 			/* Wait on cond, this releases the mutex */
-			while (t->call == 0) {
+			while (t->call == 0 && !t->terminate) {
 				if (pthread_cond_wait(&t->cond1, &t->mutex2)) {
 					syslog(LOG_ERR,
 					    "extension: pthread_cond_wait");
 					exit(1);
 				}
 			}
+			if (t->terminate)
+				break;
 			t->call = 0;
 			switch (lua_pcall(t->L, 1, 1, 0)) {
 			case LUA_OK:
@@ -107,6 +116,22 @@ extension(void *arg)
 				exit(1);
 			}
 		}
+
+		/*
+		 * A private extension whose client went away, or one that a
+		 * reload retired.  Dispatchers may still lock the latter, it
+		 * is freed by destination_stop() once the thread has exited.
+		 */
+		pthread_mutex_unlock(&t->mutex2);
+		if (t->retired) {
+			lua_close(t->L);
+			t->L = NULL;
+		} else {
+			pthread_mutex_destroy(&t->mutex);
+			pthread_mutex_destroy(&t->mutex2);
+			pthread_cond_destroy(&t->cond1);
+			pthread_cond_destroy(&t->cond2);
+		}
 	} else {
 		if (t->has_config)
 			lua_call(t->L, 1, 1);
@@ -114,6 +139,9 @@ extension(void *arg)
 			lua_call(t->L, 0, 1);
 	}
 
-	pthread_cleanup_pop(0);
+	retired = t->retired;
+	pthread_cleanup_pop(t->terminate && !retired);
+	if (retired)
+		__atomic_store_n(&t->exited, 1, __ATOMIC_RELEASE);
 	return NULL;
 }
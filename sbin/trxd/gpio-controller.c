@@ -47,12 +47,20 @@ extern int luaopen_trxd(lua_State *);
 extern int luaopen_gpio_controller(lua_State *);
 extern int luaopen_gpio(lua_State *);
 extern int luaopen_json(lua_State *);
+extern const char *json_encode_value(lua_State *, int, size_t *);
+extern command_t *command_next(command_queue_t *);
+extern void command_done(command_queue_t *, command_t *, const char *,
+    size_t);
+extern void request_push(lua_State *, request_t *);
 
 extern int verbose;
 
 __thread gpio_controller_tag_t	*gpio_controller_tag;
 __thread int gpio_device;
 
+static const char unencodable[] = "{\"status\":\"Error\","
+    "\"reason\":\"Response is not encodable as JSON\"}";
+
 static void
 cleanup(void *arg)
 {
@@ -63,13 +71,6 @@ cleanup(void *arg)
 	free(arg);
 }
 
-static void *
-freeexternalstring(void *ud, void *ptr, size_t osize, size_t nsize)
-{
-	free(ptr);
-	return NULL;
-}
-
 void *
 gpio_controller(void *arg)
 {
@@ -78,6 +79,9 @@ gpio_controller(void *arg)
 	int fd;
 	struct stat sb;
 	char gpio_driver[PATH_MAX];
+	command_t *c;
+	const char *response;
+	size_t len;
 
 	t->L = NULL;
 	if (pthread_detach(pthread_self())) {
@@ -105,11 +109,6 @@ gpio_controller(void *arg)
 		exit(1);
 	}
 
-	if (pthread_mutex_lock(&t->mutex2)) {
-		syslog(LOG_ERR, "gpio-controller: pthread_mutex_lock");
-		exit(1);
-	}
-
 	if (strchr(t->driver, '/')) {
 		syslog(LOG_ERR, "gpio-controller: driver name must not "
 		    "contain slashes");
@@ -210,8 +209,8 @@ gpio_controller(void *arg)
 	t->is_running = 1;
 
 	/*
-	 * We are ready to go, unlock the mutex, so that client-handlers,
-	 * gpio-handlers, and, gpio-pollers can access it.
+	 * We are ready to go, unlock the mutex and execute the commands of
+	 * the dispatchers and the gpio-poller.
 	 */
 	if (pthread_mutex_unlock(&t->mutex)) {
 		syslog(LOG_ERR, "gpio-controller: pthread_mutex_unlock");
@@ -219,50 +218,53 @@ gpio_controller(void *arg)
 	}
 
 	for (;;) {
-		/* Wait on cond, this releases the mutex */
-		while (t->handler == NULL) {
-			if (pthread_cond_wait(&t->cond1, &t->mutex2)) {
-				syslog(LOG_ERR, "gpio-controller: "
-				    "pthread_cond_wait");
-				exit(1);
-			}
-		}
+		c = command_next(&t->queue);
+		response = NULL;
+		len = 0;
+
 		lua_geti(t->L, LUA_REGISTRYINDEX, t->ref);
-		lua_getfield(t->L, -1, t->handler);
+		lua_getfield(t->L, -1, c->handler);
 		if (lua_type(t->L, -1) != LUA_TFUNCTION) {
-			t->response = "command not supported, "
+			response = "command not supported, "
 			    "please submit a bug report";
+			len = strlen(response);
 		} else {
-			lua_pushexternalstring(t->L, t->data, t->len,
-			    freeexternalstring, NULL);
-			t->response = NULL;
+			if (c->request != NULL)
+				request_push(t->L, c->request);
+			else
+				lua_pushnil(t->L);
 
 			switch (lua_pcall(t->L, 1, 1, 0)) {
 			case LUA_OK:
 				if (lua_type(t->L, -1) == LUA_TSTRING)
-					t->response =
-					    (char *)lua_tostring(t->L, -1);
-				else
-					t->response = "";
+					response = lua_tolstring(t->L, -1,
+					    &len);
+				else if (lua_type(t->L, -1) == LUA_TTABLE) {
+					response = json_encode_value(t->L, -1,
+					    &len);
+					if (response == NULL) {
+						response = unencodable;
+						len = strlen(response);
+					}
+				} else if (lua_isinteger(t->L, -1))
+					c->result = lua_tointeger(t->L, -1);
 				break;
 			case LUA_ERRRUN:
 			case LUA_ERRMEM:
 			case LUA_ERRERR:
-				t->response = "{\"status\":\"Error\","
+				response = "{\"status\":\"Error\","
 				    "\"reason\":\"Lua error\"}";
+				len = strlen(response);
 
 				syslog(LOG_ERR, "Lua error: %s",
 				    lua_tostring(t->L, -1));
 				break;
 			}
 		}
-		lua_pop(t->L, 2);
-		t->handler = NULL;
 
-		if (pthread_cond_signal(&t->cond2)) {
-			syslog(LOG_ERR, "gpio-controller: pthread_cond_signal");
-			exit(1);
-		}
+		/* The response is still on the Lua stack */
+		command_done(&t->queue, c, response, len);
+		lua_pop(t->L, 2);
 	}
 	pthread_cleanup_pop(0);
 	return NULL;
@@ -35,21 +35,19 @@ local function registerDriver(name, dev, newDriver)
 end
 
 -- Handle request from a network client
-local function requestHandler(data, fd)
-	local request = json.decode(data)
-
-	if request == nil then
-		return json.encode({
+local function requestHandler(request, fd)
+	if type(request) ~= 'table' then
+		return {
 			status = 'Error',
 			reason = 'Invalid input data or no input data at all'
-		})
+		}
 	end
 
 	if request.request == nil or #request.request == 0 then
-		return json.encode({
+		return {
 			status = 'Error',
 			reason = 'No request'
-		})
+		}
 	end
 
 	local response = {
@@ -121,7 +119,7 @@ local function requestHandler(data, fd)
 		response.reason = 'Unknown request'
 	end
 
-	return json.encode(response)
+	return response
 end
 
 local function pollHandler(data, fd)
@@ -136,15 +134,14 @@ local function pollHandler(data, fd)
 			}
 		}
 
-		local jsonData = json.encode(status)
-		gpioController.notifyListeners(jsonData)
+		gpioController.notifyListeners(status)
 		lastFrequency = frequency
 		lastMode = mode
 	else
 		return nil
 	end
 	--]]
-	return nil
+	return 0
 end
 
 return {
@@ -22,90 +22,46 @@
 
 /* Handle GPIOs that require polling for status updates */
 
-#include <pthread.h>
 #include <stdlib.h>
-#include <string.h>
 #include <stdio.h>
 #include <syslog.h>
-#include <unistd.h>
 
 #include "trxd.h"
 
-#define STATUS_REQUEST	"{\"request\": \"status-update\"}"
-#define POLLING_INTERVAL	200000	/* microseconds */
+extern void command_submit(command_queue_t *, command_t *);
+extern void poll_done(poll_timer_t *, int);
 
+/*
+ * Called by the gpio-controller, pollHandler returns 1 if the status
+ * has changed.
+ */
 static void
-cleanup(void *arg)
+gpio_poll_done(command_t *c, const char *response, size_t len)
 {
-	free(arg);
+	gpio_controller_tag_t *t = c->arg;
+
+	if (len > 0)
+		printf("gpio-poller: unexpected response '%.*s'\n", (int)len,
+		    response);
+	poll_done(&t->poll, c->result);
+	free(c);
 }
 
-void *
-gpio_poller(void *arg)
+/* Called by the poll-scheduler, this must not block */
+void
+gpio_poll(poll_timer_t *p)
 {
-	gpio_controller_tag_t *t = (gpio_controller_tag_t *)arg;
-
-	if (pthread_detach(pthread_self())) {
-		syslog(LOG_ERR, "gpio-poller: pthread_detach");
-		exit(1);
-	}
-
-	pthread_cleanup_push(cleanup, NULL);
+	gpio_controller_tag_t *t = p->arg;
+	command_t *c;
 
-	if (pthread_setname_np(pthread_self(), "gpio-poller")) {
-		syslog(LOG_ERR, "gpio-poller: pthread_setname_np");
+	c = calloc(1, sizeof(command_t));
+	if (c == NULL) {
+		syslog(LOG_ERR, "gpio-poller: malloc");
 		exit(1);
 	}
-
-	for (;;) {
-		if (pthread_mutex_lock(&t->mutex)) {
-			syslog(LOG_ERR, "gpio-poller: pthread_mutex_lock");
-			exit(1);
-		}
-
-		t->handler = "pollHandler";
-		t->response = NULL;
-		t->data  = NULL;
-
-		if (pthread_mutex_lock(&t->mutex2)) {
-			syslog(LOG_ERR, "gpio-poller: pthread_mutex_lock");
-			exit(1);
-		}
-
-		if (pthread_cond_signal(&t->cond1)) {
-			syslog(LOG_ERR, "gpio-poller: pthread_cond_signal");
-			exit(1);
-		}
-
-		if (pthread_mutex_unlock(&t->mutex2)) {
-			syslog(LOG_ERR, "gpio-poller: pthread_mutex_unlock");
-			exit(1);
-		}
-
-		while (t->response == NULL) {
-			if (pthread_cond_wait(&t->cond2, &t->mutex2)) {
-				syslog(LOG_ERR, "gpio-poller: pthread_cond_wait");
-				exit(1);
-			}
-		}
-
-		if (strlen(t->response))
-			printf("gpio-poller: unexpected response '%s'\n",
-			    t->response);
-
-		if (pthread_mutex_unlock(&t->mutex2)) {
-			syslog(LOG_ERR, "gpio-poller: pthread_mutex_unlock");
-			exit(1);
-		}
-
-		if (pthread_mutex_unlock(&t->mutex)) {
-			syslog(LOG_ERR, "gpio-poller: pthread_mutex_unlock");
-			exit(1);
-		}
-
-		usleep(POLLING_INTERVAL);
-	}
-	pthread_cleanup_pop(0);
-
-	return NULL;
+	c->handler = "pollHandler";
+	c->prio = PRIO_BACKGROUND;
+	c->done = gpio_poll_done;
+	c->arg = t;
+	command_submit(&t->queue, c);
 }
@@ -27,6 +27,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <syslog.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <lua.h>
@@ -36,38 +37,61 @@
 #include "trxd.h"
 
 extern __thread trx_controller_tag_t	*trx_controller_tag;
+extern void sender_send_message(sender_tag_t *, message_t *);
+extern const char *json_encode_value(lua_State *, int, size_t *);
+extern message_t *message_new(const char *, size_t, int, const void *);
+extern void message_unref(message_t *);
 
 static int
 notify_listeners(lua_State *L)
 {
 	sender_list_t *l;
-	char *data;
+	message_t *m;
+	const char *data;
+	size_t len;
 
-        data = (char *)luaL_checkstring(L, 1);
+	/* Tables are encoded without creating a Lua string */
+	if (lua_type(L, 1) == LUA_TTABLE) {
+		data = json_encode_value(L, 1, &len);
+		if (data == NULL)
+			return luaL_error(L, "notification is not "
+			    "encodable as JSON");
+	} else
+		data = luaL_checklstring(L, 1, &len);
 
-	for (l = trx_controller_tag->senders; l != NULL; l = l->next) {
-		if (pthread_mutex_lock(&l->sender->mutex)) {
-			syslog(LOG_ERR, "luatrxd: pthread_mutex_lock");
-			exit(1);
-		}
-		l->sender->data = data;
-		if (pthread_cond_signal(&l->sender->cond)) {
-			syslog(LOG_ERR, "luatrxd: pthread_cond_signal");
-			exit(1);
-		}
-		if (pthread_mutex_unlock(&l->sender->mutex)) {
-			syslog(LOG_ERR, "luatrxd: pthread_mutex_unlock");
-			exit(1);
-		}
-	}
+	/* All listeners share the same message */
+	m = message_new(data, len, MSG_UPDATE, trx_controller_tag);
+	for (l = trx_controller_tag->senders; l != NULL; l = l->next)
+		sender_send_message(l->sender, m);
+	message_unref(m);
 	return 0;
 }
 
+/* Monotonic time in milliseconds, for the state cache */
+static int
+now(lua_State *L)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	lua_pushinteger(L, ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+	return 1;
+}
+
+static int
+cache_window(lua_State *L)
+{
+	lua_pushinteger(L, trx_controller_tag->cache_window);
+	return 1;
+}
+
 int
 luaopen_trx_controller(lua_State *L)
 {
 	struct luaL_Reg luatrxcontroller[] = {
 		{ "notifyListeners",		notify_listeners },
+		{ "now",			now },
+		{ "cacheWindow",		cache_window },
 		{ NULL, NULL }
 	};
 
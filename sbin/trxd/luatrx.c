@@ -26,7 +26,9 @@
 #include <errno.h>
 #include <poll.h>
 #include <stdlib.h>
+#include <string.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <lua.h>
@@ -34,6 +36,17 @@
 
 #include "trxd.h"
 
+#define READ_TIMEOUT	5000	/* milliseconds */
+
+extern size_t cat_input_read(trx_controller_tag_t *, void *, size_t, int);
+extern size_t cat_input_take(trx_controller_tag_t *, void *, size_t, int,
+    const struct timespec *);
+extern void cat_input_unread(trx_controller_tag_t *, const void *, size_t);
+extern void cat_input_deadline(struct timespec *, int);
+extern int cat_input_wait(trx_controller_tag_t *, int);
+extern void cat_input_flush(trx_controller_tag_t *);
+
+extern __thread trx_controller_tag_t	*trx_controller_tag;
 extern __thread int cat_device;
 extern int verbose;
 
@@ -47,77 +60,210 @@ luatrx_version(lua_State *L)
 static int
 luatrx_wait_for_data(lua_State *L)
 {
-	struct pollfd pfd;
 	int timeout;
-	size_t nfds;
 
 	if (lua_gettop(L) == 1)
 		timeout = luaL_checkinteger(L, 1);
 	else
 		timeout = -1;	/* Infinite timeout */
 
-	pfd.fd = cat_device;
-	pfd.events = POLLIN;
-
-	nfds = poll(&pfd, 1, timeout);
-	if (nfds == -1)
-		return luaL_error(L, "poll error");
+	lua_pushboolean(L, cat_input_wait(trx_controller_tag, timeout));
+	return 1;
+}
 
-	lua_pushboolean(L, nfds == 1 ? 1 : 0);
+static void
+dump(const char *prefix, const unsigned char *data, size_t len)
+{
+	size_t i;
 
-	return 1;
+	printf("%s", prefix);
+	for (i = 0; i < len; i++)
+		printf("%02X ", data[i]);
+	printf("\n");
 }
 
 static int
 luatrx_read(lua_State *L)
 {
-	struct pollfd pfd;
-	unsigned char buf[256];
-	size_t rv, len, nread, nfds;
-	time_t now;
+	luaL_Buffer b;
+	unsigned char *buf;
+	size_t len, nread;
 
 	len = luaL_checkinteger(L, 1);
 
-	pfd.fd = cat_device;
-	pfd.events = POLLIN;
-
-	nread = 0;
 	if (verbose > 2)
 		printf("<- (read %ld bytes from %d)\n", len, cat_device);
-	now = time(NULL);
-
-	while (nread < len && time(NULL) < now + 5) {
-		nfds = poll(&pfd, 1, 1000);
-		if (nfds == -1)
-			return luaL_error(L, "poll error");
-		if (nfds == 1 && pfd.revents == POLLIN) {
-			rv = read(cat_device, &buf[nread], len - nread);
-			if (rv == -1 && errno == EAGAIN) {
-				printf("EGAIN\n");
-				continue;
-			}
-			nread += rv;
-		}
-	}
 
-	if (nread > 0 && verbose > 2) {
-		int i;
+	buf = (unsigned char *)luaL_buffinitsize(L, &b, len);
+	nread = cat_input_read(trx_controller_tag, buf, len, READ_TIMEOUT);
 
-		for (i = 0; i < nread; i++)
-			printf("%02X ", buf[i]);
-		printf("\n");
-	}
+	if (nread > 0 && verbose > 2)
+		dump("", buf, nread);
 
-	if (nread > 0)
-		lua_pushlstring(L, (char *)buf, nread);
-	else
+	luaL_pushresultsize(&b, nread);
+	if (nread == 0) {
+		lua_pop(L, 1);
 		lua_pushnil(L);
+	}
 
 	if (verbose > 2)
 		printf("\n");
 	return 1;
 }
 
+/*
+ * Read a reply until the decoder at index 2 returns the length of a
+ * complete frame.  Input after the frame is returned to the ring.
+ */
+static int
+transact_decoder(lua_State *L, const struct timespec *ts)
+{
+	unsigned char buf[CAT_INPUT_SIZE];
+	const char *data;
+	size_t len, n;
+	lua_Integer frame;
+
+	lua_pushliteral(L, "");
+	for (;;) {
+		n = cat_input_take(trx_controller_tag, buf, sizeof(buf), -1,
+		    ts);
+		if (n == 0)
+			return 0;
+		lua_pushlstring(L, (char *)buf, n);
+		lua_concat(L, 2);
+
+		lua_pushvalue(L, 2);
+		lua_pushvalue(L, -2);
+		lua_call(L, 1, 1);
+		if (lua_isinteger(L, -1))
+			break;
+		lua_pop(L, 1);
+	}
+	frame = lua_tointeger(L, -1);
+	lua_pop(L, 1);
+
+	data = lua_tolstring(L, -1, &len);
+	if (frame < 0 || frame > len)
+		return luaL_error(L, "decoder returned an invalid length");
+	if (frame < len)
+		cat_input_unread(trx_controller_tag, data + frame, len - frame);
+	lua_pushlstring(L, data, frame);
+	return 1;
+}
+
+/*
+ * Write all of data to the CAT device, which is non-blocking.  Returns -1
+ * if it fails or does not take more data for timeout milliseconds.
+ */
+static int
+cat_write(const char *data, size_t len, int timeout)
+{
+	struct pollfd pfd;
+	ssize_t n;
+
+	pfd.fd = cat_device;
+	pfd.events = POLLOUT;
+	while (len > 0) {
+		n = write(cat_device, data, len);
+		if (n > 0) {
+			data += n;
+			len -= n;
+		} else if (n == -1 && errno == EAGAIN) {
+			switch (poll(&pfd, 1, timeout)) {
+			case -1:
+				if (errno != EINTR)
+					return -1;
+				break;
+			case 0:
+				return -1;
+			}
+		} else if (n == -1 && errno != EINTR)
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * trx.transact(data, until [, timeout]) writes data, unless it is nil,
+ * and reads the reply until it is complete.  until is a byte count, a
+ * terminator string, or a decoder function.  The reply is returned, or
+ * nil and an error message if timeout milliseconds passed before.
+ */
+static int
+luatrx_transact(lua_State *L)
+{
+	struct timespec ts;
+	luaL_Buffer b;
+	const char *data, *term = NULL;
+	char *p;
+	size_t len, count = 0, termlen = 0, want, n;
+	int timeout, eol = -1, complete = 0;
+
+	data = luaL_optlstring(L, 1, NULL, &len);
+	switch (lua_type(L, 2)) {
+	case LUA_TNUMBER:
+		count = luaL_checkinteger(L, 2);
+		luaL_argcheck(L, count > 0, 2, "count must be positive");
+		break;
+	case LUA_TSTRING:
+		term = lua_tolstring(L, 2, &termlen);
+		luaL_argcheck(L, termlen > 0, 2, "empty terminator");
+		eol = (unsigned char)term[termlen - 1];
+		break;
+	case LUA_TFUNCTION:
+		break;
+	default:
+		return luaL_argerror(L, 2,
+		    "count, terminator or decoder expected");
+	}
+	timeout = luaL_optinteger(L, 3, READ_TIMEOUT);
+	lua_settop(L, 3);
+
+	if (data != NULL) {
+		cat_input_flush(trx_controller_tag);
+		if (verbose > 2)
+			dump("-> ", (const unsigned char *)data, len);
+		if (cat_write(data, len, timeout))
+			return luaL_error(L, "write to the CAT device failed");
+	}
+	cat_input_deadline(&ts, timeout);
+
+	if (lua_isfunction(L, 2))
+		complete = transact_decoder(L, &ts);
+	else {
+		luaL_buffinit(L, &b);
+		while (!complete) {
+			want = count ? count - luaL_bufflen(&b) : BUFSIZ;
+			p = luaL_prepbuffsize(&b, want);
+			n = cat_input_take(trx_controller_tag, p, want, eol,
+			    &ts);
+			if (n == 0)
+				break;
+			luaL_addsize(&b, n);
+
+			if (count)
+				complete = luaL_bufflen(&b) == count;
+			else
+				complete = p[n - 1] == eol
+				    && luaL_bufflen(&b) >= termlen
+				    && !memcmp(luaL_buffaddr(&b) +
+				    luaL_bufflen(&b) - termlen, term, termlen);
+		}
+		luaL_pushresult(&b);
+	}
+
+	if (!complete) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "timeout");
+		return 2;
+	}
+	if (verbose > 2) {
+		data = lua_tolstring(L, -1, &len);
+		dump("<- ", (const unsigned char *)data, len);
+	}
+	return 1;
+}
+
 static int
 luatrx_write(lua_State *L)
 {
@@ -125,7 +271,7 @@ luatrx_write(lua_State *L)
 	size_t len;
 
 	data = (unsigned char *)luaL_checklstring(L, 1, &len);
-	tcflush(cat_device, TCIFLUSH);
+	cat_input_flush(trx_controller_tag);
 	if (verbose > 2) {
 		int i;
 
@@ -217,6 +363,7 @@ luaopen_trx(lua_State *L)
 		{ "version",		luatrx_version },
 		{ "read",		luatrx_read },
 		{ "write",		luatrx_write },
+		{ "transact",		luatrx_transact },
 		{ "waitForData",	luatrx_wait_for_data },
 		{ "bcdToString",	bcd_to_string },
 		{ "stringToBcd",	string_to_bcd },
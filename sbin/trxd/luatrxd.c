@@ -43,30 +43,33 @@ extern __thread extension_tag_t	*extension_tag;
 extern void *zmq_ctx;
 
 extern void *signal_input(void *);
+extern void sender_send_message(sender_tag_t *, message_t *);
+extern const char *json_encode_value(lua_State *, int, size_t *);
+extern message_t *message_new(const char *, size_t, int, const void *);
+extern void message_unref(message_t *);
 
 static int
 luatrxd_notify(lua_State *L)
 {
 	sender_list_t *l;
-	char *data;
-
-	data = (char *)luaL_checkstring(L, 1);
-
-	for (l = extension_tag->listeners; l != NULL; l = l->next) {
-		if (pthread_mutex_lock(&l->sender->mutex)) {
-			syslog(LOG_ERR, "luatrxd: pthread_mutex_lock");
-			exit(1);
-		}
-		l->sender->data = data;
-		if (pthread_cond_signal(&l->sender->cond)) {
-			syslog(LOG_ERR, "luatrxd: pthread_cond_signal");
-			exit(1);
-		}
-		if (pthread_mutex_unlock(&l->sender->mutex)) {
-			syslog(LOG_ERR, "luatrxd: pthread_mutex_unlock");
-			exit(1);
-		}
-	}
+	message_t *m;
+	const char *data;
+	size_t len;
+
+	/* Tables are encoded without creating a Lua string */
+	if (lua_type(L, 1) == LUA_TTABLE) {
+		data = json_encode_value(L, 1, &len);
+		if (data == NULL)
+			return luaL_error(L, "notification is not "
+			    "encodable as JSON");
+	} else
+		data = luaL_checklstring(L, 1, &len);
+
+	/* All listeners share the same message */
+	m = message_new(data, len, MSG_UPDATE, extension_tag);
+	for (l = extension_tag->listeners; l != NULL; l = l->next)
+		sender_send_message(l->sender, m);
+	message_unref(m);
 	return 0;
 }
 
@@ -0,0 +1,173 @@
+/*
+ * Copyright (c) 2023 - 2026 Marc Balmer HB9SSB
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/* Reference counted messages sent to clients */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include <lua.h>
+
+#include "buffer.h"
+#include "trxd.h"
+#include "websocket.h"
+
+#define CBOR_BUFFER_MAX	65536	/* Larger buffers are not kept */
+
+extern int cbor_transcode(struct buffer *, const char *, size_t);
+extern void cbor_text(struct buffer *, const char *, size_t);
+
+#if MSG_HEADROOM < MAX_WS_HEADER
+#error "MSG_HEADROOM too small for a WebSocket header"
+#endif
+
+/* Create a message, the payload is left to the caller if data is NULL */
+message_t *
+message_new(const char *data, size_t len, int flags, const void *source)
+{
+	message_t *m;
+
+	m = malloc(sizeof(message_t) + MSG_HEADROOM + len + 1);
+	if (m == NULL) {
+		syslog(LOG_ERR, "message: malloc");
+		exit(1);
+	}
+	m->refcnt = 1;
+	m->flags = flags;
+	m->source = source;
+	m->len = len;
+	m->wslen = 0;
+	m->data = m->buf + MSG_HEADROOM;
+	m->cbor = NULL;
+	if (data != NULL)
+		memcpy(m->data, data, len);
+	m->data[len] = '\n';
+	return m;
+}
+
+void
+message_ref(message_t *m)
+{
+	__atomic_add_fetch(&m->refcnt, 1, __ATOMIC_RELAXED);
+}
+
+void
+message_unref(message_t *m)
+{
+	if (__atomic_sub_fetch(&m->refcnt, 1, __ATOMIC_ACQ_REL) == 0) {
+		free(m->cbor);
+		free(m);
+	}
+}
+
+/*
+ * Transcode a message to CBOR, preceded by room for a WebSocket header.
+ * A message that is not JSON becomes a text string.
+ */
+static void
+message_cbor(message_t *m)
+{
+	static struct buffer b;
+
+	if (b.data == NULL && buf_init(&b)) {
+		syslog(LOG_ERR, "message: malloc");
+		exit(1);
+	}
+	b.size = 0;
+	buf_reserve(&b, MSG_HEADROOM);
+	b.size = MSG_HEADROOM;
+	if (cbor_transcode(&b, m->data, m->len))
+		cbor_text(&b, m->data, m->len);
+
+	m->cbor = malloc(b.size);
+	if (m->cbor == NULL) {
+		syslog(LOG_ERR, "message: malloc");
+		exit(1);
+	}
+	memcpy(m->cbor, b.data, b.size);
+	m->cborlen = b.size - MSG_HEADROOM;
+	m->cborws = 0;
+
+	if (b.capacity > CBOR_BUFFER_MAX) {
+		buf_free(&b);
+		b.data = NULL;
+	}
+}
+
+/*
+ * Return the frame of a message for a client type and encoding.  The
+ * WebSocket header and the CBOR encoding are built when the message is
+ * first sent to such a client, a status update is encoded once for all of
+ * them.  Frames are only built by the reactor thread, so no locking is
+ * needed.
+ */
+const char *
+message_frame(message_t *m, enum SenderType type, enum Encoding encoding,
+    size_t *len)
+{
+	uint8_t hdr[MAX_WS_HEADER];
+	char *data;
+
+	if (m->flags & MSG_FRAMED) {
+		*len = m->len;
+		return m->data;
+	}
+
+	/* CBOR data items delimit themselves, there is no newline */
+	if (encoding == ENCODING_CBOR) {
+		if (m->cbor == NULL)
+			message_cbor(m);
+		data = m->cbor + MSG_HEADROOM;
+		if (type != SENDER_WEBSOCKET) {
+			*len = m->cborlen;
+			return data;
+		}
+		if (m->cborws == 0) {
+			m->cborws = wsMakeHeader(m->cborlen, hdr,
+			    WS_BINARY_FRAME);
+			memcpy(data - m->cborws, hdr, m->cborws);
+		}
+		*len = m->cborws + m->cborlen;
+		return data - m->cborws;
+	}
+
+	/* The chunks of a stream are fragments of one frame or line */
+	switch (type) {
+	case SENDER_WEBSOCKET:
+		if (m->wslen == 0) {
+			m->wslen = wsMakeHeader(m->len, hdr,
+			    m->flags & MSG_CONTINUED ? WS_CONTINUATION_FRAME
+			    : WS_TEXT_FRAME);
+			if (m->flags & MSG_PARTIAL)
+				hdr[0] &= ~0x80;	/* Clear FIN */
+			memcpy(m->data - m->wslen, hdr, m->wslen);
+		}
+		*len = m->wslen + m->len;
+		return m->data - m->wslen;
+	case SENDER_SOCKET:
+	default:
+		*len = m->flags & MSG_PARTIAL ? m->len : m->len + 1;
+		return m->data;
+	}
+}
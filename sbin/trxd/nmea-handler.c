@@ -34,6 +34,9 @@
 
 #include "trxd.h"
 
+extern int device_open(const char *, int, int);
+extern int reconnect(reconnect_t *, const char *, int, int);
+
 extern int verbose;
 
 #ifdef NMEA_DEBUG
@@ -444,8 +447,8 @@ nmea_handler(void *arg)
 	nmea_tag_t *t = (nmea_tag_t *)arg;
 	struct nmea *np;
 	struct pollfd pfd;
-	int n, fd;
-	char data;
+	ssize_t n, i;
+	char data[NMEAMAX];
 
 	if (pthread_detach(pthread_self())) {
 		syslog(LOG_ERR, "nmea-handler: pthread_detach");
@@ -468,21 +471,47 @@ nmea_handler(void *arg)
 
 	pthread_cleanup_push(cleanup_nmea, np);
 
+	t->fd = device_open(t->device, t->baudrate, t->channel);
+	if (t->fd == -1) {
+		syslog(LOG_WARNING, "nmea-handler: %s is offline", t->device);
+		t->fd = reconnect(&t->reconnect, t->device, t->baudrate,
+		    t->channel);
+	}
 
 	pfd.fd = t->fd;
 	pfd.events = POLLIN;
 
 	for (;;) {
-		if (poll(&pfd, 1, 0) == -1) {
+		if (poll(&pfd, 1, -1) == -1) {
+			if (errno == EINTR)
+				continue;
 			syslog(LOG_ERR, "nmea-handler: poll");
 			exit(1);
 		}
 
-		if (pfd.revents) {
-			read(t->fd, &data, 1);
-			nmea_input(t, data, np);
+		n = read(t->fd, data, sizeof(data));
+		for (i = 0; i < n; i++)
+			nmea_input(t, data[i], np);
+		if (n > 0 || (n == -1 && (errno == EAGAIN || errno == EINTR)))
+			continue;
+
+		/* The device went away, there is no fix until it is back */
+		syslog(LOG_ERR, "nmea-handler: %s: %s", t->device,
+		    n == 0 ? "device closed" : strerror(errno));
+		close(t->fd);
+		if (pthread_mutex_lock(&t->mutex)) {
+			syslog(LOG_ERR, "nmea-handler: pthread_mutex_lock");
+			exit(1);
 		}
-	};
+		t->status = 0;
+		if (pthread_mutex_unlock(&t->mutex)) {
+			syslog(LOG_ERR, "nmea-handler: pthread_mutex_unlock");
+			exit(1);
+		}
+		np->sync = 1;
+		t->fd = pfd.fd = reconnect(&t->reconnect, t->device,
+		    t->baudrate, t->channel);
+	}
 	pthread_cleanup_pop(0);
 	pthread_cleanup_pop(0);
 	return NULL;
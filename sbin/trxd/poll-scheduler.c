@@ -0,0 +1,320 @@
+/*
+ * Copyright (c) 2023 - 2026 Marc Balmer HB9SSB
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+
+/*
+ * Schedule the status polls of all polling destinations:  A single thread
+ * drives a timer wheel with one slot per tick, it sleeps until the next
+ * timer is due and then catches up on the ticks.  A destination is polled
+ * often right after a change and less often while nothing changes, and
+ * not at all while nobody is subscribed to its status updates.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <syslog.h>
+#include <time.h>
+
+#include "trxd.h"
+
+#define TICK		10		/* milliseconds */
+#define WHEEL_SIZE	256
+
+static poll_timer_t *wheel[WHEEL_SIZE];
+static unsigned int current;		/* Slot of the last tick */
+static struct timespec next;		/* Time of the tick after it */
+static int armed;			/* Timers in the wheel */
+static unsigned int waiting;		/* Ticks the scheduler sleeps for */
+
+static pthread_mutex_t poll_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t poll_cond;
+
+static void
+advance(struct timespec *ts, unsigned int ticks)
+{
+	long ms = ticks * TICK;
+
+	ts->tv_sec += ms / 1000;
+	ts->tv_nsec += ms % 1000 * 1000000L;
+	if (ts->tv_nsec >= 1000000000L) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000L;
+	}
+}
+
+/* Ticks that passed since the last one, the wheel must be locked */
+static unsigned int
+behind(void)
+{
+	struct timespec now;
+	long long ns;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ns = (now.tv_sec - next.tv_sec) * 1000000000LL
+	    + now.tv_nsec - next.tv_nsec;
+	return ns < 0 ? 0 : ns / (TICK * 1000000LL) + 1;
+}
+
+/* Ticks from the last one to the first timer due, the wheel must be locked */
+static unsigned int
+first_due(void)
+{
+	poll_timer_t *p;
+	unsigned int i, ticks, due = UINT_MAX;
+
+	for (i = 1; i <= WHEEL_SIZE && i < due; i++)
+		for (p = wheel[(current + i) % WHEEL_SIZE]; p != NULL;
+		    p = p->next) {
+			ticks = i + p->rounds * WHEEL_SIZE;
+			if (ticks < due)
+				due = ticks;
+		}
+	return due;
+}
+
+/*
+ * Put a timer in the wheel, the wheel must be locked.  The ticks the
+ * scheduler did not catch up on yet count towards the interval.
+ */
+static void
+insert(poll_timer_t *p, int interval)
+{
+	unsigned int ticks;
+
+	/* The wheel starts over, it has not been turning while empty */
+	if (armed == 0) {
+		clock_gettime(CLOCK_MONOTONIC, &next);
+		advance(&next, 1);
+	}
+
+	ticks = (interval + TICK - 1) / TICK;
+	if (ticks == 0)
+		ticks = 1;
+	ticks += behind();
+
+	p->slot = (current + ticks) % WHEEL_SIZE;
+	p->rounds = (ticks - 1) / WHEEL_SIZE;
+	p->next = wheel[p->slot];
+	if (p->next != NULL)
+		p->next->prev = &p->next;
+	p->prev = &wheel[p->slot];
+	wheel[p->slot] = p;
+
+	/* Wake the scheduler if it sleeps past the timer */
+	if ((armed++ == 0 || ticks < waiting)
+	    && pthread_cond_signal(&poll_cond)) {
+		syslog(LOG_ERR, "poll-scheduler: pthread_cond_signal");
+		exit(1);
+	}
+}
+
+/* Take a timer out of the wheel, the wheel must be locked */
+static void
+unlink_timer(poll_timer_t *p)
+{
+	*p->prev = p->next;
+	if (p->next != NULL)
+		p->next->prev = p->prev;
+	p->prev = NULL;
+	armed--;
+}
+
+/* The first subscriber wants status updates */
+void
+poll_start(poll_timer_t *p)
+{
+	pthread_mutex_lock(&poll_mutex);
+	if (!p->active) {
+		p->active = 1;
+		p->interval = p->min_interval;
+		if (!p->inflight && p->prev == NULL)
+			insert(p, 0);
+	}
+	pthread_mutex_unlock(&poll_mutex);
+}
+
+/* The last subscriber is gone */
+void
+poll_stop(poll_timer_t *p)
+{
+	pthread_mutex_lock(&poll_mutex);
+	p->active = 0;
+	if (p->prev != NULL)
+		unlink_timer(p);
+	pthread_mutex_unlock(&poll_mutex);
+}
+
+/* Returns 1 if a timer is armed or its poll has not been done yet */
+int
+poll_pending(poll_timer_t *p)
+{
+	int pending;
+
+	pthread_mutex_lock(&poll_mutex);
+	pending = p->inflight || p->prev != NULL;
+	pthread_mutex_unlock(&poll_mutex);
+	return pending;
+}
+
+/* A client changed the destination, poll it soon */
+void
+poll_activity(poll_timer_t *p)
+{
+	unsigned int ticks, lag;
+
+	pthread_mutex_lock(&poll_mutex);
+	if (p->active) {
+		p->interval = p->min_interval;
+		p->activity = 1;
+		if (p->prev != NULL) {
+			ticks = (p->slot + WHEEL_SIZE - current - 1)
+			    % WHEEL_SIZE + 1 + p->rounds * WHEEL_SIZE;
+			lag = behind();
+			if (ticks > lag
+			    && (ticks - lag) * TICK > p->min_interval) {
+				unlink_timer(p);
+				insert(p, p->min_interval);
+			}
+		}
+	}
+	pthread_mutex_unlock(&poll_mutex);
+}
+
+/* A poll has been executed, schedule the next one */
+void
+poll_done(poll_timer_t *p, int changed)
+{
+	pthread_mutex_lock(&poll_mutex);
+	p->inflight = 0;
+	if (changed || p->activity)
+		p->interval = p->min_interval;
+	else if ((p->interval *= 2) > p->max_interval)
+		p->interval = p->max_interval;
+	p->activity = 0;
+	if (p->active)
+		insert(p, p->interval);
+	pthread_mutex_unlock(&poll_mutex);
+}
+
+static void *
+poll_scheduler(void *arg)
+{
+	struct timespec deadline;
+	poll_timer_t *p, *n, *due;
+	unsigned int ticks;
+	int error;
+
+	if (pthread_detach(pthread_self())) {
+		syslog(LOG_ERR, "poll-scheduler: pthread_detach");
+		exit(1);
+	}
+
+	if (pthread_setname_np(pthread_self(), "poll-scheduler")) {
+		syslog(LOG_ERR, "poll-scheduler: pthread_setname_np");
+		exit(1);
+	}
+
+	pthread_mutex_lock(&poll_mutex);
+	for (;;) {
+		/* Sleep until there is something to poll */
+		while (armed == 0)
+			pthread_cond_wait(&poll_cond, &poll_mutex);
+
+		/* Until the first timer is due, an earlier one wakes us up */
+		waiting = first_due();
+		deadline = next;
+		advance(&deadline, waiting - 1);
+		error = pthread_cond_timedwait(&poll_cond, &poll_mutex,
+		    &deadline);
+		waiting = 0;
+		if (error != 0 && error != EINTR && error != ETIMEDOUT) {
+			syslog(LOG_ERR, "poll-scheduler: "
+			    "pthread_cond_timedwait");
+			exit(1);
+		}
+
+		/* Catch up on the ticks that passed while sleeping */
+		due = NULL;
+		for (ticks = behind(); ticks > 0; ticks--) {
+			current = (current + 1) % WHEEL_SIZE;
+			advance(&next, 1);
+			for (p = wheel[current]; p != NULL; p = n) {
+				n = p->next;
+				if (p->rounds > 0) {
+					p->rounds--;
+					continue;
+				}
+				unlink_timer(p);
+				p->inflight = 1;
+				p->next = due;
+				due = p;
+			}
+		}
+		if (due == NULL)
+			continue;
+
+		/* Submitting a poll never blocks, but don't hold the wheel */
+		pthread_mutex_unlock(&poll_mutex);
+		for (p = due; p != NULL; p = n) {
+			n = p->next;
+			p->poll(p);
+		}
+		pthread_mutex_lock(&poll_mutex);
+	}
+	return NULL;
+}
+
+void
+poll_scheduler_init(void)
+{
+	pthread_condattr_t attr;
+	pthread_t thread;
+
+	if (pthread_condattr_init(&attr)
+	    || pthread_condattr_setclock(&attr, CLOCK_MONOTONIC)
+	    || pthread_cond_init(&poll_cond, &attr)) {
+		syslog(LOG_ERR, "poll-scheduler: pthread_cond_init");
+		exit(1);
+	}
+	pthread_condattr_destroy(&attr);
+
+	if (pthread_create(&thread, NULL, poll_scheduler, NULL)) {
+		syslog(LOG_ERR, "poll-scheduler: pthread_create");
+		exit(1);
+	}
+}
+
+/* Defaults for a polled destination, see the polling section in trxd.yaml */
+void
+poll_timer_init(poll_timer_t *p, void (*poll)(poll_timer_t *), void *arg)
+{
+	p->next = NULL;
+	p->prev = NULL;
+	p->active = p->inflight = p->activity = 0;
+	p->min_interval = POLL_MIN_INTERVAL;
+	p->max_interval = POLL_MAX_INTERVAL;
+	p->interval = p->min_interval;
+	p->poll = poll;
+	p->arg = arg;
+}
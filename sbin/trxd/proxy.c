@@ -20,63 +20,353 @@
  * IN THE SOFTWARE.
  */
 
+/*
+ * Copy Lua values between Lua states.  A value is marshalled into a binary
+ * buffer in one pass and rebuilt in the other state.  A table that is
+ * reached more than once, e.g. through a YAML alias or a cycle, is sent once
+ * and referenced by its offset in the buffer, so the copy has the same shape.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
 #include <lua.h>
 #include <lualib.h>
 #include <lauxlib.h>
 
-void
-proxy_map(lua_State *L, lua_State *R, int t)
+#include "buffer.h"
+
+#define PROXY_MAX_DEPTH	64
+#define PROXY_SEEN	64	/* Initial size of the table of seen tables */
+
+/* Stack slots used per nesting level, see proxy_encode() and proxy_decode() */
+#define PROXY_STACK	(3 * PROXY_MAX_DEPTH + 8)
+
+enum proxy_tag {
+	P_NIL,
+	P_FALSE,
+	P_TRUE,
+	P_INTEGER,	/* lua_Integer */
+	P_NUMBER,	/* lua_Number */
+	P_STRING,	/* size_t length, bytes */
+	P_SHORT,	/* One byte length, bytes */
+	P_TABLE,	/* Array and hash size, key/value pairs, P_END */
+	P_SHARED,	/* A P_TABLE that is referenced later */
+	P_REF,		/* Offset of a P_SHARED table */
+	P_END
+};
+
+/* A table encoded so far and its offset */
+struct seen {
+	const void	*table;
+	size_t		 offset;
+};
+
+struct proxy {
+	lua_State	*L;
+	struct buffer	*b;
+	size_t		 base;	/* Offsets are relative to it */
+	struct seen	*seen;	/* Open addressing, a power of two */
+	size_t		 nseen;
+	size_t		 seensize;
+	int		 depth;
+	const char	*error;
+};
+
+static void
+put(struct buffer *b, const void *data, size_t len)
 {
-	int top, istable = 0;
-	char nam[64];
+	memcpy(buf_reserve(b, len), data, len);
+	b->size += len;
+}
+
+#define SEEN_HASH(t)	(((uintptr_t)(t) >> 4) * 2654435761U)
+
+/*
+ * Look up a table, it is added if it was not seen before.  Returns the
+ * entry, its table is NULL for a new one.
+ */
+static struct seen *
+seen(struct proxy *p, const void *t)
+{
+	struct seen *old, *e;
+	size_t n, i, mask;
 
-	luaL_checkstack(R, 32, "out of stack space");
-	switch (lua_type(L, -2)) {
+	if (2 * (p->nseen + 1) > p->seensize) {
+		old = p->seen;
+		n = p->seensize;
+		p->seensize = n ? 2 * n : PROXY_SEEN;
+		p->seen = calloc(p->seensize, sizeof(struct seen));
+		if (p->seen == NULL) {
+			syslog(LOG_ERR, "proxy: malloc");
+			exit(1);
+		}
+		mask = p->seensize - 1;
+		for (e = old; e < old + n; e++) {
+			if (e->table == NULL)
+				continue;
+			for (i = SEEN_HASH(e->table) & mask;
+			    p->seen[i].table != NULL; i = (i + 1) & mask)
+				;
+			p->seen[i] = *e;
+		}
+		free(old);
+	}
+
+	mask = p->seensize - 1;
+	for (i = SEEN_HASH(t) & mask; p->seen[i].table != NULL;
+	    i = (i + 1) & mask)
+		if (p->seen[i].table == t)
+			return &p->seen[i];
+	p->nseen++;
+	return &p->seen[i];
+}
+
+/* Encode the value on the top of the stack */
+static int
+encode(struct proxy *p)
+{
+	lua_State *L = p->L;
+	struct buffer *b = p->b;
+	lua_Integer i;
+	lua_Number n;
+	struct seen *e;
+	const char *s;
+	size_t len, pos;
+	uint32_t size[2];
+	int t;
+
+	switch (lua_type(L, -1)) {
+	case LUA_TNIL:
+		buf_addchar(b, P_NIL);
+		break;
+	case LUA_TBOOLEAN:
+		buf_addchar(b, lua_toboolean(L, -1) ? P_TRUE : P_FALSE);
+		break;
 	case LUA_TNUMBER:
-		lua_pushnumber(R, lua_tonumber(L, -2));
-		snprintf(nam, sizeof nam, "%d", (int)lua_tonumber(L, -2));
+		if (lua_isinteger(L, -1)) {
+			i = lua_tointeger(L, -1);
+			buf_addchar(b, P_INTEGER);
+			put(b, &i, sizeof(i));
+		} else {
+			n = lua_tonumber(L, -1);
+			buf_addchar(b, P_NUMBER);
+			put(b, &n, sizeof(n));
+		}
 		break;
 	case LUA_TSTRING:
-		snprintf(nam, sizeof nam, "%s", lua_tostring(L, -2));
-		lua_pushstring(R, lua_tostring(L, -2));
+		s = lua_tolstring(L, -1, &len);
+		if (len <= UINT8_MAX) {
+			buf_addchar(b, P_SHORT);
+			buf_addchar(b, len);
+		} else {
+			buf_addchar(b, P_STRING);
+			put(b, &len, sizeof(len));
+		}
+		put(b, s, len);
 		break;
 	case LUA_TTABLE:
-	case LUA_TNIL:
-		istable = 1;
+		/* A table seen before is a reference to the first copy */
+		e = seen(p, lua_topointer(L, -1));
+		if (e->table != NULL) {
+			b->data[p->base + e->offset] = P_SHARED;
+			buf_addchar(b, P_REF);
+			put(b, &e->offset, sizeof(e->offset));
+			break;
+		}
+
+		if (++p->depth > PROXY_MAX_DEPTH) {
+			p->error = "tables nested too deeply";
+			return -1;
+		}
+
+		pos = b->size;
+		e->table = lua_topointer(L, -1);
+		e->offset = pos - p->base;
+
+		/* The sizes are filled in once the pairs are counted */
+		buf_addchar(b, P_TABLE);
+		buf_reserve(b, sizeof(size));
+		b->size += sizeof(size);
+		size[0] = lua_rawlen(L, -1);
+		size[1] = 0;
+
+		t = lua_gettop(L);
+		lua_pushnil(L);
+		while (lua_next(L, t)) {
+			lua_pushvalue(L, -2);
+			if (encode(p))
+				return -1;
+			lua_pop(L, 1);
+			if (encode(p))
+				return -1;
+			lua_pop(L, 1);
+			size[1]++;
+		}
+		buf_addchar(b, P_END);
+
+		size[1] = size[1] > size[0] ? size[1] - size[0] : 0;
+		memcpy(b->data + pos + 1, size, sizeof(size));
+		p->depth--;
 		break;
 	default:
-		luaL_error(L, "proxy: data type '%s' is not "
-		    "supported as an index value", luaL_typename(L, -2));
-		return;
+		p->error = luaL_typename(L, -1);
+		return -1;
 	}
-	switch (lua_type(L, -1)) {
-	case LUA_TBOOLEAN:
-		lua_pushboolean(R, lua_toboolean(L, -1));
+	return 0;
+}
+
+/*
+ * Append the value at idx to b.  Returns -1 and sets error to what can not
+ * be copied, a type other than nil, boolean, number, string, and table, or
+ * tables nested too deeply.
+ */
+int
+proxy_encode(lua_State *L, int idx, struct buffer *b, const char **error)
+{
+	struct proxy p;
+	int top, rv;
+
+	if (!lua_checkstack(L, PROXY_STACK)) {
+		*error = "out of stack space";
+		return -1;
+	}
+	idx = lua_absindex(L, idx);
+	p.L = L;
+	p.b = b;
+	p.base = b->size;
+	p.seen = NULL;
+	p.nseen = p.seensize = 0;
+	p.depth = 0;
+	p.error = NULL;
+	top = lua_gettop(L);
+	lua_pushvalue(L, idx);
+	rv = encode(&p);
+	lua_settop(L, top);
+	free(p.seen);
+	if (rv)
+		*error = p.error;
+	return rv;
+}
+
+struct unproxy {
+	lua_State	*R;
+	const char	*data;
+	const char	*p;
+	int		 refs;	/* Shared tables by offset */
+	int		 shared;
+};
+
+static void
+get(struct unproxy *u, void *data, size_t len)
+{
+	memcpy(data, u->p, len);
+	u->p += len;
+}
+
+/* Push the next value */
+static void
+decode(struct unproxy *u)
+{
+	lua_State *R = u->R;
+	lua_Integer i;
+	lua_Number n;
+	size_t len, offset;
+	uint32_t size[2];
+	int tag;
+
+	tag = *u->p++;
+	switch (tag) {
+	case P_NIL:
+		lua_pushnil(R);
 		break;
-	case LUA_TNUMBER:
-		if (lua_isinteger(L, -1))
-			lua_pushinteger(R, lua_tointeger(L, -1));
-		else
-			lua_pushnumber(R, lua_tonumber(L, -1));
+	case P_FALSE:
+	case P_TRUE:
+		lua_pushboolean(R, tag == P_TRUE);
 		break;
-	case LUA_TSTRING:
-		lua_pushstring(R, lua_tostring(L, -1));
+	case P_INTEGER:
+		get(u, &i, sizeof(i));
+		lua_pushinteger(R, i);
 		break;
-	case LUA_TNIL:
-		lua_pushnil(R);
+	case P_NUMBER:
+		get(u, &n, sizeof(n));
+		lua_pushnumber(R, n);
 		break;
-	case LUA_TTABLE:
-		top = lua_gettop(L);
-		lua_newtable(R);
-		lua_pushnil(L);  /* first key */
-		while (lua_next(L, top) != 0) {
-			proxy_map(L, R, lua_gettop(R));
-			lua_pop(L, 1);
+	case P_STRING:
+	case P_SHORT:
+		if (tag == P_SHORT)
+			len = (unsigned char)*u->p++;
+		else
+			get(u, &len, sizeof(len));
+		lua_pushlstring(R, u->p, len);
+		u->p += len;
+		break;
+	case P_TABLE:
+	case P_SHARED:
+		offset = u->p - 1 - u->data;
+		get(u, size, sizeof(size));
+		lua_createtable(R, size[0], size[1]);
+		if (tag == P_SHARED) {
+			if (!u->shared) {
+				lua_newtable(R);
+				lua_replace(R, u->refs);
+				u->shared = 1;
+			}
+			lua_pushvalue(R, -1);
+			lua_rawseti(R, u->refs, offset);
 		}
+		while (*u->p != P_END) {
+			decode(u);
+			decode(u);
+			lua_rawset(R, -3);
+		}
+		u->p++;
 		break;
-	default:
-		printf("unknown type %s\n", nam);
+	case P_REF:
+		get(u, &offset, sizeof(offset));
+		lua_rawgeti(R, u->refs, offset);
+		break;
+	}
+}
+
+/* Push the value marshalled by proxy_encode() */
+void
+proxy_decode(lua_State *R, const char *data)
+{
+	struct unproxy u;
+
+	luaL_checkstack(R, PROXY_STACK, "out of stack space");
+	u.R = R;
+	u.data = u.p = data;
+	u.shared = 0;
+	lua_pushnil(R);		/* Room for the shared tables */
+	u.refs = lua_gettop(R);
+	decode(&u);
+	lua_remove(R, -2);
+}
+
+/*
+ * Copy the value at idx of L to the top of R.  Returns -1 and logs the
+ * reason if the value can not be copied, nothing is pushed then.
+ */
+int
+proxy_copy(lua_State *L, int idx, lua_State *R)
+{
+	struct buffer b;
+	const char *error;
+	int rv;
+
+	if (buf_init(&b)) {
+		syslog(LOG_ERR, "proxy: malloc");
+		exit(1);
 	}
-	if (!istable)
-		lua_settable(R, t);
+	rv = proxy_encode(L, idx, &b, &error);
+	if (rv)
+		syslog(LOG_ERR, "proxy: can't copy %s", error);
+	else
+		proxy_decode(R, b.data);
+	buf_free(&b);
+	return rv;
 }
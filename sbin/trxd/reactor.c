@@ -0,0 +1,414 @@
+/*
+ * Copyright (c) 2023 - 2026 Marc Balmer HB9SSB
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+
+/*
+ * Event-driven i/o for network clients:  A single reactor thread owns all
+ * client sockets, plain TCP/IP and WebSocket alike, and waits for them
+ * using epoll(7).  Complete requests are handed to the dispatcher pool,
+ * responses and status updates are queued by the senders and written when
+ * the socket becomes writable.
+ */
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include <openssl/ssl.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "trxd.h"
+
+#define MAXLISTEN	16
+#define MAXEVENTS	64
+
+extern sender_tag_t *sender_new(enum SenderType, int, SSL_CTX *, SSL *);
+extern void sender_ref(sender_tag_t *);
+extern void sender_unref(sender_tag_t *);
+extern int sender_flush(sender_tag_t *);
+extern int socket_input(sender_tag_t *);
+extern int websocket_input(sender_tag_t *);
+extern void dispatcher_detach(sender_tag_t *);
+
+extern int log_connections;
+extern int verbose;
+
+static int epfd = -1;
+static int wakeup_fd = -1;
+static int listen_fd[MAXLISTEN];
+static int nlisten;
+
+/*
+ * Senders with queued output, linked through flush_next, and senders whose
+ * throttled input is to be resumed, linked through resume_next.
+ */
+static pthread_mutex_t flush_mutex = PTHREAD_MUTEX_INITIALIZER;
+static sender_tag_t *flush_list;
+static sender_tag_t *resume_list;
+
+/* Senders closed during the current batch, linked through closed_next */
+static sender_tag_t *closed_list;
+
+void
+reactor_init(void)
+{
+	struct epoll_event ev;
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd == -1) {
+		syslog(LOG_ERR, "reactor: epoll_create1: %s", strerror(errno));
+		exit(1);
+	}
+
+	wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (wakeup_fd == -1) {
+		syslog(LOG_ERR, "reactor: eventfd: %s", strerror(errno));
+		exit(1);
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = &wakeup_fd;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, wakeup_fd, &ev)) {
+		syslog(LOG_ERR, "reactor: epoll_ctl: %s", strerror(errno));
+		exit(1);
+	}
+}
+
+/* Accept plain TCP/IP connections on a listening socket */
+void
+reactor_listen(int fd)
+{
+	struct epoll_event ev;
+
+	if (nlisten == MAXLISTEN) {
+		syslog(LOG_ERR, "reactor: too many listening sockets");
+		close(fd);
+		return;
+	}
+	listen_fd[nlisten] = fd;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = &listen_fd[nlisten];
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev)) {
+		syslog(LOG_ERR, "reactor: epoll_ctl: %s", strerror(errno));
+		exit(1);
+	}
+	nlisten++;
+}
+
+/* Hand a connected client over to the reactor */
+void
+reactor_attach(sender_tag_t *s)
+{
+	struct epoll_event ev;
+
+	if (fcntl(s->socket, F_SETFL, fcntl(s->socket, F_GETFL) | O_NONBLOCK))
+		syslog(LOG_ERR, "reactor: fcntl: %s", strerror(errno));
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLRDHUP;
+	ev.data.ptr = s;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, s->socket, &ev)) {
+		syslog(LOG_ERR, "reactor: epoll_ctl: %s", strerror(errno));
+		exit(1);
+	}
+}
+
+static void
+reactor_notify(void)
+{
+	uint64_t one = 1;
+
+	if (write(wakeup_fd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+		syslog(LOG_ERR, "reactor: write: %s", strerror(errno));
+}
+
+/* Ask the reactor to write the queued output of a sender */
+void
+reactor_flush(sender_tag_t *s)
+{
+	int wakeup;
+
+	sender_ref(s);
+
+	pthread_mutex_lock(&flush_mutex);
+	wakeup = flush_list == NULL && resume_list == NULL;
+	s->flush_next = flush_list;
+	flush_list = s;
+	pthread_mutex_unlock(&flush_mutex);
+
+	if (wakeup)
+		reactor_notify();
+}
+
+/*
+ * Ask the reactor to read the input of a throttled sender again, after
+ * the queued output has been written.
+ */
+void
+reactor_resume(sender_tag_t *s)
+{
+	int wakeup;
+
+	sender_ref(s);
+
+	pthread_mutex_lock(&flush_mutex);
+	if (s->resume) {
+		pthread_mutex_unlock(&flush_mutex);
+		sender_unref(s);
+		return;
+	}
+	s->resume = 1;
+	wakeup = flush_list == NULL && resume_list == NULL;
+	s->resume_next = resume_list;
+	resume_list = s;
+	pthread_mutex_unlock(&flush_mutex);
+
+	if (wakeup)
+		reactor_notify();
+}
+
+/* Wait for the events the sender is ready for */
+static void
+reactor_arm(sender_tag_t *s)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	if (!s->throttled)
+		ev.events = EPOLLIN | EPOLLRDHUP;
+	if (s->pollout)
+		ev.events |= EPOLLOUT;
+	ev.data.ptr = s;
+	if (epoll_ctl(epfd, EPOLL_CTL_MOD, s->socket, &ev))
+		syslog(LOG_ERR, "reactor: epoll_ctl: %s", strerror(errno));
+}
+
+static void
+reactor_close(sender_tag_t *s)
+{
+	if (pthread_mutex_lock(&s->mutex)) {
+		syslog(LOG_ERR, "reactor: pthread_mutex_lock");
+		exit(1);
+	}
+	s->closing = 1;
+	pthread_cond_broadcast(&s->room);	/* See sender_stream() */
+	pthread_mutex_unlock(&s->mutex);
+
+	epoll_ctl(epfd, EPOLL_CTL_DEL, s->socket, NULL);
+
+	if (s->ssl) {
+		SSL_shutdown(s->ssl);
+		SSL_free(s->ssl);
+		s->ssl = NULL;
+	}
+	close(s->socket);
+
+	if (verbose)
+		printf("reactor: connection closed\n");
+
+	/* Unsubscribe, the reference is dropped after this batch */
+	dispatcher_detach(s);
+	s->closed_next = closed_list;
+	closed_list = s;
+}
+
+static void
+reactor_write(sender_tag_t *s)
+{
+	int rv;
+
+	rv = sender_flush(s);
+	if (rv == -1 || (rv == 0 && s->close_after_flush)) {
+		reactor_close(s);
+		return;
+	}
+
+	if ((rv == 1) != s->pollout) {
+		s->pollout = rv == 1;
+		reactor_arm(s);
+	}
+}
+
+static void reactor_input(sender_tag_t *, uint32_t);
+
+static void
+reactor_wakeup(void)
+{
+	sender_tag_t *s, *next, *resume;
+	uint64_t n;
+
+	if (read(wakeup_fd, &n, sizeof(n)) == -1 && errno != EAGAIN)
+		syslog(LOG_ERR, "reactor: read: %s", strerror(errno));
+
+	pthread_mutex_lock(&flush_mutex);
+	resume = resume_list;
+	resume_list = NULL;
+	s = flush_list;
+	flush_list = NULL;
+	pthread_mutex_unlock(&flush_mutex);
+
+	for (; s != NULL; s = next) {
+		next = s->flush_next;
+		if (!s->closing)
+			reactor_write(s);
+		sender_unref(s);
+	}
+
+	/* The buffered input is handled first, it won't raise an event */
+	for (s = resume; s != NULL; s = next) {
+		pthread_mutex_lock(&flush_mutex);
+		next = s->resume_next;
+		s->resume = 0;
+		pthread_mutex_unlock(&flush_mutex);
+		if (!s->closing) {
+			s->throttled = 0;
+			reactor_arm(s);
+			reactor_input(s, EPOLLIN);
+		}
+		sender_unref(s);
+	}
+}
+
+static void
+reactor_accept(int fd)
+{
+	struct sockaddr_storage	 sa;
+	socklen_t		 len;
+	sender_tag_t		*s;
+	char			 hbuf[NI_MAXHOST];
+	int			 client_fd, error;
+
+	for (;;) {
+		memset(&sa, 0, sizeof(sa));
+		len = sizeof(sa);
+		client_fd = accept4(fd, (struct sockaddr *)&sa, &len,
+		    SOCK_CLOEXEC);
+		if (client_fd == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				syslog(LOG_ERR, "accept: %s", strerror(errno));
+			break;
+		}
+
+		if (log_connections) {
+			error = getnameinfo((struct sockaddr *)&sa, len,
+			    hbuf, sizeof(hbuf), NULL, 0, NI_NUMERICHOST);
+			if (error)
+				syslog(LOG_ERR, "getnameinfo: %s",
+				    gai_strerror(error));
+			else
+				syslog(LOG_INFO, "socket connection from %s",
+				    hbuf);
+		}
+
+		s = sender_new(SENDER_SOCKET, client_fd, NULL, NULL);
+		reactor_attach(s);
+	}
+}
+
+/*
+ * Handle the input of a sender.  A throttled sender is only waited for to
+ * write, unless the connection failed.
+ */
+static void
+reactor_input(sender_tag_t *s, uint32_t events)
+{
+	int rv;
+
+	if (s->throttled && (events & (EPOLLHUP | EPOLLERR))) {
+		reactor_close(s);
+		return;
+	}
+	if (!s->throttled
+	    && (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+		switch (s->type) {
+		case SENDER_SOCKET:
+			rv = socket_input(s);
+			break;
+		case SENDER_WEBSOCKET:
+			rv = websocket_input(s);
+			break;
+		default:
+			rv = -1;
+		}
+		if (rv == -1) {
+			reactor_close(s);
+			return;
+		}
+		if (s->throttled)
+			reactor_arm(s);
+	}
+	if (events & EPOLLOUT)
+		reactor_write(s);
+}
+
+/* The reactor loop, it runs as long as trxd runs */
+void
+reactor(void)
+{
+	struct epoll_event ev[MAXEVENTS];
+	sender_tag_t *s;
+	int i, n;
+
+	for (;;) {
+		n = epoll_wait(epfd, ev, MAXEVENTS, -1);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			syslog(LOG_ERR, "reactor: epoll_wait: %s",
+			    strerror(errno));
+			break;
+		}
+
+		for (i = 0; i < n; i++) {
+			if (ev[i].data.ptr == &wakeup_fd)
+				reactor_wakeup();
+			else if (ev[i].data.ptr >= (void *)listen_fd &&
+			    ev[i].data.ptr < (void *)&listen_fd[MAXLISTEN])
+				reactor_accept(*(int *)ev[i].data.ptr);
+			else {
+				s = ev[i].data.ptr;
+				if (!s->closing)
+					reactor_input(s, ev[i].events);
+			}
+		}
+
+		while ((s = closed_list) != NULL) {
+			closed_list = s->closed_next;
+			sender_unref(s);
+		}
+	}
+}
@@ -44,6 +44,11 @@
 
 extern int luaopen_trxd(lua_State *);
 extern int luaopen_json(lua_State *);
+extern const char *json_encode_value(lua_State *, int, size_t *);
+extern command_t *command_next(command_queue_t *);
+extern void command_done(command_queue_t *, command_t *, const char *,
+    size_t);
+extern void request_push(lua_State *, request_t *);
 
 extern trx_controller_tag_t *trx_controller_tag;
 extern int verbose;
@@ -63,18 +68,14 @@ cleanup_lua(void *arg)
 	lua_close(L);
 }
 
-static void *
-freeexternalstring(void *ud, void *ptr, size_t osize, size_t nsize)
-{
-	free(ptr);
-	return NULL;
-}
-
 void *
 relay_controller(void *arg)
 {
 	relay_controller_tag_t *t = (relay_controller_tag_t *)arg;
 	lua_State *L;
+	command_t *c;
+	const char *response;
+	size_t len;
 
 	if (pthread_detach(pthread_self())) {
 		syslog(LOG_ERR, "relay-controller: pthread_detach");
@@ -97,11 +98,6 @@ relay_controller(void *arg)
 		exit(1);
 	}
 
-	if (pthread_mutex_lock(&t->mutex2)) {
-		syslog(LOG_ERR, "relay-controller: pthread_mutex_lock");
-		exit(1);
-	}
-
 	/* Setup Lua */
 	L = luaL_newstate();
 	if (L == NULL) {
@@ -120,51 +116,43 @@ relay_controller(void *arg)
 
 	t->is_running = 1;
 
-	/*
-	 * We are ready to go, unlock the mutex, so that client-handlers,
-	 * relay-handlers, and, relay-pollers can access it.
-	 */
+	/* We are ready to go, unlock the mutex and execute commands */
 	if (pthread_mutex_unlock(&t->mutex)) {
 		syslog(LOG_ERR, "relay-controller: pthread_mutex_unlock");
 		exit(1);
 	}
 
 	for (;;) {
-		/* Wait on cond, this releases the mutex */
-		while (t->handler == NULL) {
-			if (pthread_cond_wait(&t->cond1, &t->mutex2)) {
-				syslog(LOG_ERR, "relay-controller: "
-				    "pthread_cond_wait");
-				exit(1);
+		c = command_next(&t->queue);
+		response = NULL;
+		len = 0;
+
+		lua_getglobal(L, c->handler);
+		if (lua_type(L, -1) == LUA_TFUNCTION) {
+			if (c->request != NULL)
+				request_push(L, c->request);
+			else
+				lua_pushnil(L);
+
+			switch (lua_pcall(L, 1, 1, 0)) {
+			case LUA_OK:
+				break;
+			case LUA_ERRRUN:
+			case LUA_ERRMEM:
+			case LUA_ERRERR:
+				syslog(LOG_ERR, "Lua error: %s",
+					lua_tostring(L, -1));
+				break;
 			}
+			if (lua_type(L, -1) == LUA_TSTRING)
+				response = lua_tolstring(L, -1, &len);
+			else if (lua_type(L, -1) == LUA_TTABLE)
+				response = json_encode_value(L, -1, &len);
 		}
 
-		lua_pushexternalstring(L, t->data, t->len, freeexternalstring,
-		    NULL);
-
-		switch (lua_pcall(L, 1, 1, 0)) {
-		case LUA_OK:
-			break;
-		case LUA_ERRRUN:
-		case LUA_ERRMEM:
-		case LUA_ERRERR:
-			syslog(LOG_ERR, "Lua error: %s",
-				lua_tostring(L, -1));
-			break;
-		}
-		if (lua_type(L, -1) == LUA_TSTRING)
-			t->response = (char *)lua_tostring(L, -1);
-		else
-			t->response = "";
-
-		lua_pop(L, 2);
-		t->handler = NULL;
-
-		if (pthread_cond_signal(&t->cond2)) {
-			syslog(LOG_ERR, "relay-controller: "
-			    "pthread_cond_signal");
-			exit(1);
-		}
+		/* The response is still on the Lua stack */
+		command_done(&t->queue, c, response, len);
+		lua_pop(L, 1);
 	}
 	pthread_cleanup_pop(0);
 	pthread_cleanup_pop(0);
@@ -36,6 +36,8 @@
 #include "trxd.h"
 #include "trx-control.h"
 
+extern void device_attached(const char *);
+
 extern int verbose;
 
 static void
@@ -45,6 +47,30 @@ cleanup(void *arg)
 		syslog(LOG_NOTICE, "sd-handler: terminating\n");
 }
 
+/* Devices that are attached again are reopened right away */
+static void
+attach(sd_device *device)
+{
+	const char *name;
+	char *links, *link, *last;
+
+	if (sd_device_get_devname(device, &name) >= 0)
+		device_attached(name);
+
+	/* The configuration can name the device by one of its symlinks */
+	if (sd_device_get_property_value(device, "DEVLINKS", &name) < 0)
+		return;
+	links = strdup(name);
+	if (links == NULL) {
+		syslog(LOG_ERR, "sd-event-handler: strdup");
+		exit(1);
+	}
+	for (link = strtok_r(links, " ", &last); link != NULL;
+	    link = strtok_r(NULL, " ", &last))
+		device_attached(link);
+	free(links);
+}
+
 static int
 device_monitor(sd_device_monitor *sddm, sd_device *device, void *arg)
 {
@@ -52,13 +78,16 @@ device_monitor(sd_device_monitor *sddm, sd_device *device, void *arg)
 	sd_device_action_t action;
 	const char *devname;
 
-	/* For the moment only output information in verbose mode */
+	if (sd_device_get_action(device, &action) >= 0
+	    && action == SD_DEVICE_ADD)
+		attach(device);
+
+	/* Output information in verbose mode */
 	if (!verbose)
 		return 0;
 
 	event = sd_device_monitor_get_event(sddm);
 
-	sd_device_get_action(device, &action);
 	switch (action) {
 	case SD_DEVICE_ADD:
 		printf("SD_DEVICE_ADD\n");
@@ -0,0 +1,729 @@
+/*
+ * Copyright (c) 2023 - 2026 Marc Balmer HB9SSB
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+
+/* Queue messages for networked clients, the reactor writes them */
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <openssl/ssl.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trxd.h"
+
+#define QUEUE_LENGTH	64	/* Default length of the output queue */
+#define WRITE_BATCH	32	/* Messages written with a single writev() */
+#define STREAM_STALL	10	/* Seconds a stream may wait for the client */
+
+#define QUEUE_AT(s, i)	((s)->queue[((s)->qhead + (i)) % (s)->qsize])
+
+extern message_t *message_new(const char *, size_t, int, const void *);
+extern void message_ref(message_t *);
+extern void message_unref(message_t *);
+extern const char *message_frame(message_t *, enum SenderType, enum Encoding,
+    size_t *);
+extern void reactor_flush(sender_tag_t *);
+
+extern int verbose;
+
+/* The id of the request this thread is responding to, see sender_send() */
+__thread const char *response_id;
+__thread size_t response_idlen;
+
+size_t queue_length = QUEUE_LENGTH;
+enum OverflowPolicy overflow_policy = OVERFLOW_COALESCE;
+
+/* Statistics over all clients */
+static unsigned long clients;
+static unsigned long total_dropped;
+static unsigned long total_coalesced;
+static unsigned long total_disconnected;
+static unsigned long first_responses;
+static unsigned long first_response_total;	/* us */
+static unsigned long first_response_max;	/* us */
+
+static const char *overflow_policies[] = {
+	"drop-oldest",
+	"coalesce",
+	"disconnect"
+};
+
+sender_tag_t *
+sender_new(enum SenderType type, int fd, SSL_CTX *ctx, SSL *ssl)
+{
+	pthread_condattr_t attr;
+	sender_tag_t *s;
+
+	s = calloc(1, sizeof(sender_tag_t));
+	if (s == NULL) {
+		syslog(LOG_ERR, "sender: malloc");
+		exit(1);
+	}
+
+	s->qsize = queue_length;
+	s->queue = calloc(s->qsize, sizeof(message_t *));
+	if (s->queue == NULL) {
+		syslog(LOG_ERR, "sender: malloc");
+		exit(1);
+	}
+
+	if (pthread_mutex_init(&s->mutex, NULL)
+	    || pthread_mutex_init(&s->private_mutex, NULL)) {
+		syslog(LOG_ERR, "sender: pthread_mutex_init");
+		exit(1);
+	}
+	if (pthread_condattr_init(&attr)
+	    || pthread_condattr_setclock(&attr, CLOCK_MONOTONIC)
+	    || pthread_cond_init(&s->room, &attr)) {
+		syslog(LOG_ERR, "sender: pthread_cond_init");
+		exit(1);
+	}
+	pthread_condattr_destroy(&attr);
+
+	s->refcnt = 1;
+	s->type = type;
+	s->socket = fd;
+	s->ctx = ctx;
+	s->ssl = ssl;
+	s->requests_tail = &s->requests;
+	clock_gettime(CLOCK_MONOTONIC, &s->connected);
+
+	__atomic_add_fetch(&clients, 1, __ATOMIC_RELAXED);
+	return s;
+}
+
+void
+sender_ref(sender_tag_t *s)
+{
+	__atomic_add_fetch(&s->refcnt, 1, __ATOMIC_RELAXED);
+}
+
+void
+sender_unref(sender_tag_t *s)
+{
+	if (__atomic_sub_fetch(&s->refcnt, 1, __ATOMIC_ACQ_REL) > 0)
+		return;
+
+	while (s->qlen > 0) {
+		message_unref(QUEUE_AT(s, 0));
+		s->qhead = (s->qhead + 1) % s->qsize;
+		s->qlen--;
+	}
+	free(s->queue);
+	free(s->inbuf);
+	pthread_cond_destroy(&s->room);
+	pthread_mutex_destroy(&s->private_mutex);
+	pthread_mutex_destroy(&s->mutex);
+	free(s);
+
+	__atomic_sub_fetch(&clients, 1, __ATOMIC_RELAXED);
+}
+
+/* Remove a queued message, the sender must be locked */
+static void
+queue_remove(sender_tag_t *s, size_t n)
+{
+	if (n < s->qstream)
+		s->qstream--;
+	message_unref(QUEUE_AT(s, n));
+	for (; n + 1 < s->qlen; n++)
+		QUEUE_AT(s, n) = QUEUE_AT(s, n + 1);
+	s->qlen--;
+}
+
+/* Insert a message into a queue that is not full */
+static void
+queue_insert(sender_tag_t *s, size_t n, message_t *m)
+{
+	size_t i;
+
+	for (i = s->qlen; i > n; i--)
+		QUEUE_AT(s, i) = QUEUE_AT(s, i - 1);
+	QUEUE_AT(s, n) = m;
+	s->qlen++;
+	if (s->qlen > s->maxdepth)
+		s->maxdepth = s->qlen;
+}
+
+/*
+ * Have the reactor disconnect the client, the sender must be locked.
+ * Returns 1 if the reactor must be woken up.
+ */
+static int
+queue_disconnect(sender_tag_t *s)
+{
+	s->overflow = 1;
+	__atomic_add_fetch(&total_disconnected, 1, __ATOMIC_RELAXED);
+	pthread_cond_broadcast(&s->room);
+	if (s->flush_pending)
+		return 0;
+	s->flush_pending = 1;
+	return 1;
+}
+
+/*
+ * Make room for a message in a full queue according to the overflow
+ * policy.  Returns 0 if there is room for the message and -1 if the client
+ * must be disconnected.  A status update replaces an older one from the
+ * same source, which is removed so that the update is queued after the
+ * responses queued since.  A message that is partially written is never
+ * touched.
+ */
+static int
+queue_overflow(sender_tag_t *s, message_t *m)
+{
+	message_t *q;
+	size_t n, first;
+
+	first = s->qoff > 0 ? 1 : 0;
+
+	switch (overflow_policy) {
+	case OVERFLOW_COALESCE:
+		if (m->flags & MSG_UPDATE) {
+			for (n = s->qlen; n > first; n--) {
+				q = QUEUE_AT(s, n - 1);
+				if ((q->flags & MSG_UPDATE)
+				    && q->source == m->source) {
+					queue_remove(s, n - 1);
+					s->coalesced++;
+					__atomic_add_fetch(&total_coalesced, 1,
+					    __ATOMIC_RELAXED);
+					return 0;
+				}
+			}
+		}
+		/* FALLTHROUGH */
+	case OVERFLOW_DROP_OLDEST:
+		/* Responses are never dropped */
+		for (n = first; n < s->qlen; n++) {
+			if (QUEUE_AT(s, n)->flags & MSG_UPDATE) {
+				queue_remove(s, n);
+				s->dropped++;
+				__atomic_add_fetch(&total_dropped, 1,
+				    __ATOMIC_RELAXED);
+				return 0;
+			}
+		}
+		return -1;
+	case OVERFLOW_DISCONNECT:
+	default:
+		return -1;
+	}
+}
+
+/* Queue a message, the caller's reference is passed to the queue */
+static void
+sender_queue(sender_tag_t *s, message_t *m)
+{
+	int wakeup = 0;
+
+	if (pthread_mutex_lock(&s->mutex)) {
+		syslog(LOG_ERR, "sender: pthread_mutex_lock");
+		exit(1);
+	}
+
+	if (s->closing || s->overflow) {
+		pthread_mutex_unlock(&s->mutex);
+		message_unref(m);
+		return;
+	}
+
+	if (s->qlen == s->qsize && queue_overflow(s, m) == -1) {
+		/* The reactor disconnects the client */
+		wakeup = queue_disconnect(s);
+		pthread_mutex_unlock(&s->mutex);
+		message_unref(m);
+		syslog(LOG_NOTICE, "sender: output queue full, "
+		    "disconnecting client");
+		if (wakeup)
+			reactor_flush(s);
+		return;
+	}
+
+	queue_insert(s, s->qlen, m);
+
+	/* A blocked socket is written when it becomes writable again */
+	if (!s->flush_pending && !s->want_write) {
+		s->flush_pending = 1;
+		wakeup = 1;
+	}
+
+	if (pthread_mutex_unlock(&s->mutex)) {
+		syslog(LOG_ERR, "sender: pthread_mutex_unlock");
+		exit(1);
+	}
+
+	if (wakeup)
+		reactor_flush(s);
+}
+
+/* Account the time from connecting to the first response */
+static void
+first_response(sender_tag_t *s)
+{
+	struct timespec now;
+	unsigned long us, max;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	us = (now.tv_sec - s->connected.tv_sec) * 1000000UL
+	    + (now.tv_nsec - s->connected.tv_nsec) / 1000L;
+	if (us == 0)
+		us = 1;
+
+	/* Concurrent requests of the client may race for it */
+	max = 0;
+	if (!__atomic_compare_exchange_n(&s->first_response, &max, us, 0,
+	    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		return;
+
+	__atomic_add_fetch(&first_responses, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&first_response_total, us, __ATOMIC_RELAXED);
+	max = __atomic_load_n(&first_response_max, __ATOMIC_RELAXED);
+	while (us > max && !__atomic_compare_exchange_n(&first_response_max,
+	    &max, us, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+/*
+ * Create a response.  If the request had an id, it is inserted as the
+ * first member of the response, which must be a JSON object.
+ */
+static message_t *
+response_new(const char *data, size_t len, int flags)
+{
+	message_t *m;
+	char *p;
+
+	if (response_id == NULL || len < 2 || *data != '{')
+		return message_new(data, len, flags, NULL);
+
+	m = message_new(NULL, len + response_idlen + 6, flags, NULL);
+	p = m->data;
+	memcpy(p, "{\"id\":", 6);
+	p += 6;
+	memcpy(p, response_id, response_idlen);
+	p += response_idlen;
+
+	/* Skip the opening brace and any white space after it */
+	for (data++, len--; len > 0 && (*data == ' ' || *data == '\t' ||
+	    *data == '\r' || *data == '\n'); data++, len--)
+		;
+	if (len > 0 && *data != '}')
+		*p++ = ',';
+	memcpy(p, data, len);
+	m->len = p + len - m->data;
+	m->data[m->len] = '\n';
+	return m;
+}
+
+/* Queue a response */
+void
+sender_send(sender_tag_t *s, const char *data, size_t len)
+{
+	if (verbose)
+		printf("sender: -> %.*s\n", (int)len, data);
+
+	if (__atomic_load_n(&s->first_response, __ATOMIC_RELAXED) == 0)
+		first_response(s);
+
+	sender_queue(s, response_new(data, len, 0));
+}
+
+/*
+ * Acknowledge a change of the encoding.  The acknowledgement is sent in
+ * the current encoding, the messages after it in the new one.
+ */
+void
+sender_set_encoding(sender_tag_t *s, enum Encoding encoding,
+    const char *data, size_t len)
+{
+	if (verbose)
+		printf("sender: -> %.*s\n", (int)len, data);
+
+	if (__atomic_load_n(&s->first_response, __ATOMIC_RELAXED) == 0)
+		first_response(s);
+
+	__atomic_store_n(&s->next_encoding, encoding, __ATOMIC_RELAXED);
+	sender_queue(s, response_new(data, len, MSG_SWITCH));
+}
+
+/* The client read part of a stream, the sender must be locked */
+static void
+stream_progress(sender_tag_t *s)
+{
+	clock_gettime(CLOCK_MONOTONIC, &s->stream_deadline);
+	s->stream_deadline.tv_sec += STREAM_STALL;
+}
+
+/*
+ * Wait until a stream can queue a chunk, the sender must be locked.  A
+ * stream in progress keeps at most half of the queue filled, a new stream
+ * waits for the one in progress.  Both wait as long as the client reads
+ * the stream in progress, the deadline is pushed back whenever a part of
+ * it has been written.  Returns -1 if the client went away or does not
+ * read its output for STREAM_STALL seconds.
+ */
+static int
+stream_wait(sender_tag_t *s, int mine, int *wakeup)
+{
+	struct timespec ts;
+
+	while (!s->closing && !s->overflow
+	    && (mine ? s->qstream >= s->qsize / 2 : s->streaming)) {
+		ts = s->stream_deadline;
+		if (pthread_cond_timedwait(&s->room, &s->mutex, &ts)
+		    == ETIMEDOUT && s->stream_deadline.tv_sec == ts.tv_sec
+		    && s->stream_deadline.tv_nsec == ts.tv_nsec) {
+			syslog(LOG_NOTICE, "sender: output stalled, "
+			    "disconnecting client");
+			*wakeup = queue_disconnect(s);
+		}
+	}
+	return s->closing || s->overflow ? -1 : 0;
+}
+
+/*
+ * Queue a chunk of a response that is streamed while it is being encoded,
+ * final is set for the last one.  The chunks are fragments of one frame
+ * for WebSocket clients and of one line for socket clients, other messages
+ * are sent after the stream has ended.  A response that consists of a
+ * single chunk is sent as usual.  Returns -1 if the stream has to be
+ * aborted, the client is disconnected then since the response it got is
+ * incomplete.
+ */
+int
+sender_stream(sender_tag_t *s, const char *data, size_t len, int final)
+{
+	message_t *m;
+	int mine, wakeup = 0, rv = 0;
+
+	if (pthread_mutex_lock(&s->mutex)) {
+		syslog(LOG_ERR, "sender: pthread_mutex_lock");
+		exit(1);
+	}
+	mine = s->streaming && pthread_equal(s->streamer, pthread_self());
+	pthread_mutex_unlock(&s->mutex);
+
+	if (!mine && final) {
+		sender_send(s, data, len);
+		return 0;
+	}
+
+	if (verbose)
+		printf("sender: -> %.*s\n", (int)len, data);
+
+	if (mine)
+		m = message_new(data, len, final ? MSG_CONTINUED
+		    : MSG_CONTINUED | MSG_PARTIAL, NULL);
+	else {
+		if (__atomic_load_n(&s->first_response, __ATOMIC_RELAXED)
+		    == 0)
+			first_response(s);
+		m = response_new(data, len, MSG_PARTIAL);
+	}
+
+	if (pthread_mutex_lock(&s->mutex)) {
+		syslog(LOG_ERR, "sender: pthread_mutex_lock");
+		exit(1);
+	}
+
+	if (stream_wait(s, mine, &wakeup)) {
+		message_unref(m);
+		rv = -1;
+		final = 1;
+	} else {
+		if (!mine) {
+			s->streaming = 1;
+			s->streamer = pthread_self();
+			s->qstream = s->qlen;
+			stream_progress(s);
+			mine = 1;
+		}
+
+		/* Like any response, a chunk makes room in a full queue */
+		if (s->qlen == s->qsize && queue_overflow(s, m) == -1) {
+			syslog(LOG_NOTICE, "sender: output queue full, "
+			    "disconnecting client");
+			wakeup = queue_disconnect(s);
+			message_unref(m);
+			rv = -1;
+			final = 1;
+		} else {
+			queue_insert(s, s->qstream, m);
+			s->qstream++;
+			if (!s->flush_pending && !s->want_write) {
+				s->flush_pending = 1;
+				wakeup = 1;
+			}
+		}
+	}
+
+	if (final && mine) {
+		s->streaming = 0;
+		s->qstream = 0;
+		pthread_cond_broadcast(&s->room);
+	}
+
+	if (pthread_mutex_unlock(&s->mutex)) {
+		syslog(LOG_ERR, "sender: pthread_mutex_unlock");
+		exit(1);
+	}
+
+	if (wakeup)
+		reactor_flush(s);
+	return rv;
+}
+
+/*
+ * End a stream that could not be encoded completely.  Returns 1 if the
+ * client got part of it already and is disconnected, 0 if there was no
+ * stream and the caller can still respond.
+ */
+int
+sender_stream_abort(sender_tag_t *s)
+{
+	int wakeup = 0, rv = 0;
+
+	if (pthread_mutex_lock(&s->mutex)) {
+		syslog(LOG_ERR, "sender: pthread_mutex_lock");
+		exit(1);
+	}
+	if (s->streaming && pthread_equal(s->streamer, pthread_self())) {
+		if (!s->overflow && !s->closing)
+			wakeup = queue_disconnect(s);
+		s->streaming = 0;
+		s->qstream = 0;
+		pthread_cond_broadcast(&s->room);
+		rv = 1;
+	}
+	pthread_mutex_unlock(&s->mutex);
+
+	if (wakeup)
+		reactor_flush(s);
+	return rv;
+}
+
+/* Queue a message that is shared by several clients */
+void
+sender_send_message(sender_tag_t *s, message_t *m)
+{
+	message_ref(m);
+	sender_queue(s, m);
+}
+
+/* Queue data that is already framed, e.g. WebSocket control frames */
+void
+sender_send_frame(sender_tag_t *s, const void *frame, size_t len)
+{
+	sender_queue(s, message_new(frame, len, MSG_FRAMED, NULL));
+}
+
+static ssize_t
+sender_write(sender_tag_t *s, struct iovec *iov, int niov)
+{
+	ssize_t n, total;
+	int i;
+
+	if (s->ssl == NULL) {
+		do
+			n = writev(s->socket, iov, niov);
+		while (n == -1 && errno == EINTR);
+		return n;
+	}
+
+	for (total = 0, i = 0; i < niov; i++) {
+		if (iov[i].iov_len == 0)
+			continue;
+		n = SSL_write(s->ssl, iov[i].iov_base, iov[i].iov_len);
+		if (n <= 0) {
+			if (total > 0)
+				break;
+			switch (SSL_get_error(s->ssl, n)) {
+			case SSL_ERROR_WANT_READ:
+			case SSL_ERROR_WANT_WRITE:
+				errno = EAGAIN;
+				break;
+			default:
+				errno = EIO;
+			}
+			return -1;
+		}
+		total += n;
+		if ((size_t)n < iov[i].iov_len)
+			break;
+	}
+	return total;
+}
+
+/*
+ * Write queued messages until the socket would block.  Only called by the
+ * reactor.  Returns 1 if messages remain queued, 0 if the queue is empty,
+ * and -1 if the client is to be disconnected.
+ */
+int
+sender_flush(sender_tag_t *s)
+{
+	struct iovec iov[WRITE_BATCH];
+	size_t len, avail;
+	ssize_t n;
+	int niov, i, rv = 0, progress = 0;
+
+	if (pthread_mutex_lock(&s->mutex)) {
+		syslog(LOG_ERR, "sender: pthread_mutex_lock");
+		exit(1);
+	}
+
+	s->flush_pending = 0;
+
+	if (s->overflow)
+		rv = -1;
+
+	while (rv == 0 && s->qlen > 0) {
+		/* Messages queued during a stream wait until it has ended */
+		avail = s->streaming ? s->qstream : s->qlen;
+		if (avail == 0)
+			break;
+
+		/* A change of the encoding ends the batch */
+		for (niov = 0; niov < WRITE_BATCH && niov < avail; niov++) {
+			iov[niov].iov_base = (void *)message_frame(
+			    QUEUE_AT(s, niov), s->type, s->encoding, &len);
+			iov[niov].iov_len = len;
+			if (QUEUE_AT(s, niov)->flags & MSG_SWITCH) {
+				niov++;
+				break;
+			}
+		}
+
+		/* Skip what has already been written */
+		iov[0].iov_base = (char *)iov[0].iov_base + s->qoff;
+		iov[0].iov_len -= s->qoff;
+
+		n = sender_write(s, iov, niov);
+		if (n == -1) {
+			rv = errno == EAGAIN || errno == EWOULDBLOCK ? 1 : -1;
+			break;
+		}
+
+		/* Remove the messages that have been written completely */
+		for (i = 0; i < niov && n > 0; i++) {
+			if ((size_t)n < iov[i].iov_len) {
+				s->qoff += n;
+				break;
+			}
+			n -= iov[i].iov_len;
+			s->qoff = 0;
+			if (QUEUE_AT(s, 0)->flags & MSG_SWITCH)
+				s->encoding = __atomic_load_n(
+				    &s->next_encoding, __ATOMIC_RELAXED);
+			message_unref(QUEUE_AT(s, 0));
+			s->qhead = (s->qhead + 1) % s->qsize;
+			s->qlen--;
+			s->sent++;
+			if (s->streaming) {
+				s->qstream--;
+				progress = 1;
+			}
+		}
+	}
+	s->want_write = rv == 1;
+	if (progress) {
+		stream_progress(s);
+		pthread_cond_broadcast(&s->room);
+	}
+
+	if (pthread_mutex_unlock(&s->mutex)) {
+		syslog(LOG_ERR, "sender: pthread_mutex_unlock");
+		exit(1);
+	}
+	return rv;
+}
+
+/* Queue the output queue statistics of a client */
+void
+sender_queue_status(sender_tag_t *s)
+{
+	char status[512];
+	size_t depth, maxdepth;
+	unsigned long sent, dropped, coalesced, n;
+	int len;
+
+	if (pthread_mutex_lock(&s->mutex)) {
+		syslog(LOG_ERR, "sender: pthread_mutex_lock");
+		exit(1);
+	}
+	depth = s->qlen;
+	maxdepth = s->maxdepth;
+	sent = s->sent;
+	dropped = s->dropped;
+	coalesced = s->coalesced;
+	pthread_mutex_unlock(&s->mutex);
+
+	if (__atomic_load_n(&s->first_response, __ATOMIC_RELAXED) == 0)
+		first_response(s);
+	n = __atomic_load_n(&first_responses, __ATOMIC_RELAXED);
+
+	/* Times are in microseconds */
+	len = snprintf(status, sizeof(status),
+	    "{\"status\":\"Ok\",\"response\":\"queue-status\","
+	    "\"queueLength\":%zu,\"overflow\":\"%s\",\"depth\":%zu,"
+	    "\"maxDepth\":%zu,\"sent\":%lu,\"dropped\":%lu,\"coalesced\":%lu,"
+	    "\"firstResponse\":%lu,"
+	    "\"total\":{\"clients\":%lu,\"dropped\":%lu,\"coalesced\":%lu,"
+	    "\"disconnected\":%lu,\"firstResponseAvg\":%lu,"
+	    "\"firstResponseMax\":%lu}}",
+	    s->qsize, overflow_policies[overflow_policy], depth, maxdepth,
+	    sent, dropped, coalesced,
+	    __atomic_load_n(&s->first_response, __ATOMIC_RELAXED),
+	    __atomic_load_n(&clients, __ATOMIC_RELAXED),
+	    __atomic_load_n(&total_dropped, __ATOMIC_RELAXED),
+	    __atomic_load_n(&total_coalesced, __ATOMIC_RELAXED),
+	    __atomic_load_n(&total_disconnected, __ATOMIC_RELAXED),
+	    n ? __atomic_load_n(&first_response_total, __ATOMIC_RELAXED) / n
+	    : 0, __atomic_load_n(&first_response_max, __ATOMIC_RELAXED));
+	sender_send(s, status, len);
+}
+
+/* Set the overflow policy by name, returns -1 if the name is unknown */
+int
+sender_overflow_policy(const char *name)
+{
+	size_t n;
+
+	for (n = 0; n < sizeof(overflow_policies) /
+	    sizeof(overflow_policies[0]); n++) {
+		if (!strcmp(name, overflow_policies[n])) {
+			overflow_policy = n;
+			return 0;
+		}
+	}
+	return -1;
+}
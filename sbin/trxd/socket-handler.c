@@ -20,10 +20,12 @@
  * IN THE SOFTWARE.
  */
 
-/* Handle network clients over TCP/IP sockets */
 
-#include <pthread.h>
-#include <sched.h>
+/* Handle input from network clients over TCP/IP sockets */
+
+#include <sys/socket.h>
+
+#include <errno.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -31,187 +33,97 @@
 #include <unistd.h>
 
 #include "trxd.h"
-#include "trx-control.h"
-
-extern void *socket_sender(void *);
-extern void *dispatcher(void *);
-
-extern trx_controller_tag_t *trx_controller_tag;
-extern int verbose;
-
-static void
-cleanup(void *arg)
-{
-	int fd = *(int *)arg;
-	close(fd);
-}
 
-static void
-cleanup_sender(void *arg)
-{
-	sender_tag_t *s = (sender_tag_t *)arg;
-
-	pthread_cancel(s->sender);
-}
+#define INPUT_SIZE	1024
+#define INPUT_MAX	(MAX_REQUEST + 16)	/* A request and its framing */
 
-static void
-cleanup_dispatcher(void *arg)
-{
-	dispatcher_tag_t *d = (dispatcher_tag_t *)arg;
+extern int dispatcher_submit(sender_tag_t *, char *, size_t);
+extern void reactor_resume(sender_tag_t *);
 
-	pthread_cancel(d->dispatcher);
-}
+extern int verbose;
 
-void *
-socket_handler(void *arg)
+/*
+ * Read all data available on a socket and dispatch each complete,
+ * newline terminated, line.  Called by the reactor when the socket is
+ * readable.  When the client has too many requests queued, the input is
+ * throttled, the remaining lines stay in the buffer until the reactor
+ * resumes it.  Returns -1 when the connection is closed or a line is
+ * longer than MAX_REQUEST.
+ */
+int
+socket_input(sender_tag_t *s)
 {
-	sender_tag_t *s;
-	dispatcher_tag_t *d;
-	int fd = *(int *)arg;
-	char *buf;
-
-	if (pthread_detach(pthread_self())) {
-		syslog(LOG_ERR, "socket-handler: pthread_detach");
-		exit(1);
-	}
-
-	pthread_cleanup_push(cleanup, arg);
-
-	if (pthread_setname_np(pthread_self(), "socket")) {
-		syslog(LOG_ERR, "socket-handler: pthread_setname_np");
-		exit(1);
-	}
-
-	/* Create a socket-sender thread to send data to the client */
-	s = malloc(sizeof(sender_tag_t));
-	if (s == NULL) {
-		syslog(LOG_ERR, "socket-handler: malloc");
-		exit(1);
-	}
-	s->data = (char *)1;
-	s->socket = fd;
-
-	if (pthread_mutex_init(&s->mutex, NULL)) {
-		syslog(LOG_ERR, "socket-handler: pthread_mutex_init");
-		exit(1);
-	}
-
-	if (pthread_mutex_init(&s->mutex2, NULL)) {
-		syslog(LOG_ERR, "socket-handler: pthread_mutex_init");
-		exit(1);
-	}
-
-	if (pthread_cond_init(&s->cond, NULL)) {
-		syslog(LOG_ERR, "socket-handler: pthread_cond_init");
-		exit(1);
-	}
-
-	if (pthread_cond_init(&s->cond2, NULL)) {
-		syslog(LOG_ERR, "socket-handler: pthread_cond_init");
-		exit(1);
-	}
-
-	if (pthread_create(&s->sender, NULL, socket_sender, s)) {
-		syslog(LOG_ERR, "socket-handler: pthread_create");
-		exit(1);
-	}
+	char *p, *eol, *buf;
+	ssize_t n;
+	size_t len;
+	int eof = 0, submitted = 0;
 
-	pthread_cleanup_push(cleanup_sender, s);
-
-	/* Create a dispatcher thread to dispatch incoming data */
-	d = malloc(sizeof(dispatcher_tag_t));
-	if (d == NULL) {
-		syslog(LOG_ERR, "socket-handler: malloc");
-		exit(1);
-	}
-	d->data = (char *)1;
-	d->sender = s;
-
-	if (pthread_mutex_init(&d->mutex, NULL)) {
-		syslog(LOG_ERR, "socket-handler: pthread_mutex_init");
-		exit(1);
-	}
-
-	if (pthread_mutex_init(&d->mutex2, NULL)) {
-		syslog(LOG_ERR, "socket-handler: pthread_mutex_init");
-		exit(1);
-	}
-
-	if (pthread_cond_init(&d->cond, NULL)) {
-		syslog(LOG_ERR, "socket-handler: pthread_cond_init");
-		exit(1);
-	}
-
-	if (pthread_cond_init(&d->cond2, NULL)) {
-		syslog(LOG_ERR, "socket-handler: pthread_cond_init");
-		exit(1);
-	}
-
-	if (pthread_create(&d->dispatcher, NULL, dispatcher, d)) {
-		syslog(LOG_ERR, "socket-handler: pthread_create");
-		exit(1);
-	}
-
-	pthread_cleanup_push(cleanup_dispatcher, d);
-
-	if (pthread_mutex_lock(&d->mutex2)) {
-		syslog(LOG_ERR, "socket-handler: pthread_mutex_lock");
-		exit(1);
-	}
-
-	if (verbose)
-		printf("socket-handler: wait for dispatcher\n");
-
-	while (d->data != NULL)
-		if (pthread_cond_wait(&d->cond2, &d->mutex2)) {
-			syslog(LOG_ERR, "socket-handler: pthread_cond_wait");
-			exit(1);
+	for (;;) {
+		if (s->insize - s->inlen < INPUT_SIZE
+		    && s->insize < INPUT_MAX) {
+			s->insize = s->insize ? s->insize * 2 : INPUT_SIZE;
+			if (s->insize > INPUT_MAX)
+				s->insize = INPUT_MAX;
+			s->inbuf = realloc(s->inbuf, s->insize);
+			if (s->inbuf == NULL) {
+				syslog(LOG_ERR, "socket-handler: realloc");
+				exit(1);
+			}
 		}
-
-	if (pthread_mutex_lock(&s->mutex2)) {
-		syslog(LOG_ERR, "socket-handler: pthread_mutex_lock");
-		exit(1);
+		/* The rest is read on the next event */
+		if (s->inlen == s->insize)
+			break;
+
+		n = recv(s->socket, s->inbuf + s->inlen, s->insize - s->inlen,
+		    0);
+		if (n == 0) {
+			eof = 1;
+			break;
+		} else if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				eof = 1;
+			break;
+		}
+		s->inlen += n;
 	}
 
-	if (verbose)
-		printf("socket-handler: wait for sender\n");
+	/* At the end of the input, everything that was sent is dispatched */
+	for (p = s->inbuf; (eof || !s->throttled)
+	    && (eol = memchr(p, '\n', s->inbuf + s->inlen - p));
+	    p = eol + 1) {
+		len = eol - p;
 
-	while (s->data != NULL)
-		if (pthread_cond_wait(&s->cond2, &s->mutex2)) {
-			syslog(LOG_ERR, "socket-handler: pthread_cond_wait");
+		/* buf will later be freed by the dispatcher */
+		buf = malloc(len + 1);
+		if (buf == NULL) {
+			syslog(LOG_ERR, "socket-handler: malloc");
 			exit(1);
 		}
+		memcpy(buf, p, len);
+		buf[len] = '\0';
 
-	if (verbose)
-		printf("socket-handler: sender is ready\n");
-
-	for (;;) {
-		/* buf will later be freed by the dispatcher */
-		buf = trxd_readln(fd);
-
-		if (buf == NULL)
-			pthread_exit(NULL);
-		else if (verbose)
+		if (verbose)
 			printf("socket-handler: <- %s\n", buf);
 
-		d->data = buf;
-		d->len = strlen(buf);
-
-		if (pthread_cond_signal(&d->cond)) {
-			syslog(LOG_ERR, "socket-handler: pthread_cond_signal");
-			exit(1);
+		if (dispatcher_submit(s, buf, len))
+			s->throttled = 1;
+		else if (++submitted == MAX_QUEUED) {
+			/* Let the reactor write the responses first */
+			s->throttled = 1;
+			reactor_resume(s);
 		}
+	}
 
-		while (d->data != NULL)
-			if (pthread_cond_wait(&d->cond2, &d->mutex2)) {
-				syslog(LOG_ERR, "socket-handler: "
-				    "pthread_cond_wait");
-			exit(1);
-		}
+	s->inlen -= p - s->inbuf;
+	if (s->inlen > 0)
+		memmove(s->inbuf, p, s->inlen);
+
+	if (!s->throttled && s->inlen > MAX_REQUEST) {
+		syslog(LOG_NOTICE, "socket-handler: request too long");
+		return -1;
 	}
-	pthread_cleanup_pop(0);
-	pthread_cleanup_pop(0);
-	pthread_cleanup_pop(0);
 
-	return NULL;
+	return eof ? -1 : 0;
 }
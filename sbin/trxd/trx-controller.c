@@ -24,7 +24,6 @@
 
 #include <sys/ioctl.h>
 #include <sys/stat.h>
-#include <sys/socket.h>
 
 #include <errno.h>
 #include <fcntl.h>
@@ -37,9 +36,6 @@
 #include <termios.h>
 #include <unistd.h>
 
-#include <bluetooth/bluetooth.h>
-#include <bluetooth/rfcomm.h>
-
 #include <lua.h>
 #include <lualib.h>
 #include <lauxlib.h>
@@ -51,13 +47,29 @@ extern int luaopen_trx(lua_State *);
 extern int luaopen_trxd(lua_State *);
 extern int luaopen_trx_controller(lua_State *);
 extern int luaopen_json(lua_State *);
+extern const char *json_encode_value(lua_State *, int, size_t *);
 extern void *trx_handler(void *);
+extern void *trx_input(void *);
+extern command_t *command_next(command_queue_t *);
+extern void command_done(command_queue_t *, command_t *, const char *,
+    size_t);
+extern void command_offline(command_queue_t *, command_t *);
+extern void request_push(lua_State *, request_t *);
+extern char *cat_input_frame(trx_controller_tag_t *, size_t *);
+extern void cat_input_flush(trx_controller_tag_t *);
+extern void cat_input_wakeup(trx_controller_tag_t *);
+extern void cat_input_stop(trx_controller_tag_t *);
+extern int device_open(const char *, int, int);
+extern int reconnect(reconnect_t *, const char *, int, int);
 
 extern int verbose;
 
 __thread trx_controller_tag_t	*trx_controller_tag;
 __thread int cat_device;
 
+static const char unencodable[] = "{\"status\":\"Error\","
+    "\"reason\":\"Response is not encodable as JSON\"}";
+
 static void
 cleanup(void *arg)
 {
@@ -75,12 +87,36 @@ freeexternalstring(void *ud, void *ptr, size_t osize, size_t nsize)
 	return NULL;
 }
 
+/*
+ * The watchdog found the device not responding.  Replace it by a freshly
+ * opened one under the same descriptor, the trx-input thread and the
+ * driver keep using it.
+ */
+static void
+reopen(trx_controller_tag_t *t)
+{
+	int fd;
+
+	syslog(LOG_INFO, "trx-controller: reopening %s", t->device);
+	fd = device_open(t->device, t->speed, t->channel);
+	if (fd == -1)
+		return;
+	if (dup2(fd, t->cat_device) == -1)
+		syslog(LOG_ERR, "trx-controller: dup2: %s", strerror(errno));
+	close(fd);
+	cat_input_flush(t);
+	cat_input_wakeup(t);
+}
+
 void *
 trx_controller(void *arg)
 {
 	trx_controller_tag_t *t = (trx_controller_tag_t *)arg;
-	struct termios tty;
-	int fd;
+	command_t *c;
+	const char *response;
+	char *frame;
+	size_t len, flen;
+	int fd, stop, stops;
 
 	if (pthread_detach(pthread_self())) {
 		syslog(LOG_ERR, "trx-controller: pthread_detach");
@@ -98,80 +134,36 @@ trx_controller(void *arg)
 		exit(1);
 	}
 
+	/* Requests fail until a device that is not there can be opened */
+	fd = device_open(t->device, t->speed, t->channel);
+	if (fd == -1) {
+		syslog(LOG_WARNING, "trx-controller: %s is offline", t->name);
+		__atomic_store_n(&t->queue.offline, 1, __ATOMIC_RELAXED);
+		fd = reconnect(&t->reconnect, t->device, t->speed, t->channel);
+		if (fd == -1) {
+			c = NULL;
+			goto retired;
+		}
+	}
+
 	/*
 	 * Lock this transceivers mutex, so that no other thread accesses
-	 * while we are initializing.
+	 * while we are initializing.  Commands are queued meanwhile.
 	 */
 	if (pthread_mutex_lock(&t->mutex)) {
 		syslog(LOG_ERR, "trx-controller: pthread_mutex_lock");
 		exit(1);
 	}
-
-	if (pthread_mutex_lock(&t->mutex2)) {
-		syslog(LOG_ERR, "trx-controller: pthread_mutex_lock");
-		exit(1);
-	}
-
-	if (*t->device == '/') {	/* Assume device under /dev */
-		fd = open(t->device, O_RDWR);
-		if (fd == -1) {
-			syslog(LOG_ERR, "trx-controller: can't open %s",
-			    t->device);
-			exit(1);
-		}
-
-		if (isatty(fd)) {
-			if (tcgetattr(fd, &tty) < 0) {
-				syslog(LOG_ERR, "trx-controller: tcgetattr");
-				exit(1);
-			} else {
-				cfmakeraw(&tty);
-				tty.c_cflag |= CLOCAL;
-				cfsetspeed(&tty, t->speed);
-
-				if (tcsetattr(fd, TCSADRAIN, &tty) < 0) {
-					syslog(LOG_ERR, "trx-controller: "
-					    "tcsetattr");
-					exit(1);
-				}
-			}
-		}
-	} else if (strlen(t->device) == 17) {	/* Assume Bluetooth RFCOMM */
-		struct sockaddr_rc addr = { 0 };
-
-		fd = socket(AF_BLUETOOTH, SOCK_STREAM, BTPROTO_RFCOMM);
-		if (fd == -1) {
-			syslog(LOG_ERR, "trx-controller: %s: can't get bluetooth "
-			    "socket: %s", t->device, strerror(errno));
-			exit(1);
-		}
-
-		addr.rc_family = AF_BLUETOOTH;
-		addr.rc_channel = (uint8_t) t->channel;
-		str2ba(t->device, &addr.rc_bdaddr);
-
-		if (verbose)
-			syslog(LOG_INFO, "trx-controller: attempting to "
-			    "connect to %s", t->device);
-
-		if (connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
-			syslog(LOG_ERR, "trx-controller: can't connect to %s"
-			    ": %s", t->device, strerror(errno));
-			exit(1);
-		}
-
-		if (verbose)
-			syslog(LOG_INFO, "trx-controller: connected to %s",
-			    t->device);
-	} else {
-		syslog(LOG_ERR, "trx-controller: unknown device %s", t->device);
-		exit(1);
-	}
-	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
 	sleep(1);
 	cat_device = fd;
 	t->cat_device = fd;
 
+	/* All input from the CAT device is read by the trx-input thread */
+	t->threads = t->poller_required ? 1 : 2;
+	pthread_create(&t->trx_input, NULL, trx_input, t);
+	if (!t->poller_required)
+		pthread_create(&t->trx_handler, NULL, trx_handler, t);
+
 	/*
 	 * Call the registerDriver function which had been setup in the
 	 * main thread.
@@ -190,10 +182,11 @@ trx_controller(void *arg)
 	lua_pop(t->L, 1);
 
 	t->is_running = 1;
+	__atomic_store_n(&t->queue.offline, 0, __ATOMIC_RELAXED);
 
 	/*
-	 * We are ready to go, unlock the mutex, so that client-handlers,
-	 * trx-handlers, and, trx-pollers can access it.
+	 * We are ready to go, unlock the mutex and execute the commands of
+	 * the dispatchers, the trx-handler, and the trx-poller.
 	 */
 
 	if (verbose)
@@ -206,53 +199,94 @@ trx_controller(void *arg)
 	}
 
 	for (;;) {
-		/* Wait on cond, this releases the mutex */
-		while (t->handler == NULL) {
-			if (pthread_cond_wait(&t->cond1, &t->mutex2)) {
-				syslog(LOG_ERR, "trx-controller: "
-				    "pthread_cond_wait");
-				exit(1);
-			}
-		}
+		c = command_next(&t->queue);
+		if (c->handler == NULL)		/* Retired by a reload */
+			break;
+		response = NULL;
+		len = 0;
 
 		lua_geti(t->L, LUA_REGISTRYINDEX, t->ref);
-		lua_getfield(t->L, -1, t->handler);
+		lua_getfield(t->L, -1, c->handler);
 		if (lua_type(t->L, -1) != LUA_TFUNCTION) {
-			t->response = "command not supported, "
+			response = "command not supported, "
 			    "please submit a bug report";
+			len = strlen(response);
 		} else {
-			lua_pushexternalstring(t->L, t->data, t->len,
-			    freeexternalstring, NULL);
-			lua_pushinteger(t->L, t->client_fd);
-			t->response = NULL;
+			if (c->request != NULL)
+				request_push(t->L, c->request);
+			else if (c->frame) {
+				/* A request might have consumed the input */
+				frame = cat_input_frame(t, &flen);
+				if (frame == NULL) {
+					lua_pop(t->L, 2);
+					command_done(&t->queue, c, NULL, 0);
+					continue;
+				}
+				lua_pushexternalstring(t->L, frame, flen,
+				    freeexternalstring, NULL);
+			} else
+				lua_pushnil(t->L);
+			lua_pushinteger(t->L, 0);
 
 			switch (lua_pcall(t->L, 2, 1, 0)) {
 			case LUA_OK:
 				if (lua_type(t->L, -1) == LUA_TSTRING)
-					t->response =
-					    (char *)lua_tostring(t->L, -1);
-				else
-					t->response = "";
+					response = lua_tolstring(t->L, -1,
+					    &len);
+				else if (lua_type(t->L, -1) == LUA_TTABLE) {
+					response = json_encode_value(t->L, -1,
+					    &len);
+					if (response == NULL) {
+						response = unencodable;
+						len = strlen(response);
+					}
+				} else if (lua_isinteger(t->L, -1))
+					c->result = lua_tointeger(t->L, -1);
 				break;
 			case LUA_ERRRUN:
 			case LUA_ERRMEM:
 			case LUA_ERRERR:
-				t->response = "{\"status\":\"Error\","
+				response = "{\"status\":\"Error\","
 				    "\"reason\":\"Lua error\"}";
+				len = strlen(response);
 
 				syslog(LOG_ERR, "Lua error: %s",
 				    lua_tostring(t->L, -1));
 				break;
 			}
 		}
+
+		/* The response is still on the Lua stack */
+		command_done(&t->queue, c, response, len);
 		lua_pop(t->L, 2);
-		t->handler = NULL;
 
-		if (pthread_cond_signal(&t->cond2)) {
-			syslog(LOG_ERR, "trx-controller: pthread_cond_signal");
-			exit(1);
-		}
+		if (__atomic_exchange_n(&t->reopen, 0, __ATOMIC_RELAXED))
+			reopen(t);
 	}
+
+retired:
+	if (verbose)
+		printf("trx-controller: %s retired\n", t->name);
+	cat_input_stop(t);
+	lua_close(t->L);
+	t->L = NULL;
+	stops = 0;
+	if (c != NULL) {
+		command_done(&t->queue, c, NULL, 0);
+		stops++;
+	}
+
+	/*
+	 * Commands queued while the reload retired us are answered without
+	 * running them, requests with the Offline status.  A second command
+	 * without handler comes when nothing queues commands anymore, the
+	 * reload frees the tag once it has been answered.
+	 */
+	do {
+		c = command_next(&t->queue);
+		stop = c->handler == NULL;
+		command_offline(&t->queue, c);
+	} while (!stop || ++stops < 2);
 	pthread_cleanup_pop(0);
 	return NULL;
 }
@@ -30,6 +30,70 @@ local statusUpdates = false
 local lastFrequency = 0
 local lastMode = ''
 
+-- State cache, filled from status updates and from set and get requests.
+-- The key is the setting followed by the VFO, the current VFO if empty.
+local cache = {}
+local cacheWindow = 0
+
+local cachedSettings = {
+	['get-frequency'] = 'frequency',
+	['get-mode'] = 'mode',
+	['set-frequency'] = 'frequency',
+	['set-mode'] = 'mode'
+}
+
+-- Requests a driver can add that change the current VFO or swap the VFOs
+local vfoRequests = {
+	['set-vfo'] = true,
+	['set-split'] = true,
+	['swap-vfo'] = true
+}
+
+-- The VFO reported with the value can name the current VFO
+local function cacheStore(setting, vfo, value, reportedVfo)
+	if value ~= nil then
+		cache[setting .. (vfo or '')] = {
+			value = value,
+			vfo = reportedVfo or vfo,
+			time = trxController.now()
+		}
+	end
+end
+
+-- A setting changed, any cached VFO might be the current one
+local function cacheInvalidate(setting)
+	for key, entry in pairs(cache) do
+		if string.sub(key, 1, #setting) == setting then
+			cache[key] = nil
+		end
+	end
+end
+
+local function cacheLookup(setting, vfo, response)
+	local entry = cache[setting .. (vfo or '')]
+
+	if entry ~= nil and cacheWindow > 0
+	    and trxController.now() - entry.time <= cacheWindow then
+		response[setting] = entry.value
+		response.vfo = entry.vfo
+		response.cached = true
+		return true
+	end
+	return false
+end
+
+-- Remember a status update, the values are for the VFO it names
+local function cacheStatus(status)
+	for _, setting in pairs({ 'frequency', 'mode' }) do
+		if status[setting] ~= nil then
+			if status.vfo ~= nil then
+				cacheInvalidate(setting)
+			end
+			cacheStore(setting, status.vfo, status[setting])
+		end
+	end
+end
+
 local function getInfo(driver, request, response)
 	response.name = driver.name
 	response.shortName = driver.shortName
@@ -42,6 +106,7 @@ local function registerDriver(destination, dev, newDriver)
 	name = destination
 	driver = newDriver
 	device = dev
+	cacheWindow = trxController.cacheWindow()
 
 	functions = {
 		['set-frequency'] = type(driver.setFrequency) == 'function'
@@ -83,25 +148,23 @@ end
 local function notImplemented(response)
 	response.status = 'Error'
 	response.reason = 'Function unknown or not implemented'
-	return json.encode(response)
+	return response
 end
 
--- Handle request from a network client
-local function requestHandler(data, fd)
-	local request = json.decode(data)
-
-	if request == nil then
-		return json.encode({
+-- Handle a request, returns the response table
+local function handleRequest(request)
+	if type(request) ~= 'table' then
+		return {
 			status = 'Error',
 			reason = 'Invalid input data or no input data at all'
-		})
+		}
 	end
 
 	if request.request == nil or #request.request == 0 then
-		return json.encode({
+		return {
 			status = 'Error',
 			reason = 'No request'
-		})
+		}
 	end
 
 	local response = {
@@ -116,8 +179,86 @@ local function requestHandler(data, fd)
 		return notImplemented(response)
 	end
 
+	local setting = cachedSettings[request.request]
+	local isGet = string.sub(request.request, 1, 4) == 'get-'
+
+	if setting ~= nil and isGet
+	    and cacheLookup(setting, request.vfo, response) then
+		return response
+	end
+
 	handler(driver, request, response)
-	return json.encode(response)
+
+	if vfoRequests[request.request] then
+		cacheInvalidate('frequency')
+		cacheInvalidate('mode')
+	elseif request.vfo ~= nil then
+		-- Drivers select the VFO a request names
+		cache['frequency'] = nil
+		cache['mode'] = nil
+	end
+
+	if setting ~= nil then
+		if isGet then
+			if response.status == 'Ok' then
+				cacheStore(setting, request.vfo,
+				    response[setting], response.vfo)
+			end
+		else
+			cacheInvalidate(setting)
+			if response.status == 'Ok' then
+				cacheStore(setting, request.vfo,
+				    request[setting], response.vfo)
+			end
+		end
+	end
+	return response
+end
+
+-- Handle request from a network client
+local function requestHandler(request, fd)
+	return handleRequest(request)
+end
+
+-- Handle a batch of requests in one go, either a JSON array of requests or
+-- a batch request with a requests array
+local function batchHandler(request, fd)
+	local requests = request
+	local batch = type(request) == 'table' and request.request == 'batch'
+
+	if batch then
+		requests = request.requests
+	end
+
+	if type(requests) ~= 'table' or #requests == 0 then
+		return {
+			status = 'Error',
+			reason = 'No requests in batch'
+		}
+	end
+
+	local responses = {}
+	for n, r in ipairs(requests) do
+		if type(r) == 'table' and r.to ~= nil and r.to ~= name then
+			responses[n] = {
+				status = 'Error',
+				reason = 'All requests of a batch must have '
+				    .. 'the same destination'
+			}
+		else
+			responses[n] = handleRequest(r)
+		end
+	end
+
+	if batch then
+		return {
+			status = 'Ok',
+			from = name,
+			response = 'batch',
+			responses = responses
+		}
+	end
+	return responses
 end
 
 local function pollHandler(data, fd)
@@ -127,8 +268,17 @@ local function pollHandler(data, fd)
 		from = name
 	}
 
-	driver.getFrequency(driver, nil, response)
-	driver.getMode(driver, nil, response)
+	if type(driver.getStatus) == 'function' then
+		driver.getStatus(driver, {}, response)
+	else
+		driver.getFrequency(driver, {}, response)
+		driver.getMode(driver, {}, response)
+	end
+	if response.status ~= 'Ok' then
+		return 0
+	end
+	cacheStore('frequency', nil, response.frequency, response.vfo)
+	cacheStore('mode', nil, response.mode, response.vfo)
 
 	if lastFrequency ~= response.frequency or lastMode ~= response.mode then
 		local status = {
@@ -140,13 +290,12 @@ local function pollHandler(data, fd)
 			}
 		}
 
-		local jsonData = json.encode(status)
-		trxController.notifyListeners(jsonData)
+		trxController.notifyListeners(status)
 		lastFrequency = response.frequency
 		lastMode = response.mode
-	else
-		return nil
+		return 1
 	end
+	return 0
 end
 
 -- Handle incoming data from the transceiver
@@ -154,20 +303,54 @@ local function dataHandler(data)
 	if type(driver.handleStatusUpdates) == 'function' then
 		local response = driver:handleStatusUpdates(data)
 		if response ~= nil then
+			cacheStatus(response)
 			local status = {
 				request = 'status-update',
 				from = name,
 				status = response
 			}
-			local jsonData = json.encode(status)
-			trxController.notifyListeners(jsonData)
+			trxController.notifyListeners(status)
 		end
 	end
 end
 
+-- Start and stop unsolicited status updates from the transceiver
+local function startStatusUpdates()
+	statusUpdates = true
+	if type(driver.startStatusUpdates) == 'function' then
+		return driver:startStatusUpdates()
+	end
+end
+
+local function stopStatusUpdates()
+	statusUpdates = false
+	if type(driver.stopStatusUpdates) == 'function' then
+		driver:stopStatusUpdates()
+	end
+end
+
+-- The device has been reopened after it went away.  The transceiver may
+-- have been power cycled, forget what we know about it and set it up again.
+local function reconnectHandler()
+	cache = {}
+	lastFrequency = 0
+	lastMode = ''
+
+	if type(driver.initialize) == 'function' then
+		driver:initialize(functions)
+	end
+	if statusUpdates and type(driver.startStatusUpdates) == 'function' then
+		driver:startStatusUpdates()
+	end
+end
+
 return {
 	registerDriver = registerDriver,
 	requestHandler = requestHandler,
+	batchHandler = batchHandler,
 	pollHandler = pollHandler,
-	dataHandler = dataHandler
+	dataHandler = dataHandler,
+	startStatusUpdates = startStatusUpdates,
+	stopStatusUpdates = stopStatusUpdates,
+	reconnectHandler = reconnectHandler
 }
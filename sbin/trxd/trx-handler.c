@@ -20,121 +20,49 @@
  * IN THE SOFTWARE.
  */
 
-/* Handle incoming data from the trx */
+/* Pass status updates received from the trx to the dataHandler */
 
-#include <errno.h>
-#include <poll.h>
 #include <pthread.h>
-#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
-#include <unistd.h>
 
 #include "trxd.h"
 
-extern int verbose;
+extern int cat_input_wait_frame(trx_controller_tag_t *);
+extern void command_call(command_queue_t *, command_t *);
 
-static void
-cleanup(void *arg)
-{
-	free(arg);
-}
+extern int verbose;
 
 void *
 trx_handler(void *arg)
 {
 	trx_controller_tag_t *t = (trx_controller_tag_t *)arg;
-	struct pollfd pfd;
-	int n, fd;
-	char buf[128];
+	command_t c;
 
 	if (pthread_detach(pthread_self())) {
 		syslog(LOG_ERR, "trx-handler: pthread_detach");
 		exit(1);
 	}
 
-	pthread_cleanup_push(cleanup, arg);
-
 	if (pthread_setname_np(pthread_self(), "trx-handler")) {
 		syslog(LOG_ERR, "trx-handler: pthread_setname_np");
 		exit(1);
 	}
 
-	fd = t->cat_device;
-
-	pfd.fd = fd;
-	pfd.events = POLLIN;
-
-	for (;;) {
-		if (pthread_mutex_lock(&t->mutex)) {
-			syslog(LOG_ERR, "trx-handler: pthread_mutex_lock");
-			exit(1);
-		}
-
-		if (poll(&pfd, 1, 0) == -1) {
-			syslog(LOG_ERR, "trx-handler: poll");
-			exit(1);
-		}
-		if (pfd.revents) {
-			for (n = 0; n < sizeof(buf) - 1;) {
-				if (read(fd, &buf[n], 1) == -1) {
-					if (errno == EAGAIN)
-						continue;
-					else
-						break;
-				} else if (buf[n] == t->handler_eol)
-					break;
-				n++;
-			}
-			buf[++n] = '\0';
-
-			t->handler = "dataHandler";
-			t->response = NULL;
-			t->data = buf;
-			t->client_fd = 0;
-
-			if (pthread_mutex_lock(&t->mutex2)) {
-				syslog(LOG_ERR,
-				    "trx-handler: pthread_mutex_lock");
-				exit(1);
-			}
-
-			if (pthread_cond_signal(&t->cond1)) {
-				syslog(LOG_ERR,
-				    "trx-handler: pthread_cond_signal");
-				exit(1);
-			}
-
-			if (pthread_mutex_unlock(&t->mutex2)) {
-				syslog(LOG_ERR,
-				    "trx-handler: pthread_mutex_unlock");
-				exit(1);
-			}
-
-			while (t->response == NULL) {
-				if (pthread_cond_wait(&t->cond2, &t->mutex2)) {
-					syslog(LOG_ERR, "trx-handler: "
-					    "pthread_cond_wait");
-					exit(1);
-				}
-			}
-
-			if (pthread_mutex_unlock(&t->mutex2)) {
-				syslog(LOG_ERR,
-				    "trx-handler: pthread_mutex_unlock");
-				exit(1);
-			}
-
-		}
-
-		if (pthread_mutex_unlock(&t->mutex)) {
-			syslog(LOG_ERR, "trx-handler: "
-			    "pthread_mutex_unlock");
-			exit(1);
-		}
-	};
-	pthread_cleanup_pop(0);
+	/* Until the controller is retired by a reload */
+	while (cat_input_wait_frame(t)) {
+		/*
+		 * The controller takes the frame off the input when it
+		 * executes the command, wait until it has done so.
+		 */
+		memset(&c, 0, sizeof(c));
+		c.handler = "dataHandler";
+		c.prio = PRIO_INTERACTIVE;
+		c.frame = 1;
+		command_call(&t->queue, &c);
+	}
+	__atomic_sub_fetch(&t->threads, 1, __ATOMIC_RELEASE);
 	return NULL;
 }
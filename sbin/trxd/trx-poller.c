@@ -22,91 +22,53 @@
 
 /* Handle transceivers that require polling for status updates */
 
-#include <pthread.h>
 #include <stdlib.h>
-#include <string.h>
 #include <stdio.h>
 #include <syslog.h>
-#include <unistd.h>
 
 #include "trxd.h"
 
-#define STATUS_REQUEST	"{\"request\": \"status-update\"}"
-#define POLLING_INTERVAL	200000	/* microseconds */
+extern void command_submit(command_queue_t *, command_t *);
+extern void poll_done(poll_timer_t *, int);
 
+/*
+ * Called by the trx-controller, pollHandler returns 1 if the status
+ * has changed.
+ */
 static void
-cleanup(void *arg)
+trx_poll_done(command_t *c, const char *response, size_t len)
 {
-	free(arg);
+	trx_controller_tag_t *t = c->arg;
+
+	if (len > 0)
+		syslog(LOG_WARNING,
+		    "trx-poller: unexpected response '%.*s'\n", (int)len,
+		    response);
+	poll_done(&t->poll, c->result);
+	free(c);
 }
 
-void *
-trx_poller(void *arg)
+/* Called by the poll-scheduler, this must not block */
+void
+trx_poll(poll_timer_t *p)
 {
-	trx_controller_tag_t *t = (trx_controller_tag_t *)arg;
+	trx_controller_tag_t *t = p->arg;
+	command_t *c;
 
-	if (pthread_detach(pthread_self())) {
-		syslog(LOG_ERR, "trx-poller: pthread_detach");
-		exit(1);
+	/* There is nothing to poll while the device is offline */
+	if (__atomic_load_n(&t->queue.offline, __ATOMIC_RELAXED)) {
+		poll_done(p, 0);
+		return;
 	}
 
-	pthread_cleanup_push(cleanup, NULL);
-
-	if (pthread_setname_np(pthread_self(), "trx-poller")) {
-		syslog(LOG_ERR, "trx-poller: pthread_setname_np");
+	c = calloc(1, sizeof(command_t));
+	if (c == NULL) {
+		syslog(LOG_ERR, "trx-poller: malloc");
 		exit(1);
 	}
-
-	for (;;) {
-		if (pthread_mutex_lock(&t->mutex)) {
-			syslog(LOG_ERR, "trx-poller: pthread_mutex_lock");
-			exit(1);
-		}
-
-		t->handler = "pollHandler";
-		t->response = NULL;
-		t->data  = NULL;
-
-		if (pthread_mutex_lock(&t->mutex2)) {
-			syslog(LOG_ERR, "trx-poller: pthread_mutex_lock");
-			exit(1);
-		}
-
-		if (pthread_cond_signal(&t->cond1)) {
-			syslog(LOG_ERR, "trx-poller: pthread_cond_signal");
-			exit(1);
-		}
-
-		if (pthread_mutex_unlock(&t->mutex2)) {
-			syslog(LOG_ERR, "trx-poller: pthread_mutex_unlock");
-			exit(1);
-		}
-
-		while (t->response == NULL) {
-			if (pthread_cond_wait(&t->cond2, &t->mutex2)) {
-				syslog(LOG_ERR, "trx-poller: pthread_cond_wait");
-				exit(1);
-			}
-		}
-
-		if (strlen(t->response))
-			syslog(LOG_WARNING,
-			    "trx-poller: unexpected response '%s'\n",
-			    t->response);
-
-		if (pthread_mutex_unlock(&t->mutex2)) {
-			syslog(LOG_ERR, "trx-poller: pthread_mutex_unlock");
-			exit(1);
-		}
-
-		if (pthread_mutex_unlock(&t->mutex)) {
-			syslog(LOG_ERR, "trx-poller: pthread_mutex_unlock");
-			exit(1);
-		}
-
-		usleep(POLLING_INTERVAL);
-	}
-	pthread_cleanup_pop(0);
-
-	return NULL;
+	c->handler = "pollHandler";
+	c->prio = PRIO_BACKGROUND;
+	c->done = trx_poll_done;
+	c->arg = t;
+	command_submit(&t->queue, c);
 }
@@ -34,17 +34,15 @@
 #include <netdb.h>
 #include <pthread.h>
 #include <pwd.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
-#include <termios.h>
+#include <time.h>
 #include <unistd.h>
 #include <zmq.h>
 
-#include <bluetooth/bluetooth.h>
-#include <bluetooth/rfcomm.h>
-
 #include <lua.h>
 #include <lualib.h>
 #include <lauxlib.h>
@@ -57,6 +55,8 @@
 #define BIND_ADDR	"localhost"
 #define LISTEN_PORT	"14285"
 
+#define DISPATCHERS	4
+
 int verbose = 0;
 int log_connections = 0;
 
@@ -67,16 +67,38 @@ extern int luaopen_trx(lua_State *);
 extern int luaopen_trxd(lua_State *);
 extern int luaopen_trx_controller(lua_State *);
 
-extern void proxy_map(lua_State *, lua_State *, int);
+extern int proxy_copy(lua_State *, int, lua_State *);
 extern void *nmea_handler(void *);
+extern void reconnect_init(reconnect_t *);
 extern void *sd_event_handler(void *);
-extern void *socket_handler(void *);
 extern void *trx_controller(void *);
 extern void *sdr_controller(void *);
 extern void *gpio_controller(void *);
 extern void *relay_controller(void *);
 extern void *websocket_listener(void *);
+extern int sender_overflow_policy(const char *);
+
+extern size_t queue_length;
 extern void *extension(void *);
+extern void command_queue_init(command_queue_t *);
+extern void command_queue_free(command_queue_t *);
+extern void cat_input_init(trx_controller_tag_t *);
+extern void cat_input_free(trx_controller_tag_t *);
+extern void reactor_init(void);
+extern void reactor_listen(int);
+extern void reactor(void);
+extern void dispatcher_init(int);
+extern void poll_scheduler_init(void);
+extern void watchdog_init(void);
+extern void poll_timer_init(poll_timer_t *, void (*)(poll_timer_t *),
+    void *);
+extern void trx_poll(poll_timer_t *);
+extern void poll_stop(poll_timer_t *);
+extern int poll_pending(poll_timer_t *);
+extern void reconnect_stop(reconnect_t *);
+extern void command_call(command_queue_t *, command_t *);
+extern void dispatcher_adopt(destination_t *, destination_t *);
+extern void gpio_poll(poll_timer_t *);
 
 extern int trx_control_running;
 
@@ -85,12 +107,57 @@ pthread_mutex_t destination_mutex;
 
 void *zmq_ctx;
 
-/*
- * private,, i.e. per connection extensions configuration.  This is in
- * JSON format, if private extensions have been defined.
- */
+/* Private, i.e. per connection, extensions */
+private_extension_t *private_extensions = NULL;
 
-char *private_extensions = NULL;
+/* The configuration is kept for reloads */
+static lua_State *config;
+static int config_ref = LUA_NOREF;
+static char *config_file;
+
+/* Read the polling intervals of a destination, -1 if they are invalid */
+static int
+polling(lua_State *L, const char *name, poll_timer_t *p)
+{
+	lua_getfield(L, -1, "polling");
+	if (lua_istable(L, -1)) {
+		lua_getfield(L, -1, "min-interval");
+		if (lua_isinteger(L, -1))
+			p->min_interval = lua_tointeger(L, -1);
+		lua_pop(L, 1);
+		lua_getfield(L, -1, "max-interval");
+		if (lua_isinteger(L, -1))
+			p->max_interval = lua_tointeger(L, -1);
+		lua_pop(L, 1);
+		if (p->min_interval < 1 || p->max_interval < p->min_interval) {
+			syslog(LOG_ERR, "%s: invalid polling intervals", name);
+			lua_pop(L, 1);
+			return -1;
+		}
+	}
+	lua_pop(L, 1);
+	return 0;
+}
+
+/* Read the default request deadline and the watchdog timeout */
+static int
+deadlines(lua_State *L, const char *name, command_queue_t *q)
+{
+	lua_getfield(L, -1, "request-timeout");
+	if (lua_isinteger(L, -1))
+		q->timeout = lua_tointeger(L, -1);
+	lua_pop(L, 1);
+	lua_getfield(L, -1, "watchdog");
+	if (lua_isinteger(L, -1))
+		q->watchdog = lua_tointeger(L, -1);
+	lua_pop(L, 1);
+	if (q->timeout < 0 || q->watchdog < 1) {
+		syslog(LOG_ERR, "%s: invalid request timeout or watchdog",
+		    name);
+		return -1;
+	}
+	return 0;
+}
 
 static void
 usage(void)
@@ -105,32 +172,20 @@ usage(void)
 	exit(1);
 }
 
-int
-add_destination(const char *name, enum DestinationType type, void *arg)
+/* Allocate a destination, it is not yet linked */
+static destination_t *
+destination_new(const char *name, enum DestinationType type, void *arg)
 {
 	destination_t *d;
 
-	if (pthread_mutex_lock(&destination_mutex)) {
-		syslog(LOG_ERR, "pthread_mutex_lock");
-		exit(1);
-	}
-
-	/* Destination names must be unique */
-	for (d = destination; d != NULL; d = d->next)
-		if (!strcmp(d->name, name)) {
-			pthread_mutex_unlock(&destination_mutex);
-			return -1;
-	}
-
-	d = malloc(sizeof(destination_t));
-	if (d == NULL) {
+	d = calloc(1, sizeof(destination_t));
+	if (d == NULL || (d->name = strdup(name)) == NULL) {
 		syslog(LOG_ERR, "memory allocation error");
 		exit(1);
 	}
 
-	d->next = d->previous = NULL;
-	d->name = strdup(name);
 	d->type = type;
+	d->refs = 1;
 	switch (type) {
 	case DEST_TRX:
 		d->tag.trx = arg;
@@ -159,6 +214,37 @@ add_destination(const char *name, enum DestinationType type, void *arg)
 		syslog(LOG_ERR, "rotors are not yet supported");
 		exit(1);
 	}
+	return d;
+}
+
+/* Drop a reference to a destination, destination_mutex is held */
+void
+destination_unref(destination_t *d)
+{
+	if (--d->refs > 0)
+		return;
+	free(d->name);
+	free(d);
+}
+
+int
+add_destination(const char *name, enum DestinationType type, void *arg)
+{
+	destination_t *d;
+
+	if (pthread_mutex_lock(&destination_mutex)) {
+		syslog(LOG_ERR, "pthread_mutex_lock");
+		exit(1);
+	}
+
+	/* Destination names must be unique */
+	for (d = destination; d != NULL; d = d->next)
+		if (!strcmp(d->name, name)) {
+			pthread_mutex_unlock(&destination_mutex);
+			return -1;
+	}
+
+	d = destination_new(name, type, arg);
 
 	if (destination == NULL)
 		destination = d;
@@ -207,8 +293,844 @@ remove_destination(const char *name)
 			}
 		}
 	}
-	pthread_mutex_unlock(&destination_mutex);
-	return rv;
+	pthread_mutex_unlock(&destination_mutex);
+	return rv;
+}
+
+/*
+ * Setup a transceiver from its configuration, the table on top of the
+ * stack.  Returns NULL if the configuration is not valid.
+ */
+static trx_controller_tag_t *
+trx_new(lua_State *L, const char *name)
+{
+	trx_controller_tag_t *t;
+	struct stat sb;
+	const char *p;
+	char trx_path[PATH_MAX];
+	const char *protocol = NULL;
+	char proto_path[PATH_MAX];
+	int top;
+
+	top = lua_gettop(L);
+	t = calloc(1, sizeof(trx_controller_tag_t));
+	if (t == NULL) {
+		syslog(LOG_ERR, "memory allocation error");
+		exit(1);
+	}
+	t->name = strdup(name);
+	t->is_running = 0;
+	t->speed = 9600;
+	t->channel = 0;
+	t->cache_window = CACHE_WINDOW;
+	t->audio_input = t->audio_output = NULL;
+	t->poller_required = 0;
+	poll_timer_init(&t->poll, trx_poll, t);
+	t->handler_running = 0;
+	t->input_head = t->input_len = 0;
+	t->input_overruns = 0;
+	t->reopen = 0;
+	t->senders = NULL;
+	command_queue_init(&t->queue);
+	reconnect_init(&t->reconnect);
+
+	lua_getfield(L, -1, "device");
+	if (!lua_isstring(L, -1)) {
+		syslog(LOG_ERR, "missing trx device path");
+		goto fail;
+	}
+	t->device = strdup(lua_tostring(L, -1));
+	lua_pop(L, 1);
+
+	lua_getfield(L, -1, "speed");
+	if (lua_isinteger(L, -1))
+		t->speed = lua_tointeger(L, -1);
+	lua_pop(L, 1);
+
+	lua_getfield(L, -1, "channel");
+	if (lua_isinteger(L, -1))
+		t->channel =lua_tointeger(L, -1);
+	lua_pop(L, 1);
+
+	if (polling(L, t->name, &t->poll) ||
+	    deadlines(L, t->name, &t->queue))
+		goto fail;
+
+	lua_getfield(L, -1, "cache-window");
+	if (lua_isinteger(L, -1))
+		t->cache_window = lua_tointeger(L, -1);
+	lua_pop(L, 1);
+
+	lua_getfield(L, -1, "audio");
+	if (lua_istable(L, -1)) {
+		lua_getfield(L, -1, "input");
+		if (lua_isstring(L, -1))
+			t->audio_input =
+			    strdup(lua_tostring(L, -1));
+		lua_pop(L, 1);
+		lua_getfield(L, -1, "output");
+		if (lua_isstring(L, -1))
+			t->audio_output =
+			    strdup(lua_tostring(L, -1));
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
+
+	lua_getfield(L, -1, "trx");
+	if (!lua_isstring(L, -1)) {
+		syslog(LOG_ERR, "missing trx name");
+		goto fail;
+	}
+	t->trx = strdup(lua_tostring(L, -1));
+	lua_pop(L, 1);
+
+	lua_getfield(L, -1, "default");
+	t->is_default = lua_toboolean(L, -1);
+	lua_pop(L, 1);
+
+	/* Setup Lua */
+	t->L = luaL_newstate();
+	if (t->L == NULL) {
+		syslog(LOG_ERR, "cannot create Lua state");
+		exit(1);
+	}
+
+	luaL_openlibs(t->L);
+
+	luaopen_trx(t->L);
+	lua_setglobal(t->L, "trx");
+	luaopen_trx_controller(t->L);
+	lua_setglobal(t->L, "trxController");
+	luaopen_trxd(t->L);
+	lua_setglobal(t->L, "trxd");
+	luaopen_json(t->L);
+	lua_setglobal(t->L, "json");
+	luaopen_yaml(t->L);
+	lua_setglobal(t->L, "yaml");
+
+	lua_getglobal(t->L, "package");
+	lua_getfield(t->L, -1, "cpath");
+	lua_pushstring(t->L, ";");
+	lua_pushstring(t->L, _PATH_LUA_CPATH);
+	lua_concat(t->L, 3);
+	lua_setfield(t->L, -2, "cpath");
+	lua_pop(t->L, 1);
+
+	lua_getglobal(t->L, "package");
+	lua_getfield(t->L, -1, "path");
+	lua_pushstring(t->L, ";");
+	lua_pushstring(t->L, _PATH_LUA_PATH);
+	lua_concat(t->L, 3);
+	lua_setfield(t->L, -2, "path");
+	lua_pop(t->L, 1);
+
+	lua_getfield(L, -1, "path");
+	if (lua_isstring(L, -1)) {
+		p = lua_tostring(L, -1);
+		lua_getglobal(t->L, "package");
+		lua_getfield(t->L, -1, "path");
+		lua_pushstring(t->L, ";");
+		lua_pushstring(t->L, p);
+		lua_concat(t->L, 3);
+		lua_setfield(t->L, -2, "path");
+		lua_pop(t->L, 1);
+	}
+	lua_pop(L, 1);
+
+	lua_getfield(L, -1, "cpath");
+	if (lua_isstring(L, -1)) {
+		p = lua_tostring(L, -1);
+		lua_getglobal(t->L, "package");
+		lua_getfield(t->L, -1, "cpath");
+		lua_pushstring(t->L, ";");
+		lua_pushstring(t->L, p);
+		lua_concat(t->L, 3);
+		lua_setfield(t->L, -2, "cpath");
+		lua_pop(t->L, 1);
+	}
+	lua_pop(L, 1);
+
+	/* Load trx description and protocol driver */
+	snprintf(trx_path, sizeof(trx_path), "%s/%s.yaml",
+	    _PATH_TRX, t->trx);
+
+	if (stat(trx_path, &sb)) {
+		syslog(LOG_ERR, "%s: file not found", trx_path);
+		goto fail;
+	}
+
+	lua_getglobal(t->L, "yaml");
+	lua_getfield(t->L, -1, "parsefile");
+	lua_pushstring(t->L, trx_path);
+
+	switch (lua_pcall(t->L, 1, 1, 0)) {
+	case LUA_OK:
+		lua_getfield(t->L, -1, "protocol");
+		protocol = lua_tostring(t->L, -1);
+		if (protocol == NULL) {
+			syslog(LOG_ERR,
+			    "%s: no protocol specified",
+			    trx_path);
+			goto fail;
+		}
+		lua_pop(t->L, 1);
+		lua_setglobal(t->L, "_trx");
+		break;
+	case LUA_ERRRUN:
+	case LUA_ERRMEM:
+	case LUA_ERRERR:
+		syslog(LOG_ERR, "%s: %s", trx_path,
+		    lua_tostring(t->L, -1));
+		goto fail;
+	}
+
+	if (protocol == NULL) {
+		syslog(LOG_ERR, "%s: no protocol defined",
+		    trx_path);
+		goto fail;
+	}
+
+	snprintf(proto_path, sizeof(proto_path), "%s/%s.lua",
+	    _PATH_PROTOCOL, protocol);
+
+	if (stat(proto_path, &sb)) {
+		syslog(LOG_ERR, "protocol not found: %s",
+		    protocol);
+		goto fail;
+	}
+	if (luaL_dofile(t->L, proto_path)) {
+		syslog(LOG_ERR, "%s", lua_tostring(t->L, -1));
+		goto fail;
+	}
+
+	lua_setglobal(t->L, "_protocol");
+
+	if (luaL_dostring(t->L, "for k, v in pairs(_trx) do "
+	    "_protocol[k] = v end")) {
+		syslog(LOG_ERR, "%s", lua_tostring(t->L, -1));
+		goto fail;
+	}
+
+	if (luaL_dofile(t->L, _PATH_TRX_CONTROLLER)) {
+		syslog(LOG_ERR, "%s", lua_tostring(t->L, -1));
+		goto fail;
+	}
+	if (lua_type(t->L, -1) != LUA_TTABLE) {
+		syslog(LOG_ERR, "table expected");
+		goto fail;
+	} else
+		t->ref = luaL_ref(t->L, LUA_REGISTRYINDEX);
+
+	/*
+	 * Setup the registerDriver function, but don't call
+	 * it yet as the CAT device is not yet open and it
+	 * might be needed by the initialize function.
+	 */
+	lua_geti(t->L, LUA_REGISTRYINDEX, t->ref);
+	lua_getfield(t->L, -1, "registerDriver");
+	lua_pushstring(t->L, t->name);
+	lua_pushstring(t->L, t->device);
+
+	lua_getglobal(t->L, "_protocol");
+	lua_getfield(t->L, -1, "statusUpdatesRequirePolling");
+	t->poller_required = lua_toboolean(t->L, -1);
+	lua_pop(t->L, 1);
+
+	lua_getfield(L, -1, "configuration");
+	if (lua_istable(L, -1)) {
+		if (proxy_copy(L, -1, t->L))
+			goto fail;
+		lua_setglobal(t->L, "_config");
+		if (luaL_dostring(t->L, "for k, v in "
+		    "pairs(_config) do _G[k] = v end "
+		    "_config = nil")) {
+			syslog(LOG_ERR, "%s", lua_tostring(t->L, -1));
+			goto fail;
+		}
+	}
+	lua_pop(L, 1);
+
+	lua_getfield(L, -1, "audio");
+	if (!lua_istable(L, -1))
+		lua_newtable(t->L);
+	else if (proxy_copy(L, -1, t->L))
+		goto fail;
+	lua_setfield(t->L, -2, "audio");
+	lua_pop(L, 1);
+
+	if (pthread_mutex_init(&t->mutex, NULL)) {
+		syslog(LOG_ERR, "pthread_mutex_init");
+		exit(1);
+	}
+	return t;
+
+fail:
+	lua_settop(L, top);
+	if (t->L != NULL)
+		lua_close(t->L);
+	free(t->name);
+	free((char *)t->device);
+	free((char *)t->trx);
+	free(t->audio_input);
+	free(t->audio_output);
+	free(t);
+	return NULL;
+}
+
+/* Start the trx-controller of a transceiver that is a destination */
+static void
+trx_start(trx_controller_tag_t *t)
+{
+	cat_input_init(t);
+
+	/* Create the trx-controller thread */
+	pthread_create(&t->trx_controller, NULL, trx_controller, t);
+}
+
+/*
+ * Setup an extension from its configuration, the table on top of the
+ * stack.  Returns NULL if the configuration is not valid.
+ */
+static extension_tag_t *
+extension_new(lua_State *L)
+{
+	extension_tag_t *t;
+	const char *p;
+	char script[PATH_MAX];
+	int top;
+
+	top = lua_gettop(L);
+	t = calloc(1, sizeof(extension_tag_t));
+	if (t == NULL) {
+		syslog(LOG_ERR, "memory allocation failure");
+		exit(1);
+	}
+	t->has_config = 0;
+	t->listeners = NULL;
+	t->L = luaL_newstate();
+	if (t->L == NULL) {
+		syslog(LOG_ERR, "cannot create Lua state");
+		exit(1);
+	}
+	luaL_openlibs(t->L);
+	luaopen_trxd(t->L);
+	lua_setglobal(t->L, "trxd");
+	luaopen_json(t->L);
+	lua_setglobal(t->L, "json");
+
+	t->call = t->done = t->terminate = t->retired = 0;
+
+	lua_getglobal(t->L, "package");
+	lua_getfield(t->L, -1, "cpath");
+	lua_pushstring(t->L, ";");
+	lua_pushstring(t->L, _PATH_LUA_CPATH);
+	lua_concat(t->L, 3);
+	lua_setfield(t->L, -2, "cpath");
+	lua_pop(t->L, 1);
+
+	lua_getglobal(t->L, "package");
+	lua_getfield(t->L, -1, "path");
+	lua_pushstring(t->L, ";");
+	lua_pushstring(t->L, _PATH_LUA_PATH);
+	lua_concat(t->L, 3);
+	lua_setfield(t->L, -2, "path");
+	lua_pop(t->L, 1);
+
+	lua_getfield(L, -1, "path");
+	if (lua_isstring(L, -1)) {
+		p = lua_tostring(L, -1);
+		lua_getglobal(t->L, "package");
+		lua_getfield(t->L, -1, "path");
+		lua_pushstring(t->L, ";");
+		lua_pushstring(t->L, p);
+		lua_concat(t->L, 3);
+		lua_setfield(t->L, -2, "path");
+		lua_pop(t->L, 1);
+	}
+	lua_pop(L, 1);
+
+	lua_getfield(L, -1, "cpath");
+	if (lua_isstring(L, -1)) {
+		p = lua_tostring(L, -1);
+		lua_getglobal(t->L, "package");
+		lua_getfield(t->L, -1, "cpath");
+		lua_pushstring(t->L, ";");
+		lua_pushstring(t->L, p);
+		lua_concat(t->L, 3);
+		lua_setfield(t->L, -2, "cpath");
+		lua_pop(t->L, 1);
+	}
+	lua_pop(L, 1);
+
+	lua_getfield(L, -1, "script");
+	if (!lua_isstring(L, -1)) {
+		syslog(LOG_ERR, "missing extension script name");
+		goto fail;
+	}
+	p = lua_tostring(L, -1);
+
+	if (strchr(p, '/')) {
+		syslog(LOG_ERR, "script name must not contain slashes");
+		goto fail;
+	}
+	snprintf(script, sizeof(script), "%s/%s.lua",
+	    _PATH_EXTENSION, p);
+
+	lua_pop(L, 1);
+
+	if (luaL_loadfile(t->L, script)) {
+		syslog(LOG_ERR, "%s", lua_tostring(t->L, -1));
+		goto fail;
+	}
+
+	lua_getfield(L, -1, "configuration");
+	if (lua_istable(L, -1)) {
+		if (proxy_copy(L, -1, t->L))
+			goto fail;
+		t->has_config = 1;
+	}
+	lua_pop(L, 1);
+
+	lua_getfield(L, -1, "callable");
+	if (lua_isboolean(L, -1))
+		t->is_callable = lua_toboolean(L, -1);
+	else
+		t->is_callable = 1;
+	lua_pop(L, 1);
+
+	if (pthread_mutex_init(&t->mutex, NULL)
+	    || pthread_mutex_init(&t->mutex2, NULL)
+	    || pthread_cond_init(&t->cond1, NULL)
+	    || pthread_cond_init(&t->cond2, NULL)) {
+		syslog(LOG_ERR, "pthread_mutex_init");
+		exit(1);
+	}
+	return t;
+
+fail:
+	lua_settop(L, top);
+	lua_close(t->L);
+	free(t);
+	return NULL;
+}
+
+/* Start the thread of an extension that is a destination */
+static void
+extension_start(extension_tag_t *t)
+{
+	/* Create the extension thread */
+	pthread_create(&t->extension, NULL, extension, t);
+}
+
+/* Compare two configuration values, tables by their contents */
+static int
+same(lua_State *L, int a, int b)
+{
+	a = lua_absindex(L, a);
+	b = lua_absindex(L, b);
+
+	if (lua_type(L, a) != lua_type(L, b))
+		return 0;
+	if (!lua_istable(L, a))
+		return lua_rawequal(L, a, b);
+
+	/* Each field of a is in b with the same value... */
+	lua_pushnil(L);
+	while (lua_next(L, a)) {
+		lua_pushvalue(L, -2);
+		lua_rawget(L, b);
+		if (!same(L, -2, -1)) {
+			lua_pop(L, 3);
+			return 0;
+		}
+		lua_pop(L, 2);
+	}
+
+	/* ...and b has no other fields */
+	lua_pushnil(L);
+	while (lua_next(L, b)) {
+		lua_pop(L, 1);
+		lua_pushvalue(L, -1);
+		lua_rawget(L, a);
+		if (lua_isnil(L, -1)) {
+			lua_pop(L, 2);
+			return 0;
+		}
+		lua_pop(L, 1);
+	}
+	return 1;
+}
+
+/*
+ * Take a destination out of service, new takes its place unless it is
+ * NULL.  The old destination is not freed, clients that have it as their
+ * current destination follow the retired flag to its replacement.
+ */
+static void
+retire_destination(destination_t *old, destination_t *new)
+{
+	if (pthread_mutex_lock(&destination_mutex)) {
+		syslog(LOG_ERR, "pthread_mutex_lock");
+		exit(1);
+	}
+
+	if (new != NULL) {
+		new->previous = old->previous;
+		new->next = old->next;
+		if (new->next != NULL)
+			new->next->previous = new;
+		if (old == destination)
+			destination = new;
+		else
+			old->previous->next = new;
+	} else {
+		if (old->next != NULL)
+			old->next->previous = old->previous;
+		if (old == destination)
+			destination = old->next;
+		else
+			old->previous->next = old->next;
+	}
+	old->retired = 1;
+
+	/* Status updates and listeners go to the new destination */
+	dispatcher_adopt(old, new);
+	pthread_mutex_unlock(&destination_mutex);
+}
+
+/* Free a transceiver whose threads have exited */
+static void
+trx_free(trx_controller_tag_t *t)
+{
+	sender_list_t *l;
+
+	while ((l = t->senders) != NULL) {
+		t->senders = l->next;
+		free(l);
+	}
+	cat_input_free(t);
+	command_queue_free(&t->queue);
+	pthread_mutex_destroy(&t->mutex);
+	free(t->name);
+	free((char *)t->device);
+	free((char *)t->trx);
+	free(t->audio_input);
+	free(t->audio_output);
+	free(t);
+}
+
+/*
+ * Stop the thread of a retired destination.  Its tag is freed once the
+ * dispatchers that looked it up before it was retired are done with it
+ * and its threads have exited.
+ */
+static void
+destination_stop(destination_t *d)
+{
+	struct timespec tick;
+	trx_controller_tag_t *t;
+	extension_tag_t *e;
+	command_t c;
+
+	tick.tv_sec = 0;
+	tick.tv_nsec = 10000000L;
+
+	switch (d->type) {
+	case DEST_TRX:
+		t = d->tag.trx;
+		__atomic_store_n(&t->queue.offline, 1, __ATOMIC_RELAXED);
+		poll_stop(&t->poll);
+		reconnect_stop(&t->reconnect);
+
+		/* A command without handler retires the controller */
+		memset(&c, 0, sizeof(c));
+		c.prio = PRIO_REALTIME;
+		command_call(&t->queue, &c);
+
+		while (__atomic_load_n(&d->users, __ATOMIC_ACQUIRE) > 0)
+			nanosleep(&tick, NULL);
+
+		/* A dispatcher may have started polling again */
+		poll_stop(&t->poll);
+		while (__atomic_load_n(&t->threads, __ATOMIC_ACQUIRE) > 0
+		    || poll_pending(&t->poll))
+			nanosleep(&tick, NULL);
+
+		/*
+		 * Nothing queues commands anymore, a second one ends the
+		 * controller after those that are still queued.
+		 */
+		memset(&c, 0, sizeof(c));
+		c.prio = PRIO_BACKGROUND;
+		command_call(&t->queue, &c);
+		d->tag.trx = NULL;
+		trx_free(t);
+		break;
+	case DEST_EXTENSION:
+		e = d->tag.extension;
+		pthread_mutex_lock(&e->mutex);
+		pthread_mutex_lock(&e->mutex2);
+		e->retired = e->terminate = 1;
+		pthread_cond_signal(&e->cond1);
+		pthread_mutex_unlock(&e->mutex2);
+		pthread_mutex_unlock(&e->mutex);
+
+		while (__atomic_load_n(&d->users, __ATOMIC_ACQUIRE) > 0
+		    || !__atomic_load_n(&e->exited, __ATOMIC_ACQUIRE))
+			nanosleep(&tick, NULL);
+		pthread_mutex_destroy(&e->mutex);
+		pthread_mutex_destroy(&e->mutex2);
+		pthread_cond_destroy(&e->cond1);
+		pthread_cond_destroy(&e->cond2);
+		d->tag.extension = NULL;
+		free(e);
+		break;
+	default:
+		break;
+	}
+
+	if (pthread_mutex_lock(&destination_mutex)) {
+		syslog(LOG_ERR, "pthread_mutex_lock");
+		exit(1);
+	}
+	destination_unref(d);
+	pthread_mutex_unlock(&destination_mutex);
+}
+
+/* Setup a transceiver or an extension from the table on top of the stack */
+static void *
+setup(lua_State *L, enum DestinationType type, const char *name)
+{
+	if (type == DEST_TRX)
+		return trx_new(L, name);
+	return extension_new(L);
+}
+
+static void
+start(enum DestinationType type, void *tag)
+{
+	if (type == DEST_TRX)
+		trx_start(tag);
+	else
+		extension_start(tag);
+}
+
+/*
+ * Apply the changes of the transceivers or extensions section of the
+ * configuration.  The new configuration keeps the old entry of a
+ * destination that could not be changed and drops the entry of one that
+ * could not be added, so that the next reload tries again.
+ */
+static void
+reload_section(lua_State *L, int old, int new, const char *section,
+    enum DestinationType type)
+{
+	destination_t *d;
+	const char *name;
+	void *tag;
+	int top;
+
+	top = lua_gettop(L);
+	lua_getfield(L, old, section);
+	if (!lua_istable(L, -1)) {
+		lua_pop(L, 1);
+		lua_newtable(L);
+	}
+	old = lua_gettop(L);
+	lua_getfield(L, new, section);
+	if (!lua_istable(L, -1)) {
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, new, section);
+	}
+	new = lua_gettop(L);
+
+	/* Removed or changed */
+	lua_pushnil(L);
+	while (lua_next(L, old)) {
+		if (lua_type(L, -2) != LUA_TSTRING) {
+			lua_pop(L, 1);
+			continue;
+		}
+		name = lua_tostring(L, -2);
+		lua_pushvalue(L, -2);
+		lua_rawget(L, new);
+		if (same(L, -2, -1)) {
+			lua_pop(L, 2);
+			continue;
+		}
+
+		for (d = destination; d != NULL; d = d->next)
+			if (!strcmp(d->name, name))
+				break;
+		if (d == NULL || d->type != type)
+			;
+		else if (type == DEST_EXTENSION
+		    && !d->tag.extension->is_callable)
+			syslog(LOG_WARNING, "%s: extensions that are not "
+			    "callable can't be reloaded", name);
+		else if (lua_isnil(L, -1)) {
+			syslog(LOG_NOTICE, "%s: removed", name);
+			retire_destination(d, NULL);
+			destination_stop(d);
+			lua_pop(L, 2);
+			continue;
+		} else if ((tag = setup(L, type, name)) != NULL) {
+			syslog(LOG_NOTICE, "%s: reconfigured", name);
+			retire_destination(d, destination_new(name, type, tag));
+			destination_stop(d);
+			start(type, tag);
+			lua_pop(L, 2);
+			continue;
+		}
+
+		/* Keep the old one */
+		lua_pushvalue(L, -3);
+		lua_pushvalue(L, -3);
+		lua_rawset(L, new);
+		lua_pop(L, 2);
+	}
+
+	/* Added */
+	lua_pushnil(L);
+	while (lua_next(L, new)) {
+		if (lua_type(L, -2) != LUA_TSTRING) {
+			lua_pop(L, 1);
+			continue;
+		}
+		name = lua_tostring(L, -2);
+		lua_pushvalue(L, -2);
+		lua_rawget(L, old);
+		if (!lua_isnil(L, -1)) {
+			lua_pop(L, 2);
+			continue;
+		}
+		lua_pop(L, 1);
+
+		for (d = destination; d != NULL; d = d->next)
+			if (!strcmp(d->name, name))
+				break;
+		if (d != NULL) {
+			syslog(LOG_ERR, "%s: names must be unique", section);
+			tag = NULL;
+		} else
+			tag = setup(L, type, name);
+
+		if (tag != NULL) {
+			syslog(LOG_NOTICE, "%s: added", name);
+			add_destination(name, type, tag);
+			start(type, tag);
+		} else {
+			/* Try again on the next reload */
+			lua_pushvalue(L, -2);
+			lua_pushnil(L);
+			lua_rawset(L, new);
+		}
+		lua_pop(L, 1);
+	}
+	lua_settop(L, top);
+}
+
+/*
+ * Warn about changed settings that are only read at startup, or if added
+ * is set, about those that are in a but not in b.
+ */
+static void
+restart_needed(lua_State *L, int a, int b, int added)
+{
+	const char *key;
+
+	lua_pushnil(L);
+	while (lua_next(L, a)) {
+		if (lua_type(L, -2) == LUA_TSTRING) {
+			key = lua_tostring(L, -2);
+			lua_pushvalue(L, -2);
+			lua_rawget(L, b);
+			if (strcmp(key, "transceivers")
+			    && strcmp(key, "extensions")
+			    && (added ? lua_isnil(L, -1) : !same(L, -2, -1)))
+				syslog(LOG_WARNING, "%s: changes take effect "
+				    "when trxd is restarted", key);
+			lua_pop(L, 1);
+		}
+		lua_pop(L, 1);
+	}
+}
+
+/*
+ * Reread the configuration file.  Transceivers and extensions that have
+ * been added, removed, or changed are started and stopped, all other
+ * destinations and the client connections are left alone.
+ */
+static void
+reload(void)
+{
+	lua_State *L = config;
+	int old, new;
+
+	lua_getglobal(L, "yaml");
+	lua_getfield(L, -1, "parsefile");
+	lua_pushstring(L, config_file);
+	if (lua_pcall(L, 1, 1, 0) != LUA_OK) {
+		syslog(LOG_ERR, "%s: %s, configuration not reloaded",
+		    config_file, lua_tostring(L, -1));
+		lua_settop(L, 0);
+		return;
+	}
+	if (lua_type(L, -1) != LUA_TTABLE) {
+		syslog(LOG_ERR, "invalid configuration file, "
+		    "configuration not reloaded");
+		lua_settop(L, 0);
+		return;
+	}
+	new = lua_gettop(L);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, config_ref);
+	old = lua_gettop(L);
+
+	syslog(LOG_NOTICE, "reloading %s", config_file);
+
+	/* Everything else is only read at startup */
+	restart_needed(L, old, new, 0);
+	restart_needed(L, new, old, 1);
+
+	reload_section(L, old, new, "transceivers", DEST_TRX);
+	reload_section(L, old, new, "extensions", DEST_EXTENSION);
+
+	/* The new configuration is the base of the next reload */
+	luaL_unref(L, LUA_REGISTRYINDEX, config_ref);
+	lua_pushvalue(L, new);
+	config_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	lua_settop(L, 0);
+}
+
+/* Reload the configuration when trxd receives SIGHUP */
+static void *
+reloader(void *arg)
+{
+	sigset_t set;
+	int sig;
+
+	if (pthread_detach(pthread_self())) {
+		syslog(LOG_ERR, "reloader: pthread_detach");
+		exit(1);
+	}
+
+	if (pthread_setname_np(pthread_self(), "reloader")) {
+		syslog(LOG_ERR, "reloader: pthread_setname_np");
+		exit(1);
+	}
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGHUP);
+	for (;;) {
+		if (sigwait(&set, &sig)) {
+			syslog(LOG_ERR, "reloader: sigwait");
+			exit(1);
+		}
+		reload();
+	}
+	return NULL;
 }
 
 int
@@ -221,9 +1143,10 @@ main(int argc, char *argv[])
 	struct stat sb;
 	struct addrinfo hints, *res, *res0;
 	lua_State *L;
-	pthread_t thread;
-	int fd, listen_fd[MAXLISTEN], i, ch, noannounce = 0, nodaemon = 0;
-	int error, val, top;
+	int listen_fd[MAXLISTEN], i, ch, noannounce = 0, nodaemon = 0;
+	int error, val, top, n, dispatchers = DISPATCHERS;
+	pthread_t reloader_thread;
+	sigset_t sigs;
 #ifdef USE_SDDM
 	pthread_t sd_event_handler_thread;
 	int monitor_systemd = 0;
@@ -337,6 +1260,20 @@ main(int argc, char *argv[])
 		exit(1);
 	}
 
+	/* Reloads happen after the working directory changed */
+	if ((config_file = realpath(cfg_file, NULL)) == NULL) {
+		syslog(LOG_ERR, "%s: %s", cfg_file, strerror(errno));
+		exit(1);
+	}
+
+	/* SIGHUP is handled by the reloader thread, block it in all others */
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGHUP);
+	if (pthread_sigmask(SIG_BLOCK, &sigs, NULL)) {
+		syslog(LOG_ERR, "pthread_sigmask");
+		exit(1);
+	}
+
 	if (pthread_mutex_init(&destination_mutex, NULL)) {
 		syslog(LOG_ERR, "pthread_mutex_init");
 		exit(1);
@@ -415,6 +1352,34 @@ main(int argc, char *argv[])
 				log_connections = lua_toboolean(L, -1);
 				lua_pop(L, 1);
 			}
+			lua_getfield(L, -1, "dispatchers");
+			if (lua_isinteger(L, -1))
+				dispatchers = lua_tointeger(L, -1);
+			lua_pop(L, 1);
+			lua_getfield(L, -1, "output-queue");
+			if (lua_istable(L, -1)) {
+				lua_getfield(L, -1, "length");
+				if (lua_isinteger(L, -1)) {
+					if (lua_tointeger(L, -1) < 1) {
+						syslog(LOG_ERR, "output queue "
+						    "length must be positive");
+						exit(1);
+					}
+					queue_length = lua_tointeger(L, -1);
+				}
+				lua_pop(L, 1);
+				lua_getfield(L, -1, "overflow");
+				if (lua_isstring(L, -1) &&
+				    sender_overflow_policy(
+				    lua_tostring(L, -1))) {
+					syslog(LOG_ERR, "unknown output queue "
+					    "overflow policy '%s'",
+					    lua_tostring(L, -1));
+					exit(1);
+				}
+				lua_pop(L, 1);
+			}
+			lua_pop(L, 1);
 			break;
 		case LUA_ERRRUN:
 		case LUA_ERRMEM:
@@ -505,6 +1470,20 @@ main(int argc, char *argv[])
 		}
 	}
 
+	if (dispatchers < 1) {
+		syslog(LOG_ERR, "at least one dispatcher is needed");
+		exit(1);
+	}
+
+	/* Writes to closed client connections must not terminate trxd */
+	signal(SIGPIPE, SIG_IGN);
+
+	/* Setup the reactor and the dispatcher threads for network clients */
+	reactor_init();
+	dispatcher_init(dispatchers);
+	poll_scheduler_init();
+	watchdog_init();
+
 	/* Setup the trx-controllers */
 	lua_getfield(L, -1, "transceivers");
 	if (lua_istable(L, -1)) {
@@ -512,271 +1491,17 @@ main(int argc, char *argv[])
 		lua_pushnil(L);
 		while (lua_next(L, top)) {
 			trx_controller_tag_t *t;
-			const char *p;
-			char trx_path[PATH_MAX];
-			const char *protocol = NULL;
-			char proto_path[PATH_MAX];
-
-			t = malloc(sizeof(trx_controller_tag_t));
-			t->name = strdup(lua_tostring(L, -2));
-			t->handler = t->response = NULL;
-			t->is_running = 0;
-			t->speed = 9600;
-			t->channel = 0;
-			t->audio_input = t->audio_output = NULL;
-			t->poller_required = 0;
-			t->poller_running = 0;
-			t->handler_running = 0;
-			t->senders = NULL;
-
-			lua_getfield(L, -1, "device");
-			if (!lua_isstring(L, -1)) {
-				syslog(LOG_ERR, "missing trx device path");
-				exit(1);
-			}
-			t->device = strdup(lua_tostring(L, -1));
-			lua_pop(L, 1);
-
-			if (*t->device == '/' && stat(t->device, &sb)) {
-				syslog(LOG_WARNING,
-				    "trxd: file not found %s\n", t->device);
-				free((void *)t->device);
-				free(t->name);
-				free(t);
-				lua_pop(L, 1);
-				continue;
-			}
-
-			lua_getfield(L, -1, "speed");
-			if (lua_isinteger(L, -1))
-				t->speed = lua_tointeger(L, -1);
-			lua_pop(L, 1);
-
-			lua_getfield(L, -1, "channel");
-			if (lua_isinteger(L, -1))
-				t->channel =lua_tointeger(L, -1);
-			lua_pop(L, 1);
-
-			lua_getfield(L, -1, "audio");
-			if (lua_istable(L, -1)) {
-				lua_getfield(L, -1, "input");
-				if (lua_isstring(L, -1))
-					t->audio_input =
-					    strdup(lua_tostring(L, -1));
-				lua_pop(L, 1);
-				lua_getfield(L, -1, "output");
-				if (lua_isstring(L, -1))
-					t->audio_output =
-					    strdup(lua_tostring(L, -1));
-				lua_pop(L, 1);
-			}
-			lua_pop(L, 1);
-
-			lua_getfield(L, -1, "trx");
-			if (!lua_isstring(L, -1)) {
-				syslog(LOG_ERR, "missing trx name");
-				exit(1);
-			}
-			t->trx = strdup(lua_tostring(L, -1));
-			lua_pop(L, 1);
-
-			lua_getfield(L, -1, "default");
-			t->is_default = lua_toboolean(L, -1);
-			lua_pop(L, 1);
-
-			/* Setup Lua */
-			t->L = luaL_newstate();
-			if (t->L == NULL) {
-				syslog(LOG_ERR, "cannot create Lua state");
-				exit(1);
-			}
-
-			luaL_openlibs(t->L);
-
-			luaopen_trx(t->L);
-			lua_setglobal(t->L, "trx");
-			luaopen_trx_controller(t->L);
-			lua_setglobal(t->L, "trxController");
-			luaopen_trxd(t->L);
-			lua_setglobal(t->L, "trxd");
-			luaopen_json(t->L);
-			lua_setglobal(t->L, "json");
-			luaopen_yaml(t->L);
-			lua_setglobal(t->L, "yaml");
-
-			lua_getglobal(t->L, "package");
-			lua_getfield(t->L, -1, "cpath");
-			lua_pushstring(t->L, ";");
-			lua_pushstring(t->L, _PATH_LUA_CPATH);
-			lua_concat(t->L, 3);
-			lua_setfield(t->L, -2, "cpath");
-			lua_pop(t->L, 1);
-
-			lua_getglobal(t->L, "package");
-			lua_getfield(t->L, -1, "path");
-			lua_pushstring(t->L, ";");
-			lua_pushstring(t->L, _PATH_LUA_PATH);
-			lua_concat(t->L, 3);
-			lua_setfield(t->L, -2, "path");
-			lua_pop(t->L, 1);
-
-			lua_getfield(L, -1, "path");
-			if (lua_isstring(L, -1)) {
-				p = lua_tostring(L, -1);
-				lua_getglobal(t->L, "package");
-				lua_getfield(t->L, -1, "path");
-				lua_pushstring(t->L, ";");
-				lua_pushstring(t->L, p);
-				lua_concat(t->L, 3);
-				lua_setfield(t->L, -2, "path");
-				lua_pop(t->L, 1);
-			}
-			lua_pop(L, 1);
-
-			lua_getfield(L, -1, "cpath");
-			if (lua_isstring(L, -1)) {
-				p = lua_tostring(L, -1);
-				lua_getglobal(t->L, "package");
-				lua_getfield(t->L, -1, "cpath");
-				lua_pushstring(t->L, ";");
-				lua_pushstring(t->L, p);
-				lua_concat(t->L, 3);
-				lua_setfield(t->L, -2, "cpath");
-				lua_pop(t->L, 1);
-			}
-			lua_pop(L, 1);
-
-			/* Load trx description and protocol driver */
-			snprintf(trx_path, sizeof(trx_path), "%s/%s.yaml",
-			    _PATH_TRX, t->trx);
-
-			if (stat(trx_path, &sb)) {
-				syslog(LOG_ERR, "%s: file not found", trx_path);
-				exit(1);
-			}
-
-			lua_getglobal(t->L, "yaml");
-			lua_getfield(t->L, -1, "parsefile");
-			lua_pushstring(t->L, trx_path);
-
-			switch (lua_pcall(t->L, 1, 1, 0)) {
-			case LUA_OK:
-				lua_getfield(t->L, -1, "protocol");
-				protocol = lua_tostring(t->L, -1);
-				if (protocol == NULL) {
-					syslog(LOG_ERR,
-					    "%s: no protocol specified",
-					    trx_path);
-					exit(1);
-				}
-				lua_pop(t->L, 1);
-				lua_setglobal(t->L, "_trx");
-				break;
-			case LUA_ERRRUN:
-			case LUA_ERRMEM:
-			case LUA_ERRERR:
-				syslog(LOG_ERR, "%s: %s", trx_path,
-				    lua_tostring(t->L, -1));
-				exit(1);
-				break;
-			}
-
-			if (protocol == NULL) {
-				syslog(LOG_ERR, "%s: no protocol defined",
-				    trx_path);
-				exit(1);
-			}
-
-			snprintf(proto_path, sizeof(proto_path), "%s/%s.lua",
-			    _PATH_PROTOCOL, protocol);
 
-			if (stat(proto_path, &sb)) {
-				syslog(LOG_ERR, "protocol not found: %s",
-				    protocol);
+			t = trx_new(L, lua_tostring(L, -2));
+			if (t == NULL)
 				exit(1);
-			}
-			if (luaL_dofile(t->L, proto_path)) {
-				syslog(LOG_ERR, "%s", lua_tostring(t->L, -1));
-				exit(1);
-			}
-
-			lua_setglobal(t->L, "_protocol");
-
-			if (luaL_dostring(t->L, "for k, v in pairs(_trx) do "
-			    "_protocol[k] = v end")) {
-				syslog(LOG_ERR, "%s", lua_tostring(t->L, -1));
-				exit(1);
-			}
-
-			if (luaL_dofile(t->L, _PATH_TRX_CONTROLLER)) {
-				syslog(LOG_ERR, "%s", lua_tostring(t->L, -1));
-				exit(1);
-			}
-			if (lua_type(t->L, -1) != LUA_TTABLE) {
-				syslog(LOG_ERR, "table expected");
-				exit(1);
-			} else
-				t->ref = luaL_ref(t->L, LUA_REGISTRYINDEX);
-
-			/*
-			 * Setup the registerDriver function, but don't call
-			 * it yet as the CAT device is not yet open and it
-			 * might be needed by the initialize function.
-			 */
-			lua_geti(t->L, LUA_REGISTRYINDEX, t->ref);
-			lua_getfield(t->L, -1, "registerDriver");
-			lua_pushstring(t->L, t->name);
-			lua_pushstring(t->L, t->device);
-
-			lua_getglobal(t->L, "_protocol");
-			lua_getfield(t->L, -1,
-			    "statusUpdatesRequirePolling");
-			t->poller_required = lua_toboolean(t->L, -1);
-			lua_pop(t->L, 1);
-
-			lua_getfield(L, -1, "configuration");
-			if (lua_istable(L, -1)) {
-				proxy_map(L, t->L, lua_gettop(t->L));
-				lua_setglobal(t->L, "_config");
-				if (luaL_dostring(t->L, "for k, v in "
-				    "pairs(_config) do _G[k] = v end "
-				    "_config = nil")) {
-					syslog(LOG_ERR, "%s",
-					    lua_tostring(t->L, -1));
-					exit(1);
-				}
-			}
-			lua_pop(L, 1);
-
-			lua_getfield(L, -1, "audio");
-			if (lua_istable(L, -1))
-				proxy_map(L, t->L, lua_gettop(t->L));
-			else
-				lua_newtable(t->L);
-			lua_setfield(t->L, -2, "audio");
-			lua_pop(L, 1);
 
 			if (add_destination(t->name, DEST_TRX, t)) {
 				syslog(LOG_ERR,
 				    "transceivers: names must be unique");
 				exit(1);
 			}
-
-			if (pthread_mutex_init(&t->mutex, NULL))
-				goto terminate;
-
-			if (pthread_mutex_init(&t->mutex2, NULL))
-				goto terminate;
-
-			if (pthread_cond_init(&t->cond1, NULL))
-				goto terminate;
-
-			if (pthread_cond_init(&t->cond2, NULL))
-				goto terminate;
-
-			/* Create the trx-controller thread */
-			pthread_create(&t->trx_controller, NULL, trx_controller,
-			    t);
+			trx_start(t);
 			lua_pop(L, 1);
 		}
 	} else if (verbose)
@@ -793,12 +1518,12 @@ main(int argc, char *argv[])
 
 			t = malloc(sizeof(gpio_controller_tag_t));
 			t->name = strdup(lua_tostring(L, -2));
-			t->handler = t->response = NULL;
 			t->is_running = 0;
 			t->speed = 9600;
 			t->poller_required = 0;
-			t->poller_running = 0;
+			poll_timer_init(&t->poll, gpio_poll, t);
 			t->senders = NULL;
+			command_queue_init(&t->queue);
 
 			lua_getfield(L, -1, "device");
 			if (!lua_isstring(L, -1)) {
@@ -813,6 +1538,10 @@ main(int argc, char *argv[])
 				t->speed =lua_tointeger(L, -1);
 			lua_pop(L, 1);
 
+			if (polling(L, t->name, &t->poll) ||
+			    deadlines(L, t->name, &t->queue))
+				exit(1);
+
 			lua_getfield(L, -1, "driver");
 			if (!lua_isstring(L, -1)) {
 				syslog(LOG_ERR, "missing gpio driver name");
@@ -829,15 +1558,6 @@ main(int argc, char *argv[])
 			if (pthread_mutex_init(&t->mutex, NULL))
 				goto terminate;
 
-			if (pthread_mutex_init(&t->mutex2, NULL))
-				goto terminate;
-
-			if (pthread_cond_init(&t->cond1, NULL))
-				goto terminate;
-
-			if (pthread_cond_init(&t->cond2, NULL))
-				goto terminate;
-
 			/* Create the gpio-controller thread */
 			pthread_create(&t->gpio_controller, NULL,
 			    gpio_controller, t);
@@ -857,7 +1577,6 @@ main(int argc, char *argv[])
 
 			t = malloc(sizeof(relay_controller_tag_t));
 			t->name = strdup(lua_tostring(L, -2));
-			t->handler = t->response = NULL;
 			t->is_running = 0;
 			t->poller_running = 0;
 
@@ -878,14 +1597,7 @@ main(int argc, char *argv[])
 			if (pthread_mutex_init(&t->mutex, NULL))
 				goto terminate;
 
-			if (pthread_mutex_init(&t->mutex2, NULL))
-				goto terminate;
-
-			if (pthread_cond_init(&t->cond1, NULL))
-				goto terminate;
-
-			if (pthread_cond_init(&t->cond2, NULL))
-				goto terminate;
+			command_queue_init(&t->queue);
 
 			/* Create the relay-controller thread */
 			pthread_create(&t->relay_controller, NULL,
@@ -903,71 +1615,52 @@ main(int argc, char *argv[])
 		lua_pushnil(L);
 		while (lua_next(L, top)) {
 			extension_tag_t *t;
-			const char *p;
-			char script[PATH_MAX], *name;
+			const char *name;
 
-			t = malloc(sizeof(extension_tag_t));
-			if (t == NULL) {
-				syslog(LOG_ERR, "memory allocation failure");
+			name = lua_tostring(L, -2);
+			t = extension_new(L);
+			if (t == NULL)
 				exit(1);
-			}
-			t->has_config = 0;
-			t->listeners = NULL;
-			t->L = luaL_newstate();
-			if (t->L == NULL) {
-				syslog(LOG_ERR, "cannot create Lua state");
+
+			if (add_destination(name, DEST_EXTENSION, t)) {
+				syslog(LOG_ERR, "names must be unique");
 				exit(1);
 			}
-			luaL_openlibs(t->L);
-			luaopen_trxd(t->L);
-			lua_setglobal(t->L, "trxd");
-			luaopen_json(t->L);
-			lua_setglobal(t->L, "json");
-
-			t->call = t->done = 0;
-			name = (char *)lua_tostring(L, -2);
-
-			lua_getglobal(t->L, "package");
-			lua_getfield(t->L, -1, "cpath");
-			lua_pushstring(t->L, ";");
-			lua_pushstring(t->L, _PATH_LUA_CPATH);
-			lua_concat(t->L, 3);
-			lua_setfield(t->L, -2, "cpath");
-			lua_pop(t->L, 1);
-
-			lua_getglobal(t->L, "package");
-			lua_getfield(t->L, -1, "path");
-			lua_pushstring(t->L, ";");
-			lua_pushstring(t->L, _PATH_LUA_PATH);
-			lua_concat(t->L, 3);
-			lua_setfield(t->L, -2, "path");
-			lua_pop(t->L, 1);
+			extension_start(t);
+			lua_pop(L, 1);
+		}
+	} else if (verbose)
+		syslog(LOG_NOTICE, "no extensions defined\n");
+	lua_pop(L, 1);
 
-			lua_getfield(L, -1, "path");
-			if (lua_isstring(L, -1)) {
-				p = lua_tostring(L, -1);
-				lua_getglobal(t->L, "package");
-				lua_getfield(t->L, -1, "path");
-				lua_pushstring(t->L, ";");
-				lua_pushstring(t->L, p);
-				lua_concat(t->L, 3);
-				lua_setfield(t->L, -2, "path");
-				lua_pop(t->L, 1);
+	/*
+	 * Setup private extensions.  They are only checked here, each client
+	 * gets its own instance when it first sends a request to one.
+	 */
+	lua_getfield(L, -1, "private-extensions");
+	if (lua_istable(L, -1)) {
+		top = lua_gettop(L);
+		lua_pushnil(L);
+		while (lua_next(L, top)) {
+			private_extension_t *p, *n;
+			destination_t *d;
+			const char *name;
+			char script[PATH_MAX];
+
+			p = calloc(1, sizeof(private_extension_t));
+			if (p == NULL) {
+				syslog(LOG_ERR, "memory allocation failure");
+				exit(1);
 			}
-			lua_pop(L, 1);
+			name = lua_tostring(L, -2);
 
-			lua_getfield(L, -1, "cpath");
-			if (lua_isstring(L, -1)) {
-				p = lua_tostring(L, -1);
-				lua_getglobal(t->L, "package");
-				lua_getfield(t->L, -1, "cpath");
-				lua_pushstring(t->L, ";");
-				lua_pushstring(t->L, p);
-				lua_concat(t->L, 3);
-				lua_setfield(t->L, -2, "cpath");
-				lua_pop(t->L, 1);
+			for (d = destination; d != NULL; d = d->next)
+				if (!strcmp(d->name, name))
+					break;
+			if (d != NULL) {
+				syslog(LOG_ERR, "names must be unique");
+				exit(1);
 			}
-			lua_pop(L, 1);
 
 			lua_getfield(L, -1, "script");
 			if (!lua_isstring(L, -1)) {
@@ -975,87 +1668,91 @@ main(int argc, char *argv[])
 				    "missing extension script name");
 				exit(1);
 			}
-			p = lua_tostring(L, -1);
-
-			if (strchr(p, '/')) {
+			if (strchr(lua_tostring(L, -1), '/')) {
 				syslog(LOG_ERR,
 				    "script name must not contain slashes");
 				exit(1);
 			}
 			snprintf(script, sizeof(script), "%s/%s.lua",
-			    _PATH_EXTENSION, p);
-
+			    _PATH_EXTENSION, lua_tostring(L, -1));
 			lua_pop(L, 1);
 
-			if (luaL_loadfile(t->L, script)) {
-				syslog(LOG_ERR, "%s", lua_tostring(t->L, -1));
+			if (access(script, R_OK)) {
+				syslog(LOG_ERR, "%s: %s", script,
+				    strerror(errno));
 				exit(1);
 			}
 
-			lua_getfield(L, -1, "configuration");
-			if (lua_istable(L, -1)) {
-				proxy_map(L, t->L, lua_gettop(t->L));
-				t->has_config = 1;
-			}
-			lua_pop(L, 1);
-
 			lua_getfield(L, -1, "callable");
-			if (lua_isboolean(L, -1))
-				t->is_callable = lua_toboolean(L, -1);
-			else
-				t->is_callable = 1;
+			if (lua_isboolean(L, -1) && !lua_toboolean(L, -1)) {
+				syslog(LOG_ERR,
+				    "private extensions must be callable");
+				exit(1);
+			}
 			lua_pop(L, 1);
 
-			if (add_destination(name, DEST_EXTENSION, t)) {
-				syslog(LOG_ERR, "names must be unique");
+			p->name = strdup(name);
+			p->script = strdup(script);
+			if (p->name == NULL || p->script == NULL) {
+				syslog(LOG_ERR, "memory allocation failure");
 				exit(1);
 			}
 
-			if (pthread_mutex_init(&t->mutex, NULL))
-				goto terminate;
-
-			if (pthread_mutex_init(&t->mutex2, NULL))
-				goto terminate;
-
-			if (pthread_cond_init(&t->cond1, NULL))
-				goto terminate;
+			lua_getfield(L, -1, "path");
+			if (lua_isstring(L, -1)) {
+				p->path = strdup(lua_tostring(L, -1));
+				if (p->path == NULL) {
+					syslog(LOG_ERR,
+					    "memory allocation failure");
+					exit(1);
+				}
+			}
+			lua_pop(L, 1);
 
-			if (pthread_cond_init(&t->cond2, NULL))
-				goto terminate;
+			lua_getfield(L, -1, "cpath");
+			if (lua_isstring(L, -1)) {
+				p->cpath = strdup(lua_tostring(L, -1));
+				if (p->cpath == NULL) {
+					syslog(LOG_ERR,
+					    "memory allocation failure");
+					exit(1);
+				}
+			}
+			lua_pop(L, 1);
 
-			/* Create the extension thread */
-			pthread_create(&t->extension, NULL, extension, t);
+			/* Passed to each instance in JSON format */
+			lua_getfield(L, -1, "configuration");
+			if (lua_istable(L, -1)) {
+				lua_getglobal(L, "json");
+				lua_getfield(L, -1, "encode");
+				lua_pushvalue(L, -3);
+				if (lua_pcall(L, 1, 1, 0) != LUA_OK) {
+					syslog(LOG_ERR, "%s",
+					    lua_tostring(L, -1));
+					exit(1);
+				}
+				p->configuration = strdup(lua_tostring(L, -1));
+				if (p->configuration == NULL) {
+					syslog(LOG_ERR,
+					    "memory allocation failure");
+					exit(1);
+				}
+				lua_pop(L, 2);
+			}
 			lua_pop(L, 1);
-		}
-	} else if (verbose)
-		syslog(LOG_NOTICE, "no extensions defined\n");
-	lua_pop(L, 1);
 
-#if 0
-	/* Setup private extensions */
-	lua_getglobal(L, "json");
-	lua_getfield(L, -1, "encode");
-	lua_getfield(L, -3, "private-extensions");
-	if (lua_istable(L, -1)) {
-		switch (lua_pcall(L, 1, 1, 0)) {
-		case LUA_OK:
-			private_extensions = strdup(lua_tostring(L, -1));
+			for (n = private_extensions; n != NULL; n = n->next)
+				if (!strcmp(n->name, p->name)) {
+					syslog(LOG_ERR,
+					    "names must be unique");
+					exit(1);
+				}
+			p->next = private_extensions;
+			private_extensions = p;
 			lua_pop(L, 1);
-			if (private_extensions == NULL) {
-				syslog(LOG_ERR, "memory error");
-				exit(1);
-			}
-			break;
-		case LUA_ERRRUN:
-		case LUA_ERRMEM:
-		case LUA_ERRERR:
-			syslog(LOG_ERR, "%s", lua_tostring(L, -1));
-			exit(1);
-			break;
 		}
 	}
-	lua_pop(L, 2);
-#endif
+	lua_pop(L, 1);
 
 	/* Setup WebSocket listening */
 	lua_getfield(L, -1, "websocket");
@@ -1131,16 +1828,16 @@ main(int argc, char *argv[])
 	lua_getfield(L, -1, "nmea");
 	if (lua_istable(L, -1)) {
 		nmea_tag_t *t;
-		struct termios tty;
-		const char *device;
-		int speed = 9600;
-		int channel = 0;
 
 		t = malloc(sizeof(nmea_tag_t));
 		if (t == NULL) {
 			syslog(LOG_ERR, "memory allocation error");
 			exit(1);
 		}
+		t->baudrate = 9600;
+		t->channel = 0;
+		t->fd = -1;
+		reconnect_init(&t->reconnect);
 		t->year = t->month = t->day = 0;
 		t->hour = t->minute = t->second = 0;
 		t->status = 0;
@@ -1154,64 +1851,19 @@ main(int argc, char *argv[])
 			syslog(LOG_ERR, "missing nmea device");
 			exit(1);
 		}
-		device = lua_tostring(L, -1);
+		t->device = strdup(lua_tostring(L, -1));
 		lua_pop(L, 1);
 
 		lua_getfield(L, -1, "speed");
 		if (lua_isinteger(L, -1))
-			speed = lua_tointeger(L, -1);
+			t->baudrate = lua_tointeger(L, -1);
 		lua_pop(L, 1);
 
 		lua_getfield(L, -1, "channel");
 		if (lua_isinteger(L, -1))
-			channel = lua_tointeger(L, -1);
+			t->channel = lua_tointeger(L, -1);
 		lua_pop(L, 1);
 
-		if (*device == '/') {
-			/* Assume device under /dev */
-			t->fd = open(device, O_RDWR);
-			if (t->fd == -1) {
-				syslog(LOG_ERR, "cannot open nmea device");
-				exit(1);
-			}
-
-			if (isatty(t->fd)) {
-				if (tcgetattr(t->fd, &tty) < 0) {
-					syslog(LOG_ERR, "tcgetattr");
-					exit(1);
-				} else {
-					cfmakeraw(&tty);
-					tty.c_cflag |= CLOCAL;
-					cfsetspeed(&tty, speed);
-
-					if (tcsetattr(t->fd, TCSADRAIN, &tty)
-					   < 0) {
-						syslog(LOG_ERR,
-						    "tcsetattr");
-						exit(1);
-					}
-				}
-			}
-		} else if (strlen(device) == 17) {
-			/* Assume Bluetooth RFCOMM */
-			struct sockaddr_rc addr = { 0 };
-
-			fd = socket(AF_BLUETOOTH, SOCK_STREAM, BTPROTO_RFCOMM);
-
-			addr.rc_family = AF_BLUETOOTH;
-			addr.rc_channel = (uint8_t) channel;
-			str2ba(device, &addr.rc_bdaddr);
-			if (connect(fd,
-			    (struct sockaddr *)&addr, sizeof(addr))) {
-				syslog(LOG_ERR, "can't connect to %s",
-				    device);
-				exit(1);
-			}
-		} else {
-			syslog(LOG_ERR, "unknown device %s", device);
-			exit(1);
-		}
-
 		if (add_destination("nmea", DEST_INTERNAL, t)) {
 			syslog(LOG_ERR, "nmea: names must be unique");
 			exit(1);
@@ -1220,7 +1872,7 @@ main(int argc, char *argv[])
 		if (pthread_mutex_init(&t->mutex, NULL))
 			goto terminate;
 
-		/* Create the nmea-handler thread */
+		/* The nmea-handler thread opens the device */
 		pthread_create(&t->nmea_handler, NULL, nmea_handler, t);
 		lua_pop(L, 1);
 	}
@@ -1247,8 +1899,11 @@ main(int argc, char *argv[])
 		exit(1);
 	}
 
-	/* The Lua state is no longer needed below this point */
-	lua_close(L);
+	/* Keep the configuration and reload it on SIGHUP */
+	config_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	lua_settop(L, 0);
+	config = L;
+	pthread_create(&reloader_thread, NULL, reloader, NULL);
 
 	i = 0;
 	for (res = res0; res != NULL && i < MAXLISTEN;
@@ -1277,7 +1932,7 @@ main(int argc, char *argv[])
 			close(listen_fd[i]);
 			continue;
 		}
-		if (listen(listen_fd[i], 5)) {
+		if (listen(listen_fd[i], SOMAXCONN)) {
 			syslog(LOG_ERR, "listen: %s", strerror(errno));
 			close(listen_fd[i]);
 			continue;
@@ -1285,65 +1940,11 @@ main(int argc, char *argv[])
 		i++;
 	}
 
-	/* Wait for connections as long as trx_control runs */
-	while (1) {
-		struct timeval	 tv;
-		fd_set		 readfds;
-		int		 maxfd = -1;
-		int		 r;
-
-		FD_ZERO(&readfds);
-		for (i = 0; i < MAXLISTEN; ++i) {
-			if (listen_fd[i] != -1) {
-				FD_SET(listen_fd[i], &readfds);
-				if (listen_fd[i] > maxfd)
-					maxfd = listen_fd[i];
-			}
-		}
-		tv.tv_sec = 0;
-		tv.tv_usec = 200000;
-		r = select(maxfd + 1, &readfds, NULL, NULL, &tv);
-		if (r < 0) {
-			if (errno != EINTR) {
-				syslog(LOG_ERR, "select: %s", strerror(errno));
-				break;
-			}
-		} else if (r == 0)
-			continue;
+	/* Hand the listening sockets to the reactor and run it */
+	for (n = 0; n < i; n++)
+		reactor_listen(listen_fd[n]);
+	reactor();
 
-		for (i = 0; i < MAXLISTEN; ++i) {
-			struct sockaddr_storage	 sa;
-			socklen_t		 len;
-			int			 *client_fd, error;
-			char			 hbuf[NI_MAXHOST];
-
-			client_fd = malloc(sizeof(int));
-
-			if (listen_fd[i] == -1 ||
-			    !FD_ISSET(listen_fd[i], &readfds))
-				continue;
-			memset(&sa, 0, sizeof(sa));
-			len = sizeof(sa);
-			*client_fd = accept(listen_fd[i],
-			    (struct sockaddr *)&sa, &len);
-			if (*client_fd < 0) {
-				syslog(LOG_ERR, "accept: %s", strerror(errno));
-				free(client_fd);
-				break;
-			}
-			error = getnameinfo((struct sockaddr *)&sa, len,
-			    hbuf, sizeof(hbuf), NULL, 0, NI_NUMERICHOST);
-			if (error)
-				syslog(LOG_ERR, "getnameinfo: %s",
-				    gai_strerror(error));
-			if (log_connections)
-				syslog(LOG_INFO, "socket connection from %s",
-				    hbuf);
-
-			pthread_create(&thread, NULL, socket_handler,
-			    client_fd);
-		}
-	}
 terminate:
 	closelog();
 	return 0;
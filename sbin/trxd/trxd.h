@@ -24,6 +24,7 @@
 #define __TRXD_H__
 
 #include <pthread.h>
+#include <semaphore.h>
 
 #include <openssl/ssl.h>
 
@@ -33,6 +34,13 @@
 #define TRXD_USER	"trxd"
 #define TRXD_GROUP	"trxd"
 
+#define CAT_INPUT_SIZE	4096	/* Size of the CAT input ring buffer */
+#define MAX_REQUEST	(1024 * 1024)	/* Longest request of a client */
+#define MAX_QUEUED	32	/* Requests of a client before it is paused */
+#define CACHE_WINDOW	100	/* Serve get-* requests from the cache, ms */
+#define REQUEST_TIMEOUT	10000	/* Default deadline of a request, ms */
+#define WATCHDOG_TIMEOUT 3000	/* Longest command of a healthy controller */
+
 typedef struct sender_tag sender_tag_t;
 
 typedef struct sender_list {
@@ -40,16 +48,98 @@ typedef struct sender_list {
 	struct sender_list	*next;
 } sender_list_t;
 
-typedef struct trx_controller_tag {
-	/* The first mutex locks the trx-controller */
-	pthread_mutex_t		 mutex;
+/*
+ * A command for a controller thread.  Any thread can queue commands to a
+ * controller without taking a lock, the controller executes them one at a
+ * time in its Lua state.  Afterwards it calls the done function of the
+ * command with the response of the handler, if there is one.  The done
+ * function owns the command.
+ */
+typedef struct request request_t;
+
+/* Priority classes, a controller executes the higher classes first */
+enum CommandPriority {
+	PRIO_REALTIME,		/* PTT, keying */
+	PRIO_INTERACTIVE,	/* Client requests */
+	PRIO_BACKGROUND,	/* Polling */
+	PRIO_MAX
+};
 
-	pthread_mutex_t		 mutex2;
-	pthread_cond_t		 cond1;	/* A handler is set */
-	const char		*handler;
+typedef struct command {
+	struct command		*next;
+	const char		*handler;	/* Name of the handler */
+	int			 prio;		/* Priority class */
+	request_t		*request;	/* Decoded for the handler */
+	int			 superseded;	/* By a later request */
+	struct command		*followers;	/* Share the result */
+	int			 frame;		/* Pass the next CAT frame */
+	int			 result;	/* Integer returned */
+	void			(*done)(struct command *, const char *,
+				    size_t);
+	void			*arg;
+} command_t;
 
-	pthread_cond_t		 cond2;	/* A response is set */
-	char			*response;
+/*
+ * Queued commands, the producers push them on a lock-free stack.  The
+ * controller moves them to a list per priority class, keeping their order.
+ * The watchdog marks the queue degraded when a command takes longer than
+ * the watchdog timeout, until a command completes in time again.  While
+ * the device is offline, requests fail without being executed.
+ */
+typedef struct command_queue {
+	command_t		*head;		/* Most recently queued */
+	command_t		*next[PRIO_MAX];
+	command_t		**tail[PRIO_MAX];
+	sem_t			 pending;
+	unsigned int		 queued;	/* Submitted, not yet done */
+	unsigned long		 busy;		/* Executing since, or 0 */
+	int			 degraded;
+	int			 offline;	/* The device went away */
+	int			 timeout;	/* Default request deadline */
+	int			 watchdog;	/* milliseconds */
+} command_queue_t;
+
+/*
+ * A polled destination, driven by the poll-scheduler.  The interval is
+ * reset to the minimum after a change and doubles while nothing changes.
+ */
+#define POLL_MIN_INTERVAL	200	/* milliseconds */
+#define POLL_MAX_INTERVAL	3200
+
+typedef struct poll_timer {
+	struct poll_timer	*next;		/* In the wheel slot */
+	struct poll_timer	**prev;		/* NULL if not in the wheel */
+	unsigned int		 slot;
+	unsigned int		 rounds;	/* Wheel turns to wait */
+	int			 active;	/* There are subscribers */
+	int			 inflight;	/* Poll has been submitted */
+	int			 activity;	/* Client changed something */
+	int			 min_interval;
+	int			 max_interval;
+	int			 interval;
+	void			(*poll)(struct poll_timer *);
+	void			*arg;
+} poll_timer_t;
+
+/*
+ * A device that went away is reopened with an exponential backoff.  The
+ * device monitor cuts the wait short when the device is attached again.
+ */
+#define RECONNECT_MIN		1000	/* milliseconds */
+#define RECONNECT_MAX		60000
+
+typedef struct reconnect {
+	pthread_mutex_t		 mutex;
+	pthread_cond_t		 cond;		/* The device is attached */
+	int			 attached;
+	int			 stop;		/* See reconnect_stop() */
+	int			 interval;	/* Until the next attempt */
+} reconnect_t;
+
+typedef struct trx_controller_tag {
+	/* The mutex locks the list of senders */
+	pthread_mutex_t		 mutex;
+	command_queue_t		 queue;
 
 	char			*name;
 	const char		*device;
@@ -59,38 +149,40 @@ typedef struct trx_controller_tag {
 	char			*audio_output;
 	const char		*trx;		/* trx description (YAML) */
 	int			 is_default;
+	int			 cache_window;	/* milliseconds */
 
 	lua_State		*L;
 	int			 ref;
 
-	char			*data;
-	size_t			 len;
-
-	int			 client_fd;
 	int			 cat_device;
+	int			 reopen;	/* Set by the watchdog */
+	reconnect_t		 reconnect;
 	pthread_t		 trx_controller;
-	pthread_t		 trx_poller;
 	pthread_t		 trx_handler;
 	int			 is_running;
 	int			 poller_required;
-	int			 poller_running;
-	int			 poller_suspended;
+	poll_timer_t		 poll;
 	int			 handler_running;
 	int			 handler_eol;
+	int			 threads;	/* trx-input and trx-handler */
+
+	/* CAT input ring buffer, filled by the trx-input thread */
+	pthread_mutex_t		 input_mutex;
+	pthread_cond_t		 input_cond;	/* Input has arrived */
+	pthread_t		 trx_input;
+	int			 input_wakeup[2];	/* Device reopened */
+	unsigned char		 input[CAT_INPUT_SIZE];
+	size_t			 input_head;
+	size_t			 input_len;
+	unsigned long		 input_overruns;
+	int			 input_stop;	/* The controller retired */
 
 	sender_list_t		*senders;
 } trx_controller_tag_t;
 
 typedef struct sdr_controller_tag {
-	/* The first mutex locks the sdr-controller */
 	pthread_mutex_t		 mutex;
-
-	pthread_mutex_t		 mutex2;
-	pthread_cond_t		 cond1;	/* A handler is set */
-	const char		*handler;
-
-	pthread_cond_t		 cond2;	/* A response is set */
-	char			*response;
+	command_queue_t		 queue;
 
 	char			*name;
 	const char		*device;
@@ -102,10 +194,6 @@ typedef struct sdr_controller_tag {
 	lua_State		*L;
 	int			 ref;
 
-	char			*data;
-	size_t			 len;
-
-	int			 client_fd;
 	int			 cat_device;
 	pthread_t		 sdr_controller;
 	pthread_t		 sdr_handler;
@@ -121,6 +209,11 @@ typedef struct sdr_controller_tag {
 typedef struct nmea_tag {
 	pthread_mutex_t		 mutex;
 
+	const char		*device;
+	int			 baudrate;	/* For serial devices */
+	int			 channel;	/* For RFCOMM devices */
+	reconnect_t		 reconnect;
+
 	int			 fd;
 	pthread_t		 nmea_handler;
 
@@ -138,15 +231,8 @@ typedef struct nmea_tag {
 } nmea_tag_t;
 
 typedef struct gpio_controller_tag {
-	/* The first mutex locks the gpio-controller */
 	pthread_mutex_t		 mutex;
-
-	pthread_mutex_t		 mutex2;
-	pthread_cond_t		 cond1;	/* A handler is set */
-	const char		*handler;
-
-	pthread_cond_t		 cond2;	/* A response is set */
-	char			*response;
+	command_queue_t		 queue;
 
 	char			*name;
 	const char		*device;
@@ -156,41 +242,26 @@ typedef struct gpio_controller_tag {
 	lua_State		*L;
 	int			 ref;
 
-	char			*data;
-	size_t			 len;
-
 	int			 gpio_device;
 	pthread_t		 gpio_controller;
-	pthread_t		 gpio_poller;
 	pthread_t		 gpio_handler;
 	int			 is_running;
 	int			 poller_required;
-	int			 poller_running;
-	int			 poller_suspended;
+	poll_timer_t		 poll;
 	int			 handler_running;
 
 	sender_list_t		*senders;
 } gpio_controller_tag_t;
 
 typedef struct relay_controller_tag {
-	/* The first mutex locks the relay-controller */
 	pthread_mutex_t		 mutex;
-
-	pthread_mutex_t		 mutex2;
-	pthread_cond_t		 cond1;	/* A handler is set */
-	const char		*handler;
-
-	pthread_cond_t		 cond2;	/* A response is set */
-	char			*response;
+	command_queue_t		 queue;
 
 	char			*name;
 	const char		*device;
 	const char		*driver;
 	int			 is_default;
 
-	char			*data;
-	size_t			 len;
-
 	pthread_t		 relay_controller;
 	pthread_t		 relay_poller;
 	pthread_t		 relay_handler;
@@ -207,9 +278,12 @@ typedef struct extension_tag {
 
 	pthread_cond_t		 cond1;	/* Call the extension */
 	int			 call;
+	int			 terminate;	/* The client went away */
 
 	pthread_cond_t		 cond2;	/* The extension returned */
 	int			 done;
+	int			 retired;	/* Removed by a reload */
+	int			 exited;	/* The thread is done with it */
 	int			 has_config;
 	int			 is_callable;
 
@@ -230,9 +304,19 @@ enum DestinationType {
 	DEST_EXTENSION
 };
 
+/*
+ * A destination removed by a reload is unlinked but not freed, clients
+ * and dispatchers may still refer to it.  Its tag is freed once no
+ * dispatcher uses it anymore, see destination_stop(), the destination
+ * itself once no client has it as its current destination.  The list and
+ * the references are locked by destination_mutex.
+ */
 typedef struct destination {
 	char			*name;
 	enum DestinationType	 type;
+	int			 retired;
+	int			 users;		/* Dispatchers using the tag */
+	int			 refs;		/* The list and clients */
 
 	union {
 		trx_controller_tag_t	*trx;
@@ -247,6 +331,19 @@ typedef struct destination {
 	struct destination	*next;
 } destination_t;
 
+/*
+ * A private extension is configured once and instantiated for a client
+ * when the client addresses it for the first time.
+ */
+typedef struct private_extension {
+	char			*name;
+	char			*script;	/* Path of the Lua script */
+	char			*path;
+	char			*cpath;
+	char			*configuration;	/* JSON */
+	struct private_extension *next;
+} private_extension_t;
+
 typedef struct signal_input {
 	extension_tag_t	*extension;
 	int		 fd;
@@ -279,51 +376,215 @@ typedef struct websocket {
 	/* For secure websockets */
 	SSL_CTX			*ctx;
 	SSL			*ssl;
-
-	sender_tag_t		*sender;
-	pthread_t		 listen_thread;
 } websocket_t;
 
 /*
- * A dispatcher thread is needed per client.  It receives the request from
- * a socket-handler or websocket-handler and dispatches it to the right
- * controller (or extension).
+ * A fixed pool of dispatcher threads handles the requests of all clients.
+ * Each dispatcher thread has its own Lua state.  The requests of a client
+ * are handled in the order they arrive, one at a time.
  */
 typedef struct dispatcher_tag {
-	/* The first mutex locks the dispatcher */
-	pthread_mutex_t		 mutex;
-	pthread_mutex_t		 mutex2;
-	pthread_cond_t		 cond;	/* data is ready to be dispatched */
-	pthread_cond_t		 cond2;	/* Request has been handled */
+	lua_State		*L;
+	pthread_t		 dispatcher;
+} dispatcher_tag_t;
 
-	char			*data;	/* The data received on the socket */
-	size_t			 len;	/* Length of the data */
+/* Requests handled by the dispatcher itself */
+enum Request {
+	REQ_NONE,		/* No request member */
+	REQ_OTHER,		/* Handled by the destination */
+	REQ_START_STATUS_UPDATES,
+	REQ_STOP_STATUS_UPDATES,
+	REQ_LISTEN,
+	REQ_UNLISTEN,
+	REQ_LIST_DESTINATION,
+	REQ_VERSION,
+	REQ_QUEUE_STATUS,
+	REQ_BATCH,		/* Sub-requests run in one controller turn */
+	REQ_SET_ENCODING,
+	REQ_MAX
+};
 
+/* The routing fields of a request, found without decoding the request */
+#define ENVELOPE_SIZE	256
+
+typedef struct envelope {
+	enum Request		 req;
+	const char		*to;
+	const char		*request;
+	const char		*type;
+	const char		*vfo;
+	const char		*encoding;
+	const char		*id;	/* Raw JSON value, not terminated */
+	size_t			 idlen;
+	int			 coalesce;	/* Only the last value counts */
+	int			 timeout;	/* Client deadline, ms, or 0 */
+	int			 readonly;	/* A get-* request */
+	char			*buf;	/* fixed, or allocated if too small */
+	size_t			 bufsize;
+	char			 fixed[ENVELOPE_SIZE];
+} envelope_t;
+
+#define SUPERSEDED	"{\"status\":\"Superseded\",\"response\":\"%s\"," \
+			"\"reason\":\"Superseded by a later request\"}"
+#define EXPIRED		"{\"status\":\"Expired\",\"response\":\"%s\"," \
+			"\"reason\":\"Deadline passed before handling\"}"
+#define DEGRADED	"{\"status\":\"Degraded\",\"response\":\"%s\"," \
+			"\"reason\":\"Destination is not responding\"}"
+#define OFFLINE		"{\"status\":\"Offline\",\"response\":\"%s\"," \
+			"\"reason\":\"Destination is offline\"}"
+
+/* A request received from a client, waiting to be dispatched */
+struct request {
+	struct request		*next;
 	sender_tag_t		*sender;
-	pthread_t		 dispatcher;
-} dispatcher_tag_t;
+	char			*data;	/* NULL when the client went away */
+	size_t			 len;
+	int			 error;	/* Not a JSON object */
+	int			 superseded;
+	unsigned long		 deadline;	/* command_clock(), or 0 */
+	envelope_t		 env;
+};
+
+/*
+ * A message sent to one or more clients.  Messages are immutable once
+ * created and reference counted, a status update is created once and
+ * queued to all subscribers.  The payload is preceded by room for a
+ * WebSocket header and followed by a newline, so that the frames for both
+ * client types are built in place, once, and shared by all clients.
+ */
+#define MSG_UPDATE	0x01	/* Status update, may be dropped */
+#define MSG_FRAMED	0x02	/* Already framed, sent as is */
+#define MSG_PARTIAL	0x04	/* A chunk of a stream, more follow */
+#define MSG_CONTINUED	0x08	/* A chunk of a stream, not the first */
+#define MSG_SWITCH	0x10	/* Later messages use the next encoding */
+
+#define MSG_HEADROOM	10	/* Longest WebSocket header */
+#define STREAM_CHUNK	65536	/* Larger responses are sent in chunks */
+
+typedef struct message {
+	int			 refcnt;
+	int			 flags;
+	const void		*source;	/* Origin of a status update */
+	size_t			 len;
+	size_t			 wslen;		/* WebSocket header length */
+	char			*data;
+
+	/* The CBOR encoding, built when first sent to a CBOR client */
+	char			*cbor;
+	size_t			 cborlen;
+	size_t			 cborws;
+	char			 buf[];
+} message_t;
+
+/* What to do when the output queue of a client is full */
+enum OverflowPolicy {
+	OVERFLOW_DROP_OLDEST,	/* Drop the oldest status update */
+	OVERFLOW_COALESCE,	/* Replace an update from the same source */
+	OVERFLOW_DISCONNECT	/* Disconnect the client */
+};
+
+enum SenderType {
+	SENDER_SOCKET,
+	SENDER_WEBSOCKET
+};
+
+/* The encoding of the messages a client receives */
+enum Encoding {
+	ENCODING_JSON,
+	ENCODING_CBOR
+};
 
 /*
- * A sender thread is needed per client, so that i/o problems do
- * do not lock a controller.  Also some protocols, notably websockets,
- * do not just regular i/o, but need some framing.  The specific
- * sender thread can deal with this.
+ * A sender tag exists per client connection.  All i/o on the socket is
+ * done by the reactor thread, other threads queue data using sender_send()
+ * and the reactor writes it as soon as the socket is writable.  This way
+ * i/o problems do not lock a controller.  The sender tag is reference
+ * counted, it is freed when the last reference is dropped.
  */
 typedef struct sender_tag {
-	/* The first mutex locks the sender */
+	/* The first mutex locks the output queue */
 	pthread_mutex_t		 mutex;
-	pthread_mutex_t		 mutex2;
-	pthread_cond_t		 cond;	/* data is ready to be send set */
-	pthread_cond_t		 cond2;	/* data has been sent */
-	char			*data;
+	int			 refcnt;
+	int			 closing;
 
+	enum SenderType		 type;
 	int			 socket;
 
+	/*
+	 * The encoding of the output, only used by the reactor.  A client
+	 * that asked for another encoding gets it after the acknowledgement,
+	 * which is marked MSG_SWITCH.
+	 */
+	enum Encoding		 encoding;
+	enum Encoding		 next_encoding;
+
 	/* For secure sockets */
 	SSL_CTX			*ctx;
 	SSL			*ssl;
 
-	pthread_t		 sender;
+	/* Input buffer, only used by the reactor */
+	char			*inbuf;
+	size_t			 inlen;
+	size_t			 insize;
+	int			 throttled;	/* EPOLLIN is not armed */
+	int			 resume;	/* On the resume list */
+	struct sender_tag	*resume_next;
+
+	/* Output queue, a ring of messages */
+	message_t		**queue;
+	size_t			 qsize;
+	size_t			 qhead;
+	size_t			 qlen;
+	size_t			 qoff;	/* Bytes of the first message written */
+	int			 flush_pending;
+	int			 want_write;	/* Socket would block */
+	int			 pollout;	/* EPOLLOUT is armed */
+	int			 close_after_flush;
+	int			 overflow;
+
+	/*
+	 * A response that is streamed in chunks, see sender_stream().  The
+	 * first qstream messages of the queue are written before the stream
+	 * ends, the messages queued meanwhile are held back after them.
+	 */
+	int			 streaming;
+	pthread_t		 streamer;
+	size_t			 qstream;
+	struct timespec		 stream_deadline;
+	pthread_cond_t		 room;
+
+	/* Output queue statistics */
+	unsigned long		 sent;
+	unsigned long		 dropped;
+	unsigned long		 coalesced;
+	size_t			 maxdepth;
+
+	struct sender_tag	*flush_next;
+	struct sender_tag	*closed_next;
+
+	/*
+	 * Request queue, locked by the dispatcher pool.  Requests with an id
+	 * are handled concurrently, requests without one alone and in order.
+	 * The input of a client with MAX_QUEUED requests not yet done is
+	 * paused until half of them are done.
+	 */
+	request_t		*requests;
+	request_t		**requests_tail;
+	request_t		*requests_last;
+	int			 queued;	/* Submitted, not yet done */
+	int			 paused;
+	int			 attached;
+	int			 inflight;	/* Requests being handled */
+	int			 ordered;	/* One without id among them */
+	int			 ready;
+	struct sender_tag	*ready_next;
+	destination_t		*to;	/* Current destination */
+	destination_t		*private;	/* Private extensions */
+	pthread_mutex_t		 private_mutex;	/* Locks private */
+
+	/* Time from connecting to the first response */
+	struct timespec		 connected;
+	unsigned long		 first_response;	/* us */
 } sender_tag_t;
 
 #endif /* __TRXD_H__ */
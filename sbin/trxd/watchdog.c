@@ -0,0 +1,120 @@
+/*
+ * Copyright (c) 2023 - 2026 Marc Balmer HB9SSB
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+
+/* Mark controllers degraded that do not complete their commands in time */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <syslog.h>
+#include <time.h>
+
+#include "trxd.h"
+
+#define WATCHDOG_TICK	250	/* milliseconds */
+
+extern unsigned long command_clock(void);
+
+extern destination_t *destination;
+extern pthread_mutex_t destination_mutex;
+extern int verbose;
+
+/* Returns 1 if the queue has just been marked degraded */
+static int
+check(command_queue_t *q, const char *name, unsigned long now)
+{
+	unsigned long busy;
+
+	busy = __atomic_load_n(&q->busy, __ATOMIC_RELAXED);
+	if (busy == 0 || now - busy < q->watchdog
+	    || __atomic_load_n(&q->degraded, __ATOMIC_RELAXED))
+		return 0;
+
+	__atomic_store_n(&q->degraded, 1, __ATOMIC_RELAXED);
+	syslog(LOG_WARNING, "watchdog: %s is not responding", name);
+	if (verbose)
+		printf("watchdog: %s is not responding\n", name);
+	return 1;
+}
+
+static void *
+watchdog(void *arg)
+{
+	struct timespec tick;
+	destination_t *d;
+	unsigned long now;
+
+	if (pthread_detach(pthread_self())) {
+		syslog(LOG_ERR, "watchdog: pthread_detach");
+		exit(1);
+	}
+
+	if (pthread_setname_np(pthread_self(), "watchdog")) {
+		syslog(LOG_ERR, "watchdog: pthread_setname_np");
+		exit(1);
+	}
+
+	tick.tv_sec = 0;
+	tick.tv_nsec = WATCHDOG_TICK * 1000000L;
+
+	for (;;) {
+		nanosleep(&tick, NULL);
+		now = command_clock();
+
+		if (pthread_mutex_lock(&destination_mutex)) {
+			syslog(LOG_ERR, "watchdog: pthread_mutex_lock");
+			exit(1);
+		}
+		for (d = destination; d != NULL; d = d->next) {
+			switch (d->type) {
+			case DEST_TRX:
+				/* The controller reopens the device */
+				if (check(&d->tag.trx->queue, d->name, now))
+					__atomic_store_n(&d->tag.trx->reopen,
+					    1, __ATOMIC_RELAXED);
+				break;
+			case DEST_GPIO:
+				check(&d->tag.gpio->queue, d->name, now);
+				break;
+			default:
+				break;
+			}
+		}
+		if (pthread_mutex_unlock(&destination_mutex)) {
+			syslog(LOG_ERR, "watchdog: pthread_mutex_unlock");
+			exit(1);
+		}
+	}
+	return NULL;
+}
+
+void
+watchdog_init(void)
+{
+	pthread_t thread;
+
+	if (pthread_create(&thread, NULL, watchdog, NULL)) {
+		syslog(LOG_ERR, "watchdog: pthread_create");
+		exit(1);
+	}
+}
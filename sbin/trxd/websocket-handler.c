@@ -20,16 +20,14 @@
  * IN THE SOFTWARE.
  */
 
-/* Handle network clients over WebSockets */
+
+/* Handle input from network clients over WebSockets */
 
 #include <sys/socket.h>
 
 #include <openssl/ssl.h>
 
 #include <errno.h>
-#include <pthread.h>
-#include <sched.h>
-#include <signal.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -37,237 +35,197 @@
 #include <unistd.h>
 
 #include "trxd.h"
-#include "trx-control.h"
 #include "websocket.h"
 
-extern void *websocket_sender(void *);
-extern void *dispatcher(void *);
+#define INPUT_SIZE	1024
+#define INPUT_MAX	(MAX_REQUEST + 16)	/* A request and its framing */
+
+extern void sender_send_frame(sender_tag_t *, const void *, size_t);
+extern int dispatcher_submit(sender_tag_t *, char *, size_t);
+extern void reactor_resume(sender_tag_t *);
 
 extern int verbose;
 
-static void
-cleanup(void *arg)
+static ssize_t
+websocket_read(sender_tag_t *s, char *dest, size_t len)
 {
-	websocket_t *w = (websocket_t *)arg;
-
-	if (verbose)
-		syslog(LOG_NOTICE, "websocket-handler: terminating\n");
-
-	if (w->ssl) {
-		SSL_shutdown(w->ssl);
-		SSL_free(w->ssl);
+	ssize_t n;
+
+	if (s->ssl) {
+		n = SSL_read(s->ssl, dest, len);
+		if (n <= 0) {
+			switch (SSL_get_error(s->ssl, n)) {
+			case SSL_ERROR_WANT_READ:
+			case SSL_ERROR_WANT_WRITE:
+				errno = EAGAIN;
+				return -1;
+			case SSL_ERROR_ZERO_RETURN:
+				return 0;
+			default:
+				errno = EIO;
+				return -1;
+			}
+		}
 	} else
-		close(w->socket);
-
-	free(arg);
-}
-
-static void
-cleanup_sender(void *arg)
-{
-	sender_tag_t *s = (sender_tag_t *)arg;
-
-	pthread_cancel(s->sender);
-}
-
-static void
-cleanup_dispatcher(void *arg)
-{
-	dispatcher_tag_t *d = (dispatcher_tag_t *)arg;
-
-	pthread_cancel(d->dispatcher);
+		n = recv(s->socket, dest, len, 0);
+	return n;
 }
 
+/*
+ * Handle a complete frame.  Returns 1 if a request was dispatched, -1 if
+ * the connection is to be closed, and 0 otherwise.
+ */
 static int
-websocket_read(void *data, unsigned char *dest, size_t len)
+websocket_frame(sender_tag_t *s, uint8_t *frame, size_t framelen)
 {
-	websocket_t *websock = (websocket_t *)data;
+	uint8_t *data, reply[MAX_WS_HEADER + 125];
+	size_t datasize, replysize;
+	char *buf;
 
-	if (websock->ssl)
-		return SSL_read(websock->ssl, dest, len);
-	else
-		return recv(websock->socket, dest, len, 0);
-}
+	switch (wsParseInputFrame(frame, framelen, &data, &datasize)) {
+	case WS_TEXT_FRAME:
+		if (datasize == 0) {
+			syslog(LOG_ERR, "websocket-handler: received empty "
+			    "text frame, skipping it.");
+			break;
+		}
 
-static int
-websocket_write(void *data, unsigned char *dest, size_t len)
-{
-	websocket_t *websock = (websocket_t *)data;
+		/* buf will later be freed by the dispatcher */
+		buf = malloc(datasize + 1);
+		if (buf == NULL) {
+			syslog(LOG_ERR, "websocket-handler: malloc");
+			exit(1);
+		}
+		memcpy(buf, data, datasize);
+		buf[datasize] = '\0';
 
-	if (websock->ssl)
-		return SSL_write(websock->ssl, dest, len);
-	else
-		return send(websock->socket, dest, len, 0);
-}
+		if (verbose)
+			printf("websocket-handler: <- %s\n", buf);
 
-void
-sigpipe_handler(int unused)
-{
-	pthread_exit(NULL);
+		if (dispatcher_submit(s, buf, datasize))
+			s->throttled = 1;
+		return 1;
+	case WS_PING_FRAME:
+		/* Control frames carry at most 125 bytes of payload */
+		if (datasize > 125)
+			return -1;
+		wsMakeFrame(data, datasize, reply, &replysize, WS_PONG_FRAME);
+		sender_send_frame(s, reply, replysize);
+		break;
+	case WS_PONG_FRAME:
+		break;
+	case WS_CLOSING_FRAME:
+		wsMakeFrame(NULL, 0, reply, &replysize, WS_CLOSING_FRAME);
+		s->close_after_flush = 1;
+		sender_send_frame(s, reply, replysize);
+		break;
+	default:
+		return -1;
+	}
+	return 0;
 }
 
-void *
-websocket_handler(void *arg)
+/*
+ * Read all data available on a WebSocket and handle each complete frame.
+ * Called by the reactor when the socket is readable.  Like socket_input(),
+ * it stops at a request that throttles the input.  Returns -1 when the
+ * connection is closed or a frame is longer than MAX_REQUEST.
+ */
+int
+websocket_input(sender_tag_t *s)
 {
-	websocket_t *w = (websocket_t *)arg;
-	sender_tag_t *s;
-	dispatcher_tag_t *d;
-	char *buf;
-	size_t len;
-
-	if (pthread_detach(pthread_self())) {
-		syslog(LOG_ERR, "websocket-handler: pthread_detach");
-		exit(1);
-	}
-
-	pthread_cleanup_push(cleanup, arg);
-
-	if (pthread_setname_np(pthread_self(), "websocket")) {
-		syslog(LOG_ERR, "websocket-handler: pthread_setname_np");
-		exit(1);
-	}
-
-	/* Create a websocket-sender thread to send data to the client */
-	s = malloc(sizeof(sender_tag_t));
-	if (s == NULL) {
-		syslog(LOG_ERR, "websocket-handler: malloc");
-		exit(1);
-	}
-	s->data = (char *)1;
-	s->socket = w->socket;
-	s->ssl = w->ssl;
-	s->ctx = w->ctx;
-
-	w->sender = s;
-
-	if (pthread_mutex_init(&s->mutex, NULL)) {
-		syslog(LOG_ERR, "websocket-handler: pthread_mutex_init");
-		exit(1);
-	}
-
-	if (pthread_mutex_init(&s->mutex2, NULL)) {
-		syslog(LOG_ERR, "websocket-handler: pthread_mutex_init");
-		exit(1);
-	}
-
-	if (pthread_cond_init(&s->cond, NULL)) {
-		syslog(LOG_ERR, "websocket-handler: pthread_cond_init");
-		exit(1);
-	}
-
-	if (pthread_cond_init(&s->cond2, NULL)) {
-		syslog(LOG_ERR, "websocket-handler: pthread_cond_init");
-		exit(1);
-	}
-
-	if (pthread_create(&s->sender, NULL, websocket_sender, s)) {
-		syslog(LOG_ERR, "websocket-handler: pthread_create");
-		exit(1);
-	}
-
-	pthread_cleanup_push(cleanup_sender, s);
-
-	/* Create a dispatcher thread to dispatch incoming data */
-	d = malloc(sizeof(dispatcher_tag_t));
-	if (d == NULL) {
-		syslog(LOG_ERR, "websocket-handler: malloc");
-		exit(1);
-	}
-	d->data = (char *)1;
-	d->sender = s;
-
-	if (pthread_mutex_init(&d->mutex, NULL)) {
-		syslog(LOG_ERR, "websocket-handler: pthread_mutex_init");
-		exit(1);
-	}
-
-	if (pthread_mutex_init(&d->mutex2, NULL)) {
-		syslog(LOG_ERR, "websocket-handler: pthread_mutex_init");
-		exit(1);
-	}
-
-	if (pthread_cond_init(&d->cond, NULL)) {
-		syslog(LOG_ERR, "websocket-handler: pthread_cond_init");
-		exit(1);
-	}
-
-	if (pthread_cond_init(&d->cond2, NULL)) {
-		syslog(LOG_ERR, "websocket-handler: pthread_cond_init");
-		exit(1);
-	}
-
-	if (pthread_create(&d->dispatcher, NULL, dispatcher, d)) {
-		syslog(LOG_ERR, "websocket-handler: pthread_create");
-		exit(1);
-	}
-
-	pthread_cleanup_push(cleanup_dispatcher, d);
-
-	if (pthread_mutex_lock(&d->mutex2)) {
-		syslog(LOG_ERR, "websocket-handler: pthread_mutex_lock");
-		exit(1);
-	}
-
-	if (verbose)
-		printf("websocket-handler: wait for dispatcher\n");
-
-	while (d->data != NULL)
-		if (pthread_cond_wait(&d->cond2, &d->mutex2)) {
-			syslog(LOG_ERR, "wbsocket-handler: pthread_cond_wait");
-			exit(1);
+	enum wsFrameType type;
+	uint8_t *p, extra;
+	size_t avail, payloadLength, framelen;
+	ssize_t n;
+	int eof = 0, full, rv, submitted = 0;
+
+again:
+	full = 0;
+	for (;;) {
+		if (s->insize - s->inlen < INPUT_SIZE
+		    && s->insize < INPUT_MAX) {
+			s->insize = s->insize ? s->insize * 2 : INPUT_SIZE;
+			if (s->insize > INPUT_MAX)
+				s->insize = INPUT_MAX;
+			s->inbuf = realloc(s->inbuf, s->insize);
+			if (s->inbuf == NULL) {
+				syslog(LOG_ERR, "websocket-handler: realloc");
+				exit(1);
+			}
+		}
+		/* The rest is read on the next event */
+		if (s->inlen == s->insize) {
+			full = 1;
+			break;
 		}
 
-	if (pthread_mutex_lock(&s->mutex2)) {
-		syslog(LOG_ERR, "websocket-handler: pthread_mutex_lock");
-		exit(1);
-	}
-
-	if (verbose)
-		printf("websocket-handler: wait for sender\n");
-
-	while (s->data != NULL)
-		if (pthread_cond_wait(&s->cond2, &s->mutex2)) {
-			syslog(LOG_ERR, "websocket-handler: pthread_cond_wait");
-			exit(1);
+		n = websocket_read(s, s->inbuf + s->inlen,
+		    s->insize - s->inlen);
+		if (n == 0) {
+			eof = 1;
+			break;
+		} else if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				eof = 1;
+			break;
+		}
+		s->inlen += n;
+	}
+
+	/* At the end of the input, everything that was sent is handled */
+	p = (uint8_t *)s->inbuf;
+	while (!s->close_after_flush && (eof || !s->throttled)) {
+		avail = s->inlen - (p - (uint8_t *)s->inbuf);
+		if (avail < 2)
+			break;
+
+		/* Fragmented and unmasked frames are not supported */
+		if ((p[0] & 0x70) != 0x0 || (p[0] & 0x80) != 0x80 ||
+		    (p[1] & 0x80) != 0x80)
+			return -1;
+
+		type = WS_EMPTY_FRAME;
+		payloadLength = wsGetPayloadLength(p, avail, &extra, &type);
+		if (type == WS_INCOMPLETE_FRAME)
+			break;
+		else if (type == WS_ERROR_FRAME)
+			return -1;
+
+		/* Checked before the frame is buffered, framelen can't wrap */
+		if (payloadLength > MAX_REQUEST) {
+			syslog(LOG_NOTICE, "websocket-handler: frame too long");
+			return -1;
 		}
 
-	sigaction(SIGPIPE, &(struct sigaction){sigpipe_handler}, NULL);
+		framelen = 2 + extra + 4 + payloadLength;
+		if (avail < framelen)
+			break;
+
+		rv = websocket_frame(s, p, framelen);
+		if (rv == -1)
+			return -1;
+		p += framelen;
+		if (rv == 1 && !s->throttled && ++submitted == MAX_QUEUED) {
+			/* Let the reactor write the responses first */
+			s->throttled = 1;
+			reactor_resume(s);
+		}
+	}
 
-	if (verbose)
-		printf("websocket-handler: sender is ready\n");
+	/* Anything after a close frame is ignored */
+	if (s->close_after_flush)
+		p = (uint8_t *)s->inbuf + s->inlen;
 
-	for (;;) {
-		/* buf will later be freed by the dispatcher */
-		if (wsRead(&buf, &len, websocket_read, websocket_write, w)) {
-			if (verbose)
-				printf("websocket-handler: short read: %s\n",
-					strerror(errno));
-			pthread_exit(NULL);
-		} else if (verbose && buf != NULL)
-			printf("websocket-handler: <- %s\n", buf);
+	s->inlen -= p - (uint8_t *)s->inbuf;
+	if (s->inlen > 0)
+		memmove(s->inbuf, p, s->inlen);
 
-		if (buf != NULL) {
-			d->data = buf;
-			d->len = len;
-			if (pthread_cond_signal(&d->cond)) {
-				syslog(LOG_ERR,
-				    "websocket-handler: pthread_cond_signal");
-				exit(1);
-			}
+	/* Data SSL has already read from the socket raises no event */
+	if (full && !s->throttled && s->ssl != NULL && SSL_pending(s->ssl))
+		goto again;
 
-			while (d->data != NULL)
-				if (pthread_cond_wait(&d->cond2, &d->mutex2)) {
-					syslog(LOG_ERR,
-					    "websocket-handler: "
-					    "pthread_cond_wait");
-					exit(1);
-				}
-		} else
-			syslog(LOG_ERR, "websocket-handler: received empty "
-			    "text frame, skipping it.");
-	}
-	pthread_cleanup_pop(0);
-	pthread_cleanup_pop(0);
-	pthread_cleanup_pop(0);
-	return NULL;
+	return eof ? -1 : 0;
 }
@@ -61,14 +61,17 @@
 #define BIND_ADDR	"localhost"
 #define LISTEN_PORT	"14290"
 
-extern void *websocket_handler(void *);
+extern sender_tag_t *sender_new(enum SenderType, int, SSL_CTX *, SSL *);
+extern void reactor_attach(sender_tag_t *);
 extern void *avahi_handler(void *);
 extern int log_connections;
 
 #define BUFSIZE		65535
 
+/* The subprotocol selects the encoding of the messages */
 static int
-websocket_handshake(websocket_t *websock, char *path)
+websocket_handshake(websocket_t *websock, char *path,
+    enum Encoding *encoding)
 {
 	struct handshake hs;
 	size_t nread;
@@ -89,6 +92,9 @@ websocket_handshake(websocket_t *websock, char *path)
 		/* Skip leading slash */
 		if (!strcmp(&hs.resource[1], path)) {
 			wsGetHandshakeAnswer(&hs, (unsigned char *)buf, &nread);
+			*encoding = hs.protocol != NULL
+			    && !strcmp(hs.protocol, "cbor") ? ENCODING_CBOR
+			    : ENCODING_JSON;
 			freeHandshake(&hs);
 			if (websock->ssl)
 				SSL_write(websock->ssl, buf, nread);
@@ -216,6 +222,10 @@ websocket_listener(void *arg)
 			exit(1);
 		}
 
+		/* SSL_write() is called on a non-blocking socket */
+		SSL_CTX_set_mode(t->ctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+		    SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
 		if (t->key) {
 			if (SSL_CTX_use_PrivateKey_file(t->ctx, t->key,
 			    SSL_FILETYPE_PEM) != 1) {
@@ -272,6 +282,8 @@ websocket_listener(void *arg)
 			int			*client_fd;
 			char			 hbuf[NI_MAXHOST];
 			websocket_t		*w;
+			sender_tag_t		*s;
+			enum Encoding		 encoding;
 
 			client_fd = malloc(sizeof(int));
 
@@ -320,9 +332,13 @@ websocket_listener(void *arg)
 				}
 			}
 
-			if (!websocket_handshake(w, t->path)) {
-				pthread_create(&w->listen_thread, NULL,
-				    websocket_handler, w);
+			if (!websocket_handshake(w, t->path, &encoding)) {
+				/* The reactor takes over the connection */
+				s = sender_new(SENDER_WEBSOCKET, w->socket,
+				    w->ctx, w->ssl);
+				s->encoding = s->next_encoding = encoding;
+				reactor_attach(s);
+				free(w);
 			} else {
 				close(w->socket);
 				free(w->ssl);
@@ -46,6 +46,7 @@ nullHandshake(struct handshake *hs)
 	hs->origin = NULL;
 	hs->resource = NULL;
 	hs->key = NULL;
+	hs->protocol = NULL;
 	hs->frameType = WS_EMPTY_FRAME;
 }
 
@@ -59,6 +60,13 @@ freeHandshake(struct handshake *hs)
 	nullHandshake(hs);
 }
 
+/* The subprotocols we speak, the encoding of the messages */
+static const char *subprotocols[] = {
+	"json",
+	"cbor",
+	NULL
+};
+
 static char *
 getUptoLinefeed(const char *startFrom)
 {
@@ -125,7 +133,19 @@ wsParseHandshake(const uint8_t *inputFrame, size_t inputLength,
 			hs->origin = getUptoLinefeed(inputPtr);
 		} else if (!strncasecmp(inputPtr, protocolField,
 		    strlen(protocolField))) {
+			char *protocols, *p, *last;
+			int n;
+
+			/* Select the first subprotocol we speak */
 			inputPtr += strlen(protocolField);
+			protocols = getUptoLinefeed(inputPtr);
+			for (p = strtok_r(protocols, ", \t", &last);
+			    p != NULL && hs->protocol == NULL;
+			    p = strtok_r(NULL, ", \t", &last))
+				for (n = 0; subprotocols[n] != NULL; n++)
+					if (!strcmp(p, subprotocols[n]))
+						hs->protocol = subprotocols[n];
+			free(protocols);
 			subprotocolFlag = 1;
 		} else if (!strncasecmp(inputPtr, keyField, strlen(keyField))) {
 			inputPtr += strlen(keyField);
@@ -166,7 +186,7 @@ wsParseHandshake(const uint8_t *inputFrame, size_t inputLength,
 
 	/* we have read all data, so check them */
 	if (!hs->host || !hs->key || !connectionFlag || !upgradeFlag ||
-	    subprotocolFlag || versionMismatch)
+	    (subprotocolFlag && hs->protocol == NULL) || versionMismatch)
 		hs->frameType = WS_ERROR_FRAME;
 	else
 		hs->frameType = WS_OPENING_FRAME;
@@ -208,8 +228,12 @@ wsGetHandshakeAnswer(const struct handshake *hs, uint8_t *outFrame,
 	    "HTTP/1.1 101 Switching Protocols\r\n"
 	    "%s%s\r\n"
 	    "%s%s\r\n"
+	    "%s%s%s"
 	    "Sec-WebSocket-Accept: %s\r\n\r\n", upgradeField,
-	     websocket, connectionField, upgrade2, b64);
+	     websocket, connectionField, upgrade2,
+	     hs->protocol ? protocolField : "",
+	     hs->protocol ? hs->protocol : "", hs->protocol ? "\r\n" : "",
+	     b64);
 	free(b64);
 
 	/* if the assert fails, that means, that we corrupt memory */
@@ -228,31 +252,40 @@ htonll(uint64_t value)
 	return (uint64_t)low << 32 | high;
 }
 
-void
-wsMakeFrame(const uint8_t *data, size_t dataLength, uint8_t *outFrame,
-    size_t *outLength, enum wsFrameType frameType)
+/* Make the header of an unmasked frame, returns the header length */
+size_t
+wsMakeHeader(size_t dataLength, uint8_t *outFrame, enum wsFrameType frameType)
 {
-	assert(outFrame && outLength);
+	assert(outFrame);
 	assert(frameType < 0x10);
-	if (dataLength > 0)
-		assert(data);
 
 	outFrame[0] = 0x80 | frameType;
 
 	if (dataLength <= 125) {
 		outFrame[1] = dataLength;
-		*outLength = 2;
+		return 2;
 	} else if (dataLength <= 0xFFFF) {
 		outFrame[1] = 126;
 		uint16_t payloadLength16b = htons(dataLength);
 		memcpy(&outFrame[2], &payloadLength16b, 2);
-		*outLength = 4;
+		return 4;
 	} else {
 		outFrame[1] = 127;
 		uint64_t payloadLength64b = htonll((uint64_t)dataLength);
 		memcpy(&outFrame[2], &payloadLength64b, 8);
-		*outLength = 10;
+		return 10;
 	}
+}
+
+void
+wsMakeFrame(const uint8_t *data, size_t dataLength, uint8_t *outFrame,
+    size_t *outLength, enum wsFrameType frameType)
+{
+	assert(outFrame && outLength);
+	if (dataLength > 0)
+		assert(data);
+
+	*outLength = wsMakeHeader(dataLength, outFrame, frameType);
 	memcpy(&outFrame[*outLength], data, dataLength);
 	*outLength += dataLength;
 }
@@ -269,7 +302,7 @@ wsGetPayloadLength(const uint8_t *inputFrame, size_t inputLength,
 		*frameType = WS_INCOMPLETE_FRAME;
 		return 0;
 	}
-	if (payloadLength == 0x7F && (inputFrame[3] & 0x80) != 0x0) {
+	if (payloadLength == 0x7F && (inputFrame[2] & 0x80) != 0x0) {
 		*frameType = WS_ERROR_FRAME;
 		return 0;
 	}
@@ -279,12 +312,16 @@ wsGetPayloadLength(const uint8_t *inputFrame, size_t inputLength,
 
 		payloadLength = be16toh(*(uint16_t *)&inputFrame[2]);
 	} else if (payloadLength == 0x7F) {
+		uint64_t payloadLength64b;
+
 		*payloadFieldExtraBytes = 8;
 
-		if (payloadLength > SIZE_MAX) {
+		payloadLength64b = be64toh(*(uint64_t *)&inputFrame[2]);
+		if (payloadLength64b > SIZE_MAX) {
 			*frameType = WS_ERROR_FRAME;
 			return 0;
 		}
+		payloadLength = payloadLength64b;
 	}
 	return payloadLength;
 }
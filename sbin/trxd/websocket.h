@@ -24,8 +24,11 @@
 #ifndef __WEBSOCKET_H__
 #define __WEBSOCKET_H__
 
+#include <stddef.h>
 #include <stdint.h>
 
+#define MAX_WS_HEADER	10
+
 static const char connectionField[] = "Connection: ";
 static const char upgrade[] = "upgrade";
 static const char upgrade2[] = "Upgrade";
@@ -44,6 +47,7 @@ enum wsFrameType {
 	WS_EMPTY_FRAME = 0xf0,
 	WS_ERROR_FRAME = 0xf1,
 	WS_INCOMPLETE_FRAME = 0xf2,
+	WS_CONTINUATION_FRAME = 0x00,
 	WS_TEXT_FRAME = 0x01,
 	WS_BINARY_FRAME = 0x02,
 	WS_PING_FRAME = 0x09,
@@ -63,6 +67,7 @@ struct handshake {
 	char		*origin;
 	char		*key;
 	char		*resource;
+	const char	*protocol;	/* Selected subprotocol, or NULL */
 	enum wsFrameType frameType;
 };
 
@@ -72,6 +77,8 @@ extern enum wsFrameType wsParseHandshake(const uint8_t *, size_t,
 extern void wsGetHandshakeAnswer(const struct handshake *, uint8_t *,
     size_t *);
 
+extern size_t wsMakeHeader(size_t, uint8_t *, enum wsFrameType);
+
 extern void wsMakeFrame(const uint8_t *, size_t, uint8_t *, size_t *,
     enum wsFrameType);
 